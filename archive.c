@@ -137,8 +137,9 @@ static int archive_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int archive_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset archive_buffer_save(EditBuffer *b,
+                                    QEOffset start, QEOffset end,
+                                    const char *filename)
 {
     /* XXX: prevent saving parsed contents to archive file */
     return -1;
@@ -248,8 +249,9 @@ static int compress_buffer_load(EditBuffer *b, FILE *f)
     }
 }
 
-static int compress_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset compress_buffer_save(EditBuffer *b,
+                                     QEOffset start, QEOffset end,
+                                     const char *filename)
 {
     /* XXX: should recompress contents to compressed file */
     return -1;
@@ -328,8 +330,9 @@ static int wget_buffer_load(EditBuffer *b, FILE *f)
     return 0;
 }
 
-static int wget_buffer_save(EditBuffer *b, int start, int end,
-                               const char *filename)
+static QEOffset wget_buffer_save(EditBuffer *b,
+                                 QEOffset start, QEOffset end,
+                                 const char *filename)
 {
     /* XXX: should put contents back to web server */
     return -1;
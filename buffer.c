@@ -23,18 +23,700 @@
 #ifdef CONFIG_MMAP
 #include <sys/mman.h>
 #endif
+#ifndef CONFIG_WIN32
+#include <sys/uio.h>
+#endif
 
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size);
+                      QEOffset offset, QEOffset size);
+static void eb_addlog2(EditBuffer *b, enum LogOperation op,
+                       QEOffset offset, QEOffset size, QEOffset size1);
+static void eb_load_stop(EditBuffer *b);
+static void eb_undo_restore(EditBuffer *b);
+
+/* last buffer version tag: versions are unique across buffers */
+static unsigned int eb_last_version;
+
+/************************************************************/
+/* lazily mapped files */
+
+/* Large files are neither read nor mapped at once: mmap_buffer()
+ * describes the file with read only pages of MAPPED_PAGE_SIZE bytes
+ * and each window of MMAP_WINDOW_SIZE bytes is mapped upon first
+ * access.  At most MMAP_MAX_WINDOWS windows stay mapped per file, the
+ * least recently used one is unmapped when another one is needed, so
+ * the address space and resident set track the parts of the file
+ * actually viewed.  Each mapped page holds a reference to the file,
+ * pages copied to other buffers by eb_insert_buffer() share it.
+ * The data of mapped pages must be accessed via page_data(), which
+ * returns NULL and reports an error if the window cannot be mapped.
+ * Pages are split when modified, see find_page_for_edit().
+ */
+
+#ifdef CONFIG_MMAP
+static int mapped_window_size(MappedFile *mf, int n)
+{
+    return (int)min_offset(mf->file_size - (QEOffset)n * MMAP_WINDOW_SIZE,
+                           MMAP_WINDOW_SIZE);
+}
+
+static void mapped_file_unmap(MappedFile *mf, int n)
+{
+    MapWindow *w = &mf->windows[n];
+
+    if (w->addr) {
+        munmap(w->addr, mapped_window_size(mf, n));
+        w->addr = NULL;
+        mf->nb_mapped--;
+    }
+}
+
+static void mapped_file_unmap_lru(MappedFile *mf)
+{
+    int i, n;
+
+    for (n = -1, i = 0; i < mf->nb_windows; i++) {
+        if (mf->windows[i].addr
+        &&  (n < 0 || mf->clock - mf->windows[i].last_used >
+                      mf->clock - mf->windows[n].last_used)) {
+            n = i;
+        }
+    }
+    if (n >= 0)
+        mapped_file_unmap(mf, n);
+}
+
+/* return a pointer to the file data at 'offset', valid until
+ * MMAP_MAX_WINDOWS other windows have been accessed, or NULL if the
+ * window cannot be mapped.  The error is reported upon the first
+ * failure only and the window is not retried: reverting the buffer
+ * maps the file again.
+ */
+static u8 *mapped_file_data(EditBuffer *b, MappedFile *mf, QEOffset offset)
+{
+    int n = (int)(offset / MMAP_WINDOW_SIZE);
+    MapWindow *w = &mf->windows[n];
+    void *addr;
+
+    if (!w->addr) {
+        if (w->error)
+            return NULL;
+        if (mf->nb_mapped >= MMAP_MAX_WINDOWS)
+            mapped_file_unmap_lru(mf);
+        for (;;) {
+            addr = mmap(NULL, mapped_window_size(mf, n), PROT_READ,
+                        MAP_SHARED, mf->fd, (off_t)n * MMAP_WINDOW_SIZE);
+            if (addr != MAP_FAILED)
+                break;
+            if (mf->nb_mapped == 0) {
+                w->error = errno;
+                put_status(NULL, "Error reading '%s': %s",
+                           b->filename, strerror(w->error));
+                return NULL;
+            }
+            /* release address space and retry */
+            mapped_file_unmap_lru(mf);
+        }
+        w->addr = addr;
+        mf->nb_mapped++;
+    }
+    w->last_used = ++mf->clock;
+    return w->addr + (offset - (QEOffset)n * MMAP_WINDOW_SIZE);
+}
+#endif
+
+/* release a reference to a mapped file */
+static void mapped_file_free(MappedFile **mfp)
+{
+    MappedFile *mf = *mfp;
+
+    if (mf && --mf->ref_count == 0) {
+#ifdef CONFIG_MMAP
+        int n;
+        for (n = 0; n < mf->nb_windows; n++)
+            mapped_file_unmap(mf, n);
+#endif
+        close(mf->fd);
+        qe_free(&mf->windows);
+        qe_free(&mf);
+    }
+    *mfp = NULL;
+}
+
+/* return the data of a page, mapping it if needed, or NULL if the
+ * mapped file cannot be read.
+ */
+static inline u8 *page_data(EditBuffer *b, Page *p)
+{
+#ifdef CONFIG_MMAP
+    if (p->flags & PG_MAPPED)
+        return mapped_file_data(b, p->map, p->map_offset);
+#endif
+    return p->data;
+}
+
+/* return true unless page 'p' is mapped and cannot be read */
+static int page_readable(EditBuffer *b, Page *p)
+{
+    return !(p->flags & PG_MAPPED) || page_data(b, p) != NULL;
+}
+
+/************************************************************/
+/* shared pages */
+
+/* Whole pages copied between buffers by eb_insert_buffer(), such as
+ * killed text, yanked text and undo records, share their data instead
+ * of copying it: the data is moved to a reference counted PageBlock
+ * and both pages become read only.  update_page() copies a shared page
+ * before it is modified, or takes the block back from the last page
+ * referencing it.
+ */
+
+/* let page 'p' share its data, return true if possible */
+static int page_share(Page *p)
+{
+    PageBlock *blk;
+
+    if (p->flags & PG_SHARED)
+        return 1;
+    if (p->flags & PG_READ_ONLY)
+        return 0;
+    blk = qe_mallocz(PageBlock);
+    if (!blk)
+        return 0;
+    blk->ref_count = 1;
+    blk->data = p->data;
+    p->block = blk;
+    p->flags |= PG_READ_ONLY | PG_SHARED;
+    return 1;
+}
+
+static void page_block_free(PageBlock **blkp)
+{
+    PageBlock *blk = *blkp;
+
+    if (blk && --blk->ref_count == 0) {
+        qe_free(&blk->data);
+        qe_free(&blk);
+    }
+    *blkp = NULL;
+}
+
+/* release the data of a page being removed */
+static void page_free_data(Page *p)
+{
+    if (p->flags & PG_MAPPED) {
+        mapped_file_free(&p->map);
+    } else
+    if (p->flags & PG_SHARED) {
+        page_block_free(&p->block);
+        p->data = NULL;
+    } else
+    if (!(p->flags & PG_READ_ONLY)) {
+        qe_free(&p->data);
+    }
+}
+
+/************************************************************/
+/* page index */
+
+/* Consecutive pages are gathered in groups of about PAGE_GROUP_SIZE
+ * pages holding their page count, size, line count, column count and
+ * char count.  Fenwick trees (binary indexed trees) of the group
+ * metrics, where tree node j sums groups [j - (j & -j), j - 1], locate
+ * the group holding an offset, a line or a char number in O(log n),
+ * the page is then found among the pages of the group.
+ * Inserting or removing pages updates the groups involved and the tree
+ * nodes above them in O(log n).  A group is split when it exceeds
+ * PAGE_GROUP_MAX pages and merged with a neighbour when it falls below
+ * PAGE_GROUP_MIN pages, which rebuilds the tree nodes of the following
+ * groups, so this linear cost is only paid every PAGE_GROUP_SIZE page
+ * insertions or so.  The page table itself is still a flat array moved
+ * with memmove().
+ * Line and char counts require scanning page contents: their trees
+ * only cover a leading range of groups and are extended lazily, as far
+ * as needed.  A page modified in place is recorded as stale and its
+ * group metrics are recomputed upon the next lookup.
+ */
+
+#define PAGE_GROUP_SIZE  64
+#define PAGE_GROUP_MAX   (2 * PAGE_GROUP_SIZE)
+#define PAGE_GROUP_MIN   (PAGE_GROUP_SIZE / 4)
+
+/* the bytes of pages that cannot be read are handled as newlines, see
+ * eb_nextc(), they are counted again when their group is reindexed.
+ */
+static int page_metric(EditBuffer *b, Page *p, int which)
+{
+    const u8 *data;
+
+    switch (which) {
+    case PI_PAGES:
+        return 1;
+    case PI_SIZE:
+        return p->size;
+    case PI_LINES:
+    case PI_COL:
+        if (!(p->flags & PG_VALID_POS)) {
+            data = page_data(b, p);
+            if (!data)
+                return (which == PI_LINES) ? p->size : 0;
+            p->flags |= PG_VALID_POS;
+            b->charset_state.get_pos_func(&b->charset_state,
+                                          data, p->size,
+                                          &p->nb_lines, &p->col);
+        }
+        return (which == PI_LINES) ? p->nb_lines : p->col;
+    case PI_CHARS:
+    default:
+        if (!(p->flags & PG_VALID_CHAR)) {
+            data = page_data(b, p);
+            if (!data)
+                return p->size;
+            p->flags |= PG_VALID_CHAR;
+            p->nb_chars = b->charset->get_chars_func(&b->charset_state,
+                                                     data, p->size);
+        }
+        return p->nb_chars;
+    }
+}
+
+/* sum of metric 'which' over 'count' pages from page 'start' */
+static QEOffset page_range_metric(EditBuffer *b, int start, int count,
+                                  int which)
+{
+    Page *p = b->page_table + start;
+    QEOffset sum = 0;
+
+    for (; count > 0; count--, p++)
+        sum += page_metric(b, p, which);
+    return sum;
+}
+
+/* sum of the first n entries, n <= pi->nb_valid */
+static QEOffset page_index_sum(PageIndex *pi, int n)
+{
+    QEOffset sum = 0;
+
+    for (; n > 0; n &= n - 1)
+        sum += pi->tree[n];
+    return sum;
+}
+
+static void page_index_add(PageIndex *pi, int k, QEOffset delta)
+{
+    int j;
+
+    for (j = k + 1; j <= pi->nb_valid; j += j & -j)
+        pi->tree[j] += delta;
+}
+
+/* return the largest number of leading entries whose cumulative value
+ * is <= value (< value if 'strict'), store the remainder in *rem.
+ */
+static int page_index_find(PageIndex *pi, QEOffset value, int strict,
+                           QEOffset *rem)
+{
+    QEOffset v;
+    int pos, step, n;
+
+    n = pi->nb_valid;
+    for (step = 1; step * 2 <= n; step *= 2)
+        continue;
+    for (pos = 0; step > 0; step >>= 1) {
+        if (pos + step <= n) {
+            v = pi->tree[pos + step];
+            if (v < value || (!strict && v == value)) {
+                pos += step;
+                value -= v;
+            }
+        }
+    }
+    *rem = value;
+    return pos;
+}
+
+/* recompute the tree nodes of metric 'which' from group k */
+static void page_index_rebuild(EditBuffer *b, int which, int k)
+{
+    PageIndex *pi = &b->page_index[which];
+    QEOffset sum;
+    int j, i;
+
+    for (j = k + 1; j <= pi->nb_valid; j++) {
+        /* node j is group j-1 plus nodes j-1, j-2, j-4 ... */
+        sum = b->page_groups[j - 1].metric[which];
+        for (i = 1; i < (j & -j); i <<= 1)
+            sum += pi->tree[j - i];
+        pi->tree[j] = sum;
+    }
+}
+
+/* make room for n page groups, return false if out of memory */
+static int page_index_alloc(EditBuffer *b, int n)
+{
+    PageIndex *pi;
+    int which, nb_alloc;
+
+    for (which = 0; which < PI_NB; which++) {
+        pi = &b->page_index[which];
+        if (n < pi->nb_alloc)
+            continue;
+        nb_alloc = max(n + 1, pi->nb_alloc + (pi->nb_alloc >> 1) + 16);
+        if (!qe_realloc(&pi->tree, nb_alloc * sizeof(*pi->tree)))
+            return 0;
+        if (which == PI_PAGES
+        &&  !qe_realloc(&b->page_groups, nb_alloc * sizeof(PageGroup)))
+            return 0;
+        pi->nb_alloc = nb_alloc;
+    }
+    return 1;
+}
+
+static void page_index_free(EditBuffer *b)
+{
+    int which;
+
+    for (which = 0; which < PI_NB; which++) {
+        qe_free(&b->page_index[which].tree);
+        b->page_index[which].nb_valid = 0;
+        b->page_index[which].nb_alloc = 0;
+    }
+    qe_free(&b->page_groups);
+    b->nb_page_groups = 0;
+    b->page_index_stale = 0;
+}
+
+/* index of the first page of group k */
+static int page_group_start(EditBuffer *b, int k)
+{
+    return (int)page_index_sum(&b->page_index[PI_PAGES], k);
+}
+
+/* return the group holding page n, store its first page in *start */
+static int page_group_find(EditBuffer *b, int n, int *start)
+{
+    QEOffset rem;
+    int k;
+
+    k = page_index_find(&b->page_index[PI_PAGES], n, 0, &rem);
+    *start = n - (int)rem;
+    return k;
+}
+
+/* make metric 'which' cover at least the first n groups */
+static void page_index_extend(EditBuffer *b, int which, int n)
+{
+    PageIndex *pi = &b->page_index[which];
+    PageGroup *pg;
+    int k, start;
+
+    if (n > b->nb_page_groups)
+        n = b->nb_page_groups;
+    if (pi->nb_valid >= n)
+        return;
+
+    k = pi->nb_valid;
+    start = page_group_start(b, k);
+    for (; pi->nb_valid < n; pi->nb_valid++) {
+        pg = &b->page_groups[pi->nb_valid];
+        pg->metric[which] = page_range_metric(b, start,
+                                              (int)pg->metric[PI_PAGES],
+                                              which);
+        start += (int)pg->metric[PI_PAGES];
+    }
+    page_index_rebuild(b, which, k);
+}
+
+/* extend index 'which' until its total exceeds 'value' (or reaches it
+ * if 'strict'), doubling the range each time to keep scans lazy.
+ */
+static void page_index_reach(EditBuffer *b, int which, QEOffset value,
+                             int strict)
+{
+    PageIndex *pi = &b->page_index[which];
+    QEOffset sum;
+
+    while (pi->nb_valid < b->nb_page_groups) {
+        sum = page_index_sum(pi, pi->nb_valid);
+        if (sum > value || (strict && sum == value))
+            break;
+        page_index_extend(b, which, pi->nb_valid * 2 + 4);
+    }
+}
+
+/* return the largest number of leading pages whose cumulative metric
+ * is <= value (< value if 'strict'), store the remainder in *rem.
+ * Only the pages covered by the index are considered.
+ */
+static int page_index_lookup(EditBuffer *b, int which, QEOffset value,
+                             int strict, QEOffset *rem)
+{
+    PageIndex *pi = &b->page_index[which];
+    QEOffset m;
+    int k, n, end;
+
+    k = page_index_find(pi, value, strict, &value);
+    n = page_group_start(b, k);
+    if (k < pi->nb_valid) {
+        end = n + (int)b->page_groups[k].metric[PI_PAGES];
+        for (; n < end; n++) {
+            m = page_metric(b, &b->page_table[n], which);
+            if (m > value || (strict && m == value))
+                break;
+            value -= m;
+        }
+    }
+    *rem = value;
+    return n;
+}
+
+/* sum of metric 'which' over the first n pages */
+static QEOffset page_index_prefix(EditBuffer *b, int which, int n)
+{
+    PageIndex *pi = &b->page_index[which];
+    int k, start, count;
+
+    if (n <= 0)
+        return 0;
+    k = page_group_find(b, n - 1, &start);
+    page_index_extend(b, which, k + 1);
+    count = (int)b->page_groups[k].metric[PI_PAGES];
+    if (n - start > count / 2) {
+        /* closer to the end of the group */
+        return page_index_sum(pi, k + 1) -
+            page_range_metric(b, n, start + count - n, which);
+    }
+    return page_index_sum(pi, k) +
+        page_range_metric(b, start, n - start, which);
+}
+
+/* recompute the metrics of group k from its pages */
+static void page_group_refresh(EditBuffer *b, int k, int start)
+{
+    PageGroup *pg = &b->page_groups[k];
+    QEOffset delta;
+    int which;
+
+    for (which = PI_PAGES + 1; which < PI_NB; which++) {
+        if (k < b->page_index[which].nb_valid) {
+            delta = page_range_metric(b, start, (int)pg->metric[PI_PAGES],
+                                      which) - pg->metric[which];
+            if (delta) {
+                pg->metric[which] += delta;
+                page_index_add(&b->page_index[which], k, delta);
+            }
+        }
+    }
+}
+
+/* adjust the index for the page modified in place, if any */
+static void page_index_flush(EditBuffer *b)
+{
+    int k, start;
+
+    if (b->page_index_stale) {
+        k = page_group_find(b, b->page_index_stale - 1, &start);
+        b->page_index_stale = 0;
+        page_group_refresh(b, k, start);
+    }
+}
+
+/* spread the pages of group k starting at page 'start' over groups of
+ * about PAGE_GROUP_SIZE pages.
+ */
+static void page_group_split(EditBuffer *b, int k, int start)
+{
+    PageGroup *pg;
+    int which, i, n, count, len;
+
+    n = (int)b->page_groups[k].metric[PI_PAGES];
+    count = (n + PAGE_GROUP_SIZE - 1) / PAGE_GROUP_SIZE;
+    if (!page_index_alloc(b, b->nb_page_groups + count - 1)) {
+        /* out of memory: keep a larger group */
+        page_group_refresh(b, k, start);
+        return;
+    }
+    memmove(b->page_groups + k + count, b->page_groups + k + 1,
+            (b->nb_page_groups - k - 1) * sizeof(PageGroup));
+    b->nb_page_groups += count - 1;
+    for (which = 0; which < PI_NB; which++) {
+        if (b->page_index[which].nb_valid > k)
+            b->page_index[which].nb_valid += count - 1;
+    }
+    for (i = 0; i < count; i++) {
+        pg = &b->page_groups[k + i];
+        len = n / (count - i);
+        for (which = 0; which < PI_NB; which++) {
+            if (k < b->page_index[which].nb_valid)
+                pg->metric[which] = page_range_metric(b, start, len, which);
+        }
+        start += len;
+        n -= len;
+    }
+    for (which = 0; which < PI_NB; which++)
+        page_index_rebuild(b, which, k);
+}
+
+/* remove 'count' groups from group k, their pages must have been
+ * removed or accounted for by other groups.
+ */
+static void page_groups_remove(EditBuffer *b, int k, int count)
+{
+    PageIndex *pi;
+    int which;
+
+    memmove(b->page_groups + k, b->page_groups + k + count,
+            (b->nb_page_groups - k - count) * sizeof(PageGroup));
+    b->nb_page_groups -= count;
+    for (which = 0; which < PI_NB; which++) {
+        pi = &b->page_index[which];
+        if (pi->nb_valid > k + count)
+            pi->nb_valid -= count;
+        else
+        if (pi->nb_valid > k)
+            pi->nb_valid = k;
+        page_index_rebuild(b, which, k);
+    }
+}
+
+/* merge group k + 1 into group k */
+static void page_group_merge(EditBuffer *b, int k)
+{
+    PageGroup *pg = &b->page_groups[k];
+    PageIndex *pi;
+    int which;
+
+    for (which = 0; which < PI_NB; which++) {
+        pi = &b->page_index[which];
+        if (k + 1 < pi->nb_valid) {
+            pg->metric[which] += pg[1].metric[which];
+            page_index_add(pi, k, pg[1].metric[which]);
+        } else
+        if (k < pi->nb_valid) {
+            /* the pages of group k + 1 were not scanned yet */
+            pi->nb_valid = k;
+        }
+    }
+    page_groups_remove(b, k + 1, 1);
+}
+
+/* merge group k with a neighbour if it became too small */
+static void page_group_balance(EditBuffer *b, int k)
+{
+    PageGroup *pg = b->page_groups;
+
+    if (k >= b->nb_page_groups || pg[k].metric[PI_PAGES] >= PAGE_GROUP_MIN)
+        return;
+    if (k + 1 < b->nb_page_groups
+    &&  pg[k].metric[PI_PAGES] + pg[k + 1].metric[PI_PAGES] <= PAGE_GROUP_MAX) {
+        page_group_merge(b, k);
+    } else
+    if (k > 0
+    &&  pg[k - 1].metric[PI_PAGES] + pg[k].metric[PI_PAGES] <= PAGE_GROUP_MAX) {
+        page_group_merge(b, k - 1);
+    }
+}
+
+/* 'n' pages were inserted at page index 'i' */
+static void page_index_insert(EditBuffer *b, int i, int n)
+{
+    PageGroup *pg;
+    int k, start;
+
+    if (n <= 0)
+        return;
+    if (b->page_index_stale > i)
+        b->page_index_stale += n;
+
+    if (b->nb_page_groups == 0) {
+        /* first group: line and char counts are computed lazily.
+           Room for it is allocated by eb_new(). */
+        pg = &b->page_groups[0];
+        memset(pg, 0, sizeof(*pg));
+        pg->metric[PI_PAGES] = b->nb_pages;
+        pg->metric[PI_SIZE] = page_range_metric(b, 0, b->nb_pages, PI_SIZE);
+        b->nb_page_groups = 1;
+        b->page_index[PI_PAGES].nb_valid = 1;
+        b->page_index[PI_SIZE].nb_valid = 1;
+        page_index_rebuild(b, PI_PAGES, 0);
+        page_index_rebuild(b, PI_SIZE, 0);
+        k = start = 0;
+    } else {
+        /* the new pages join the group of the previous page */
+        k = 0;
+        start = 0;
+        if (i > 0)
+            k = page_group_find(b, i - 1, &start);
+        pg = &b->page_groups[k];
+        pg->metric[PI_PAGES] += n;
+        page_index_add(&b->page_index[PI_PAGES], k, n);
+    }
+    if (pg->metric[PI_PAGES] > PAGE_GROUP_MAX)
+        page_group_split(b, k, start);
+    else
+        page_group_refresh(b, k, start);
+}
+
+/* the 'n' pages at page index 'i' were removed */
+static void page_index_remove(EditBuffer *b, int i, int n)
+{
+    PageGroup *pg;
+    int k, k1, start, take, first, last;
+
+    if (n <= 0)
+        return;
+    if (b->page_index_stale > i + n)
+        b->page_index_stale -= n;
+    else
+    if (b->page_index_stale > i)
+        b->page_index_stale = 0;
+
+    /* take the pages from the groups holding them */
+    k = page_group_find(b, i, &start);
+    for (k1 = k; n > 0; k1++) {
+        pg = &b->page_groups[k1];
+        take = min(n, start + (int)pg->metric[PI_PAGES] - i);
+        pg->metric[PI_PAGES] -= take;
+        page_index_add(&b->page_index[PI_PAGES], k1, -take);
+        n -= take;
+        start = i;
+    }
+    /* groups k + 1 to k1 - 2 are empty, k and k1 - 1 may be */
+    pg = b->page_groups;
+    first = (pg[k].metric[PI_PAGES] == 0) ? k : k + 1;
+    last = (pg[k1 - 1].metric[PI_PAGES] == 0) ? k1 : k1 - 1;
+    if (last > first)
+        page_groups_remove(b, first, last - first);
+
+    /* the groups that lost pages are now at k and k + 1 */
+    for (k1 = k; k1 < k + 2 && k1 < b->nb_page_groups; k1++)
+        page_group_refresh(b, k1, page_group_start(b, k1));
+    page_group_balance(b, k + 1);
+    page_group_balance(b, k);
+}
+
+/* the pages from page index 'i' to 'end' were modified in place */
+static void page_index_update(EditBuffer *b, int i, int end)
+{
+    int k, start;
+
+    while (i < end) {
+        k = page_group_find(b, i, &start);
+        page_group_refresh(b, k, start);
+        i = start + (int)b->page_groups[k].metric[PI_PAGES];
+    }
+}
 
 /************************************************************/
 /* basic access to the edit buffer */
 
 /* find a page at a given offset */
-static Page *find_page(EditBuffer *b, int *offset_ptr)
+static Page *find_page(EditBuffer *b, QEOffset *offset_ptr)
 {
     Page *p;
-    int offset;
+    QEOffset offset;
+    int n;
 
     offset = *offset_ptr;
     if (b->cur_page && offset >= b->cur_offset &&
@@ -43,7 +725,10 @@ static Page *find_page(EditBuffer *b, int *offset_ptr)
         *offset_ptr -= b->cur_offset;
         return b->cur_page;
     } else {
-        p = b->page_table;
+        page_index_flush(b);
+        page_index_extend(b, PI_SIZE, b->nb_page_groups);
+        n = page_index_lookup(b, PI_SIZE, offset, 0, &offset);
+        p = b->page_table + n;
         while (offset >= p->size) {
             offset -= p->size;
             p++;
@@ -55,52 +740,346 @@ static Page *find_page(EditBuffer *b, int *offset_ptr)
     }
 }
 
-/* prepare a page to be written */
-static void update_page(Page *p)
+/* find a page at a given offset to modify it: pages larger than
+ * MAX_PAGE_SIZE, such as mapped file windows, are split so the
+ * returned page holds at most MAX_PAGE_SIZE bytes.  Return NULL if
+ * memory runs out, the pages are then left unchanged.
+ */
+static Page *find_page_for_edit(EditBuffer *b, QEOffset *offset_ptr)
 {
-    u8 *buf;
+    Page *p, *q, p0;
+    QEOffset offset = *offset_ptr;
+    u8 *pieces[3];
+    int sizes[3], page_index, start, pos, i, n;
+
+    p = find_page(b, offset_ptr);
+    if (p->size <= MAX_PAGE_SIZE)
+        return p;
+
+    /* cut the bytes before, at most MAX_PAGE_SIZE bytes around the
+       offset and the bytes after */
+    start = (int)*offset_ptr / MAX_PAGE_SIZE * MAX_PAGE_SIZE;
+    n = 0;
+    if (start > 0)
+        sizes[n++] = start;
+    sizes[n++] = min(p->size - start, MAX_PAGE_SIZE);
+    if (start + MAX_PAGE_SIZE < p->size)
+        sizes[n++] = p->size - start - MAX_PAGE_SIZE;
+
+    /* writable pages are cut in copies allocated beforehand */
+    memset(pieces, 0, sizeof(pieces));
+    if (!(p->flags & PG_READ_ONLY)) {
+        for (i = 1, pos = sizes[0]; i < n; pos += sizes[i++]) {
+            pieces[i] = qe_malloc_dup(p->data + pos, sizes[i]);
+            if (!pieces[i])
+                goto fail;
+        }
+    }
+
+    page_index = p - b->page_table;
+    p0 = *p;
+    if (!qe_realloc(&b->page_table, (b->nb_pages + n - 1) * sizeof(Page)))
+        goto fail;
+    p = b->page_table + page_index;
+    memmove(p + n, p + 1, (b->nb_pages - page_index - 1) * sizeof(Page));
+    b->nb_pages += n - 1;
+
+    for (i = pos = 0; i < n; pos += sizes[i++]) {
+        q = p + i;
+        *q = p0;
+        q->size = sizes[i];
+        q->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+        if (p0.flags & PG_MAPPED)
+            q->map_offset += pos;
+        else
+        if (p0.flags & PG_READ_ONLY)
+            q->data += pos;
+        else
+        if (i > 0)
+            q->data = pieces[i];
+    }
+    /* the first piece keeps the original block */
+    if (!(p0.flags & PG_READ_ONLY))
+        qe_realloc(&p->data, sizes[0]);
+    if (p0.flags & PG_SHARED)
+        p0.block->ref_count += n - 1;
+    if (p0.flags & PG_MAPPED)
+        p0.map->ref_count += n - 1;
+    page_index_insert(b, page_index + 1, n - 1);
+
+    b->cur_page = NULL;
+    *offset_ptr = offset;
+    return find_page(b, offset_ptr);
+
+ fail:
+    for (i = 1; i < n; i++)
+        qe_free(&pieces[i]);
+    return NULL;
+}
+
+/* split the large pages at both ends of a region to be modified, the
+ * pages in between are modified entirely.  Return -1 if memory runs
+ * out.
+ */
+static int eb_split_region(EditBuffer *b, QEOffset offset, QEOffset size)
+{
+    QEOffset pos;
+
+    /* no need to split if a bound falls on a page boundary */
+    pos = offset + size;
+    if (pos < b->total_size && (find_page(b, &pos), pos > 0)) {
+        pos = offset + size;
+        if (!find_page_for_edit(b, &pos))
+            return -1;
+    }
+    pos = offset;
+    if (find_page(b, &pos), pos > 0) {
+        pos = offset;
+        if (!find_page_for_edit(b, &pos))
+            return -1;
+    }
+    return 0;
+}
+
+/* return true if the pages modified by an edit of the region can be
+ * read, all the pages of the region if 'all' is true, only those
+ * partially covered otherwise.  Edits copy the data of mapped pages.
+ */
+static int eb_range_readable(EditBuffer *b, QEOffset offset, QEOffset size,
+                             int all)
+{
+    QEOffset start, end, pos;
+    Page *p;
+
+    start = max_offset(offset, 0);
+    end = min_offset(offset + size, b->total_size);
+    offset = start;
+    while (offset < end) {
+        pos = offset;
+        p = find_page(b, &pos);
+        offset -= pos;
+        if ((all || offset < start || offset + p->size > end)
+        &&  !page_readable(b, p)) {
+            return 0;
+        }
+        offset += p->size;
+        /* only the last page may be partially covered */
+        if (!all)
+            offset = max_offset(offset, end - 1);
+    }
+    return 1;
+}
+
+/************************************************************/
+/* page coalescing */
+
+/* Typing and deleting leave partially filled pages behind.  Runs of
+ * adjacent small writable pages are merged by a background timer, one
+ * time slice at a time, from the first page modified in each buffer
+ * since the last pass.
+ */
+
+#define COALESCE_DELAY  1000    /* ms after the last modification */
+#define COALESCE_SLICE  5       /* ms per timer callback */
+#define COALESCE_CHUNK  1024    /* pages examined between clock checks */
+
+static QETimer *eb_coalesce_timer;
+
+/* merge runs of small writable pages starting among 'count' pages from
+ * 'page_index', return the index of the next page to examine.
+ */
+static int eb_coalesce_pages(EditBuffer *b, int page_index, int count)
+{
+    Page *p, *q, *q_end, *p_end;
+    int first = -1, end, n;
+
+    p = q = b->page_table + page_index;
+    p_end = b->page_table + b->nb_pages;
+    q_end = b->page_table + min(b->nb_pages, page_index + count);
+    while (q < q_end) {
+        *p = *q++;
+        while (!(p->flags & PG_READ_ONLY) && q < p_end
+        &&     !(q->flags & PG_READ_ONLY)
+        &&     p->size + q->size <= MAX_PAGE_SIZE) {
+            if (!qe_realloc(&p->data, p->size + q->size))
+                break;
+            memcpy(p->data + p->size, q->data, q->size);
+            p->size += q->size;
+            p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+            qe_free(&q->data);
+            q++;
+            if (first < 0)
+                first = p - b->page_table;
+        }
+        p++;
+    }
+    end = p - b->page_table;
+    if (q > p) {
+        n = q - p;
+        memmove(p, q, (p_end - q) * sizeof(Page));
+        b->nb_pages -= n;
+        qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
+        /* the merged pages moved: account them as modified and the
+           count difference as removed after the last one */
+        if (b->page_index_stale > first && b->page_index_stale <= end + n)
+            b->page_index_stale = 0;
+        page_index_remove(b, end, n);
+        page_index_update(b, first, end);
+        b->cur_page = NULL;
+    }
+    return end;
+}
+
+static void eb_coalesce_timer_cb(__unused__ void *opaque)
+{
+    QEmacsState *qs = &qe_state;
+    EditBuffer *b;
+    int start_time, page_index, delay = -1;
+
+    eb_coalesce_timer = NULL;
+    start_time = get_clock_ms();
+    for (b = qs->first_buffer; b; b = b->next) {
+        if (b->flags & (BF_LOADING | BF_SAVING)) {
+            if (b->coalesce_start && delay < 0)
+                delay = COALESCE_DELAY;
+            continue;
+        }
+        while (b->coalesce_start) {
+            if (get_clock_ms() - start_time >= COALESCE_SLICE) {
+                delay = 0;
+                break;
+            }
+            page_index = eb_coalesce_pages(b, b->coalesce_start - 1,
+                                           COALESCE_CHUNK);
+            b->coalesce_start = (page_index < b->nb_pages) ? page_index + 1 : 0;
+        }
+    }
+    if (delay >= 0)
+        eb_coalesce_timer = qe_add_timer(delay, NULL, eb_coalesce_timer_cb);
+}
+
+/* pages from 'page_index' were modified: schedule their coalescing */
+static void eb_coalesce_later(EditBuffer *b, int page_index)
+{
+    /* the previous page may merge with the modified one */
+    page_index = max(page_index, 1);
+    if (!b->coalesce_start || b->coalesce_start > page_index)
+        b->coalesce_start = page_index;
+    if (!eb_coalesce_timer) {
+        eb_coalesce_timer = qe_add_timer(COALESCE_DELAY, NULL,
+                                         eb_coalesce_timer_cb);
+    }
+}
+
+/* prepare a page to be written, return -1 if its data cannot be
+ * copied, the page is then left unchanged.
+ */
+static int update_page(EditBuffer *b, Page *p)
+{
+    u8 *data, *buf;
+    int page_index = p - b->page_table;
+
+    /* page metrics will be reindexed upon next lookup */
+    if (b->page_index_stale != page_index + 1) {
+        page_index_flush(b);
+        b->page_index_stale = page_index + 1;
+    }
 
     /* if the page is read only, copy it */
     if (p->flags & PG_READ_ONLY) {
-        buf = qe_malloc_dup(p->data, p->size);
-        /* XXX: should return an error */
-        if (!buf)
-            return;
-        p->data = buf;
-        p->flags &= ~PG_READ_ONLY;
+        if ((p->flags & PG_SHARED) && p->block->ref_count == 1
+        &&  p->data == p->block->data) {
+            /* last reference: take the block back */
+            qe_free(&p->block);
+        } else {
+            /* edits check that mapped pages can be read beforehand */
+            data = page_data(b, p);
+            buf = data ? qe_malloc_dup(data, p->size) : NULL;
+            if (!buf)
+                return -1;
+            if (p->flags & PG_SHARED)
+                page_block_free(&p->block);
+            if (p->flags & PG_MAPPED)
+                mapped_file_free(&p->map);
+            p->data = buf;
+        }
+        p->flags &= ~(PG_READ_ONLY | PG_MAPPED | PG_SHARED);
     }
     p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
+    return 0;
+}
+
+/* make writable the pages modified by an edit of the region, as
+ * selected by eb_range_readable(), so the edit cannot fail once
+ * logged.  Return -1 if memory runs out.
+ */
+static int eb_update_region(EditBuffer *b, QEOffset offset, QEOffset size,
+                            int all)
+{
+    QEOffset start, end, pos;
+    Page *p;
+
+    start = max_offset(offset, 0);
+    end = min_offset(offset + size, b->total_size);
+    offset = start;
+    while (offset < end) {
+        pos = offset;
+        p = find_page(b, &pos);
+        offset -= pos;
+        if ((all || offset < start || offset + p->size > end)
+        &&  update_page(b, p)) {
+            return -1;
+        }
+        offset += p->size;
+        if (!all)
+            offset = max_offset(offset, end - 1);
+    }
+    return 0;
 }
 
 /* Read or write in the buffer. We must have 0 <= offset < b->total_size */
-static int eb_rw(EditBuffer *b, int offset, u8 *buf, int size1, int do_write)
+static int eb_rw(EditBuffer *b, QEOffset offset, u8 *buf, int size1,
+                 int do_write)
 {
+    const u8 *data;
     Page *p;
     int len, size;
 
     if (offset < 0)
         return 0;
 
-    if ((offset + size1) > b->total_size)
-        size1 = b->total_size - offset;
+    if (offset + size1 > b->total_size)
+        size1 = (int)max_offset(b->total_size - offset, 0);
 
     if (size1 <= 0)
         return 0;
 
     size = size1;
-    if (do_write)
+    if (do_write) {
+        if (!eb_range_readable(b, offset, size, 1))
+            return 0;
+        if (eb_split_region(b, offset, size)
+        ||  eb_update_region(b, offset, size, 1))
+            return 0;
         eb_addlog(b, LOGOP_WRITE, offset, size);
+    }
 
     p = find_page(b, &offset);
     while (size > 0) {
-        len = p->size - offset;
+        len = p->size - (int)offset;
         if (len > size)
             len = size;
         if (do_write) {
-            update_page(p);
+            update_page(b, p);
             memcpy(p->data + offset, buf, len);
         } else {
-            memcpy(buf, p->data + offset, len);
+            data = page_data(b, p);
+            if (!data) {
+                /* read error: return the number of bytes read */
+                memset(buf, 0, size);
+                break;
+            }
+            memcpy(buf, data + offset, len);
         }
         buf += len;
         size -= len;
@@ -110,18 +1089,63 @@ static int eb_rw(EditBuffer *b, int offset, u8 *buf, int size1, int do_write)
             offset = 0;
         }
     }
-    return size1;
+    return size1 - size;
 }
 
 /* We must have: 0 <= offset < b->total_size */
-/* Safety: request will be clipped */
-int eb_read(EditBuffer *b, int offset, void *buf, int size)
+/* Safety: request will be clipped, fewer bytes are read upon error */
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size)
 {
     return eb_rw(b, offset, buf, size, 0);
 }
 
+/* Return a pointer to the buffer contents at 'offset' and store the
+ * number of contiguous bytes available there in *size_ptr, 0 at end of
+ * buffer or upon read error.  The data is only valid until the buffer
+ * is modified or many other parts of a mapped file are accessed.
+ */
+const u8 *eb_peek(EditBuffer *b, QEOffset offset, int *size_ptr)
+{
+    const u8 *data;
+    Page *p;
+
+    *size_ptr = 0;
+    if (offset < 0 || offset >= b->total_size)
+        return NULL;
+    p = find_page(b, &offset);
+    data = page_data(b, p);
+    if (!data)
+        return NULL;
+    *size_ptr = p->size - (int)offset;
+    return data + offset;
+}
+
+/* Return a pointer to the data of the page containing 'offset', store
+ * the buffer offset of its first byte in *start_ptr and its size in
+ * *size_ptr, 0 if 'offset' is outside the buffer or upon read error.
+ */
+const u8 *eb_peek_page(EditBuffer *b, QEOffset offset,
+                       QEOffset *start_ptr, int *size_ptr)
+{
+    const u8 *data;
+    Page *p;
+    QEOffset page_offset = offset;
+
+    *start_ptr = offset;
+    *size_ptr = 0;
+    if (offset < 0 || offset >= b->total_size)
+        return NULL;
+    p = find_page(b, &page_offset);
+    data = page_data(b, p);
+    if (!data)
+        return NULL;
+    *start_ptr = offset - page_offset;
+    *size_ptr = p->size;
+    return data;
+}
+
 /* Note: eb_write can be used to insert after the end of the buffer */
-void eb_write(EditBuffer *b, int offset, const void *buf_arg, int size)
+void eb_write(EditBuffer *b, QEOffset offset, const void *buf_arg, int size)
 {
     int len, left;
     const u8 *buf = buf_arg;
@@ -150,8 +1174,8 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
         len = MAX_PAGE_SIZE - p->size;
         if (len > size)
             len = size;
-        if (len > 0) {
-            update_page(p);
+        /* the bytes go to new pages if the page cannot be copied */
+        if (len > 0 && !update_page(b, p)) {
             /* CG: probably faster with qe_malloc + qe_free */
             qe_realloc(&p->data, p->size + len);
             memmove(p->data + len, p->data, p->size);
@@ -162,7 +1186,7 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
     }
 
     /* now add new pages if necessary */
-    n = (size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
+    n = (size + LARGE_PAGE_SIZE - 1) / LARGE_PAGE_SIZE;
     if (n > 0) {
         b->nb_pages += n;
         qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
@@ -170,8 +1194,8 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
         memmove(p + n, p, sizeof(Page) * (b->nb_pages - n - page_index));
         while (size > 0) {
             len = size;
-            if (len > MAX_PAGE_SIZE)
-                len = MAX_PAGE_SIZE;
+            if (len > LARGE_PAGE_SIZE)
+                len = LARGE_PAGE_SIZE;
             p->size = len;
             p->data = qe_malloc_dup(buf, len);
             p->flags = 0;
@@ -179,13 +1203,42 @@ static void eb_insert1(EditBuffer *b, int page_index, const u8 *buf, int size)
             size -= len;
             p++;
         }
+        page_index_insert(b, page_index, n);
+    }
+}
+
+/* split and make writable the page where eb_insert_lowlevel() inserts
+ * bytes at 'offset', return -1 if memory runs out.
+ */
+static int eb_insert_prepare(EditBuffer *b, QEOffset offset)
+{
+    QEOffset pos;
+    Page *p;
+
+    if (offset <= 0)
+        return 0;
+    pos = offset - 1;
+    p = find_page(b, &pos);
+    /* large pages are only split to insert inside them */
+    if (p->size > MAX_PAGE_SIZE && pos + 1 < p->size) {
+        pos = offset - 1;
+        p = find_page_for_edit(b, &pos);
+        if (!p)
+            return -1;
     }
+    /* bytes are only inserted in the page if it has room after pos */
+    if (pos + 1 < MAX_PAGE_SIZE && update_page(b, p))
+        return -1;
+    return 0;
 }
 
-/* We must have : 0 <= offset <= b->total_size */
-static void eb_insert_lowlevel(EditBuffer *b, int offset,
+/* We must have : 0 <= offset <= b->total_size,
+ * the page at 'offset' must be prepared by eb_insert_prepare().
+ */
+static void eb_insert_lowlevel(EditBuffer *b, QEOffset offset,
                                const u8 *buf, int size)
 {
+    QEOffset pos;
     int len, len_out, page_index;
     Page *p;
 
@@ -194,30 +1247,30 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
     /* find the correct page */
     p = b->page_table;
     if (offset > 0) {
-        offset--;
-        p = find_page(b, &offset);
-        offset++;
+        pos = offset - 1;
+        p = find_page(b, &pos);
+        offset = pos + 1;
 
         /* compute what we can insert in current page */
-        len = MAX_PAGE_SIZE - offset;
+        len = max(MAX_PAGE_SIZE - (int)offset, 0);
         if (len > size)
             len = size;
         /* number of bytes to put in next pages */
         len_out = p->size + len - MAX_PAGE_SIZE;
         page_index = p - b->page_table;
-        if (len_out > 0)
+        if (len > 0 && len_out > 0)
             eb_insert1(b, page_index + 1,
-                       p->data + p->size - len_out, len_out);
+                       page_data(b, p) + p->size - len_out, len_out);
         else
             len_out = 0;
         /* now we can insert in current page */
         if (len > 0) {
             p = b->page_table + page_index;
-            update_page(p);
+            update_page(b, p);
             p->size += len - len_out;
             qe_realloc(&p->data, p->size);
             memmove(p->data + offset + len,
-                    p->data + offset, p->size - (offset + len));
+                    p->data + offset, p->size - ((int)offset + len));
             memcpy(p->data + offset, buf, len);
             buf += len;
             size -= len;
@@ -229,20 +1282,52 @@ static void eb_insert_lowlevel(EditBuffer *b, int offset,
     if (size > 0)
         eb_insert1(b, page_index + 1, buf, size);
 
+    eb_coalesce_later(b, page_index);
+
     /* the page cache is no longer valid */
     b->cur_page = NULL;
 }
 
+/* Make 'offset' fall on a page boundary, return the index of the page
+ * starting there, or nb_pages at the end of the buffer, -1 if memory
+ * runs out.
+ */
+static int eb_cut_page(EditBuffer *b, QEOffset offset)
+{
+    Page *q;
+    int page_index;
+
+    if (offset >= b->total_size)
+        return b->nb_pages;
+
+    q = find_page_for_edit(b, &offset);
+    if (!q)
+        return -1;
+    page_index = q - b->page_table;
+    if (offset > 0) {
+        if (update_page(b, q))
+            return -1;
+        page_index++;
+        eb_insert1(b, page_index, q->data + offset, q->size - (int)offset);
+        /* must reload q because page_table may have been realloced */
+        q = b->page_table + page_index - 1;
+        qe_realloc(&q->data, offset);
+        q->size = (int)offset;
+    }
+    return page_index;
+}
+
 /* Insert 'size' bytes of 'src' buffer from position 'src_offset' into
  * buffer 'dest' at offset 'dest_offset'. 'src' MUST BE DIFFERENT from
  * 'dest'. Raw insertion performed, encoding is ignored.
  */
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size)
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size)
 {
     Page *p, *p_start, *q;
-    int len, n, page_index, size0;
+    QEOffset size0;
+    int len, n, page_index;
 
     if (dest->flags & BF_READONLY)
         return 0;
@@ -260,44 +1345,43 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
     if (size <= 0)
         return 0;
 
+    if (!eb_range_readable(src, src_offset, size, 0)
+    ||  !eb_range_readable(dest, dest_offset - 1, 2, 1))
+        return 0;
+
     size0 = size;
 
+    /* prepare the destination page before logging the insertion */
+    p = find_page(src, &src_offset);
+    if (src_offset > 0) {
+        if (eb_insert_prepare(dest, dest_offset))
+            return 0;
+    } else {
+        page_index = eb_cut_page(dest, dest_offset);
+        if (page_index < 0)
+            return 0;
+    }
+
     eb_addlog(dest, LOGOP_INSERT, dest_offset, size);
 
     /* insert the data from the first page if it is not completely
        selected */
-    p = find_page(src, &src_offset);
     if (src_offset > 0) {
-        len = p->size - src_offset;
+        len = p->size - (int)src_offset;
         if (len > size)
-            len = size;
-        eb_insert_lowlevel(dest, dest_offset, p->data + src_offset, len);
+            len = (int)size;
+        eb_insert_lowlevel(dest, dest_offset,
+                           page_data(src, p) + src_offset, len);
         dest_offset += len;
         size -= len;
         p++;
+        if (size == 0)
+            return size0;
+        /* cut the page at dest offset if needed: the bytes before it
+           were just inserted in writable pages, so this cannot fail */
+        page_index = eb_cut_page(dest, dest_offset);
     }
-
-    if (size == 0)
-        return size0;
-
-    /* cut the page at dest offset if needed */
-    if (dest_offset < dest->total_size) {
-        q = find_page(dest, &dest_offset);
-        page_index = q - dest->page_table;
-        if (dest_offset > 0) {
-            page_index++;
-            eb_insert1(dest, page_index, q->data + dest_offset,
-                       q->size - dest_offset);
-            /* must reload q because page_table may have been
-               realloced */
-            q = dest->page_table + page_index - 1;
-            update_page(q);
-            qe_realloc(&q->data, dest_offset);
-            q->size = dest_offset;
-        }
-    } else {
-        page_index = dest->nb_pages;
-    }
+    eb_coalesce_later(dest, page_index);
 
     /* update total_size */
     dest->total_size += size;
@@ -320,25 +1404,37 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
         while (n > 0) {
             len = p->size;
             q->size = len;
-            if (p->flags & PG_READ_ONLY) {
-                /* simply copy the reference */
-                q->flags = PG_READ_ONLY;
+            if (p->flags & PG_MAPPED) {
+                /* share the mapped file data */
+                q->flags = PG_READ_ONLY | PG_MAPPED;
+                q->data = NULL;
+                q->map_offset = p->map_offset;
+                q->map = p->map;
+                q->map->ref_count++;
+            } else
+            if (page_share(p)) {
+                /* share the data block */
+                q->flags = PG_READ_ONLY | PG_SHARED;
                 q->data = p->data;
+                q->block = p->block;
+                q->block->ref_count++;
             } else {
                 /* allocate a new page */
                 q->flags = 0;
-                q->data = qe_malloc_dup(p->data, len);
+                q->data = qe_malloc_dup(page_data(src, p), len);
             }
             n--;
             p++;
             q++;
         }
-        page_index = q - dest->page_table;
+        n = p - p_start;
+        page_index_insert(dest, page_index, n);
+        page_index += n;
     }
 
     /* insert the remaning bytes */
     if (size > 0) {
-        eb_insert1(dest, page_index, p->data, size);
+        eb_insert1(dest, page_index, page_data(src, p), (int)size);
     }
 
     /* the page cache is no longer valid */
@@ -349,7 +1445,7 @@ int eb_insert_buffer(EditBuffer *dest, int dest_offset,
 /* Insert 'size' bytes from 'buf' into 'b' at offset 'offset'. We must
    have : 0 <= offset <= b->total_size */
 /* Return number of bytes inserted */
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size)
 {
     if (b->flags & BF_READONLY)
         return 0;
@@ -361,6 +1457,10 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
     if (offset < 0 || size <= 0)
         return 0;
 
+    if (!eb_range_readable(b, offset - 1, 2, 1)
+    ||  eb_insert_prepare(b, offset))
+        return 0;
+
     eb_addlog(b, LOGOP_INSERT, offset, size);
 
     eb_insert_lowlevel(b, offset, buf, size);
@@ -373,9 +1473,10 @@ int eb_insert(EditBuffer *b, int offset, const void *buf, int size)
 /* We must have : 0 <= offset <= b->total_size,
  * return actual number of bytes removed.
  */
-int eb_delete(EditBuffer *b, int offset, int size)
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size)
 {
-    int n, len, size0;
+    QEOffset size0;
+    int n, len;
     Page *del_start, *p;
 
     if (b->flags & BF_READONLY)
@@ -387,8 +1488,15 @@ int eb_delete(EditBuffer *b, int offset, int size)
     if (size > b->total_size - offset)
         size = b->total_size - offset;
 
+    if (!eb_range_readable(b, offset, size, 0))
+        return 0;
+
     size0 = size;
 
+    if (eb_split_region(b, offset, size)
+    ||  eb_update_region(b, offset, size, 0))
+        return 0;
+
     /* dispatch callbacks before buffer update */
     eb_addlog(b, LOGOP_DELETE, offset, size);
 
@@ -396,23 +1504,24 @@ int eb_delete(EditBuffer *b, int offset, int size)
 
     /* find the correct page */
     p = find_page(b, &offset);
+    eb_coalesce_later(b, p - b->page_table);
     n = 0;
     del_start = NULL;
     while (size > 0) {
-        len = p->size - offset;
+        len = p->size - (int)offset;
         if (len > size)
-            len = size;
+            len = (int)size;
         if (len == p->size) {
             if (!del_start)
                 del_start = p;
-            /* we cannot free if read only */
-            if (!(p->flags & PG_READ_ONLY))
-                qe_free(&p->data);
+            if (b->page_index_stale == p - b->page_table + 1)
+                b->page_index_stale = 0;
+            page_free_data(p);
             p++;
             offset = 0;
             n++;
         } else {
-            update_page(p);
+            update_page(b, p);
             memmove(p->data + offset, p->data + offset + len,
                     p->size - offset - len);
             p->size -= len;
@@ -431,6 +1540,7 @@ int eb_delete(EditBuffer *b, int offset, int size)
         b->nb_pages -= n;
         memmove(del_start, del_start + n,
                 (b->page_table + b->nb_pages - del_start) * sizeof(Page));
+        page_index_remove(b, del_start - b->page_table, n);
         qe_realloc(&b->page_table, b->nb_pages * sizeof(Page));
     }
 
@@ -444,20 +1554,72 @@ int eb_delete(EditBuffer *b, int offset, int size)
 void log_reset(EditBuffer *b)
 {
     eb_free(&b->log_buffer);
-    b->log_new_index = 0;
-    b->log_current = 0;
-    b->nb_logs = 0;
+    qe_free(&b->undo_records);
+    b->undo_size = 0;
+    b->undo_first = 0;
+    b->undo_count = 0;
+    b->undo_current = 0;
+    b->undo_dead = 0;
+    b->undo_base = 0;
+    b->undo_synced = 0;
+    /* the journal no longer matches the records */
+    b->undo_journal_size = 0;
     b->modified = 0;    /* ??? */
 }
 
+/* Buffers are indexed by name, by file name and by file identity in
+ * hash tables of the global state.
+ */
+static inline unsigned int eb_file_id_hash(dev_t dev, ino_t ino)
+{
+    return (unsigned int)(((unsigned long long)ino ^
+                           ((unsigned long long)dev << 20)) * 2654435761U);
+}
+
+static void eb_unindex_file(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+
+    if (b->filename[0])
+        qe_hash_remove(&qs->file_table, qe_hash_string(b->filename), b);
+    if (b->file_ino) {
+        qe_hash_remove(&qs->file_id_table,
+                       eb_file_id_hash(b->file_dev, b->file_ino), b);
+        b->file_dev = 0;
+        b->file_ino = 0;
+    }
+}
+
+/* record the identity of the file, it changes when the file is saved */
+static void eb_index_file_id(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    struct stat st;
+
+    if (b->file_ino) {
+        qe_hash_remove(&qs->file_id_table,
+                       eb_file_id_hash(b->file_dev, b->file_ino), b);
+        b->file_dev = 0;
+        b->file_ino = 0;
+    }
+    if (b->filename[0] && stat(b->filename, &st) == 0 && st.st_ino) {
+        b->file_dev = st.st_dev;
+        b->file_ino = st.st_ino;
+        qe_hash_add(&qs->file_id_table,
+                    eb_file_id_hash(b->file_dev, b->file_ino), b);
+    }
+}
+
 /* rename a buffer and add characters so that the name is unique */
 void eb_set_buffer_name(EditBuffer *b, const char *name1)
 {
+    QEmacsState *qs = &qe_state;
     char name[MAX_BUFFERNAME_SIZE];
     int n, pos;
 
     pstrcpy(name, sizeof(name) - 10, name1);
     /* set the buffer name to NULL since it will be changed */
+    qe_hash_remove(&qs->buffer_table, qe_hash_string(b->name), b);
     b->name[0] = '\0';
     pos = strlen(name);
     n = 1;
@@ -466,6 +1628,7 @@ void eb_set_buffer_name(EditBuffer *b, const char *name1)
         n++;
     }
     pstrcpy(b->name, sizeof(b->name), name);
+    qe_hash_add(&qs->buffer_table, qe_hash_string(b->name), b);
 }
 
 EditBuffer *eb_new(const char *name, int flags)
@@ -480,6 +1643,13 @@ EditBuffer *eb_new(const char *name, int flags)
 
     // should ensure name uniqueness ?
     pstrcpy(b->name, sizeof(b->name), name);
+    if (!page_index_alloc(b, 1)
+    ||  qe_hash_add(&qs->buffer_table, qe_hash_string(b->name), b)) {
+        page_index_free(b);
+        qe_free(&b);
+        return NULL;
+    }
+    b->version = ++eb_last_version;
     b->flags = flags & ~BF_STYLES;
 
     /* set default data type */
@@ -539,6 +1709,7 @@ EditBuffer *eb_scratch(const char *name, int flags)
 
 void eb_clear(EditBuffer *b)
 {
+    eb_load_stop(b);
     b->flags &= ~BF_READONLY;
 
     /* XXX: should just reset logging instead of disabling it */
@@ -547,12 +1718,6 @@ void eb_clear(EditBuffer *b)
     eb_delete(b, 0, b->total_size);
     log_reset(b);
 
-    /* close and reset file handle */
-    if (b->file_handle > 0) {
-        close(b->file_handle);
-    }
-    b->file_handle = 0;
-
     /* TODO: clear buffer structure */
     //memset(b, 0, offsetof(EditBuffer, remanent_area));
 }
@@ -568,6 +1733,8 @@ void eb_free(EditBuffer **bp)
         if (b->close)
             b->close(b);
 
+        eb_free_colorize_caches(b);
+
         /* free each callback */
         while (b->first_callback) {
             EditBufferCallbackList *cb = b->first_callback;
@@ -576,6 +1743,7 @@ void eb_free(EditBuffer **bp)
         }
 
         eb_clear(b);
+        page_index_free(b);
 
         /* suppress from buffer list */
         pb = &qs->first_buffer;
@@ -585,6 +1753,8 @@ void eb_free(EditBuffer **bp)
             pb = &(*pb)->next;
         }
         *pb = (*pb)->next;
+        qe_hash_remove(&qs->buffer_table, qe_hash_string(b->name), b);
+        eb_unindex_file(b);
 
         if (b == qs->trace_buffer)
             qs->trace_buffer = NULL;
@@ -600,13 +1770,13 @@ void eb_free(EditBuffer **bp)
 EditBuffer *eb_find(const char *name)
 {
     QEmacsState *qs = &qe_state;
+    unsigned int h = qe_hash_string(name);
     EditBuffer *b;
+    int pos = -1;
 
-    b = qs->first_buffer;
-    while (b != NULL) {
+    while ((b = qe_hash_next(&qs->buffer_table, h, &pos)) != NULL) {
         if (strequal(b->name, name))
             return b;
-        b = b->next;
     }
     return NULL;
 }
@@ -624,14 +1794,30 @@ EditBuffer *eb_find_new(const char *name, int flags)
 EditBuffer *eb_find_file(const char *filename)
 {
     QEmacsState *qs = &qe_state;
+    unsigned int h = qe_hash_string(filename);
     EditBuffer *b;
+    struct stat st, st1;
+    int pos = -1;
 
-    b = qs->first_buffer;
-    while (b != NULL) {
-        /* XXX: should also use stat to ensure this is same file */
+    while ((b = qe_hash_next(&qs->file_table, h, &pos)) != NULL) {
         if (strequal(b->filename, filename))
             return b;
-        b = b->next;
+    }
+    /* the same file under another name, through links */
+    if (stat(filename, &st) == 0 && st.st_ino) {
+        h = eb_file_id_hash(st.st_dev, st.st_ino);
+        pos = -1;
+        while ((b = qe_hash_next(&qs->file_id_table, h, &pos)) != NULL) {
+            if (b->file_dev != st.st_dev || b->file_ino != st.st_ino)
+                continue;
+            /* the recorded identity is stale if the buffer file was
+               removed or replaced since: its inode may be reused */
+            if (stat(b->filename, &st1) == 0
+            &&  st1.st_dev == st.st_dev && st1.st_ino == st.st_ino)
+                return b;
+            eb_index_file_id(b);
+            pos = -1;
+        }
     }
     return NULL;
 }
@@ -656,7 +1842,7 @@ void eb_trace_bytes(const void *buf, int size, int state)
     QEmacsState *qs = &qe_state;
     EditBuffer *b = qs->trace_buffer;
     EditState *e;
-    int point;
+    QEOffset point;
 
     if (b) {
         point = b->total_size;
@@ -701,70 +1887,521 @@ void eb_trace_bytes(const void *buf, int size, int state)
 #endif
         eb_write(b, b->total_size, buf, size);
 
-        /* If point is visible in window, should keep it so */
-        e = eb_find_window(b, NULL);
-        if (e && e->offset == point)
-            e->offset = b->total_size;
+        /* If point is visible in window, should keep it so */
+        e = eb_find_window(b, NULL);
+        if (e && e->offset == point)
+            e->offset = b->total_size;
+    }
+}
+
+/************************************************************/
+/* callbacks */
+
+int eb_add_callback(EditBuffer *b, EditBufferCallback cb,
+                    void *opaque, int arg)
+{
+    EditBufferCallbackList *l;
+
+    l = qe_mallocz(EditBufferCallbackList);
+    if (!l)
+        return -1;
+    l->callback = cb;
+    l->opaque = opaque;
+    l->arg = arg;
+    l->next = b->first_callback;
+    b->first_callback = l;
+    return 0;
+}
+
+void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
+{
+    EditBufferCallbackList **pl, *l;
+
+    for (pl = &b->first_callback; (*pl) != NULL; pl = &(*pl)->next) {
+        l = *pl;
+        if (l->callback == cb && l->opaque == opaque) {
+            *pl = l->next;
+            qe_free(&l);
+            break;
+       }
+    }
+}
+
+/* standard callback to move offsets */
+void eb_offset_callback(__unused__ EditBuffer *b, void *opaque, int edge,
+                        enum LogOperation op, QEOffset offset, QEOffset size)
+{
+    QEOffset *offset_ptr = opaque;
+
+    switch (op) {
+    case LOGOP_INSERT:
+        if (*offset_ptr > offset)
+            *offset_ptr += size;
+        /* special case for buffer's own point position and shell cursor:
+         * edge position is pushed right */
+        if (*offset_ptr == offset && edge)
+            *offset_ptr += size;
+        break;
+    case LOGOP_DELETE:
+        if (*offset_ptr > offset) {
+            *offset_ptr -= size;
+            if (*offset_ptr < offset)
+                *offset_ptr = offset;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/************************************************************/
+/* style map */
+
+/* The styles of a buffer are kept as runs of chars with the same
+ * style, in blocks of at most STYLE_BLOCK_RUNS runs.  A block left
+ * with less than STYLE_BLOCK_MIN runs by deletions is merged with a
+ * neighbour, so the number of blocks follows the number of runs.
+ * As in the page index, consecutive blocks are gathered in groups of
+ * about STYLE_GROUP_SIZE blocks and Fenwick trees of the group block
+ * counts and sizes locate the block holding a position in O(log n).
+ * Resizing, inserting or removing a block updates its group and the
+ * tree nodes above it, only splitting or merging groups rebuilds the
+ * nodes of the following groups.  Positions and lengths are buffer
+ * offsets >> char_shift.
+ */
+
+#define STYLE_BLOCK_RUNS  64
+#define STYLE_BLOCK_MIN   (STYLE_BLOCK_RUNS / 4)
+#define STYLE_GROUP_SIZE  64
+#define STYLE_GROUP_MAX   (2 * STYLE_GROUP_SIZE)
+#define STYLE_GROUP_MIN   (STYLE_GROUP_SIZE / 4)
+#define STYLE_RUN_MAX     (1 << 30)  /* chars inserted in one run */
+
+/* make room for n style groups, return false if out of memory */
+static int style_index_alloc(StyleMap *m, int n)
+{
+    PageIndex *pi;
+    int which, nb_alloc;
+
+    for (which = 0; which < SI_NB; which++) {
+        pi = &m->index[which];
+        if (n < pi->nb_alloc)
+            continue;
+        nb_alloc = max(n + 1, pi->nb_alloc + (pi->nb_alloc >> 1) + 16);
+        if (!qe_realloc(&pi->tree, nb_alloc * sizeof(*pi->tree)))
+            return 0;
+        if (which == SI_BLOCKS
+        &&  !qe_realloc(&m->groups, nb_alloc * sizeof(StyleGroup)))
+            return 0;
+        pi->nb_alloc = nb_alloc;
+    }
+    return 1;
+}
+
+/* recompute the tree nodes from group g */
+static void style_index_rebuild(StyleMap *m, int g)
+{
+    PageIndex *pi;
+    QEOffset sum;
+    int which, i, j;
+
+    for (which = 0; which < SI_NB; which++) {
+        pi = &m->index[which];
+        pi->nb_valid = m->nb_groups;
+        for (j = g + 1; j <= pi->nb_valid; j++) {
+            sum = m->groups[j - 1].metric[which];
+            for (i = 1; i < (j & -j); i <<= 1)
+                sum += pi->tree[j - i];
+            pi->tree[j] = sum;
+        }
+    }
+}
+
+/* return the group holding block k, store its first block in *start */
+static int style_group_find(StyleMap *m, int k, int *start)
+{
+    QEOffset rem;
+    int g;
+
+    g = page_index_find(&m->index[SI_BLOCKS], k, 0, &rem);
+    *start = k - (int)rem;
+    return g;
+}
+
+/* spread the blocks of group g starting at block 'start' over groups
+ * of about STYLE_GROUP_SIZE blocks.
+ */
+static void style_group_split(StyleMap *m, int g, int start)
+{
+    StyleGroup *sg;
+    int i, j, n, count, len;
+
+    n = (int)m->groups[g].metric[SI_BLOCKS];
+    count = (n + STYLE_GROUP_SIZE - 1) / STYLE_GROUP_SIZE;
+    if (!style_index_alloc(m, m->nb_groups + count - 1)) {
+        /* out of memory: keep a larger group */
+        return;
+    }
+    memmove(m->groups + g + count, m->groups + g + 1,
+            (m->nb_groups - g - 1) * sizeof(StyleGroup));
+    m->nb_groups += count - 1;
+    for (i = 0; i < count; i++) {
+        sg = &m->groups[g + i];
+        len = n / (count - i);
+        sg->metric[SI_BLOCKS] = len;
+        sg->metric[SI_SIZE] = 0;
+        for (j = start; j < start + len; j++)
+            sg->metric[SI_SIZE] += m->blocks[j].size;
+        start += len;
+        n -= len;
+    }
+    style_index_rebuild(m, g);
+}
+
+/* remove 'count' groups from group g, their blocks must have been
+ * removed or accounted for by other groups.
+ */
+static void style_groups_remove(StyleMap *m, int g, int count)
+{
+    memmove(m->groups + g, m->groups + g + count,
+            (m->nb_groups - g - count) * sizeof(StyleGroup));
+    m->nb_groups -= count;
+    style_index_rebuild(m, g);
+}
+
+/* merge group g with a neighbour if it became too small */
+static void style_group_balance(StyleMap *m, int g)
+{
+    StyleGroup *sg = m->groups;
+    int which;
+
+    if (g >= m->nb_groups || sg[g].metric[SI_BLOCKS] >= STYLE_GROUP_MIN)
+        return;
+    if (g + 1 < m->nb_groups
+    &&  sg[g].metric[SI_BLOCKS] + sg[g + 1].metric[SI_BLOCKS] <= STYLE_GROUP_MAX) {
+        /* merge group g + 1 into group g */
+    } else
+    if (g > 0
+    &&  sg[g - 1].metric[SI_BLOCKS] + sg[g].metric[SI_BLOCKS] <= STYLE_GROUP_MAX) {
+        g--;
+    } else {
+        return;
     }
+    for (which = 0; which < SI_NB; which++) {
+        sg[g].metric[which] += sg[g + 1].metric[which];
+        page_index_add(&m->index[which], g, sg[g + 1].metric[which]);
+    }
+    style_groups_remove(m, g + 1, 1);
 }
 
-/************************************************************/
-/* callbacks */
+/* return the block holding 'pos' < m->size, store the index of the
+ * run holding it in *run_ptr and its offset in the run in *rem_ptr.
+ */
+static int style_map_find(StyleMap *m, QEOffset pos, int *run_ptr,
+                          QEOffset *rem_ptr)
+{
+    StyleBlock *sb;
+    QEOffset rem;
+    int g, r;
+
+    g = page_index_find(&m->index[SI_SIZE], pos, 0, &rem);
+    sb = &m->blocks[page_index_sum(&m->index[SI_BLOCKS], g)];
+    while (rem >= sb->size)
+        rem -= sb++->size;
+    for (r = 0; rem >= sb->runs[r].len; r++)
+        rem -= sb->runs[r].len;
+    *run_ptr = r;
+    *rem_ptr = rem;
+    return sb - m->blocks;
+}
 
-int eb_add_callback(EditBuffer *b, EditBufferCallback cb,
-                    void *opaque, int arg)
+static void style_map_resize(StyleMap *m, int k, QEOffset delta)
 {
-    EditBufferCallbackList *l;
+    int g, start;
 
-    l = qe_mallocz(EditBufferCallbackList);
-    if (!l)
+    g = style_group_find(m, k, &start);
+    m->blocks[k].size += delta;
+    m->groups[g].metric[SI_SIZE] += delta;
+    page_index_add(&m->index[SI_SIZE], g, delta);
+    m->size += delta;
+}
+
+/* insert an empty block at index k, it joins the group of the
+ * previous block.
+ */
+static StyleBlock *style_map_new_block(StyleMap *m, int k)
+{
+    StyleBlock *sb;
+    StyleRun *runs;
+    int g, start;
+
+    if (m->nb_blocks == m->nb_alloc) {
+        int nb_alloc = m->nb_alloc + (m->nb_alloc >> 1) + 16;
+        if (!qe_realloc(&m->blocks, nb_alloc * sizeof(*m->blocks)))
+            return NULL;
+        m->nb_alloc = nb_alloc;
+    }
+    if (!m->nb_groups && !style_index_alloc(m, 1))
+        return NULL;
+    runs = qe_malloc_array(StyleRun, STYLE_BLOCK_RUNS);
+    if (!runs)
+        return NULL;
+    memmove(m->blocks + k + 1, m->blocks + k,
+            (m->nb_blocks - k) * sizeof(*m->blocks));
+    m->nb_blocks++;
+    sb = &m->blocks[k];
+    sb->runs = runs;
+    sb->nb_runs = 0;
+    sb->size = 0;
+
+    g = start = 0;
+    if (!m->nb_groups) {
+        memset(m->groups, 0, sizeof(*m->groups));
+        m->nb_groups = 1;
+        style_index_rebuild(m, 0);
+    } else
+    if (k > 0) {
+        g = style_group_find(m, k - 1, &start);
+    }
+    m->groups[g].metric[SI_BLOCKS]++;
+    page_index_add(&m->index[SI_BLOCKS], g, 1);
+    if (m->groups[g].metric[SI_BLOCKS] > STYLE_GROUP_MAX)
+        style_group_split(m, g, start);
+    return sb;
+}
+
+/* remove n blocks from index k along with their chars */
+static void style_map_remove_blocks(StyleMap *m, int k, int n)
+{
+    StyleGroup *sg;
+    QEOffset size;
+    int i, j, g, g1, start, take, first, last;
+
+    if (n <= 0)
+        return;
+
+    /* take the blocks from the groups holding them */
+    g = style_group_find(m, k, &start);
+    for (i = k, g1 = g; i < k + n; g1++) {
+        sg = &m->groups[g1];
+        take = min(k + n, start + (int)sg->metric[SI_BLOCKS]) - i;
+        for (size = 0, j = i; j < i + take; j++) {
+            size += m->blocks[j].size;
+            qe_free(&m->blocks[j].runs);
+        }
+        sg->metric[SI_BLOCKS] -= take;
+        sg->metric[SI_SIZE] -= size;
+        page_index_add(&m->index[SI_BLOCKS], g1, -take);
+        page_index_add(&m->index[SI_SIZE], g1, -size);
+        m->size -= size;
+        i += take;
+        start = i;
+    }
+    memmove(m->blocks + k, m->blocks + k + n,
+            (m->nb_blocks - k - n) * sizeof(*m->blocks));
+    m->nb_blocks -= n;
+
+    /* groups g + 1 to g1 - 2 are empty, g and g1 - 1 may be */
+    sg = m->groups;
+    first = (sg[g].metric[SI_BLOCKS] == 0) ? g : g + 1;
+    last = (sg[g1 - 1].metric[SI_BLOCKS] == 0) ? g1 : g1 - 1;
+    if (last > first)
+        style_groups_remove(m, first, last - first);
+    style_group_balance(m, g + 1);
+    style_group_balance(m, g);
+}
+
+/* move the second half of the runs of block k to a new block */
+static int style_map_split(StyleMap *m, int k)
+{
+    StyleBlock *sb, *sb1;
+    QEOffset size;
+    int i, n;
+
+    if (!style_map_new_block(m, k + 1))
         return -1;
-    l->callback = cb;
-    l->opaque = opaque;
-    l->arg = arg;
-    l->next = b->first_callback;
-    b->first_callback = l;
+    sb = &m->blocks[k];
+    sb1 = &m->blocks[k + 1];
+    n = sb->nb_runs / 2;
+    sb1->nb_runs = sb->nb_runs - n;
+    memcpy(sb1->runs, sb->runs + n, sb1->nb_runs * sizeof(StyleRun));
+    sb->nb_runs = n;
+    for (size = 0, i = 0; i < sb1->nb_runs; i++)
+        size += sb1->runs[i].len;
+    /* the blocks may be in different groups after a group split */
+    style_map_resize(m, k, -size);
+    style_map_resize(m, k + 1, size);
     return 0;
 }
 
-void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque)
+/* merge block k + 1 into block k */
+static void style_map_merge(StyleMap *m, int k)
 {
-    EditBufferCallbackList **pl, *l;
+    StyleBlock *sb = &m->blocks[k];
+    StyleBlock *sb1 = &m->blocks[k + 1];
+    StyleRun *run;
+    QEOffset size = sb1->size;
+    int r = 0;
+
+    /* coalesce the runs at the junction */
+    if (sb->nb_runs > 0 && sb1->nb_runs > 0) {
+        run = &sb->runs[sb->nb_runs - 1];
+        if (run->style == sb1->runs[0].style
+        &&  run->len <= INT_MAX - sb1->runs[0].len) {
+            run->len += sb1->runs[0].len;
+            r = 1;
+        }
+    }
+    memcpy(sb->runs + sb->nb_runs, sb1->runs + r,
+           (sb1->nb_runs - r) * sizeof(StyleRun));
+    sb->nb_runs += sb1->nb_runs - r;
+    style_map_resize(m, k + 1, -size);
+    style_map_resize(m, k, size);
+    style_map_remove_blocks(m, k + 1, 1);
+}
 
-    for (pl = &b->first_callback; (*pl) != NULL; pl = &(*pl)->next) {
-        l = *pl;
-        if (l->callback == cb && l->opaque == opaque) {
-            *pl = l->next;
-            qe_free(&l);
-            break;
-       }
+/* merge block k with a neighbour if it has too few runs */
+static void style_map_balance(StyleMap *m, int k)
+{
+    StyleBlock *sb = m->blocks;
+
+    if (k >= m->nb_blocks || sb[k].nb_runs >= STYLE_BLOCK_MIN)
+        return;
+    if (k + 1 < m->nb_blocks
+    &&  sb[k].nb_runs + sb[k + 1].nb_runs <= STYLE_BLOCK_RUNS) {
+        style_map_merge(m, k);
+    } else
+    if (k > 0 && sb[k - 1].nb_runs + sb[k].nb_runs <= STYLE_BLOCK_RUNS) {
+        style_map_merge(m, k - 1);
     }
 }
 
-/* standard callback to move offsets */
-void eb_offset_callback(__unused__ EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size)
+/* insert 'len' chars of style 'style' at 'pos' <= m->size */
+static int style_map_insert(StyleMap *m, QEOffset pos, int len, int style)
 {
-    int *offset_ptr = opaque;
+    StyleBlock *sb;
+    StyleRun *run;
+    QEOffset rem;
+    int k, r, n;
 
-    switch (op) {
-    case LOGOP_INSERT:
-        if (*offset_ptr > offset)
-            *offset_ptr += size;
-        /* special case for buffer's own point position and shell cursor:
-         * edge position is pushed right */
-        if (*offset_ptr == offset && edge)
-            *offset_ptr += size;
-        break;
-    case LOGOP_DELETE:
-        if (*offset_ptr > offset) {
-            *offset_ptr -= size;
-            if (*offset_ptr < offset)
-                *offset_ptr = offset;
+    for (;;) {
+        if (!m->nb_blocks && !style_map_new_block(m, 0))
+            return -1;
+        if (pos >= m->size) {
+            k = m->nb_blocks - 1;
+            sb = &m->blocks[k];
+            r = sb->nb_runs;
+            rem = 0;
+        } else {
+            k = style_map_find(m, pos, &r, &rem);
+            sb = &m->blocks[k];
         }
+        /* extend the run before or at the insertion point */
+        if (rem == 0 && r == 0 && k > 0) {
+            run = &m->blocks[k - 1].runs[m->blocks[k - 1].nb_runs - 1];
+            if (run->style == style && run->len <= INT_MAX - len) {
+                run->len += len;
+                k--;
+                break;
+            }
+        }
+        if (rem == 0 && r > 0) {
+            run = &sb->runs[r - 1];
+            if (run->style == style && run->len <= INT_MAX - len) {
+                run->len += len;
+                break;
+            }
+        }
+        if (r < sb->nb_runs) {
+            run = &sb->runs[r];
+            if (run->style == style && run->len <= INT_MAX - len) {
+                run->len += len;
+                break;
+            }
+        }
+        /* a run split at the insertion point takes 2 more runs */
+        n = rem ? 2 : 1;
+        if (sb->nb_runs + n > STYLE_BLOCK_RUNS) {
+            if (style_map_split(m, k))
+                return -1;
+            continue;
+        }
+        run = &sb->runs[r];
+        memmove(run + n, run, (sb->nb_runs - r) * sizeof(*run));
+        sb->nb_runs += n;
+        if (rem) {
+            run[0].len = (int)rem;
+            run[2].len -= (int)rem;
+            run++;
+        }
+        run->len = len;
+        run->style = style;
         break;
-    default:
-        break;
+    }
+    style_map_resize(m, k, len);
+    return 0;
+}
+
+static void style_map_delete(StyleMap *m, QEOffset pos, QEOffset len)
+{
+    StyleBlock *sb;
+    StyleRun *run;
+    QEOffset rem, size;
+    int k, r, n;
+
+    len = min_offset(len, m->size - pos);
+    while (len > 0) {
+        k = style_map_find(m, pos, &r, &rem);
+        sb = &m->blocks[k];
+        if (rem == 0 && r == 0 && sb->size <= len) {
+            /* remove whole blocks at once */
+            size = 0;
+            for (n = 0; k + n < m->nb_blocks
+                 && size + m->blocks[k + n].size <= len; n++) {
+                size += m->blocks[k + n].size;
+            }
+            len -= size;
+            style_map_remove_blocks(m, k, n);
+            continue;
+        }
+        run = &sb->runs[r];
+        n = (int)min_offset(len, run->len - rem);
+        run->len -= n;
+        style_map_resize(m, k, -n);
+        len -= n;
+        if (run->len == 0) {
+            memmove(run, run + 1, (sb->nb_runs - r - 1) * sizeof(*run));
+            sb->nb_runs--;
+            if (sb->nb_runs == 0) {
+                style_map_remove_blocks(m, k, 1);
+                continue;
+            }
+            /* coalesce the runs around the deleted one */
+            if (r > 0 && r < sb->nb_runs
+            &&  run[-1].style == run[0].style
+            &&  run[-1].len <= INT_MAX - run[0].len) {
+                run[-1].len += run[0].len;
+                memmove(run, run + 1, (sb->nb_runs - r - 1) * sizeof(*run));
+                sb->nb_runs--;
+            }
+            style_map_balance(m, k);
+        }
+    }
+}
+
+void style_map_free(StyleMap **mp)
+{
+    StyleMap *m = *mp;
+    int i;
+
+    if (m) {
+        for (i = 0; i < m->nb_blocks; i++)
+            qe_free(&m->blocks[i].runs);
+        qe_free(&m->blocks);
+        qe_free(&m->groups);
+        for (i = 0; i < SI_NB; i++)
+            qe_free(&m->index[i].tree);
+        qe_free(mp);
     }
 }
 
@@ -773,7 +2410,7 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
     if (b->b_styles) {
         return 0;
     } else {
-        b->b_styles = eb_new("*", BF_SYSTEM | BF_RAW);
+        b->b_styles = qe_mallocz(StyleMap);
         b->flags |= flags & BF_STYLES;
         b->style_shift = ((flags & BF_STYLES) / BF_STYLE1) - 1;
         b->style_bytes = 1 << b->style_shift;
@@ -785,59 +2422,89 @@ int eb_create_style_buffer(EditBuffer *b, int flags)
 
 void eb_free_style_buffer(EditBuffer *b)
 {
-    eb_free(&b->b_styles);
+    style_map_free(&b->b_styles);
     b->style_shift = b->style_bytes = 0;
     eb_free_callback(b, eb_style_callback, NULL);
 }
 
-/* XXX: should compress styles buffer with run length encoding */
 void eb_set_style(EditBuffer *b, int style, enum LogOperation op,
-                  int offset, int size)
+                  QEOffset offset, QEOffset size)
 {
-    unsigned char buf[256];
-    int i, len;
+    StyleMap *m = b->b_styles;
+    int len;
 
-    if (!b->b_styles || !size)
+    if (!m || !size)
         return;
 
-    offset = (offset >> b->char_shift) << b->style_shift;
-    size = (size >> b->char_shift) << b->style_shift;
+    offset >>= b->char_shift;
+    size >>= b->char_shift;
+    /* styles are stored on style_bytes bytes */
+    if (b->style_shift == 1)
+        style &= 0xffff;
+    else
+    if (b->style_shift == 0)
+        style &= 0xff;
 
     switch (op) {
     case LOGOP_WRITE:
+        style_map_delete(m, offset, size);
+        /* fall thru */
     case LOGOP_INSERT:
+        offset = min_offset(offset, m->size);
         while (size > 0) {
-            len = min(size, ssizeof(buf));
-            if (b->style_shift == 2) {
-                for (i = 0; i < len; i += 4) {
-                    *(uint32_t*)(buf + i) = style;
-                }
-            } else
-            if (b->style_shift == 1) {
-                for (i = 0; i < len; i += 2) {
-                    *(uint16_t*)(buf + i) = style;
-                }
-            } else {
-                memset(buf, style, len);
-            }
-            if (op == LOGOP_WRITE)
-                eb_write(b->b_styles, offset, buf, len);
-            else
-                eb_insert(b->b_styles, offset, buf, len);
+            len = (int)min_offset(size, STYLE_RUN_MAX);
+            /* XXX: should report the loss of styles */
+            if (style_map_insert(m, offset, len, style))
+                break;
             size -= len;
             offset += len;
         }
         break;
     case LOGOP_DELETE:
-        eb_delete(b->b_styles, offset, size);
+        if (offset < m->size)
+            style_map_delete(m, offset, size);
         break;
     default:
         break;
     }
 }
 
+/* return the style at 'offset', store the bounds of the run of chars
+ * with the same style in *start_ptr and *end_ptr.
+ */
+int eb_get_style(EditBuffer *b, QEOffset offset,
+                 QEOffset *start_ptr, QEOffset *end_ptr)
+{
+    StyleMap *m = b->b_styles;
+    StyleRun *run;
+    QEOffset pos, rem, start, end;
+    int k, r, style;
+
+    pos = offset >> b->char_shift;
+    if (!m || pos < 0 || pos >= m->size) {
+        style = 0;
+        start = offset;
+        end = offset + 1;
+        if (m && pos >= m->size) {
+            start = m->size << b->char_shift;
+            end = MAX_OFFSET;
+        }
+    } else {
+        k = style_map_find(m, pos, &r, &rem);
+        run = &m->blocks[k].runs[r];
+        style = run->style;
+        start = (pos - rem) << b->char_shift;
+        end = (pos - rem + run->len) << b->char_shift;
+    }
+    if (start_ptr)
+        *start_ptr = start;
+    if (end_ptr)
+        *end_ptr = end;
+    return style;
+}
+
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size)
+                       enum LogOperation op, QEOffset offset, QEOffset size)
 {
     eb_set_style(b, b->cur_style, op, offset, size);
 }
@@ -846,20 +2513,165 @@ void eb_style_callback(EditBuffer *b, void *opaque, int arg,
 /************************************************************/
 /* undo buffer */
 
+/* Each modification of a buffer with save_log set is described by an
+ * UndoRecord.  Records are kept in a ring buffer so the oldest ones are
+ * evicted in constant time when the memory used by the undo information
+ * exceeds undo-limit.  The bytes deleted or overwritten are kept in the
+ * log buffer, where they share the pages of the buffer when possible.
+ * The records of a command form an undo unit undone as a whole.
+ *
+ * Reverting a record restores the buffer contents it describes and
+ * turns it into the record of the inverse operation, so redoing is
+ * reverting again.  With undo-tree set, undoing appends the inverse
+ * records instead of replacing the undone ones, as in Emacs: no buffer
+ * state is ever lost, undoing after a new modification goes back
+ * through the previous undos.  Otherwise undone records are discarded
+ * upon the next modification.
+ */
+
+#define UNDO_COMPACT_MIN  (1024*1024)  /* dead log bytes before compaction */
+
+static inline UndoRecord *undo_record(EditBuffer *b, int n)
+{
+    return &b->undo_records[(b->undo_first + n) & (b->undo_size - 1)];
+}
+
+static inline QEOffset undo_data_size(const UndoRecord *r)
+{
+    return r->op == LOGOP_INSERT ? 0 : r->size;
+}
+
+/* save 'size' bytes of 'b' at 'offset', return their log buffer offset */
+static QEOffset undo_save_data(EditBuffer *b, QEOffset offset, QEOffset size)
+{
+    QEOffset pos = b->log_buffer->total_size;
+
+    eb_insert_buffer(b->log_buffer, pos, b, offset, size);
+    return pos;
+}
+
+/* append a record, return NULL if out of memory */
+static UndoRecord *undo_append(EditBuffer *b)
+{
+    UndoRecord *records;
+    int i, size;
+
+    if (b->undo_count == b->undo_size) {
+        size = b->undo_size ? b->undo_size * 2 : 256;
+        records = qe_malloc_array(UndoRecord, size);
+        if (!records)
+            return NULL;
+        for (i = 0; i < b->undo_count; i++)
+            records[i] = *undo_record(b, i);
+        qe_free(&b->undo_records);
+        b->undo_records = records;
+        b->undo_size = size;
+        b->undo_first = 0;
+    }
+    return undo_record(b, b->undo_count++);
+}
+
+/* a record modified in place must be journaled again */
+static inline void undo_unsync(EditBuffer *b, int n)
+{
+    b->undo_synced = min_offset(b->undo_synced, b->undo_base + n);
+}
+
+/* drop the last record */
+static void undo_pop(EditBuffer *b)
+{
+    b->undo_dead += undo_data_size(undo_record(b, --b->undo_count));
+    undo_unsync(b, b->undo_count);
+}
+
+/* copy the live data to a new log buffer when most of it is dead */
+static void undo_compact(EditBuffer *b)
+{
+    EditBuffer *log = b->log_buffer, *log1;
+    UndoRecord *r;
+    char name[MAX_BUFFERNAME_SIZE];
+    int i;
+
+    if (b->undo_dead < UNDO_COMPACT_MIN
+    ||  b->undo_dead * 2 < log->total_size)
+        return;
+
+    pstrcpy(name, sizeof(name), log->name);
+    log1 = eb_new(name, BF_SYSTEM | BF_RAW);
+    if (!log1)
+        return;
+    for (i = 0; i < b->undo_count; i++) {
+        r = undo_record(b, i);
+        if (undo_data_size(r)) {
+            QEOffset pos = log1->total_size;
+            eb_insert_buffer(log1, pos, log, r->data, r->size);
+            r->data = pos;
+        }
+    }
+    eb_free(&b->log_buffer);
+    eb_set_buffer_name(log1, name);
+    b->log_buffer = log1;
+    b->undo_dead = 0;
+}
+
+/* evict the oldest units while over budget, keep the last one */
+static void undo_trim(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    UndoRecord *r;
+    int unit, last_unit;
+
+    last_unit = undo_record(b, b->undo_count - 1)->unit;
+    while (b->undo_current > 0
+    &&     b->undo_count * ssizeof(UndoRecord)
+           + b->log_buffer->total_size - b->undo_dead > qs->undo_limit) {
+        unit = undo_record(b, 0)->unit;
+        if (unit == last_unit)
+            break;
+        /* units are evicted as a whole */
+        while (b->undo_current > 0
+        &&     (r = undo_record(b, 0))->unit == unit) {
+            b->undo_dead += undo_data_size(r);
+            b->undo_first = (b->undo_first + 1) & (b->undo_size - 1);
+            b->undo_base++;
+            b->undo_count--;
+            b->undo_current--;
+        }
+    }
+    undo_compact(b);
+}
+
 static void eb_addlog(EditBuffer *b, enum LogOperation op,
-                      int offset, int size)
+                      QEOffset offset, QEOffset size)
+{
+    eb_addlog2(b, op, offset, size, 0);
+}
+
+/* For LOGOP_REPLACE, 'size' bytes at 'offset' are replaced with 'size1'
+ * bytes.  The record saves the old bytes.
+ */
+static void eb_addlog2(EditBuffer *b, enum LogOperation op,
+                       QEOffset offset, QEOffset size, QEOffset size1)
 {
-    int was_modified, len, size_trailer;
-    LogBuffer lb;
+    QEmacsState *qs = &qe_state;
+    int was_modified;
+    UndoRecord *r;
     EditBufferCallbackList *l;
 
+    b->version = ++eb_last_version;
+
     /* callbacks and logging disabled for composite undo phase */
     if (b->save_log & 2)
         return;
 
     /* call each callback */
     for (l = b->first_callback; l != NULL; l = l->next) {
-        l->callback(b, l->opaque, l->arg, op, offset, size);
+        if (op == LOGOP_REPLACE) {
+            l->callback(b, l->opaque, l->arg, LOGOP_DELETE, offset, size);
+            l->callback(b, l->opaque, l->arg, LOGOP_INSERT, offset, size1);
+        } else {
+            l->callback(b, l->opaque, l->arg, op, offset, size);
+        }
     }
 
     was_modified = b->modified;
@@ -869,7 +2681,7 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         return;
 
     if (!b->log_buffer) {
-        char buf[MAX_BUFFERNAME_SIZE];
+        char buf[MAX_BUFFERNAME_SIZE + 8];
         /* Name should be unique because b->name is, but b->name may
          * later change if buffer is written to a different file.  This
          * should not be a problem since this log buffer is never
@@ -880,77 +2692,106 @@ static void eb_addlog(EditBuffer *b, enum LogOperation op,
         if (!b->log_buffer)
             return;
     }
-    /* XXX: better test to limit size */
-    if (b->nb_logs >= (NB_LOGS_MAX-1)) {
-        /* no free space, delete least recent entry */
-        /* XXX: should check undo record integrity */
-        eb_read(b->log_buffer, 0, &lb, sizeof(lb));
-        len = lb.size;
-        if (lb.op == LOGOP_INSERT)
-            len = 0;
-        len += sizeof(LogBuffer) + sizeof(int);
-        eb_delete(b->log_buffer, 0, len);
-        b->log_new_index -= len;
-        if (b->log_current > 1)
-            b->log_current -= len;
-        b->nb_logs--;
+
+    /* forget the undone records */
+    if (!qs->undo_tree) {
+        while (b->undo_count > b->undo_current)
+            undo_pop(b);
     }
+    b->undo_current = b->undo_count;
 
     /* If inserting, try and coalesce log record with previous */
     if (op == LOGOP_INSERT && b->last_log == LOGOP_INSERT
-    &&  b->log_new_index >= sizeof(lb) + sizeof(int)
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(int), &size_trailer,
-                sizeof(int)) == sizeof(int)
-    &&  size_trailer == 0
-    &&  eb_read(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb,
-                sizeof(lb)) == sizeof(lb)
-    &&  lb.op == LOGOP_INSERT
-    &&  lb.offset + lb.size == offset) {
-        lb.size += size;
-        eb_write(b->log_buffer, b->log_new_index - sizeof(lb) - sizeof(int), &lb, sizeof(lb));
-        return;
+    &&  b->undo_count > 0) {
+        r = undo_record(b, b->undo_count - 1);
+        if (r->op == LOGOP_INSERT && r->offset + r->size == offset) {
+            r->size += size;
+            undo_unsync(b, b->undo_count - 1);
+            return;
+        }
     }
 
     b->last_log = op;
 
-    /* XXX: should check undo record integrity */
+    r = undo_append(b);
+    /* XXX: should report the loss of undo information */
+    if (!r)
+        return;
+    r->op = op;
+    r->was_modified = was_modified;
+    r->unit = qs->undo_unit;
+    r->offset = offset;
+    r->size = size;
+    r->size1 = size1;
+    r->data = 0;
+    if (op != LOGOP_INSERT)
+        r->data = undo_save_data(b, offset, size);
+    b->undo_current = b->undo_count;
+
+    undo_trim(b);
+}
 
-    /* header */
-    lb.pad1 = '\n';   /* make log buffer display readable */
-    lb.pad2 = ':';
-    lb.op = op;
-    lb.offset = offset;
-    lb.size = size;
-    lb.was_modified = was_modified;
-    eb_write(b->log_buffer, b->log_new_index, &lb, sizeof(lb));
-    b->log_new_index += sizeof(lb);
+/* Revert the modification described by 'r' and turn 'r' into the
+ * record of the reverting modification.  If 'keep', the data of 'r'
+ * stays referenced by another record.  Return the offset after the
+ * restored contents.
+ */
+static QEOffset eb_undo_revert(EditBuffer *b, UndoRecord *r, int keep)
+{
+    int saved_log, modified;
+    QEOffset data, size;
 
-    /* data */
-    switch (op) {
+    saved_log = b->save_log;
+    modified = b->modified;
+    /* callbacks are called, but the modifications are not logged */
+    b->save_log = 0;
+    switch (r->op) {
+    case LOGOP_INSERT:
+        r->data = undo_save_data(b, r->offset, r->size);
+        eb_delete(b, r->offset, r->size);
+        r->op = LOGOP_DELETE;
+        size = 0;
+        break;
     case LOGOP_DELETE:
+        eb_insert_buffer(b, r->offset, b->log_buffer, r->data, r->size);
+        if (!keep)
+            b->undo_dead += r->size;
+        r->op = LOGOP_INSERT;
+        size = r->size;
+        break;
     case LOGOP_WRITE:
-        eb_insert_buffer(b->log_buffer, b->log_new_index, b, offset, size);
-        b->log_new_index += size;
-        size_trailer = size;
+    case LOGOP_REPLACE:
+        /* the replacement is notified as a single modification */
+        size = r->op == LOGOP_WRITE ? r->size : r->size1;
+        data = undo_save_data(b, r->offset, size);
+        eb_addlog2(b, r->op, r->offset, size, r->size);
+        b->save_log = 2;
+        eb_delete(b, r->offset, size);
+        eb_insert_buffer(b, r->offset, b->log_buffer, r->data, r->size);
+        if (!keep)
+            b->undo_dead += r->size;
+        r->data = data;
+        r->size1 = r->size;
+        r->size = size;
+        size = r->size1;
         break;
     default:
-        size_trailer = 0;
-        break;
+        abort();
     }
-    /* trailer */
-    eb_write(b->log_buffer, b->log_new_index, &size_trailer, sizeof(int));
-    b->log_new_index += sizeof(int);
-
-    b->nb_logs++;
+    b->save_log = saved_log;
+    b->modified = r->was_modified;
+    r->was_modified = modified;
+    return r->offset + size;
 }
 
 void do_undo(EditState *s)
 {
+    QEmacsState *qs = s->qe_state;
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
-    LogBuffer lb;
+    UndoRecord rec;
+    int unit;
 
-    if (!b->log_buffer) {
+    if (!b->undo_count) {
         put_status(s, "No undo information");
         return;
     }
@@ -958,76 +2799,51 @@ void do_undo(EditState *s)
     /* deactivate region hilite */
     s->region_style = 0;
 
-    /* Should actually keep undo state current until new logs are added */
-    if (s->qe_state->last_cmd_func != (CmdFunc)do_undo
-    &&  s->qe_state->last_cmd_func != (CmdFunc)do_redo) {
-        b->log_current = 0;
+    /* undoing after other commands goes back through the last undos */
+    if (qs->undo_tree
+    &&  qs->last_cmd_func != (CmdFunc)do_undo
+    &&  qs->last_cmd_func != (CmdFunc)do_redo) {
+        b->undo_current = b->undo_count;
     }
 
-    if (b->log_current == 0) {
-        log_index = b->log_new_index;
-    } else {
-        log_index = b->log_current - 1;
-    }
-    if (log_index == 0) {
+    if (b->undo_current == 0) {
         put_status(s, "No further undo information");
         return;
     } else {
         put_status(s, "Undo!");
     }
-    /* go backward */
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
-
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
 
     b->last_log = 0;  /* prevent log compression */
 
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~2;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        eb_delete(b, lb.offset, lb.size);
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
-    }
+    /* undo the records of the unit before the undo position */
+    unit = undo_record(b, b->undo_current - 1)->unit;
+    do {
+        b->undo_current--;
+        if (qs->undo_tree) {
+            /* log the undo as a new unit */
+            rec = *undo_record(b, b->undo_current);
+            s->offset = eb_undo_revert(b, &rec, 1);
+            rec.unit = qs->undo_unit;
+            if (undo_append(b))
+                *undo_record(b, b->undo_count - 1) = rec;
+        } else {
+            s->offset = eb_undo_revert(b, undo_record(b, b->undo_current), 0);
+            undo_unsync(b, b->undo_current);
+        }
+    } while (b->undo_current > 0
+         &&  undo_record(b, b->undo_current - 1)->unit == unit);
 
-    b->modified = lb.was_modified;
+    if (qs->undo_tree)
+        undo_trim(b);
 }
 
 void do_redo(EditState *s)
 {
+    QEmacsState *qs = s->qe_state;
     EditBuffer *b = s->b;
-    int log_index, size_trailer;
-    LogBuffer lb;
+    int unit, n;
 
-    if (!b->log_buffer) {
+    if (!b->undo_count) {
         put_status(s, "No undo information");
         return;
     }
@@ -1035,80 +2851,42 @@ void do_redo(EditState *s)
     /* deactivate region hilite */
     s->region_style = 0;
 
-    /* Should actually keep undo state current until new logs are added */
-    if (s->qe_state->last_cmd_func != (CmdFunc)do_undo
-    &&  s->qe_state->last_cmd_func != (CmdFunc)do_redo) {
-        b->log_current = 0;
+    /* redoing is only possible right after undoing */
+    if (qs->undo_tree
+    &&  qs->last_cmd_func != (CmdFunc)do_undo
+    &&  qs->last_cmd_func != (CmdFunc)do_redo) {
+        b->undo_current = b->undo_count;
     }
 
-    if (!b->log_current || !b->log_new_index) {
+    if (b->undo_current == b->undo_count) {
         put_status(s, "Nothing to redo");
         return;
     }
     put_status(s, "Redo!");
 
-    /* go forward in undo stack */
-    log_index = b->log_current - 1;
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-    if (lb.op != LOGOP_INSERT)
-        log_index += lb.size;
-    log_index += sizeof(int);
-    /* log_current is 1 + index to have zero as default value */
-    b->log_current = log_index + 1;
-
-    /* go backward from the end and remove undo record */
-    log_index = b->log_new_index;
-    log_index -= sizeof(int);
-    eb_read(b->log_buffer, log_index, &size_trailer, sizeof(int));
-    log_index -= size_trailer + sizeof(LogBuffer);
-
-    /* play the log entry */
-    eb_read(b->log_buffer, log_index, &lb, sizeof(LogBuffer));
-    log_index += sizeof(LogBuffer);
-
-    switch (lb.op) {
-    case LOGOP_WRITE:
-        /* we must disable the log because we want to record a single
-           write (we should have the single operation: eb_write_buffer) */
-        b->save_log |= 2;
-        eb_delete(b, lb.offset, lb.size);
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_WRITE, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_DELETE:
-        /* we must also disable the log there because the log buffer
-           would be modified BEFORE we insert it by the implicit
-           eb_addlog */
-        b->save_log |= 2;
-        eb_insert_buffer(b, lb.offset, b->log_buffer, log_index, lb.size);
-        b->save_log &= ~3;
-        eb_addlog(b, LOGOP_INSERT, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset + lb.size;
-        break;
-    case LOGOP_INSERT:
-        b->save_log &= ~1;
-        eb_delete(b, lb.offset, lb.size);
-        b->save_log |= 1;
-        s->offset = lb.offset;
-        break;
-    default:
-        abort();
-    }
-
-    b->modified = lb.was_modified;
-
-    log_index -= sizeof(LogBuffer);
-    eb_delete(b->log_buffer, log_index, b->log_new_index - log_index);
-    b->log_new_index = log_index;
+    b->last_log = 0;
 
-    if (b->log_current >= log_index + 1) {
-        /* redone everything */
-        b->log_current = 0;
+    if (qs->undo_tree) {
+        /* revert and remove the last undo */
+        unit = undo_record(b, b->undo_count - 1)->unit;
+        n = 0;
+        while (b->undo_count > b->undo_current
+        &&     undo_record(b, b->undo_count - 1)->unit == unit) {
+            s->offset = eb_undo_revert(b, undo_record(b, b->undo_count - 1),
+                                       0);
+            undo_pop(b);
+            n++;
+        }
+        b->undo_current = min(b->undo_current + n, b->undo_count);
+    } else {
+        /* revert the records of the unit after the undo position */
+        unit = undo_record(b, b->undo_current)->unit;
+        undo_unsync(b, b->undo_current);
+        do {
+            s->offset = eb_undo_revert(b, undo_record(b, b->undo_current), 0);
+            b->undo_current++;
+        } while (b->undo_current < b->undo_count
+             &&  undo_record(b, b->undo_current)->unit == unit);
     }
 }
 
@@ -1141,47 +2919,43 @@ void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type)
             b->char_shift = charset->char_size - 1;
     }
 
-    /* Reset page cache flags */
+    /* Reset page cache flags and charset dependent indexes */
     for (n = 0; n < b->nb_pages; n++) {
         Page *p = &b->page_table[n];
         p->flags &= ~(PG_VALID_POS | PG_VALID_CHAR | PG_VALID_COLORS);
     }
+    for (n = PI_LINES; n < PI_NB; n++)
+        b->page_index[n].nb_valid = 0;
+    b->version = ++eb_last_version;
 }
 
 /* XXX: change API to go faster */
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr)
 {
     u8 buf[MAX_CHAR_BYTES];
-    int ch;
+    int ch, len;
 
-    if (b->b_styles) {
-        if (b->style_shift == 2) {
-            uint32_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 2, &style, 4);
-            b->cur_style = style;
-        } else
-        if (b->style_shift == 1) {
-            uint16_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift) << 1, &style, 2);
-            b->cur_style = style;
-        } else {
-            uint8_t style = 0;
-            eb_read(b->b_styles, (offset >> b->char_shift), &style, 1);
-            b->cur_style = style;
-        }
-    }
+    if (b->b_styles)
+        b->cur_style = eb_get_style(b, offset, NULL, NULL);
     if (eb_read(b, offset, buf, 1) <= 0) {
         ch = '\n';
-        if (offset < 0)
+        if (offset < 0) {
             offset = 0;
-        if (offset >= b->total_size)
+        } else
+        if (offset >= b->total_size) {
             offset = b->total_size;
+        } else {
+            /* read error: skip the byte as a newline */
+            offset++;
+        }
     } else {
         /* we use the charset conversion table directly to go faster */
         ch = b->charset_state.table[buf[0]];
         offset++;
         if (ch == ESCAPE_CHAR || ch == '\r') {
-            eb_read(b, offset, buf + 1, MAX_CHAR_BYTES - 1);
+            /* pad a truncated char at the end of the buffer */
+            len = eb_read(b, offset, buf + 1, MAX_CHAR_BYTES - 1);
+            memset(buf + 1 + len, 0, MAX_CHAR_BYTES - 1 - len);
             b->charset_state.p = buf;
             ch = b->charset_state.decode_func(&b->charset_state);
             offset += (b->charset_state.p - buf) - 1;
@@ -1204,7 +2978,7 @@ int eb_nextc(EditBuffer *b, int offset, int *next_ptr)
 /* compute offset after moving 'n' chars from 'offset'.
  * 'n' can be negative
  */ 
-int eb_skip_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, int n)
 {
     while (n < 0) {
         eb_prevc(b, offset, &offset);
@@ -1218,13 +2992,13 @@ int eb_skip_chars(EditBuffer *b, int offset, int n)
 }
 
 /* delete one character at offset 'offset', return number of bytes removed */
-int eb_delete_uchar(EditBuffer *b, int offset)
+int eb_delete_uchar(EditBuffer *b, QEOffset offset)
 {
-    int offset1;
+    QEOffset offset1;
     
     eb_nextc(b, offset, &offset1);
     if (offset < offset1) {
-        return eb_delete(b, offset, offset1 - offset);
+        return (int)eb_delete(b, offset, offset1 - offset);
     } else {
         return 0;
     }
@@ -1233,10 +3007,10 @@ int eb_delete_uchar(EditBuffer *b, int offset)
 /* return number of bytes deleted. n can be negative to delete
  * characters before offset
  */
-int eb_delete_chars(EditBuffer *b, int offset, int n)
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, int n)
 {
-    int offset1 = eb_skip_chars(b, offset, n);
-    int size = offset1 - offset;
+    QEOffset offset1 = eb_skip_chars(b, offset, n);
+    QEOffset size = offset1 - offset;
 
     if (size < 0) {
         offset += size;
@@ -1249,7 +3023,7 @@ int eb_delete_chars(EditBuffer *b, int offset, int n)
 
 /* XXX: only stateless charsets are supported */
 /* XXX: suppress that */
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr)
 {
     int ch, char_size;
     u8 buf[MAX_CHAR_BYTES], *q;
@@ -1263,7 +3037,11 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
         char_size = b->charset_state.char_size;
         offset -= char_size;
         q = buf + sizeof(buf) - char_size;
-        eb_read(b, offset, q, char_size);
+        if (eb_read(b, offset, q, char_size) < char_size) {
+            /* read error: see eb_nextc() */
+            ch = '\n';
+            goto the_end;
+        }
         if (b->charset == &charset_utf8) {
             while (*q >= 0x80 && *q < 0xc0) {
                 if (offset == 0 || q == buf) {
@@ -1294,33 +3072,37 @@ int eb_prevc(EditBuffer *b, int offset, int *prev_ptr)
     return ch;
 }
 
-int eb_goto_pos(EditBuffer *b, int line1, int col1)
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1)
 {
+    const u8 *data;
     Page *p, *p_end;
-    int line2, col2, line, col, offset, offset1;
+    QEOffset line, line2, col, col2, offset, offset1;
+    int n;
 
-    line = 0;
+    /* find the page holding the EOL that starts line1 */
+    page_index_flush(b);
+    page_index_reach(b, PI_LINES, line1, 1);
+    n = page_index_lookup(b, PI_LINES, line1, 1, &line);
+    line = line1 - line;
     col = 0;
-    offset = 0;
+    offset = page_index_prefix(b, PI_SIZE, n);
 
-    p = b->page_table;
+    p = b->page_table + n;
     p_end = b->page_table + b->nb_pages;
     while (p < p_end) {
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
-        }
-        line2 = line + p->nb_lines;
-        if (p->nb_lines)
-            col2 = 0;
-        col2 = col + p->col;
+        line2 = line + page_metric(b, p, PI_LINES);
+        col2 = (p->nb_lines ? 0 : col) + p->col;
         if (line2 > line1 || (line2 == line1 && col2 >= col1)) {
             /* compute offset */
             if (line < line1) {
                 /* seek to the correct line */
-                offset += b->charset->goto_line_func(&b->charset_state,
-                    p->data, p->size, line1 - line);
+                data = page_data(b, p);
+                if (data) {
+                    offset += b->charset->goto_line_func(&b->charset_state,
+                        data, p->size, (int)(line1 - line));
+                } else {
+                    offset += line1 - line;
+                }
                 line = line1;
                 col = 0;
             }
@@ -1338,74 +3120,78 @@ int eb_goto_pos(EditBuffer *b, int line1, int col1)
     return b->total_size;
 }
 
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset)
+/* line and column numbers are clipped to INT_MAX */
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset)
 {
-    Page *p, *p_end;
-    int line, col, line1, col1;
+    const u8 *data;
+    Page *p;
+    QEOffset line, col, rem;
+    int n, k, line1, col1;
 
     QASSERT(offset >= 0);
 
-    line = 0;
-    col = 0;
-    p = b->page_table;
-    p_end = p + b->nb_pages;
-    for (;;) {
-        if (p >= p_end)
-            goto the_end;
-        if (offset < p->size)
-            break;
-        if (!(p->flags & PG_VALID_POS)) {
-            p->flags |= PG_VALID_POS;
-            b->charset_state.get_pos_func(&b->charset_state, p->data, p->size,
-                                          &p->nb_lines, &p->col);
+    p = NULL;
+    n = b->nb_pages;
+    if (offset < b->total_size) {
+        p = find_page(b, &offset);
+        n = p - b->page_table;
+    }
+
+    page_index_flush(b);
+    line = page_index_prefix(b, PI_LINES, n);
+    col = page_index_prefix(b, PI_COL, n);
+    if (line > 0) {
+        /* column restarts after the last EOL before page n */
+        k = page_index_lookup(b, PI_LINES, line, 1, &rem);
+        col += b->page_table[k].col - page_index_prefix(b, PI_COL, k + 1);
+    }
+    if (p) {
+        data = page_data(b, p);
+        if (data) {
+            b->charset_state.get_pos_func(&b->charset_state, data,
+                                          (int)offset, &line1, &col1);
+        } else {
+            line1 = (int)offset;
+            col1 = 0;
         }
-        line += p->nb_lines;
-        if (p->nb_lines)
+        line += line1;
+        if (line1)
             col = 0;
-        col += p->col;
-        offset -= p->size;
-        p++;
+        col += col1;
     }
-    b->charset_state.get_pos_func(&b->charset_state, p->data, offset,
-                                  &line1, &col1);
-    line += line1;
-    if (line1)
-        col = 0;
-    col += col1;
 
- the_end:
-    *line_ptr = line;
-    *col_ptr = col;
-    return line;
+    *line_ptr = (int)min_offset(line, INT_MAX);
+    *col_ptr = (int)min_offset(col, INT_MAX);
+    return *line_ptr;
 }
 
 /************************************************************/
 /* char offset computation */
 
 /* convert a char number into a byte offset according to buffer charset */
-int eb_goto_char(EditBuffer *b, int pos)
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos)
 {
-    int offset;
-    Page *p, *p_end;
+    const u8 *data;
+    QEOffset offset;
+    int n;
+    Page *p;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
-        offset = min(pos * b->charset->char_size, b->total_size);
+        offset = min_offset(pos * b->charset->char_size, b->total_size);
     } else {
-        offset = 0;
-        p = b->page_table;
-        p_end = b->page_table + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (pos < p->nb_chars) {
-                offset += b->charset->goto_char_func(&b->charset_state, p->data, p->size, pos);
-                break;
+        page_index_flush(b);
+        page_index_reach(b, PI_CHARS, pos, 0);
+        n = page_index_lookup(b, PI_CHARS, pos, 0, &pos);
+        offset = page_index_prefix(b, PI_SIZE, n);
+        if (n < b->nb_pages) {
+            p = b->page_table + n;
+            data = page_data(b, p);
+            if (data) {
+                offset += b->charset->goto_char_func(&b->charset_state,
+                                                     data, p->size,
+                                                     (int)pos);
             } else {
-                pos -= p->nb_chars;
-                offset += p->size;
-                p++;
+                offset += pos;
             }
         }
     }
@@ -1413,17 +3199,19 @@ int eb_goto_char(EditBuffer *b, int pos)
 }
 
 /* convert a byte offset into a char number according to buffer charset */
-int eb_get_char_offset(EditBuffer *b, int offset)
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset)
 {
-    int pos;
-    Page *p, *p_end;
+    const u8 *data;
+    QEOffset pos;
+    int n;
+    Page *p;
 
     if (offset < 0)
         offset = 0;
 
     if (!b->charset->variable_size && b->eol_type != EOL_DOS) {
         /* offset is round down to character boundary */
-        pos = min(offset, b->total_size) / b->charset->char_size;
+        pos = min_offset(offset, b->total_size) / b->charset->char_size;
     } else {
         /* XXX: should handle rounding if EOL_DOS */
         /* XXX: should fix buffer offset via charset specific method */
@@ -1438,21 +3226,21 @@ int eb_get_char_offset(EditBuffer *b, int offset)
         } else {
             /* CG: XXX: offset rounding to character boundary is undefined */
         }
-        pos = 0;
-        p = b->page_table;
-        p_end = p + b->nb_pages;
-        while (p < p_end) {
-            if (!(p->flags & PG_VALID_CHAR)) {
-                p->flags |= PG_VALID_CHAR;
-                p->nb_chars = b->charset->get_chars_func(&b->charset_state, p->data, p->size);
-            }
-            if (offset < p->size) {
-                pos += b->charset->get_chars_func(&b->charset_state, p->data, offset);
-                break;
+        p = NULL;
+        n = b->nb_pages;
+        if (offset < b->total_size) {
+            p = find_page(b, &offset);
+            n = p - b->page_table;
+        }
+        page_index_flush(b);
+        pos = page_index_prefix(b, PI_CHARS, n);
+        if (p) {
+            data = page_data(b, p);
+            if (data) {
+                pos += b->charset->get_chars_func(&b->charset_state,
+                                                  data, (int)offset);
             } else {
-                pos += p->nb_chars;
-                offset -= p->size;
-                p++;
+                pos += offset;
             }
         }
     }
@@ -1462,10 +3250,10 @@ int eb_get_char_offset(EditBuffer *b, int offset)
 /* delete a range of bytes from the buffer, bounds in any order, return
  * number of bytes removed.
  */
-int eb_delete_range(EditBuffer *b, int p1, int p2)
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     if (p1 > p2) {
-        int tmp = p1;
+        QEOffset tmp = p1;
         p1 = p2;
         p2 = tmp;
     }
@@ -1473,7 +3261,7 @@ int eb_delete_range(EditBuffer *b, int p1, int p2)
 }
 
 /* replace 'size' bytes at offset 'offset' with 'size1' bytes from 'buf' */
-void eb_replace(EditBuffer *b, int offset, int size,
+void eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
                 const void *buf, int size1)
 {
     /* CG: behaviour is not exactly identical: mark, point and other
@@ -1488,261 +3276,1039 @@ void eb_replace(EditBuffer *b, int offset, int size,
     }
 }
 
+/* Unchanged spans longer than this end the current region: copying
+ * them would cost more than a separate undo record.
+ */
+#define BULK_MAX_GAP  (64 * 1024)
+
+/* Start a bulk edit of 'b' for a region beginning at 'start' */
+int eb_bulk_init(EditBulk *bk, EditBuffer *b, QEOffset start)
+{
+    bk->b = b;
+    bk->out = NULL;
+    bk->start = bk->offset = clamp_offset(start, 0, b->total_size);
+    bk->delta = 0;
+    bk->len = 0;
+    if (b->flags & BF_READONLY)
+        return -1;
+    bk->out = eb_new("*bulk*", BF_SYSTEM | BF_RAW);
+    if (!bk->out)
+        return -1;
+    return 0;
+}
+
+static void eb_bulk_flush(EditBulk *bk)
+{
+    eb_insert(bk->out, bk->out->total_size, bk->buf, bk->len);
+    bk->len = 0;
+}
+
+static void eb_bulk_put(EditBulk *bk, const void *buf, int len)
+{
+    int n;
+
+    while (len > 0) {
+        if (bk->len == ssizeof(bk->buf))
+            eb_bulk_flush(bk);
+        n = min(len, ssizeof(bk->buf) - bk->len);
+        memcpy(bk->buf + bk->len, buf, n);
+        bk->len += n;
+        buf = (const u8 *)buf + n;
+        len -= n;
+    }
+}
+
+/* Replace the current region with its new contents */
+static void eb_bulk_commit(EditBulk *bk)
+{
+    EditBuffer *b = bk->b;
+    QEOffset start, size, size1;
+
+    eb_bulk_flush(bk);
+    start = bk->start + bk->delta;
+    size = bk->offset - bk->start;
+    size1 = bk->out->total_size;
+    if (size > 0 || size1 > 0) {
+        /* callbacks see one deletion and one insertion */
+        eb_addlog2(b, LOGOP_REPLACE, start, size, size1);
+        b->save_log |= 2;
+        eb_delete(b, start, size);
+        eb_insert_buffer(b, start, bk->out, 0, size1);
+        b->save_log &= ~2;
+        eb_delete(bk->out, 0, size1);
+    }
+    bk->delta += size1 - size;
+    bk->start = bk->offset;
+}
+
+/* Copy the source up to 'offset', then replace 'size' bytes with the
+ * utf8 text in 'buf'.  Replacements must be given in increasing order
+ * of offsets.  Offsets are those of the buffer as modified so far: the
+ * current region is only replaced once a long unchanged span follows
+ * it.  Return the size change of the buffer before 'offset', by which
+ * the caller must move the offsets it holds past 'offset'.
+ */
+QEOffset eb_bulk_replace(EditBulk *bk, QEOffset offset, QEOffset size,
+                         const char *buf, int len)
+{
+    EditBuffer *b = bk->b;
+    QEOffset delta, source_size;
+    const char *bufend;
+    char cbuf[MAX_CHAR_BYTES];
+    int n;
+
+    delta = bk->delta;
+    offset -= delta;
+    if (!bk->out || offset < bk->offset)
+        return 0;
+
+    source_size = b->total_size - delta;
+    offset = min_offset(offset, source_size);
+    if (offset - bk->offset > BULK_MAX_GAP) {
+        /* leave the unchanged span in place */
+        eb_bulk_commit(bk);
+        bk->start = bk->offset = offset;
+    }
+
+    /* copy the unchanged span page by page */
+    while (bk->offset < offset) {
+        if (bk->len == ssizeof(bk->buf))
+            eb_bulk_flush(bk);
+        n = (int)min_offset(offset - bk->offset, ssizeof(bk->buf) - bk->len);
+        n = eb_read(b, bk->offset + bk->delta, bk->buf + bk->len, n);
+        bk->len += n;
+        bk->offset += n;
+    }
+
+    if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
+        eb_bulk_put(bk, buf, len);
+    } else {
+        for (bufend = buf + len; buf < bufend;) {
+            n = eb_encode_uchar(b, cbuf, utf8_decode(&buf));
+            eb_bulk_put(bk, cbuf, n);
+        }
+    }
+    bk->offset = min_offset(offset + size, source_size);
+    return bk->delta - delta;
+}
+
+/* Replace the last region with its new contents, return the size
+ * change of the buffer.
+ */
+QEOffset eb_bulk_finish(EditBulk *bk)
+{
+    if (!bk->out)
+        return 0;
+
+    eb_bulk_commit(bk);
+    eb_free(&bk->out);
+    return bk->delta;
+}
+
 /************************************************************/
 /* buffer I/O */
 
 #define IOBUF_SIZE 32768
 
-#if 0
+/* Read up to 'max_size' bytes of a file straight into new pages
+ * inserted at 'offset': the data is copied once, page line and char
+ * counts are computed while it is in cache and the buffer callbacks
+ * are invoked once for the whole insertion.
+ * CG: returns number of bytes read, or -1 upon read error
+ */
+static QEOffset eb_read_pages(EditBuffer *b, FILE *f, QEOffset offset,
+                              QEOffset max_size)
+{
+    Page *pages, *p;
+    QEOffset size;
+    int nb_pages, nb_alloc, len, page_index;
+
+    pages = NULL;
+    nb_pages = nb_alloc = 0;
+    size = 0;
+    while (size < max_size) {
+        if (nb_pages == nb_alloc) {
+            nb_alloc += nb_alloc / 2 + 16;
+            if (!qe_realloc(&pages, nb_alloc * sizeof(Page)))
+                goto fail;
+        }
+        p = &pages[nb_pages];
+        p->data = qe_malloc_array(u8, LARGE_PAGE_SIZE);
+        if (!p->data)
+            goto fail;
+        len = fread(p->data, 1,
+                    (int)min_offset(max_size - size, LARGE_PAGE_SIZE), f);
+        if (len <= 0) {
+            qe_free(&p->data);
+            if (ferror(f))
+                goto fail;
+            break;
+        }
+        if (len < LARGE_PAGE_SIZE)
+            qe_realloc(&p->data, len);
+        p->size = len;
+        /* line and char counts are computed upon lookup */
+        p->flags = 0;
+        nb_pages++;
+        size += len;
+    }
+
+    if (size > 0) {
+        if (offset > b->total_size)
+            offset = b->total_size;
+        page_index = eb_cut_page(b, offset);
+        if (page_index < 0
+        ||  !qe_realloc(&b->page_table,
+                        (b->nb_pages + nb_pages) * sizeof(Page)))
+            goto fail;
+
+        eb_addlog(b, LOGOP_INSERT, offset, size);
+
+        p = b->page_table + page_index;
+        memmove(p + nb_pages, p, (b->nb_pages - page_index) * sizeof(Page));
+        memcpy(p, pages, nb_pages * sizeof(Page));
+        b->nb_pages += nb_pages;
+        b->total_size += size;
+        page_index_insert(b, page_index, nb_pages);
+        eb_coalesce_later(b, page_index);
+        b->cur_page = NULL;
+    }
+    qe_free(&pages);
+    return size;
+
+ fail:
+    while (nb_pages > 0)
+        qe_free(&pages[--nb_pages].data);
+    qe_free(&pages);
+    return -1;
+}
+
+QEOffset raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset)
+{
+    if (b->flags & BF_READONLY)
+        return 0;
+
+    return eb_read_pages(b, f, offset, MAX_OFFSET);
+}
+
+/* Background loading: raw_buffer_load() reads the beginning of the
+ * file for at most LOAD_SLICE ms, so the window shows the first screen
+ * at once, and the rest of the file is appended by a timer one time
+ * slice at a time.  The buffer can be edited meanwhile: the insertion
+ * point is tracked by an offset callback.  BF_LOADING stays set until
+ * the end of file is reached and the buffer cannot be saved until then.
+ */
+#define LOAD_SLICE  10           /* ms of reading per time slice */
+#define LOAD_CHUNK  (1024*1024)  /* bytes read between clock checks */
 
 typedef struct BufferIOState {
-    URLContext *handle;
-    void (*progress_cb)(void *opaque, int size);
-    void (*completion_cb)(void *opaque, int err);
-    void *opaque;
-    int offset;
-    int saved_flags;
-    int saved_log;
-    int nolog;
-    unsigned char buffer[IOBUF_SIZE];
+    FILE *f;
+    QETimer *timer;
+    QEOffset offset;     /* insertion point of the next block */
+    QEOffset loaded;     /* number of bytes read so far */
+    QEOffset file_size;
 } BufferIOState;
 
-static void load_connected_cb(void *opaque, int err);
-static void load_read_cb(void *opaque, int size);
-static void eb_io_stop(EditBuffer *b, int err);
+static void eb_load_stop(EditBuffer *b)
+{
+    BufferIOState *s = b->io_state;
+
+    if (s) {
+        qe_kill_timer(&s->timer);
+        eb_free_callback(b, eb_offset_callback, &s->offset);
+        if (s->f)
+            fclose(s->f);
+        b->flags &= ~BF_LOADING;
+        qe_free(&b->io_state);
+    }
+}
+
+/* read the file for a time slice: return the size of the last block
+ * read, 0 at end of file, -1 upon read error.
+ */
+static QEOffset eb_load_run(EditBuffer *b)
+{
+    BufferIOState *s = b->io_state;
+    QEOffset size;
+    int start_time, saved_log, modified;
+
+    /* loaded data is neither undoable nor a modification */
+    saved_log = b->save_log;
+    modified = b->modified;
+    b->save_log = 0;
+    start_time = get_clock_ms();
+    for (;;) {
+        /* s->offset is pushed past the inserted block by the callback */
+        size = eb_read_pages(b, s->f, s->offset, LOAD_CHUNK);
+        if (size <= 0)
+            break;
+        s->loaded += size;
+        if (get_clock_ms() - start_time >= LOAD_SLICE)
+            break;
+    }
+    b->save_log = saved_log;
+    b->modified = modified;
+    return size;
+}
+
+static void eb_load_timer_cb(void *opaque)
+{
+    EditBuffer *b = opaque;
+    BufferIOState *s = b->io_state;
+    QEOffset size;
+
+    s->timer = NULL;
+    size = eb_load_run(b);
+    if (size > 0) {
+        s->timer = qe_add_timer(0, b, eb_load_timer_cb);
+    } else {
+        if (size < 0)
+            put_status(NULL, "Error reading '%s'", b->filename);
+        eb_load_stop(b);
+        if (size == 0)
+            eb_undo_restore(b);
+    }
+    qe_display_request(&qe_state);
+}
+
+/* start loading 'f' into 'b': return 0 if the file was loaded
+ * completely, 1 if loading continues in the background, -1 upon error.
+ */
+static int eb_load_start(EditBuffer *b, FILE *f, QEOffset file_size)
+{
+    BufferIOState *s;
+    QEOffset size;
+    int fd;
+
+    s = qe_mallocz(BufferIOState);
+    if (!s)
+        return -1;
+    b->io_state = s;
+    s->f = f;
+    s->file_size = file_size;
+    s->offset = b->total_size;
+    eb_add_callback(b, eb_offset_callback, &s->offset, 1);
+    b->flags |= BF_LOADING;
+
+    size = eb_load_run(b);
+    if (size > 0) {
+        /* the caller closes 'f': continue on a private stream of the
+           same file, which may have been renamed or replaced since */
+        fd = dup(fileno(f));
+        s->f = (fd >= 0) ? fdopen(fd, "r") : NULL;
+        if (s->f && !fseek(s->f, ftell(f), SEEK_SET)) {
+            s->timer = qe_add_timer(0, b, eb_load_timer_cb);
+            return 1;
+        }
+        if (s->f)
+            fclose(s->f);
+        else
+        if (fd >= 0)
+            close(fd);
+        size = -1;
+    }
+    /* do not close the caller's stream */
+    s->f = NULL;
+    eb_load_stop(b);
+    return size < 0 ? -1 : 0;
+}
+
+/* return the percentage of the file loaded, or -1 if not loading */
+int eb_load_percent(EditBuffer *b)
+{
+    BufferIOState *s = b->io_state;
+
+    if (!s)
+        return -1;
+    return compute_percent(s->loaded, s->file_size);
+}
+
+#ifdef CONFIG_MMAP
+/* load a file lazily: the buffer gets mapped pages of MAPPED_PAGE_SIZE
+ * bytes, the file contents are only mapped upon access, see
+ * mapped_file_data().
+ */
+int mmap_buffer(EditBuffer *b, const char *filename)
+{
+    MappedFile *mf;
+    QEOffset file_size, offset;
+    int fd, nb_windows, n, i;
+    Page *p;
+
+    /* mapped pages can only be added to an empty buffer */
+    if (b->total_size > 0)
+        return -1;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    file_size = lseek(fd, 0, SEEK_END);
+    if (file_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    nb_windows = (int)((file_size + MMAP_WINDOW_SIZE - 1) / MMAP_WINDOW_SIZE);
+    n = (int)((file_size + MAPPED_PAGE_SIZE - 1) / MAPPED_PAGE_SIZE);
+    mf = qe_mallocz(MappedFile);
+    p = qe_malloc_array(Page, n);
+    if (!mf || !p
+    ||  !(mf->windows = qe_mallocz_array(MapWindow, nb_windows))) {
+        qe_free(&mf);
+        qe_free(&p);
+        close(fd);
+        return -1;
+    }
+    mf->fd = fd;
+    mf->ref_count = n;
+    mf->file_size = file_size;
+    mf->nb_windows = nb_windows;
+    b->page_table = p;
+    b->total_size = file_size;
+    b->nb_pages = n;
+    /* pages never straddle windows: MMAP_WINDOW_SIZE is a multiple of
+       MAPPED_PAGE_SIZE */
+    for (i = 0, offset = 0; i < n; i++, p++, offset += MAPPED_PAGE_SIZE) {
+        p->size = (int)min_offset(file_size - offset, MAPPED_PAGE_SIZE);
+        p->data = NULL;
+        p->flags = PG_READ_ONLY | PG_MAPPED;
+        p->map_offset = offset;
+        p->block = NULL;
+        p->map = mf;
+    }
+    page_index_insert(b, 0, n);
+    return 0;
+}
+#endif
+
+static int raw_buffer_load(EditBuffer *b, FILE *f)
+{
+    QEmacsState *qs = &qe_state;
+    struct stat st;
+    int ret;
+
+    /* TODO: Should produce error messages */
+
+    if (stat(b->filename, &st))
+        return -1;
+
+#ifdef CONFIG_MMAP
+    if (st.st_size >= qs->mmap_threshold) {
+        if (!mmap_buffer(b, b->filename)) {
+            eb_undo_restore(b);
+            return 0;
+        }
+    }
+#endif
+    if (st.st_size <= qs->max_load_size) {
+        eb_load_stop(b);
+        ret = eb_load_start(b, f, st.st_size);
+        if (ret == 0)
+            eb_undo_restore(b);
+        return ret < 0 ? -1 : 0;
+    }
+    return -1;
+}
+
+#define SAVE_IOV_MAX  64
+
+/* Write bytes between <start> and <end> to fd straight from the page
+ * data, return bytes written or -1 if error.  Mapped pages are written
+ * one at a time because mapping a window may unmap another one.
+ */
+static QEOffset eb_write_pages(EditBuffer *b, int fd,
+                               QEOffset start, QEOffset end)
+{
+#ifndef CONFIG_WIN32
+    struct iovec iov[SAVE_IOV_MAX];
+    u8 *data;
+    Page *p;
+    QEOffset offset, size, written;
+    ssize_t len;
+    int n;
+
+    written = 0;
+    while (start < end) {
+        offset = start;
+        p = find_page(b, &offset);
+        size = 0;
+        for (n = 0; n < SAVE_IOV_MAX; n++, p++) {
+            if (n > 0 && (p->flags & PG_MAPPED))
+                break;
+            data = page_data(b, p);
+            if (!data)
+                return -1;
+            iov[n].iov_base = data + offset;
+            iov[n].iov_len = (size_t)min_offset(p->size - offset,
+                                                end - start - size);
+            size += iov[n].iov_len;
+            offset = 0;
+            if (start + size >= end || (p->flags & PG_MAPPED)) {
+                n++;
+                break;
+            }
+        }
+        len = writev(fd, iov, n);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        written += len;
+        start += len;
+    }
+    return written;
+#else
+    QEOffset written;
+    int len;
+    unsigned char buf[IOBUF_SIZE];
+
+    written = 0;
+    while (start < end) {
+        len = (int)min_offset(end - start, IOBUF_SIZE);
+        eb_read(b, start, buf, len);
+        len = write(fd, buf, len);
+        if (len < 0)
+            return -1;
+        written += len;
+        start += len;
+    }
+    return written;
+#endif
+}
+
+#ifndef CONFIG_WIN32
+/* return true if saving the file 'filename' of status 'st' must write
+ * it in place: a new file would break its hard links, other than the
+ * backup link made by eb_save_buffer(), or change its owner.
+ */
+static int save_in_place(const char *filename, const struct stat *st)
+{
+    char backup[MAX_FILENAME_SIZE];
+    struct stat st1;
+    int nlink = (int)st->st_nlink;
+
+    if (snprintf(backup, sizeof(backup), "%s~", filename) < ssizeof(backup)
+    &&  lstat(backup, &st1) == 0
+    &&  st1.st_dev == st->st_dev && st1.st_ino == st->st_ino) {
+        nlink--;
+    }
+    return nlink > 1 || (st->st_uid != geteuid() && geteuid() != 0);
+}
+
+/* copy the file 'src' to 'dest', return -1 if error */
+static int backup_copy(const char *src, const char *dest, int mode)
+{
+    unsigned char buf[IOBUF_SIZE];
+    int fd, fd1, len, ret = -1;
+
+    fd = open(src, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    fd1 = open(dest, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd1 >= 0) {
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            if (write(fd1, buf, len) != len)
+                break;
+        }
+        if (len == 0)
+            ret = 0;
+        if (close(fd1) < 0)
+            ret = -1;
+    }
+    close(fd);
+    return ret;
+}
 
-/* load a buffer asynchronously and launch the callback. The buffer
-   stays in 'loading' state while begin loaded. It is also marked
-   readonly. */
-int load_buffer(EditBuffer *b, const char *filename,
-                int offset, int nolog,
-                void (*progress_cb)(void *opaque, int size),
-                void (*completion_cb)(void *opaque, int err), void *opaque)
+/* sync the directory holding 'path' so that a rename survives a crash */
+static void fsync_dirname(const char *path)
 {
-    URLContext *h;
-    BufferIOState *s;
+    char dir[PATH_MAX];
+    int fd;
 
-    /* cannot load a buffer if already I/Os or readonly */
-    if (b->flags & (BF_LOADING | BF_SAVING | BF_READONLY))
-        return -1;
-    s = qe_mallocz(BufferIOState);
-    if (!s)
-        return -1;
-    b->io_state = s;
-    h = url_new();
-    if (!h) {
-        qe_free(&b->io_state);
-        return -1;
+    fd = open(get_dirname(dir, sizeof(dir), path), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
     }
-    s->handle = h;
-    s->saved_flags = b->flags;
-    s->nolog = nolog;
-    if (s->nolog) {
-        s->saved_log = b->save_log;
-        b->save_log = 0;
-    }
-    b->flags |= BF_LOADING | BF_READONLY;
-    s->handle = h;
-    s->progress_cb = progress_cb;
-    s->completion_cb = completion_cb;
-    s->opaque = opaque;
-    s->offset = offset;
-    printf("connect_async: '%s'\n", filename);
-    url_connect_async(s->handle, filename, URL_RDONLY,
-                      load_connected_cb, b);
-    return 0;
 }
+#endif
 
-static void load_connected_cb(void *opaque, int err)
+#ifdef CONFIG_MMAP
+/* copy to memory the mapped pages of all buffers holding data of the
+ * file of status 'st', which is about to be truncated, return -1 if
+ * error.
+ */
+static int eb_copy_mapped_file(const struct stat *st)
 {
-    EditBuffer *b = opaque;
-    BufferIOState *s = b->io_state;
-    printf("connect_cb: err=%d\n", err);
-    if (err) {
-        eb_io_stop(b, err);
-        return;
+    QEmacsState *qs = &qe_state;
+    EditBuffer *b;
+    MappedFile *mf;
+    struct stat st1;
+    u8 *data, *buf;
+    Page *p;
+    int i, same;
+
+    for (b = qs->first_buffer; b; b = b->next) {
+        mf = NULL;
+        same = 0;
+        for (i = 0, p = b->page_table; i < b->nb_pages; i++, p++) {
+            if (!(p->flags & PG_MAPPED))
+                continue;
+            if (p->map != mf) {
+                mf = p->map;
+                same = (fstat(mf->fd, &st1) == 0
+                        && st1.st_dev == st->st_dev
+                        && st1.st_ino == st->st_ino);
+            }
+            if (!same)
+                continue;
+            data = page_data(b, p);
+            buf = data ? qe_malloc_dup(data, p->size) : NULL;
+            if (!buf)
+                return -1;
+            if (mf->ref_count == 1)
+                mf = NULL;
+            mapped_file_free(&p->map);
+            p->data = buf;
+            p->flags &= ~(PG_READ_ONLY | PG_MAPPED);
+        }
     }
-    url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
+    return 0;
 }
+#endif
 
-static void load_read_cb(void *opaque, int size)
+/* Write bytes between <start> and <end> to file filename,
+ * return bytes written or -1 if error.
+ * The data is written to a temporary file in the same directory, which
+ * is synced and renamed over filename, so filename always holds either
+ * the old or the new contents.  Symbolic links are followed.  The file
+ * is written in place if it has other hard links, if it belongs to
+ * another user, or if the temporary file cannot be created: the mapped
+ * data of the file is then copied to memory first.
+ */
+static QEOffset raw_buffer_save(EditBuffer *b, QEOffset start, QEOffset end,
+                                const char *filename)
 {
-    EditBuffer *b = opaque;
-    BufferIOState *s = b->io_state;
+    QEOffset written;
+    int fd;
+#ifndef CONFIG_WIN32
+    char path[PATH_MAX], tmpname[PATH_MAX + 8];
+    struct stat st;
+    mode_t mode;
+    int exists;
+#endif
 
-    printf("read_cb: size=%d\n", size);
-    if (size < 0) {
-        eb_io_stop(b, -EIO);
-    } else if (size == 0) {
-        /* end of file */
-        eb_io_stop(b, 0);
+    if (end < start) {
+        QEOffset tmp = start;
+        start = end;
+        end = tmp;
+    }
+    if (start < 0)
+        start = 0;
+    if (end > b->total_size)
+        end = b->total_size;
+
+#ifndef CONFIG_WIN32
+    if (!realpath(filename, path))
+        pstrcpy(path, sizeof(path), filename);
+    exists = (stat(path, &st) == 0);
+    if (exists) {
+        mode = st.st_mode & 07777;
     } else {
-        eb_insert(b, s->offset, s->buffer, size);
-        s->offset += size;
-        /* launch next read request */
-        url_read_async(s->handle, s->buffer, IOBUF_SIZE, load_read_cb, b);
+        mode = umask(0);
+        umask(mode);
+        mode = 0666 & ~mode;
+    }
+    if (!exists || !save_in_place(filename, &st)) {
+        snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+        fd = mkstemp(tmpname);
+        if (fd >= 0) {
+            /* keep the group, and the owner for root, where permitted */
+            if (exists && fchown(fd, st.st_uid, st.st_gid) < 0) {
+                /* the new file keeps the default group */
+            }
+            fchmod(fd, mode);
+            written = eb_write_pages(b, fd, start, end);
+            if (written < 0 || fsync(fd) < 0) {
+                close(fd);
+                unlink(tmpname);
+                return -1;
+            }
+            if (close(fd) < 0 || rename(tmpname, path) < 0) {
+                unlink(tmpname);
+                return -1;
+            }
+            fsync_dirname(path);
+            return written;
+        }
     }
+#ifdef CONFIG_MMAP
+    /* truncating the file would pull the data from under its pages */
+    if (exists && eb_copy_mapped_file(&st))
+        return -1;
+#endif
+#endif
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+
+    written = eb_write_pages(b, fd, start, end);
+    if (close(fd) < 0)
+        written = -1;
+    return written;
 }
 
-static void eb_io_stop(EditBuffer *b, int err)
+static void raw_buffer_close(__unused__ EditBuffer *b)
 {
-    BufferIOState *s = b->io_state;
+    /* nothing to do */
+}
 
-    b->flags = s->saved_flags;
-    if (s->nolog) {
-        b->modified = 0;
-        b->save_log = s->saved_log;
+/************************************************************/
+/* undo journal */
+
+/* With undo-journal set, the undo records of a file survive the
+ * buffer in an append only journal in ~/.qe/undo/, named after the
+ * hash of the real path of the file.  Each save appends a segment
+ * with the records added or changed since the previous save and their
+ * data, tagged with the size and hash of the saved contents.  When the
+ * file is loaded again with these contents, the records are read back
+ * and the journal itself is mapped as the log buffer: the saved data
+ * is only paged in when undone.  The journal is rewritten when most of
+ * it is no longer referenced.
+ */
+
+#ifdef CONFIG_MMAP
+
+#define UNDO_JOURNAL_MAGIC  0x31554551  /* "QEU1" */
+
+typedef struct UndoJournalHeader {
+    uint32_t magic;
+    uint32_t record_size;   /* sizeof(UndoRecord) */
+    QEOffset nb_records;    /* number of records after the header */
+    QEOffset first;         /* serial number of the first live record */
+    QEOffset keep;          /* serial number of the first record of
+                               this segment, the previous ones come
+                               from the previous segments */
+    QEOffset current;       /* serial number of the undo position */
+    QEOffset data_size;     /* bytes of data after the records */
+    QEOffset file_size;     /* saved contents size */
+    uint64_t hash;          /* saved contents hash */
+} UndoJournalHeader;
+
+#define HASH_SEED  0xcbf29ce484222325ULL
+
+/* hash 8 bytes at a time, 'size' must be a multiple of 8 except for
+ * the last block hashed.
+ */
+static uint64_t undo_hash(uint64_t h, const u8 *p, int size)
+{
+    uint64_t w;
+
+    for (; size >= 8; p += 8, size -= 8) {
+        memcpy(&w, p, 8);
+        h ^= w * 0x9e3779b97f4a7c15ULL;
+        h = ((h << 31) | (h >> 33)) * 0x100000001b3ULL;
     }
-    url_close(s->handle);
-    s->completion_cb(s->opaque, err);
-    qe_free(&b->io_state);
+    while (size-- > 0)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
 }
-#endif
 
-/* CG: returns number of bytes read, or -1 upon read error */
-int raw_buffer_load1(EditBuffer *b, FILE *f, int offset)
+/* the hash does not depend on the page layout */
+static uint64_t eb_hash_contents(EditBuffer *b)
 {
-    unsigned char buf[IOBUF_SIZE];
-    int len, size;
+    u8 buf[IOBUF_SIZE];
+    uint64_t h = HASH_SEED;
+    QEOffset offset;
+    int len;
 
-    //put_status(NULL, "loading %s", filename);
-    size = 0;
-    for (;;) {
-        len = fread(buf, 1, IOBUF_SIZE, f);
-        if (len <= 0) {
-            if (ferror(f))
-                return -1;
+    for (offset = 0; offset < b->total_size; offset += len) {
+        len = eb_read(b, offset, buf, sizeof(buf));
+        if (len <= 0)
             break;
-        }
-        eb_insert(b, offset, buf, len);
-        offset += len;
-        size += len;
+        h = undo_hash(h, buf, len);
     }
-    //put_status(NULL, "");
-    return size;
+    return h;
 }
 
-#ifdef CONFIG_MMAP
-int mmap_buffer(EditBuffer *b, const char *filename)
+static int undo_journal_path(EditBuffer *b, char *buf, int size, int create)
 {
-    int fd, len, file_size, n, size;
-    u8 *file_ptr, *ptr;
-    Page *p;
+    QEmacsState *qs = &qe_state;
+    char path[PATH_MAX];
+    const char *home;
+    uint64_t h;
 
-    fd = open(filename, O_RDONLY);
-    if (fd < 0)
-        return -1;
-    file_size = lseek(fd, 0, SEEK_END);
-    //put_status(NULL, "mapping %s", filename);
-    file_ptr = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
-    if ((void*)file_ptr == MAP_FAILED) {
-        close(fd);
+    if (!qs->undo_journal || !(b->flags & BF_SAVELOG)
+    ||  b->data_type != &raw_data_type || !b->filename[0]
+    ||  !realpath(b->filename, path) || !(home = getenv("HOME")))
         return -1;
+    if (create) {
+        snprintf(buf, size, "%s/.qe", home);
+        mkdir(buf, 0700);
+        snprintf(buf, size, "%s/.qe/undo", home);
+        mkdir(buf, 0700);
     }
-    n = (file_size + MAX_PAGE_SIZE - 1) / MAX_PAGE_SIZE;
-    p = qe_malloc_array(Page, n);
-    if (!p) {
-        close(fd);
+    h = undo_hash(HASH_SEED, (const u8 *)path, strlen(path));
+    if (snprintf(buf, size, "%s/.qe/undo/%016llx", home,
+                 (unsigned long long)h) >= size)
         return -1;
-    }
-    b->page_table = p;
-    b->total_size = file_size;
-    b->nb_pages = n;
-    size = file_size;
-    ptr = file_ptr;
+    return 0;
+}
+
+static int undo_write(int fd, const void *buf, size_t size)
+{
+    ssize_t len;
+
     while (size > 0) {
-        len = size;
-        if (len > MAX_PAGE_SIZE)
-            len = MAX_PAGE_SIZE;
-        p->data = ptr;
-        p->size = len;
-        p->flags = PG_READ_ONLY;
-        ptr += len;
+        len = write(fd, buf, size);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const u8 *)buf + len;
         size -= len;
-        p++;
     }
-    b->file_handle = fd;
-    //put_status(NULL, "");
     return 0;
 }
-#endif
 
-static int raw_buffer_load(EditBuffer *b, FILE *f)
+/* append the records not yet journaled after the buffer was saved */
+static void eb_undo_journal(EditBuffer *b)
 {
-    QEmacsState *qs = &qe_state;
+    UndoJournalHeader h;
+    UndoRecord *records, *r, *rec;
+    QEOffset keep, live, pos, data;
+    char path[MAX_FILENAME_SIZE], tmpname[MAX_FILENAME_SIZE + 8];
     struct stat st;
+    int i, n, fd, rewrite;
 
-    /* TODO: Should produce error messages */
+    if (!b->log_buffer || undo_journal_path(b, path, sizeof(path), 1))
+        return;
 
-    if (stat(b->filename, &st))
-        return -1;
+    live = b->undo_count * ssizeof(UndoRecord);
+    for (i = 0; i < b->undo_count; i++)
+        live += undo_data_size(undo_record(b, i));
 
-#ifdef CONFIG_MMAP
-    if (st.st_size >= qs->mmap_threshold) {
-        if (mmap_buffer(b, b->filename))
-            return 0;
+    /* rewrite the journal if it was changed behind our back or if
+     * most of it is dead: the previous one may still be mapped.
+     */
+    keep = max_offset(b->undo_synced, b->undo_base);
+    fd = open(path, O_WRONLY);
+    rewrite = (fd < 0 || fstat(fd, &st) || !b->undo_journal_size
+               || st.st_size != b->undo_journal_size
+               || st.st_size > 2 * live + UNDO_COMPACT_MIN);
+    pos = 0;
+    if (rewrite) {
+        if (fd >= 0)
+            close(fd);
+        snprintf(tmpname, sizeof(tmpname), "%s.XXXXXX", path);
+        fd = mkstemp(tmpname);
+        if (fd < 0)
+            return;
+        keep = b->undo_base;
+    } else {
+        pos = st.st_size;
+        if (lseek(fd, pos, SEEK_SET) < 0) {
+            close(fd);
+            return;
+        }
     }
-#endif
-    if (st.st_size <= qs->max_load_size) {
-        return raw_buffer_load1(b, f, 0);
+
+    /* record data offsets are journal offsets, the padding bytes are
+     * written as zeros.
+     */
+    n = (int)(b->undo_base + b->undo_count - keep);
+    records = qe_mallocz_array(UndoRecord, max(n, 1));
+    if (!records)
+        goto fail;
+    data = pos + ssizeof(h) + n * ssizeof(UndoRecord);
+    for (i = 0; i < n; i++) {
+        r = &records[i];
+        rec = undo_record(b, (int)(keep - b->undo_base) + i);
+        r->op = rec->op;
+        r->was_modified = rec->was_modified;
+        r->unit = rec->unit;
+        r->offset = rec->offset;
+        r->size = rec->size;
+        r->size1 = rec->size1;
+        r->data = rec->data;
+        if (undo_data_size(r)) {
+            r->data = data;
+            data += r->size;
+        }
     }
-    return -1;
+    memset(&h, 0, sizeof(h));
+    h.magic = UNDO_JOURNAL_MAGIC;
+    h.record_size = sizeof(UndoRecord);
+    h.nb_records = n;
+    h.first = b->undo_base;
+    h.keep = keep;
+    h.current = b->undo_base + b->undo_current;
+    h.data_size = data - (pos + ssizeof(h) + n * ssizeof(UndoRecord));
+    h.file_size = b->total_size;
+    h.hash = eb_hash_contents(b);
+
+    if (undo_write(fd, &h, sizeof(h))
+    ||  undo_write(fd, records, n * sizeof(UndoRecord)))
+        goto fail;
+    for (i = 0; i < n; i++) {
+        r = undo_record(b, (int)(keep - b->undo_base) + i);
+        if (undo_data_size(r)
+        &&  eb_write_pages(b->log_buffer, fd, r->data,
+                           r->data + r->size) != r->size)
+            goto fail;
+    }
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    if (rewrite && rename(tmpname, path) < 0) {
+        unlink(tmpname);
+        qe_free(&records);
+        return;
+    }
+    b->undo_synced = b->undo_base + b->undo_count;
+    b->undo_journal_size = data;
+    qe_free(&records);
+    return;
+
+ fail:
+    /* leave the journal as it was */
+    if (rewrite) {
+        unlink(tmpname);
+    } else
+    if (fd >= 0 && ftruncate(fd, pos)) {
+        b->undo_journal_size = 0;
+    }
+    if (fd >= 0)
+        close(fd);
+    qe_free(&records);
 }
 
-/* Write bytes between <start> and <end> to file filename,
- * return bytes written or -1 if error
+/* read back the undo records of a file just loaded if its journal
+ * matches its contents.
  */
-static int raw_buffer_save(EditBuffer *b, int start, int end,
-                           const char *filename)
+static void eb_undo_restore(EditBuffer *b)
 {
-    int fd, len, size, written;
-    unsigned char buf[IOBUF_SIZE];
-
-    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0)
-        return -1;
+    UndoJournalHeader h;
+    UndoRecord *records, *r;
+    EditBuffer *log;
+    QEOffset pos, base, live, drop;
+    char path[MAX_FILENAME_SIZE], name[MAX_BUFFERNAME_SIZE + 8];
+    int i, count, nb_alloc, unit, last_unit;
+
+    if (b->undo_count || b->log_buffer
+    ||  undo_journal_path(b, path, sizeof(path), 0))
+        return;
 
-    //put_status(NULL, "writing %s", filename);
-    if (end < start) {
-        int tmp = start;
-        start = end;
-        end = tmp;
-    }
-    if (start < 0)
-        start = 0;
-    if (end > b->total_size)
-        end = b->total_size;
-    written = 0;
-    size = end - start;
-    while (size > 0) {
-        len = size;
-        if (len > IOBUF_SIZE)
-            len = IOBUF_SIZE;
-        eb_read(b, start, buf, len);
-        len = write(fd, buf, len);
-        if (len < 0) {
-            close(fd);
-            return -1;
+    snprintf(name, sizeof(name), "*log <%s>*", b->name);
+    log = eb_new(name, BF_SYSTEM | BF_RAW);
+    if (!log)
+        return;
+    records = NULL;
+    if (mmap_buffer(log, path))
+        goto fail;
+
+    /* replay the segments on the record serial numbers */
+    base = 0;
+    count = nb_alloc = 0;
+    memset(&h, 0, sizeof(h));
+    for (pos = 0; pos < log->total_size;
+         pos += ssizeof(h) + h.nb_records * ssizeof(UndoRecord) + h.data_size) {
+        if (eb_read(log, pos, &h, sizeof(h)) != ssizeof(h))
+            goto fail;
+        /* a rewritten journal starts with the oldest live record */
+        if (pos == 0)
+            base = h.keep;
+        if (h.magic != UNDO_JOURNAL_MAGIC
+        ||  h.record_size != sizeof(UndoRecord)
+        ||  h.nb_records < 0 || h.nb_records > INT_MAX / 2 - count
+        ||  h.data_size < 0 || h.keep < base || h.keep > base + count
+        ||  h.first < base || h.first > h.keep + h.nb_records
+        ||  h.current < h.first || h.current > h.keep + h.nb_records
+        ||  pos + ssizeof(h) + h.nb_records * ssizeof(UndoRecord)
+            + h.data_size > log->total_size)
+            goto fail;
+        count = (int)(h.keep - base);
+        if (count + h.nb_records > nb_alloc) {
+            nb_alloc = max(256, (int)(count + h.nb_records) * 2);
+            if (!qe_realloc(&records, nb_alloc * sizeof(UndoRecord)))
+                goto fail;
         }
-        written += len;
-        start += len;
-        size -= len;
+        if (eb_read(log, pos + ssizeof(h), records + count,
+                    (int)h.nb_records * ssizeof(UndoRecord))
+            != h.nb_records * ssizeof(UndoRecord))
+            goto fail;
+        count += (int)h.nb_records;
+        drop = h.first - base;
+        memmove(records, records + drop, (count - drop) * sizeof(UndoRecord));
+        count -= (int)drop;
+        base = h.first;
     }
-    close(fd);
-    //put_status(NULL, "");
-    return written;
+    if (!count || h.file_size != b->total_size
+    ||  h.hash != eb_hash_contents(b))
+        goto fail;
+
+    /* the ring size must be a power of 2 */
+    for (nb_alloc = 256; nb_alloc < count; nb_alloc *= 2)
+        continue;
+    if (!qe_realloc(&records, nb_alloc * sizeof(UndoRecord)))
+        goto fail;
+
+    /* restored units must not collide with the units of new commands */
+    live = 0;
+    unit = INT_MIN;
+    last_unit = 0;
+    for (i = 0; i < count; i++) {
+        r = &records[i];
+        if (r->op < LOGOP_WRITE || r->op > LOGOP_REPLACE
+        ||  (undo_data_size(r) && (r->data < 0 || r->size < 0
+                                   || r->data + r->size > log->total_size)))
+            goto fail;
+        if (i == 0 || r->unit != last_unit)
+            unit++;
+        last_unit = r->unit;
+        r->unit = unit;
+        live += undo_data_size(r);
+    }
+
+    b->log_buffer = log;
+    b->undo_records = records;
+    b->undo_size = nb_alloc;
+    b->undo_first = 0;
+    b->undo_count = count;
+    b->undo_current = (int)(h.current - base);
+    b->undo_dead = log->total_size - live;
+    b->undo_base = base;
+    b->undo_synced = base + count;
+    b->undo_journal_size = log->total_size;
+    b->last_log = 0;
+    return;
+
+ fail:
+    qe_free(&records);
+    eb_free(&log);
+}
+#else
+static void eb_undo_journal(__unused__ EditBuffer *b)
+{
 }
 
-static void raw_buffer_close(__unused__ EditBuffer *b)
+static void eb_undo_restore(__unused__ EditBuffer *b)
 {
-    /* nothing to do */
 }
+#endif
 
 /* Associate a buffer with a file and rename it to match the
    filename. Find a unique buffer name */
 void eb_set_filename(EditBuffer *b, const char *filename)
 {
+    QEmacsState *qs = &qe_state;
+
+    eb_unindex_file(b);
     pstrcpy(b->filename, sizeof(b->filename), filename);
+    if (b->filename[0])
+        qe_hash_add(&qs->file_table, qe_hash_string(b->filename), b);
+    eb_index_file_id(b);
     eb_set_buffer_name(b, get_basename(filename));
 }
 
@@ -1774,7 +4340,7 @@ int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c)
 
 /* Insert unicode character according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_uchar(EditBuffer *b, int offset, int c)
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c)
 {
     char buf[MAX_CHAR_BYTES];
     int len;
@@ -1783,7 +4349,7 @@ int eb_insert_uchar(EditBuffer *b, int offset, int c)
     return eb_insert(b, offset, buf, len);
 }
 
-int eb_insert_spaces(EditBuffer *b, int offset, int n)
+int eb_insert_spaces(EditBuffer *b, QEOffset offset, int n)
 {
     char buf1[1024];
     int size, size1;
@@ -1802,7 +4368,8 @@ int eb_insert_spaces(EditBuffer *b, int offset, int n)
 
 /* Insert buffer with utf8 chars according to buffer encoding */
 /* Return number of bytes inserted */
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset,
+                       const char *buf, int len)
 {
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return eb_insert(b, offset, buf, len);
@@ -1825,12 +4392,12 @@ int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len)
     }
 }
 
-int eb_insert_str(EditBuffer *b, int offset, const char *str)
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str)
 {
     return eb_insert_utf8_buf(b, offset, str, strlen(str));
 }
 
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp)
 {
     if (eb_nextc(b, offset, &offset) != c)
         return 0;
@@ -1839,7 +4406,8 @@ int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp)
     return 1;
 }
 
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str,
+                 QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -1853,7 +4421,8 @@ int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp)
     return 1;
 }
 
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp)
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str,
+                  QEOffset *offsetp)
 {
     const char *p = str;
 
@@ -1920,24 +4489,25 @@ void eb_line_pad(EditBuffer *b, int n)
 #endif
 
 /* Read the contents of a buffer region encoded in a utf8 string */
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size)
 {
-    int size;
+    QEOffset size;
 
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
     size = stop - start;
 
     /* do not use eb_read if overflow to avoid partial characters */
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX
     &&  size < buf_size) {
-        eb_read(b, start, buf, size);
+        eb_read(b, start, buf, (int)size);
         buf[size] = '\0';
-        return size;
+        return (int)size;
     } else {
         buf_t outbuf, *out;
-        int c, offset;
+        QEOffset offset;
+        int c;
 
         out = buf_init(&outbuf, buf, buf_size);
         for (offset = start; offset < stop;) {
@@ -1949,15 +4519,17 @@ int eb_get_region_contents(EditBuffer *b, int start, int stop,
 }
 
 /* Compute the size of the contents of a buffer region encoded in utf8 */
-int eb_get_region_content_size(EditBuffer *b, int start, int stop)
+QEOffset eb_get_region_content_size(EditBuffer *b,
+                                    QEOffset start, QEOffset stop)
 {
-    stop = clamp(stop, 0, b->total_size);
-    start = clamp(start, 0, stop);
+    stop = clamp_offset(stop, 0, b->total_size);
+    start = clamp_offset(start, 0, stop);
 
     if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
         return stop - start;
     } else {
-        int c, offset, size;
+        QEOffset offset, size;
+        int c;
         char buf[MAX_CHAR_BYTES];
 
         for (size = 0, offset = start; offset < stop;) {
@@ -1974,9 +4546,9 @@ int eb_get_region_content_size(EditBuffer *b, int start, int stop)
  * performed.
  * Return the number of bytes inserted.
  */
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size)
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size)
 {
     int styles_flags = min((dest->flags & BF_STYLES), (src->flags & BF_STYLES));
 
@@ -1986,7 +4558,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
         return eb_insert_buffer(dest, dest_offset, src, src_offset, size);
     } else {
         EditBuffer *b;
-        int offset, offset_max, offset1 = dest_offset;
+        QEOffset offset, offset_max, offset1 = dest_offset;
 
         b = dest;
         if (!styles_flags
@@ -1998,7 +4570,7 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
 
         /* well, not very fast, but simple */
         /* XXX: should optimize save_log system for insert sequences */
-        offset_max = min(src->total_size, src_offset + size);
+        offset_max = min_offset(src->total_size, src_offset + size);
         size = 0;
         for (offset = src_offset; offset < offset_max;) {
             char buf[MAX_CHAR_BYTES];
@@ -2016,31 +4588,171 @@ int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
     }
 }
 
+/* Lines are decoded straight from the page data: single byte chars
+ * go through the charset table, multibyte chars are decoded in place
+ * when they do not straddle a page boundary and eb_nextc() only
+ * handles the remaining cases: '\r', page boundaries and the end of
+ * the buffer.  The style of a line is looked up once per run.
+ */
+
+typedef struct StyleReader {
+    EditBuffer *b;
+    QEOffset start, end;        /* run of chars with the same style */
+    int style;
+} StyleReader;
+
+static inline int style_reader_get(StyleReader *sr, QEOffset offset)
+{
+    if (offset < sr->start || offset >= sr->end)
+        sr->style = eb_get_style(sr->b, offset, &sr->start, &sr->end);
+    return sr->style;
+}
+
+#define ONES64          0x0101010101010101ULL
+#define HAS_ZERO64(w)   (((w) - ONES64) & ~(w) & (ONES64 << 7))
+
+/* Decode at most 'n' chars of the line at '*offset_ptr' into 'buf',
+ * with their styles if 'sr' is not NULL.  '*eol_ptr' is set if the
+ * end of line was reached, '*offset_ptr' is then past the newline.
+ * Return the number of chars stored.
+ */
+static int eb_decode_line(EditBuffer *b, unsigned int *buf, int n,
+                          QEOffset *offset_ptr, int *eol_ptr,
+                          StyleReader *sr)
+{
+    const unsigned short *table = b->charset_state.table;
+    int ascii = (b->charset == &charset_utf8 || b->charset == &charset_8859_1);
+    const u8 *data, *q, *q1, *q_end;
+    QEOffset offset, pos;
+    uint64_t w;
+    Page *p;
+    int len, c, i;
+
+    offset = *offset_ptr;
+    *eol_ptr = 0;
+    len = 0;
+    while (len < n) {
+        if (offset >= b->total_size) {
+            offset = b->total_size;
+            *eol_ptr = 1;
+            break;
+        }
+        pos = offset;
+        p = find_page(b, &pos);
+        data = page_data(b, p);
+        if (!data) {
+            /* read error: see eb_nextc() */
+            offset++;
+            *eol_ptr = 1;
+            break;
+        }
+        q = data + pos;
+        q_end = data + p->size;
+        while (q < q_end && len < n) {
+            /* 8 ascii chars at a time, none of them '\n' or '\r' */
+            if (ascii && !sr && q_end - q >= 8 && n - len >= 8) {
+                memcpy(&w, q, 8);
+                if (!(w & (ONES64 << 7))
+                &&  !HAS_ZERO64(w ^ (ONES64 * '\n'))
+                &&  !HAS_ZERO64(w ^ (ONES64 * '\r'))) {
+                    for (i = 0; i < 8; i++)
+                        buf[len + i] = q[i];
+                    len += 8;
+                    q += 8;
+                    continue;
+                }
+            }
+            c = table[*q];
+            if (c == ESCAPE_CHAR) {
+                /* decode in place if the whole char is in the page */
+                if (q_end - q < MAX_CHAR_BYTES)
+                    break;
+                b->charset_state.p = q;
+                c = b->charset_state.decode_func(&b->charset_state);
+                if (c == '\r')
+                    break;
+                q1 = b->charset_state.p;
+            } else {
+                if (c == '\r')
+                    break;
+                q1 = q + 1;
+            }
+            if (c == '\n') {
+                q = q1;
+                *eol_ptr = 1;
+                break;
+            }
+            if (sr) {
+                c |= style_reader_get(sr, offset + (q - (data + pos)))
+                     << STYLE_SHIFT;
+            }
+            buf[len++] = c;
+            q = q1;
+        }
+        offset += q - (data + pos);
+        if (*eol_ptr || len >= n)
+            break;
+        if (q < q_end) {
+            /* '\r' or char straddling a page boundary */
+            pos = offset;
+            c = eb_nextc(b, offset, &offset);
+            if (c == '\n') {
+                *eol_ptr = 1;
+                break;
+            }
+            if (sr)
+                c |= style_reader_get(sr, pos) << STYLE_SHIFT;
+            buf[len++] = c;
+        }
+    }
+    *offset_ptr = offset;
+    return len;
+}
+
+static int eb_get_line1(EditBuffer *b, unsigned int *buf, int buf_size,
+                        QEOffset *offset_ptr, StyleReader *sr)
+{
+    unsigned int skip[256];
+    int len, eol;
+
+    len = eb_decode_line(b, buf, buf_size - 1, offset_ptr, &eol, sr);
+    buf[len] = '\0';
+    /* skip the rest of a truncated line */
+    while (!eol)
+        eb_decode_line(b, skip, countof(skip), offset_ptr, &eol, NULL);
+    return len;
+}
+
 /* get the line starting at offset 'offset' as an array of code points */
 /* offset is bumped to the beginning of the next line */
 /* returns the number of code points stored in buf, excluding '\0' */
 /* buf_size must be > 0 */
 /* XXX: cannot detect truncation */
 int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
-                int *offset_ptr)
+                QEOffset *offset_ptr)
 {
-    unsigned int *buf_ptr, *buf_end;
-    int c, offset;
+    unsigned int *p, *p_end;
+    int len;
 
-    offset = *offset_ptr;
+    len = eb_get_line1(b, buf, buf_size, offset_ptr, NULL);
+    for (p = buf, p_end = buf + len; p < p_end; p++)
+        *p &= CHAR_MASK;
+    return len;
+}
 
-    buf_ptr = buf;
-    buf_end = buf + buf_size - 1;
-    for (;;) {
-        c = eb_nextc(b, offset, &offset);
-        if (c == '\n')
-            break;
-        if (buf_ptr < buf_end)
-            *buf_ptr++ = c & CHAR_MASK;
-    }
-    *buf_ptr = '\0';
-    *offset_ptr = offset;
-    return buf_ptr - buf;
+/* same as eb_get_line() with the styles of the buffer b_styles in the
+ * high bits of the code points.
+ */
+int eb_get_styled_line(EditBuffer *b, unsigned int *buf, int buf_size,
+                       QEOffset *offset_ptr)
+{
+    StyleReader sr;
+
+    if (!b->b_styles)
+        return eb_get_line(b, buf, buf_size, offset_ptr);
+    sr.b = b;
+    sr.start = sr.end = 0;
+    return eb_get_line1(b, buf, buf_size, offset_ptr, &sr);
 }
 
 /* get the line starting at offset 'offset' encoded in utf-8 */
@@ -2049,31 +4761,34 @@ int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
 /* buf_size must be > 0 */
 /* XXX: cannot detect truncation */
 int eb_get_strline(EditBuffer *b, char *buf, int buf_size,
-                   int *offset_ptr)
+                   QEOffset *offset_ptr)
 {
+    unsigned int chars[256];
     buf_t outbuf, *out;
-    int offset;
-
-    offset = *offset_ptr;
+    int i, len, eol;
 
     out = buf_init(&outbuf, buf, buf_size);
-    for (;;) {
-        int c = eb_nextc(b, offset, &offset);
-        if (c == '\n')
-            break;
-        if (buf_putc_utf8(out, c))
-            continue;
-        /* overflow: skip past '\n' */
-        offset = eb_next_line(b, offset);
-        break;
-    }
-    *offset_ptr = offset;
+    do {
+        len = eb_decode_line(b, chars, countof(chars), offset_ptr, &eol,
+                             NULL);
+        for (i = 0; i < len; i++) {
+            if (!buf_putc_utf8(out, chars[i])) {
+                /* overflow: skip past '\n' */
+                while (!eol) {
+                    eb_decode_line(b, chars, countof(chars), offset_ptr,
+                                   &eol, NULL);
+                }
+                break;
+            }
+        }
+    } while (!eol);
     return out->len;
 }
 
-int eb_prev_line(EditBuffer *b, int offset)
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset)
 {
-    int offset1, seen_nl;
+    QEOffset offset1;
+    int seen_nl;
 
     for (seen_nl = 0;;) {
         if (eb_prevc(b, offset, &offset1) == '\n') {
@@ -2086,9 +4801,9 @@ int eb_prev_line(EditBuffer *b, int offset)
 }
 
 /* return offset of the beginning of the line containing offset */
-int eb_goto_bol(EditBuffer *b, int offset)
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset)
 {
-    int offset1;
+    QEOffset offset1;
 
     for (;;) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2101,9 +4816,10 @@ int eb_goto_bol(EditBuffer *b, int offset)
 /* move to the beginning of the line containing offset */
 /* return offset of the beginning of the line containing offset */
 /* store count of characters skipped at *countp */
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp)
 {
-    int count, offset1;
+    QEOffset offset1;
+    int count;
 
     for (count = 0;; count++) {
         if (eb_prevc(b, offset, &offset1) == '\n')
@@ -2118,7 +4834,7 @@ int eb_goto_bol2(EditBuffer *b, int offset, int *countp)
  * return 0 if not blank.
  * return 1 if blank and store start of next line in <*offset1>.
  */
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1)
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1)
 {
     int c;
     
@@ -2132,7 +4848,7 @@ int eb_is_blank_line(EditBuffer *b, int offset, int *offset1)
 }
 
 /* check if <offset> is within indentation. */
-int eb_is_in_indentation(EditBuffer *b, int offset)
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2144,9 +4860,10 @@ int eb_is_in_indentation(EditBuffer *b, int offset)
 }
 
 /* return offset of the end of the line containing offset */
-int eb_goto_eol(EditBuffer *b, int offset)
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         c = eb_nextc(b, offset, &offset1);
@@ -2157,7 +4874,7 @@ int eb_goto_eol(EditBuffer *b, int offset)
     return offset;
 }
 
-int eb_next_line(EditBuffer *b, int offset)
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset)
 {
     int c;
 
@@ -2186,45 +4903,73 @@ void eb_register_data_type(EditBufferDataType *bdt)
 /* Write buffer contents between <start> and <end> to file <filename>,
  * return bytes written or -1 if error
  */
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename)
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename)
 {
-    if (!b->data_type->buffer_save)
+    QEmacsState *qs = &qe_state;
+    QEOffset ret;
+    int start_time;
+
+    /* the contents are incomplete until the buffer is loaded */
+    if (!b->data_type->buffer_save || (b->flags & BF_LOADING))
         return -1;
 
-    return b->data_type->buffer_save(b, start, end, filename);
+    start_time = get_clock_ms();
+    ret = b->data_type->buffer_save(b, start, end, filename);
+    qs->save_time = get_clock_ms() - start_time;
+    return ret;
 }
 
 /* Save buffer contents to buffer associated file, handle backups,
  * return bytes written or -1 if error
  */
-int eb_save_buffer(EditBuffer *b)
+QEOffset eb_save_buffer(EditBuffer *b)
 {
     QEmacsState *qs = &qe_state;
-    int ret, st_mode;
+    QEOffset ret;
+    int st_mode, start_time, exists;
     char buf1[MAX_FILENAME_SIZE];
     const char *filename;
     struct stat st;
+#ifndef CONFIG_WIN32
+    char path[PATH_MAX];
+#endif
 
-    if (!b->data_type->buffer_save)
+    if (!b->data_type->buffer_save || (b->flags & BF_LOADING))
         return -1;
 
+    start_time = get_clock_ms();
+
     filename = b->filename;
     /* get old file permission */
     st_mode = 0644;
-    if (stat(filename, &st) == 0)
+    exists = (stat(filename, &st) == 0);
+    if (exists)
         st_mode = st.st_mode & 0777;
 
-    if (!qs->backup_inhibited
+    if (!qs->backup_inhibited && exists
     &&  strlen(filename) < MAX_FILENAME_SIZE - 1) {
-        /* backup old file if present */
+        /* backup old file: link it so filename stays in place until
+         * the new contents replace it, or copy it if the file is
+         * written in place.
+         */
         if (snprintf(buf1, sizeof(buf1), "%s~", filename) < ssizeof(buf1)) {
             // should check error code
+#ifndef CONFIG_WIN32
+            unlink(buf1);
+            if (!realpath(filename, path))
+                pstrcpy(path, sizeof(path), filename);
+            if (save_in_place(filename, &st) || link(path, buf1))
+                backup_copy(path, buf1, st_mode);
+#else
             rename(filename, buf1);
+#endif
         }
     }
 
     /* CG: should pass st_mode to buffer_save */
     ret = b->data_type->buffer_save(b, 0, b->total_size, filename);
+    qs->save_time = get_clock_ms() - start_time;
     if (ret < 0)
         return ret;
 
@@ -2232,9 +4977,10 @@ int eb_save_buffer(EditBuffer *b)
     /* set correct file st_mode to old file permissions */
     chmod(filename, st_mode);
 #endif
-    /* reset log */
-    /* CG: should not do this! */
-    //log_reset(b);
+    /* saving replaces the file */
+    eb_index_file_id(b);
+    /* the undo records are kept, in the journal if enabled */
+    eb_undo_journal(b);
     b->modified = 0;
     return ret;
 }
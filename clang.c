@@ -389,10 +389,11 @@ enum {
 };
 
 /* Check if indentation is already what it should be */
-static int check_indent(EditState *s, int offset, int i, int *offset_ptr)
+static int check_indent(EditState *s, QEOffset offset, int i,
+                        QEOffset *offset_ptr)
 {
     int tw, col, ntabs, nspaces, bad;
-    int offset1;
+    QEOffset offset1;
 
     tw = s->b->tab_width > 0 ? s->b->tab_width : 8;
     col = ntabs = nspaces = bad = 0;
@@ -429,7 +430,8 @@ static int check_indent(EditState *s, int offset, int i, int *offset_ptr)
  * Store new offset after indentation to <*offset_ptr>.
  * Tabs are inserted if s->indent_tabs_mode is true.
  */
-static void insert_indent(EditState *s, int offset, int i, int *offset_ptr)
+static void insert_indent(EditState *s, QEOffset offset, int i,
+                          QEOffset *offset_ptr)
 {
     /* insert tabs */
     if (s->indent_tabs_mode) {
@@ -447,9 +449,10 @@ static void insert_indent(EditState *s, int offset, int i, int *offset_ptr)
 }
 
 /* indent a line of C code starting at <offset> */
-static void c_indent_line(EditState *s, int offset0)
+static void c_indent_line(EditState *s, QEOffset offset0)
 {
-    int offset, offset1, offsetl, c, pos, line_num, col_num;
+    QEOffset offset, offset1, offsetl;
+    int c, pos, line_num, col_num;
     int i, j, eoi_found, len, pos1, lpos, style, line_num1, state;
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     unsigned char stack[MAX_STACK_SIZE];
@@ -678,7 +681,7 @@ static void do_c_indent(EditState *s)
 
 static void do_c_electric(EditState *s, int key)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
 
     do_char(s, key, 1);
     c_indent_line(s, offset);
@@ -686,7 +689,7 @@ static void do_c_electric(EditState *s, int key)
 
 static void do_c_return(EditState *s)
 {
-    int offset = s->offset;
+    QEOffset offset = s->offset;
 
     do_return(s, 1);
     /* reindent line to remove indent on blank line */
@@ -708,7 +711,7 @@ static void do_c_forward_conditional(EditState *s, int dir)
 {
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     int line_num, col_num, len, sharp, level;
-    int offset, offset0, offset1;
+    QEOffset offset, offset0, offset1;
 
     offset = offset0 = eb_goto_bol(s->b, s->offset);
     eb_get_pos(s->b, &line_num, &col_num, offset);
@@ -767,7 +770,7 @@ static void do_c_list_conditionals(EditState *s)
 {
     unsigned int buf[COLORED_MAX_LINE_SIZE], *p;
     int line_num, col_num, len, sharp, level;
-    int offset, offset1;
+    QEOffset offset, offset1;
     EditBuffer *b;
 
     b = eb_scratch("Preprocessor conditionals", BF_UTF8);
@@ -49,7 +49,7 @@ typedef struct DiredItem {
     mode_t st_mode;
     off_t size;
     time_t mtime;
-    int offset;
+    QEOffset offset;
     char mark;
     char name[1];
 } DiredItem;
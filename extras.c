@@ -29,8 +29,8 @@ void do_compare_windows(EditState *s, int argval)
     QEmacsState *qs = s->qe_state;
     EditState *s1;
     EditState *s2;
-    int offset1, offset2, size1, size2, ch1, ch2;
-    int tries;
+    QEOffset offset1, offset2, size1, size2;
+    int ch1, ch2, tries;
 
     s1 = s;
     /* Should use same internal function as for next_window */
@@ -106,7 +106,7 @@ void do_compare_windows(EditState *s, int argval)
 
 void do_delete_horizontal_space(EditState *s)
 {
-    int from, to, offset;
+    QEOffset from, to, offset;
 
     /* boundary check unnecessary because eb_prevc returns '\n'
      * at bof and eof and qe_isblank return true only on SPC and TAB.
@@ -129,7 +129,8 @@ void do_delete_blank_lines(EditState *s)
      * On nonblank line, delete any immediately following blank lines.
      */
     /* XXX: should simplify */
-    int from, offset, offset0, offset1, all = 0;
+    QEOffset from, offset, offset0, offset1;
+    int all = 0;
     EditBuffer *b = s->b;
 
     offset = eb_goto_bol(b, s->offset);
@@ -164,7 +165,7 @@ void do_delete_blank_lines(EditState *s)
     eb_delete_range(b, from, offset);
 }
 
-void eb_tabify(EditBuffer *b, int p1, int p2)
+void eb_tabify(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     /* We implement a complete analysis of the region instead of
      * scanning for certain space patterns (such as / [ \t]/).  It is
@@ -179,10 +180,10 @@ void eb_tabify(EditBuffer *b, int p1, int p2)
      * one line cache.
      */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max_offset(0, min_offset(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max_offset(p1, p2));
     int col;
-    int offset, offset1, offset2, delta;
+    QEOffset offset, offset1, offset2, delta;
 
     col = 0;
     offset = eb_goto_bol(b, start);
@@ -242,17 +243,17 @@ void do_tabify_region(EditState *s)
     eb_tabify(s->b, s->b->mark, s->offset);
 }
 
-void eb_untabify(EditBuffer *b, int p1, int p2)
+void eb_untabify(EditBuffer *b, QEOffset p1, QEOffset p2)
 {
     /* We implement a complete analysis of the region instead of
      * potentially faster scan for '\t'.  It is fast enough and even
      * faster if there are lots of tabs.
      */
     int tw = b->tab_width > 0 ? b->tab_width : 8;
-    int start = max(0, min(p1, p2));
-    int stop = min(b->total_size, max(p1, p2));
+    QEOffset start = max_offset(0, min_offset(p1, p2));
+    QEOffset stop = min_offset(b->total_size, max_offset(p1, p2));
     int col, col0;
-    int offset, offset1, offset2, delta;
+    QEOffset offset, offset1, offset2, delta;
 
     col = 0;
     offset = eb_goto_bol(b, start);
@@ -307,7 +308,7 @@ void do_indent_region(EditState *s)
 
     /* Swap point and mark so mark <= point */
     if (s->offset < s->b->mark) {
-        int tmp = s->b->mark;
+        QEOffset tmp = s->b->mark;
         s->b->mark = s->offset;
         s->offset = tmp;
     }
@@ -346,7 +347,8 @@ static void do_forward_block(EditState *s, int dir)
 {
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     char balance[MAX_LEVEL];
-    int line_num, col_num, offset, offset1, len, pos, style, c, c1, level;
+    QEOffset offset, offset1;
+    int line_num, col_num, len, pos, style, c, c1, level;
 
     eb_get_pos(s->b, &line_num, &col_num, s->offset);
     offset = eb_goto_bol2(s->b, s->offset, &pos);
@@ -469,7 +471,7 @@ the_end:
 
 static void do_kill_block(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -486,8 +488,8 @@ enum {
 
 static void do_transpose(EditState *s, int cmd)
 {
-    int offset0, offset1, offset2, offset3, end_offset;
-    int size0, size1, size2;
+    QEOffset offset0, offset1, offset2, offset3, end_offset;
+    QEOffset size0, size1, size2;
     EditBuffer *b = s->b;
 
     if (check_read_only(s))
@@ -562,10 +564,10 @@ static void do_transpose(EditState *s, int cmd)
     if (!b->b_styles && size0 + size1 + size2 <= 1024) {
         u8 buf[1024];
         /* Use fast method and generate single undo record */
-        eb_read(b, offset2, buf, size2);
-        eb_read(b, offset1, buf + size2, size1);
-        eb_read(b, offset0, buf + size2 + size1, size0);
-        eb_write(b, offset0, buf, size0 + size1 + size2);
+        eb_read(b, offset2, buf, (int)size2);
+        eb_read(b, offset1, buf + size2, (int)size1);
+        eb_read(b, offset0, buf + size2 + size1, (int)size0);
+        eb_write(b, offset0, buf, (int)(size0 + size1 + size2));
     } else {
         EditBuffer *b1 = eb_new("*tmp*", BF_SYSTEM | (b->flags & BF_STYLES));
 
@@ -823,7 +825,8 @@ static void do_about_qemacs(EditState *s)
 
 static void do_set_region_color(EditState *s, const char *str)
 {
-    int offset, size, style;
+    QEOffset offset, size;
+    int style;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -848,7 +851,8 @@ static void do_set_region_color(EditState *s, const char *str)
 
 static void do_set_region_style(EditState *s, const char *str)
 {
-    int offset, size, style;
+    QEOffset offset, size;
+    int style;
     QEStyleDef *st;
 
     /* deactivate region hilite */
@@ -891,7 +895,7 @@ static void do_describe_buffer(EditState *s, int argval)
     EditBuffer *b = s->b;
     EditBuffer *b1;
     int show;
-    int total_size;
+    QEOffset total_size;
 
     b1 = new_help_buffer(&show);
     if (!b1)
@@ -904,18 +908,19 @@ static void do_describe_buffer(EditState *s, int argval)
     eb_printf(b1, "        name: %s\n", b->name);
     eb_printf(b1, "    filename: %s\n", b->filename);
     eb_printf(b1, "    modified: %d\n", b->modified);
-    eb_printf(b1, "  total_size: %d\n", total_size);
+    eb_printf(b1, "  total_size: %lld\n", total_size);
     if (total_size > 0) {
-        int nb_chars, line, col;
+        QEOffset nb_chars;
+        int line, col;
         
         eb_get_pos(b, &line, &col, total_size);
         nb_chars = eb_get_char_offset(b, total_size);
 
         eb_printf(b1, "       lines: %d\n", line);
-        eb_printf(b1, "       chars: %d\n", nb_chars);
+        eb_printf(b1, "       chars: %lld\n", nb_chars);
     }
-    eb_printf(b1, "        mark: %d\n", b->mark);
-    eb_printf(b1, "      offset: %d\n", b->offset);
+    eb_printf(b1, "        mark: %lld\n", b->mark);
+    eb_printf(b1, "      offset: %lld\n", b->offset);
 
     eb_printf(b1, "   tab_width: %d\n", b->tab_width);
     eb_printf(b1, " fill_column: %d\n", b->fill_column);
@@ -963,18 +968,48 @@ static void do_describe_buffer(EditState *s, int argval)
     eb_printf(b1, "      probed: %d\n", b->probed);
 
     eb_printf(b1, "   data_type: %s\n", b->data_type->name);
-    eb_printf(b1, "       pages: %d\n", b->nb_pages);
-    eb_printf(b1, " file_handle: %d\n", b->file_handle);
+    {
+        int i, nb_shared = 0, nb_mapped = 0;
+        MappedFile *mf = NULL;
+        for (i = 0; i < b->nb_pages; i++) {
+            Page *p = &b->page_table[i];
+            nb_shared += (p->flags & PG_SHARED) != 0;
+            if (p->flags & PG_MAPPED) {
+                nb_mapped++;
+                mf = p->map;
+            }
+        }
+        eb_printf(b1, "       pages: %d (%d shared, %d mapped)\n",
+                  b->nb_pages, nb_shared, nb_mapped);
+        if (mf) {
+            eb_printf(b1, "      mapped: fd %d, %d/%d windows, %d refs\n",
+                      mf->fd, mf->nb_mapped, mf->nb_windows, mf->ref_count);
+        }
+    }
 
-    eb_printf(b1, "    save_log: %d (new_index=%d, current=%d, nb_logs=%d)\n",
-              b->save_log, b->log_new_index, b->log_current, b->nb_logs);
+    eb_printf(b1, "    save_log: %d (records=%d, current=%d, log=%lld bytes, dead=%lld)\n",
+              b->save_log, b->undo_count, b->undo_current,
+              b->log_buffer ? b->log_buffer->total_size : 0, b->undo_dead);
+    if (b->undo_journal_size) {
+        eb_printf(b1, "     journal: %lld bytes (synced=%lld)\n",
+                  b->undo_journal_size, b->undo_synced - b->undo_base);
+    }
     eb_printf(b1, "      styles: %d (cur_style=%d, bytes=%d, shift=%d)\n",
               !!b->b_styles, b->cur_style, b->style_bytes, b->style_shift);
+    if (b->b_styles) {
+        StyleMap *m = b->b_styles;
+        int i, nb_runs = 0;
+
+        for (i = 0; i < m->nb_blocks; i++)
+            nb_runs += m->blocks[i].nb_runs;
+        eb_printf(b1, "  style runs: %d (blocks=%d, size=%lld)\n",
+                  nb_runs, m->nb_blocks, (long long)m->size);
+    }
 
     if (total_size > 0) {
         u8 buf[4096];
-        int count[256];
-        int offset, c, i, col;
+        QEOffset count[256], offset;
+        int c, i, col;
         
         memset(count, 0, sizeof(count));
         for (offset = 0; offset < total_size;) {
@@ -998,7 +1033,7 @@ static void do_describe_buffer(EditState *s, int argval)
             case '\'':  c = '\''; break;
             default: c = 0; break;
             }
-            col += eb_printf(b1, " %5d", count[i]);
+            col += eb_printf(b1, " %5lld", count[i]);
 
             if (c != 0)
                 col += eb_printf(b1, "  '\\%c'", c);
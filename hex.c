@@ -34,26 +34,24 @@ static int to_disp(int c)
     return c;
 }
 
-static int hex_backward_offset(EditState *s, int offset)
+static QEOffset hex_backward_offset(EditState *s, QEOffset offset)
 {
     return align(offset, s->disp_width);
 }
 
-static int hex_display(EditState *s, DisplayState *ds, int offset)
+static QEOffset hex_display(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int j, len, ateof;
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     unsigned char b;
 
     display_bol(ds);
 
     ds->style = QE_STYLE_COMMENT;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", offset);
 
     ateof = 0;
-    len = s->b->total_size - offset;
-    if (len > s->disp_width)
-        len = s->disp_width;
+    len = (int)min_offset(s->b->total_size - offset, s->disp_width);
 
     if (s->mode == &hex_mode) {
 
@@ -245,7 +243,7 @@ void hex_write_char(EditState *s, int key)
 {
     unsigned int cur_ch, ch;
     int hsize, shift, cur_len, len, h;
-    int offset = s->offset;
+    QEOffset offset = s->offset, offset1;
     char buf[10];
 
     if (s->hex_mode) {
@@ -267,8 +265,8 @@ void hex_write_char(EditState *s, int key)
             eb_insert(s->b, offset, buf, len);
         } else {
             if (s->unihex_mode) {
-                cur_ch = eb_nextc(s->b, offset, &cur_len);
-                cur_len -= offset;
+                cur_ch = eb_nextc(s->b, offset, &offset1);
+                cur_len = (int)(offset1 - offset);
             } else {
                 eb_read(s->b, offset, buf, 1);
                 cur_ch = buf[0];
@@ -309,7 +307,7 @@ void hex_write_char(EditState *s, int key)
 static void hex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "0x%x--0x%x", s->offset, s->b->total_size);
+    buf_printf(out, "0x%llx--0x%llx", s->offset, s->b->total_size);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
 }
 
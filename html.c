@@ -671,7 +671,7 @@ static void html_move_bol_eol(EditState *s, int dir)
 
 static void html_move_bol(EditState *s)
 {
-    int offset;
+    QEOffset offset;
     offset = s->offset;
     html_move_bol_eol(s, 1);
     /* XXX: hack to allow to go back on left side */
@@ -753,8 +753,8 @@ static void html_mouse_goto(EditState *s, int x, int y)
 static void html_callback(__unused__ EditBuffer *b,
                           void *opaque, __unused__ int arg,
                           __unused__ enum LogOperation op,
-                          __unused__ int offset,
-                          __unused__ int size)
+                          __unused__ QEOffset offset,
+                          __unused__ QEOffset size)
 {
     EditState *s = opaque;
     HTMLState *hs = s->mode_data;
@@ -69,7 +69,8 @@ int qe_bitmap_format_to_pix_fmt(int format)
 }
 
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                           enum LogOperation op, int offset, int size);
+                           enum LogOperation op,
+                           QEOffset offset, QEOffset size);
 
 /* draw only the border of a rectangle */
 void fill_border(EditState *s, int x, int y, int w, int h, int color)
@@ -340,8 +341,9 @@ static void set_new_image(EditBuffer *b, ImageBuffer *ib)
     b->modified = 1;
 }
 
-static int image_buffer_save(EditBuffer *b, int start, int end,
-                             const char *filename)
+static QEOffset image_buffer_save(EditBuffer *b,
+                                  QEOffset start, QEOffset end,
+                                  const char *filename)
 {
     ByteIOContext pb1, *pb = &pb1;
     ImageBuffer *ib = b->data;
@@ -579,7 +581,8 @@ static void image_mode_close(EditState *s)
 
 /* when the image is modified, reparse it */
 static void image_callback(EditBuffer *b, void *opaque, int arg,
-                          enum LogOperation op, int offset, int size)
+                          enum LogOperation op,
+                          QEOffset offset, QEOffset size)
 {
     //    EditState *s = opaque;
 
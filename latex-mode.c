@@ -144,7 +144,8 @@ static int latex_mode_probe(ModeDef *mode, ModeProbeData *p)
 
 static void do_tex_insert_quote(EditState *s)
 {
-    int offset_bol, len, offset1;
+    QEOffset offset_bol, offset1;
+    int len;
     unsigned int buf[COLORED_MAX_LINE_SIZE];
     int pos;
 
@@ -25,10 +25,11 @@ ModeDef list_mode;
 
 static int list_get_colorized_line(EditState *s,
                                    unsigned int *buf, int buf_size,
-                                   int *offsetp, __unused__ int line_num)
+                                   QEOffset *offsetp, __unused__ int line_num)
 {
     QEmacsState *qs = s->qe_state;
-    int offset, len;
+    QEOffset offset;
+    int len;
 
     offset = *offsetp;
     len = eb_get_line(s->b, buf, buf_size, offsetp);
@@ -55,7 +56,7 @@ int list_get_pos(EditState *s)
 }
 
 /* get current offset of the line in list */
-int list_get_offset(EditState *s)
+QEOffset list_get_offset(EditState *s)
 {
     int line, col;
     eb_get_pos(s->b, &line, &col, s->offset);
@@ -64,7 +65,7 @@ int list_get_offset(EditState *s)
 
 void list_toggle_selection(EditState *s)
 {
-    int offset;
+    QEOffset offset;
     unsigned char ch;
 
     offset = list_get_offset(s);
@@ -270,16 +270,18 @@ static void org_colorize_line(unsigned int *str, int n, int mode_flags,
     *statep = colstate;
 }
 
-static int org_is_header_line(EditState *s, int offset)
+static int org_is_header_line(EditState *s, QEOffset offset)
 {
     /* Check if line starts with '*' */
     /* XXX: should ignore blocks using colorstate */
     return eb_nextc(s->b, eb_goto_bol(s->b, offset), &offset) == '*';
 }
 
-static int org_find_heading(EditState *s, int offset, int *level, int silent)
+static QEOffset org_find_heading(EditState *s, QEOffset offset,
+                                 int *level, int silent)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     offset = eb_goto_bol(s->b, offset);
     for (;;) {
@@ -303,9 +305,11 @@ static int org_find_heading(EditState *s, int offset, int *level, int silent)
     return -1;
 }
 
-static int org_next_heading(EditState *s, int offset, int target, int *level)
+static QEOffset org_next_heading(EditState *s, QEOffset offset,
+                                 int target, int *level)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     for (;;) {
         offset = eb_next_line(s->b, offset);
@@ -327,9 +331,11 @@ static int org_next_heading(EditState *s, int offset, int target, int *level)
     return offset;
 }
 
-static int org_prev_heading(EditState *s, int offset, int target, int *level)
+static QEOffset org_prev_heading(EditState *s, QEOffset offset,
+                                 int target, int *level)
 {
-    int offset1, nb, c;
+    QEOffset offset1;
+    int nb, c;
 
     for (;;) {
         if (offset == 0) {
@@ -363,7 +369,8 @@ static void do_outline_previous_vsible_heading(EditState *s)
 
 static void do_outline_up_heading(EditState *s)
 {
-    int offset, level;
+    QEOffset offset;
+    int level;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -379,7 +386,8 @@ static void do_outline_up_heading(EditState *s)
 
 static void do_org_backward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -395,7 +403,8 @@ static void do_org_backward_same_level(EditState *s)
 
 static void do_org_forward_same_level(EditState *s)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -411,7 +420,8 @@ static void do_org_forward_same_level(EditState *s)
 
 static void do_org_goto(EditState *s, const char *dest)
 {
-    int offset, level, level1, nb;
+    QEOffset offset;
+    int level, level1, nb;
     const char *p = dest;
 
     /* XXX: Should pop up a window with numbered outline index
@@ -439,7 +449,8 @@ static void do_org_goto(EditState *s, const char *dest)
 static void do_org_mark_element(EditState *s, int subtree)
 {
     QEmacsState *qs = s->qe_state;
-    int offset, offset1, level;
+    QEOffset offset, offset1;
+    int level;
 
     offset = org_find_heading(s, s->offset, &level, 0);
     if (offset < 0)
@@ -459,7 +470,8 @@ static void do_org_mark_element(EditState *s, int subtree)
 
 static void do_org_todo(EditState *s)
 {
-    int offset, offset1, bullets, kw;
+    QEOffset offset, offset1;
+    int bullets, kw;
 
     if (check_read_only(s))
         return;
@@ -489,7 +501,8 @@ static void do_org_todo(EditState *s)
 
 static void do_org_insert_heading(EditState *s, int flags)
 {
-    int offset, offset0, offset1, level = 1;
+    QEOffset offset, offset0, offset1;
+    int level = 1;
 
     if (check_read_only(s))
         return;
@@ -535,7 +548,8 @@ static void do_org_insert_heading(EditState *s, int flags)
 
 static void do_org_promote(EditState *s, int dir)
 {
-    int offset, level;
+    QEOffset offset;
+    int level;
 
     if (check_read_only(s))
         return;
@@ -557,7 +571,8 @@ static void do_org_promote(EditState *s, int dir)
 
 static void do_org_promote_subtree(EditState *s, int dir)
 {
-    int offset, level, level1;
+    QEOffset offset;
+    int level, level1;
 
     if (check_read_only(s))
         return;
@@ -586,7 +601,8 @@ static void do_org_promote_subtree(EditState *s, int dir)
 
 static void do_org_move_subtree(EditState *s, int dir)
 {
-    int offset, offset1, offset2, level, level1, level2, size;
+    QEOffset offset, offset1, offset2, size;
+    int level, level1, level2;
     EditBuffer *b1;
 
     if (check_read_only(s))
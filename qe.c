@@ -79,12 +79,29 @@ static const char *user_option;
 
 /* mode handling */
 
+static ModeDef *find_mode(const char *name)
+{
+    QEmacsState *qs = &qe_state;
+    unsigned int h = qe_hash_string(name);
+    ModeDef *m;
+    int pos = -1;
+
+    while ((m = qe_hash_next(&qs->mode_table, h, &pos)) != NULL) {
+        if (strequal(m->name, name))
+            return m;
+    }
+    return NULL;
+}
+
 void qe_register_mode(ModeDef *m)
 {
     QEmacsState *qs = &qe_state;
     ModeDef **p;
 
-    /* register mode in mode list (at end) */
+    /* register mode in mode list (at end), the first mode registered
+     * with a name is found by name */
+    if (!find_mode(m->name))
+        qe_hash_add(&qs->mode_table, qe_hash_string(m->name), m);
     p = &qs->first_mode;
     while (*p != NULL)
         p = &(*p)->next;
@@ -139,33 +156,19 @@ void mode_completion(CompleteState *cp)
     }
 }
 
-static ModeDef *find_mode(const char *name)
-{
-    QEmacsState *qs = &qe_state;
-    ModeDef *m;
-
-    for (m = qs->first_mode; m != NULL; m = m->next) {
-        if (strequal(m->name, name))
-            return m;
-    }
-    return NULL;
-}
 
 /* commands handling */
 
 CmdDef *qe_find_cmd(const char *cmd_name)
 {
     QEmacsState *qs = &qe_state;
+    unsigned int h = qe_hash_string(cmd_name);
     CmdDef *d;
+    int pos = -1;
 
-    d = qs->first_cmd;
-    while (d != NULL) {
-        while (d->name != NULL) {
-            if (strequal(cmd_name, d->name))
-                return d;
-            d++;
-        }
-        d = d->action.next;
+    while ((d = qe_hash_next(&qs->cmd_table, h, &pos)) != NULL) {
+        if (strequal(cmd_name, d->name))
+            return d;
     }
     return NULL;
 }
@@ -254,8 +257,13 @@ void qe_register_cmd_table(CmdDef *cmds, ModeDef *m)
     for (ld = &qs->first_cmd;;) {
         d = *ld;
         if (d == NULL) {
-            /* link new command table */
+            /* link new command table, index the commands not already
+             * defined by a previous table */
             *ld = cmds;
+            for (d = cmds; d->name != NULL; d++) {
+                if (!qe_find_cmd(d->name))
+                    qe_hash_add(&qs->cmd_table, qe_hash_string(d->name), d);
+            }
             break;
         }
         if (d == cmds) {
@@ -443,7 +451,8 @@ void text_move_eol(EditState *s)
 
 void word_right(EditState *s, int w)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         if (s->offset >= s->b->total_size)
@@ -457,7 +466,8 @@ void word_right(EditState *s, int w)
 
 void word_left(EditState *s, int w)
 {
-    int c, offset1;
+    QEOffset offset1;
+    int c;
 
     for (;;) {
         if (s->offset == 0)
@@ -480,11 +490,11 @@ void text_move_word_left_right(EditState *s, int dir)
     }
 }
 
-void do_mark_region(EditState *s, int mark, int offset)
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset)
 {
     /* CG: Should have local and global mark rings */
-    s->b->mark = clamp(mark, 0, s->b->total_size);
-    s->offset = clamp(offset, 0, s->b->total_size);
+    s->b->mark = clamp_offset(mark, 0, s->b->total_size);
+    s->offset = clamp_offset(offset, 0, s->b->total_size);
     /* activate region hilite */
     if (s->qe_state->hilite_region)
         s->region_style = QE_STYLE_REGION_HILITE;
@@ -492,7 +502,7 @@ void do_mark_region(EditState *s, int mark, int offset)
 
 /* paragraph handling */
 
-int eb_next_paragraph(EditBuffer *b, int offset)
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset)
 {
     int text_found;
 
@@ -513,7 +523,7 @@ int eb_next_paragraph(EditBuffer *b, int offset)
     return offset;
 }
 
-int eb_start_paragraph(EditBuffer *b, int offset)
+QEOffset eb_start_paragraph(EditBuffer *b, QEOffset offset)
 {
     for (;;) {
         offset = eb_goto_bol(b, offset);
@@ -530,15 +540,15 @@ int eb_start_paragraph(EditBuffer *b, int offset)
 
 void do_mark_paragraph(EditState *s)
 {
-    int start = eb_start_paragraph(s->b, s->offset);
-    int end = eb_next_paragraph(s->b, s->offset);
+    QEOffset start = eb_start_paragraph(s->b, s->offset);
+    QEOffset end = eb_next_paragraph(s->b, s->offset);
 
     do_mark_region(s, start, end);
 }
 
 void do_backward_paragraph(EditState *s)
 {
-    int offset;
+    QEOffset offset;
 
     offset = s->offset;
     /* skip empty lines */
@@ -567,7 +577,7 @@ void do_forward_paragraph(EditState *s)
 
 void do_kill_paragraph(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -583,11 +593,11 @@ void do_kill_paragraph(EditState *s, int dir)
 void do_fill_paragraph(EditState *s)
 {
     /* buffer offsets, byte counts */
-    int par_start, par_end, offset, offset1, chunk_start, word_start;
+    QEOffset par_start, par_end, offset, offset1, chunk_start, word_start, n;
     /* number of characters */
     int col, indent_size, word_size, space_size;
     /* other counts */
-    int n, word_count;
+    int word_count;
     /* character */
     int c;
 
@@ -671,9 +681,10 @@ void do_fill_paragraph(EditState *s)
 
 /* Upper / lower / capital case functions. Update offset, return isword */
 /* arg: -1=lower-case, +1=upper-case, +2=capital-case */
-static int eb_changecase(EditBuffer *b, int *offsetp, int arg)
+static int eb_changecase(EditBuffer *b, QEOffset *offsetp, int arg)
 {
-    int offset0, ch, ch1, len;
+    QEOffset offset0;
+    int ch, ch1, len;
     char buf[MAX_CHAR_BYTES];
 
     offset0 = *offsetp;
@@ -696,7 +707,7 @@ static int eb_changecase(EditBuffer *b, int *offsetp, int arg)
 
 void do_changecase_word(EditState *s, int arg)
 {
-    int offset;
+    QEOffset offset;
 
     word_right(s, 1);
     for (offset = s->offset;;) {
@@ -712,7 +723,7 @@ void do_changecase_word(EditState *s, int arg)
 
 void do_changecase_region(EditState *s, int arg)
 {
-    int offset;
+    QEOffset offset;
 
     /* deactivate region hilite */
     s->region_style = 0;
@@ -720,9 +731,9 @@ void do_changecase_region(EditState *s, int arg)
     /* WARNING: during case change, the region offsets can change, so
        it is not so simple ! */
     /* XXX: if last char of region changes width, offset will move */
-    offset = min(s->offset, s->b->mark);
+    offset = min_offset(s->offset, s->b->mark);
     for (;;) {
-        if (offset >= max(s->offset, s->b->mark))
+        if (offset >= max_offset(s->offset, s->b->mark))
               break;
         if (eb_changecase(s->b, &offset, arg)) {
             if (arg == 2)
@@ -736,7 +747,8 @@ void do_changecase_region(EditState *s, int arg)
 
 void do_delete_char(EditState *s, int argval)
 {
-    int endpos, i;
+    QEOffset endpos;
+    int i;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -762,7 +774,7 @@ void do_delete_char(EditState *s, int argval)
 
 void do_backspace(EditState *s, int argval)
 {
-    int offset1;
+    QEOffset offset1;
 
     if (s->b->flags & BF_READONLY) {
         /* CG: could scroll down */
@@ -803,7 +815,7 @@ typedef struct {
     int linec;
     int yc;
     int xc;
-    int offsetc;
+    QEOffset offsetc;
     DirType basec; /* direction of the line */
     DirType dirc; /* direction of the char under the cursor */
     int cursor_width; /* can be negative depending on char orientation */
@@ -811,7 +823,7 @@ typedef struct {
 } CursorContext;
 
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, __unused__ int hex_mode)
 {
     CursorContext *m = ds->cursor_opaque;
@@ -825,7 +837,7 @@ int cursor_func(DisplayState *ds,
         m->cursor_height = h;
         m->linec = line_num;
 #if 0
-        printf("cursor_func: xc=%d yc=%d linec=%d offset: %d<=%d<%d\n",
+        printf("cursor_func: xc=%d yc=%d linec=%d offset: %lld<=%lld<%lld\n",
                m->xc, m->yc, m->linec, offset1, m->offsetc, offset2);
 #endif
         return -1;
@@ -851,12 +863,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
 } MoveContext;
 
 /* called each time the cursor could be displayed */
 static int down_cursor_func(DisplayState *ds,
-                            int offset1, __unused__ int offset2, int line_num,
+                            QEOffset offset1, __unused__ QEOffset offset2,
+                            int line_num,
                             int x, __unused__ int y,
                             __unused__ int w, __unused__ int h,
                             __unused__ int hex_mode)
@@ -914,7 +927,7 @@ void text_move_up_down(EditState *s, int dir)
     if (dir < 0) {
         /* difficult case: we need to go backward on displayed text */
         while (cm.linec <= 0) {
-            int offset_top = s->offset_top;
+            QEOffset offset_top = s->offset_top;
 
             if (offset_top <= 0)
                 return;
@@ -947,14 +960,14 @@ void text_move_up_down(EditState *s, int dir)
 
 typedef struct {
     int y_found;
-    int offset_found;
+    QEOffset offset_found;
     int dir;
-    int offsetc;
+    QEOffset offsetc;
 } ScrollContext;
 
 /* called each time the cursor could be displayed */
 static int scroll_cursor_func(DisplayState *ds,
-                              int offset1, int offset2,
+                              QEOffset offset1, QEOffset offset2,
                               __unused__ int line_num,
                               __unused__ int x, int y,
                               __unused__ int w, int h,
@@ -1017,7 +1030,7 @@ void perform_scroll_up_down(EditState *s, int h)
     if (s->y_disp > 0) {
         display_init(ds, s, DISP_CURSOR_SCREEN);
         do {
-            int offset_top = s->offset_top;
+            QEOffset offset_top = s->offset_top;
 
             if (offset_top <= 0) {
                 /* cannot go back: we stay at the top of the screen and
@@ -1088,13 +1101,13 @@ typedef struct {
     int yd;
     int xd;
     int xdmin;
-    int offsetd;
+    QEOffset offsetd;
     int dir;
     int after_found;
 } LeftRightMoveContext;
 
 static int left_right_cursor_func(DisplayState *ds,
-                                  int offset1, __unused__ int offset2,
+                                  QEOffset offset1, __unused__ QEOffset offset2,
                                   int line_num,
                                   int x, __unused__ int y,
                                   __unused__ int w, __unused__ int h,
@@ -1164,7 +1177,7 @@ void text_move_left_right_visual(EditState *s, int dir)
             } else {
                 /* no suitable position found: go to previous line */
                 if (yc <= 0) {
-                    int offset_top = s->offset_top;
+                    QEOffset offset_top = s->offset_top;
 
                     if (offset_top <= 0)
                         break;
@@ -1192,7 +1205,7 @@ typedef struct {
     int xd;
     int dy_min;
     int dx_min;
-    int offset_found;
+    QEOffset offset_found;
     int hex_mode;
 } MouseGotoContext;
 
@@ -1210,7 +1223,7 @@ static int seg_dist(int x, int x1, int x2)
 /* XXX: would need two passes in the general case (first search line,
    then colunm */
 static int mouse_goto_func(DisplayState *ds,
-                           int offset1, __unused__ int offset2,
+                           QEOffset offset1, __unused__ QEOffset offset2,
                            __unused__ int line_num,
                            int x, int y, int w, int h, int hex_mode)
 {
@@ -1293,7 +1306,8 @@ void do_char(EditState *s, int key, int argval)
 #ifdef CONFIG_UNICODE_JOIN
 void do_combine_char(EditState *s, int accent)
 {
-    int offset0, len, c;
+    QEOffset offset0;
+    int len, c;
     unsigned int g[2];
     char buf[MAX_CHAR_BYTES];
 
@@ -1318,7 +1332,8 @@ void do_combine_char(EditState *s, int accent)
 
 void text_write_char(EditState *s, int key)
 {
-    int cur_ch, len, cur_len, offset1, ret, insert;
+    QEOffset offset1;
+    int cur_ch, len, cur_len, ret, insert;
     char buf[MAX_CHAR_BYTES];
 
     if (check_read_only(s))
@@ -1330,13 +1345,14 @@ void text_write_char(EditState *s, int key)
     s->region_style = 0;
 
     cur_ch = eb_nextc(s->b, s->offset, &offset1);
-    cur_len = offset1 - s->offset;
+    cur_len = (int)(offset1 - s->offset);
     len = eb_encode_uchar(s->b, buf, key);
     insert = (s->insert || cur_ch == '\n');
 
     if (insert) {
         const InputMethod *m;
-        int match_buf[20], match_len, offset, i;
+        int match_buf[20], match_len, i;
+        QEOffset offset;
 
         /* use compose system only if insert mode */
         if (s->compose_len == 0)
@@ -1450,8 +1466,8 @@ void do_tab(EditState *s, int argval)
     if (s->indent_tabs_mode) {
         do_char(s, 9, argval);
     } else {
-        int offset = s->offset;
-        int offset0 = eb_goto_bol(s->b, offset);
+        QEOffset offset = s->offset;
+        QEOffset offset0 = eb_goto_bol(s->b, offset);
         int col = 0;
         int tw = s->b->tab_width > 0 ? s->b->tab_width : 8;
         int indent = s->indent_size > 0 ? s->indent_size : tw;
@@ -1546,10 +1562,10 @@ void do_append_next_kill(__unused__ EditState *s)
     /* do nothing! */
 }
 
-void do_kill(EditState *s, int p1, int p2, int dir)
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir)
 {
     QEmacsState *qs = s->qe_state;
-    int len, tmp;
+    QEOffset len, tmp;
     EditBuffer *b;
 
     /* deactivate region hilite */
@@ -1588,7 +1604,7 @@ void do_kill_region(EditState *s, int killtype)
 
 void do_kill_line(EditState *s, int dir)
 {
-    int p1, p2, offset1;
+    QEOffset p1, p2, offset1;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -1614,7 +1630,7 @@ void do_kill_line(EditState *s, int dir)
 
 void do_kill_word(EditState *s, int dir)
 {
-    int start = s->offset;
+    QEOffset start = s->offset;
 
     if (s->b->flags & BF_READONLY)
         return;
@@ -1625,7 +1641,7 @@ void do_kill_word(EditState *s, int dir)
 
 void do_yank(EditState *s)
 {
-    int size;
+    QEOffset size;
     QEmacsState *qs = s->qe_state;
     EditBuffer *b;
 
@@ -1669,7 +1685,7 @@ void do_yank_pop(EditState *s)
 
 void do_exchange_point_and_mark(EditState *s)
 {
-    int tmp;
+    QEOffset tmp;
 
     tmp = s->b->mark;
     s->b->mark = s->offset;
@@ -1915,9 +1931,9 @@ void do_convert_buffer_file_coding_system(EditState *s,
     QECharset *charset;
     EOLType eol_type;
     EditBuffer *b1, *b;
-    int offset, c, len, i;
+    QEOffset offset, pos[32];
+    int c, len, i;
     EditBufferCallbackList *cb;
-    int pos[32];
     char buf[MAX_CHAR_BYTES];
 
     eol_type = s->b->eol_type;
@@ -1934,7 +1950,7 @@ void do_convert_buffer_file_coding_system(EditState *s,
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            pos[i] = eb_get_char_offset(b, *(int*)cb->opaque);
+            pos[i] = eb_get_char_offset(b, *(QEOffset*)cb->opaque);
             i++;
         }
     }
@@ -1949,7 +1965,7 @@ void do_convert_buffer_file_coding_system(EditState *s,
 
     /* replace current buffer with conversion */
     /* quick hack to transfer styles from tmp buffer to b */
-    eb_free(&b->b_styles);
+    style_map_free(&b->b_styles);
     eb_delete(b, 0, b->total_size);
     eb_set_charset(b, charset, eol_type);
     eb_insert_buffer(b, 0, b1, 0, b1->total_size);
@@ -1960,14 +1976,14 @@ void do_convert_buffer_file_coding_system(EditState *s,
     cb = b->first_callback;
     for (i = 0; i < countof(pos) && cb; cb = cb->next) {
         if (cb->callback == eb_offset_callback) {
-            *(int*)cb->opaque = eb_goto_char(b, pos[i]);
+            *(QEOffset*)cb->opaque = eb_goto_char(b, pos[i]);
             i++;
         }
     }
 
     eb_free(&b1);
 
-    put_status(s, "Buffer charset is now %s, %d bytes",
+    put_status(s, "Buffer charset is now %s, %lld bytes",
                s->b->charset->name, b->total_size);
 }
 
@@ -2007,7 +2023,8 @@ void do_word_wrap(EditState *s)
 void do_goto(EditState *s, const char *str, int unit)
 {
     const char *p;
-    int pos, line, col, rel;
+    QEOffset pos;
+    int line, col, rel;
 
     /* Update s->offset from str specification:
      * optional +- for relative moves
@@ -2019,7 +2036,7 @@ void do_goto(EditState *s, const char *str, int unit)
      * CG: XXX: resulting offset may fall inside a character.
      */
     rel = (*str == '+' || *str == '-');
-    pos = strtol(str, (char**)&p, 0);
+    pos = strtoll(str, (char**)&p, 0);
 
     /* skip space required to separate hex offset from b or c suffix */
     if (*p == ' ')
@@ -2033,29 +2050,28 @@ void do_goto(EditState *s, const char *str, int unit)
             goto error;
         if (rel)
             pos += s->offset;
-        s->offset = clamp(pos, 0, s->b->total_size);
+        s->offset = clamp_offset(pos, 0, s->b->total_size);
         return;
     case 'c':
         if (*p)
             goto error;
         if (rel)
             pos += eb_get_char_offset(s->b, s->offset);
-        s->offset = eb_goto_char(s->b, max(0, pos));
+        s->offset = eb_goto_char(s->b, max_offset(0, pos));
         return;
     case '%':
-        /* CG: should not require long long for this */
-        pos = pos * (long long)s->b->total_size / 100;
+        pos = pos * s->b->total_size / 100;
         if (rel)
             pos += s->offset;
-        eb_get_pos(s->b, &line, &col, clamp(pos, 0, s->b->total_size));
+        eb_get_pos(s->b, &line, &col, clamp_offset(pos, 0, s->b->total_size));
         line += (col > 0);
         goto getcol;
 
     case 'l':
-        line = pos - 1;
+        line = (int)clamp_offset(pos - 1, -1, INT_MAX);
         if (rel || pos == 0) {
             eb_get_pos(s->b, &line, &col, s->offset);
-            line += pos;
+            line = (int)clamp_offset(line + pos, 0, INT_MAX);
         }
     getcol:
         col = 0;
@@ -2095,7 +2111,8 @@ void do_what_cursor_position(EditState *s)
     buf_t outbuf, *out;
     unsigned char cc;
     int line_num, col_num;
-    int c, c2, offset1, offset2, off;
+    int c, c2;
+    QEOffset offset1, offset2, off;
 
     out = buf_init(&outbuf, buf, sizeof(buf));
     if (s->offset < s->b->total_size) {
@@ -2139,9 +2156,9 @@ void do_what_cursor_position(EditState *s)
         }
     }
     eb_get_pos(s->b, &line_num, &col_num, s->offset);
-    put_status(s, "%s  point=%d mark=%d size=%d region=%d col=%d",
+    put_status(s, "%s  point=%lld mark=%lld size=%lld region=%lld col=%d",
                out->buf, s->offset, s->b->mark, s->b->total_size,
-               abs(s->offset - s->b->mark), col_num);
+               llabs(s->offset - s->b->mark), col_num);
 }
 
 void do_set_tab_width(EditState *s, int tab_width)
@@ -2190,6 +2207,8 @@ void basic_mode_line(EditState *s, buf_t *out, int c1)
         buf_printf(out, " Ovwrt");
     if (s->interactive)
         buf_printf(out, " Interactive");
+    if (s->b->flags & BF_LOADING)
+        buf_printf(out, " Loading %d%%", eb_load_percent(s->b));
     buf_printf(out, ")--");
 }
 
@@ -2340,13 +2359,23 @@ void style_completion(CompleteState *cp)
     }
 }
 
+static QEHashTable style_table;
+
 QEStyleDef *find_style(const char *name)
 {
-    int i;
+    unsigned int h;
+    int i, pos = -1;
     QEStyleDef *style;
 
-    style = qe_styles;
-    for (i = 0; i < QE_STYLE_NB; i++, style++) {
+    if (!style_table.size) {
+        /* index the styles upon first use */
+        for (i = 0; i < QE_STYLE_NB; i++) {
+            qe_hash_add(&style_table, qe_hash_string(qe_styles[i].name),
+                        &qe_styles[i]);
+        }
+    }
+    h = qe_hash_string(name);
+    while ((style = qe_hash_next(&style_table, h, &pos)) != NULL) {
         if (strequal(style->name, name))
             return style;
     }
@@ -2616,7 +2645,7 @@ static unsigned int compute_crc(const void *p, int size, unsigned int sum)
 
 static void flush_line(DisplayState *s,
                        TextFragment *fragments, int nb_fragments,
-                       int offset1, int offset2, int last)
+                       QEOffset offset1, QEOffset offset2, int last)
 {
     EditState *e = s->edit_state;
     QEditScreen *screen = e->screen;
@@ -2787,7 +2816,8 @@ static void flush_line(DisplayState *s,
         }
 
         for (i = 0; i < nb_fragments; i++) {
-            int w, k, j, _offset1, _offset2;
+            QEOffset _offset1, _offset2;
+            int w, k, j;
 
             frag = &fragments[i];
 
@@ -2908,7 +2938,7 @@ static void flush_fragment(DisplayState *s)
         j++;
     }
     for (i = 0; i < s->fragment_index; i++) {
-        int offset1, offset2;
+        QEOffset offset1, offset2;
         j = s->line_index + char_to_glyph_pos[i];
         offset1 = s->fragment_offsets[i][0];
         offset2 = s->fragment_offsets[i][1];
@@ -3050,19 +3080,44 @@ static void flush_fragment(DisplayState *s)
     s->fragment_index = 0;
 }
 
-int display_char_bidir(DisplayState *s, int offset1, int offset2,
+/* Return the index of the match containing 'offset', -1 if none */
+static int find_match_range(const MatchRange *matches, int nb_matches,
+                            QEOffset offset)
+{
+    int lo = 0, hi = nb_matches;
+
+    /* first match ending after offset: ends are sorted too */
+    while (lo < hi) {
+        int mid = (lo + hi) >> 1;
+        if (matches[mid].end <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < nb_matches && matches[lo].start <= offset)
+        return lo;
+    return -1;
+}
+
+int display_char_bidir(DisplayState *s, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch)
 {
     int space, style, istab;
     EditState *e;
 
     style = s->style;
+    e = s->edit_state;
+
+    /* highlight search matches */
+    if (e->nb_hilite_matches && offset1 >= 0
+    &&  find_match_range(e->hilite_matches, e->nb_hilite_matches, offset1) >= 0) {
+        style = QE_STYLE_SEARCH_HILITE;
+    }
 
     /* special code to colorize block */
-    e = s->edit_state;
     if (e->show_selection || e->region_style) {
-        int mark = e->b->mark;
-        int offset = e->offset;
+        QEOffset mark = e->b->mark;
+        QEOffset offset = e->offset;
 
         if ((offset1 >= offset && offset1 < mark) ||
             (offset1 >= mark && offset1 < offset))
@@ -3105,7 +3160,7 @@ int display_char_bidir(DisplayState *s, int offset1, int offset2,
     return 0;
 }
 
-void display_printhex(DisplayState *s, int offset1, int offset2,
+void display_printhex(DisplayState *s, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n)
 {
     int i, v;
@@ -3128,7 +3183,7 @@ void display_printhex(DisplayState *s, int offset1, int offset2,
     s->cur_hex_mode = 0;
 }
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...)
 {
     char buf[256], *p;
@@ -3148,7 +3203,7 @@ void display_printf(DisplayState *ds, int offset1, int offset2,
 }
 
 /* end of line */
-void display_eol(DisplayState *s, int offset1, int offset2)
+void display_eol(DisplayState *s, QEOffset offset1, QEOffset offset2)
 {
     flush_fragment(s);
 
@@ -3160,7 +3215,7 @@ void display_eol(DisplayState *s, int offset1, int offset2)
 static void display1(DisplayState *s)
 {
     EditState *e = s->edit_state;
-    int offset;
+    QEOffset offset;
 
     s->eod = 0;
     offset = e->offset_top;
@@ -3189,7 +3244,7 @@ static void display1(DisplayState *s)
 }
 
 /******************************************************/
-int text_backward_offset(EditState *s, int offset)
+QEOffset text_backward_offset(EditState *s, QEOffset offset)
 {
     int line, col;
 
@@ -3199,13 +3254,14 @@ int text_backward_offset(EditState *s, int offset)
 }
 
 #ifdef CONFIG_UNICODE_JOIN
-/* max_size should be >= 2 */
+/* max_size should be >= 2. Link positions are relative to 'offset' */
 static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
-                                    EditBuffer *b, int offset)
+                                    EditBuffer *b, QEOffset offset)
 {
     TypeLink *p;
     FriBidiCharType type, ltype;
-    int left, offset1;
+    QEOffset start, offset1;
+    int left;
     unsigned int c;
 
     p = list_tab;
@@ -3218,6 +3274,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 
     ltype = FRIBIDI_TYPE_SOT;
 
+    start = offset;
     for (;;) {
         offset1 = offset;
         c = eb_nextc(b, offset, &offset);
@@ -3227,7 +3284,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
         /* if not enough room, increment last link */
         if (type != ltype && left > 0) {
             p->type = type;
-            p->pos = offset1;
+            p->pos = (int)(offset1 - start);
             p->len = 1;
             p++;
             left--;
@@ -3240,7 +3297,7 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
     /* Add the ending link */
     p->type = FRIBIDI_TYPE_EOT;
     p->len = 0;
-    p->pos = offset1;
+    p->pos = (int)(offset1 - start);
     p++;
 
     return p - list_tab;
@@ -3254,92 +3311,283 @@ static int bidir_compute_attributes(TypeLink *list_tab, int max_size,
 /* NOTE: only one colorization mode can be selected at a time for a
    buffer */
 
-/* Gets the colorized line beginning at 'offset'. Its length
-   excluding '\n' is returned */
+/* The colorizer states are kept with the buffer, one cache for each
+ * colorize function and mode flags, so the windows showing a buffer
+ * share them.  After a modification, the states of the lines that
+ * follow the modified range are kept as candidates: relexing stops
+ * at the first line whose state matches its candidate.  An idle timer
+ * computes the states of the whole buffer ahead of the display.
+ */
 
 #define COLORIZED_LINE_PREALLOC_SIZE 64
+#define COLORIZE_IDLE_DELAY  200    /* ms of inactivity before starting */
+#define COLORIZE_IDLE_SLICE  10     /* ms per time slice */
 
-int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                               int *offsetp, int line_num)
+static int colorize_cache_alloc(ColorizeCache *c, int n)
 {
-    int len, l, line, col, offset, bom;
-    int colorize_state;
+    int nb_alloc;
 
-    /* invalidate cache if needed */
-    if (s->colorize_max_valid_offset != INT_MAX) {
-        eb_get_pos(s->b, &line, &col, s->colorize_max_valid_offset);
-        line++;
-        if (line < s->colorize_nb_valid_lines)
-            s->colorize_nb_valid_lines = line;
-        s->colorize_max_valid_offset = INT_MAX;
+    if (n > c->nb_alloc) {
+        nb_alloc = max(n + COLORIZED_LINE_PREALLOC_SIZE,
+                       c->nb_alloc + (c->nb_alloc >> 1));
+        if (!qe_realloc(&c->states, nb_alloc * sizeof(*c->states)))
+            return 0;
+        c->nb_alloc = nb_alloc;
     }
+    return 1;
+}
 
-    /* realloc line buffer if needed */
-    if ((line_num + 2) > s->colorize_nb_lines) {
-        s->colorize_nb_lines = line_num + 2 + COLORIZED_LINE_PREALLOC_SIZE;
-        if (!qe_realloc(&s->colorize_states,
-                        s->colorize_nb_lines * sizeof(*s->colorize_states))) {
-            return 0;
-        }
+/* track the modified range */
+static void colorize_callback(__unused__ EditBuffer *b,
+                              void *opaque, __unused__ int arg,
+                              enum LogOperation op,
+                              QEOffset offset, QEOffset size)
+{
+    ColorizeCache *c = opaque;
+
+    if (c->dirty_start == LLONG_MAX) {
+        c->dirty_start = c->dirty_end = offset;
+    } else {
+        c->dirty_start = min_offset(c->dirty_start, offset);
+    }
+    switch (op) {
+    case LOGOP_INSERT:
+        if (c->dirty_end >= offset)
+            c->dirty_end += size;
+        c->dirty_end = max_offset(c->dirty_end, offset + size);
+        break;
+    case LOGOP_DELETE:
+        if (c->dirty_end > offset + size)
+            c->dirty_end -= size;
+        else
+            c->dirty_end = offset;
+        break;
+    default:
+        c->dirty_end = max_offset(c->dirty_end, offset + size);
+        break;
     }
+}
 
-    /* propagate state if needed */
-    if (line_num >= s->colorize_nb_valid_lines) {
-        if (s->colorize_nb_valid_lines == 0) {
-            s->colorize_states[0] = 0; /* initial state : zero */
-            s->colorize_nb_valid_lines = 1;
-        }
-        offset = eb_goto_pos(s->b, s->colorize_nb_valid_lines - 1, 0);
-        colorize_state = s->colorize_states[s->colorize_nb_valid_lines - 1];
+/* invalidate the states after the modified range, keep the states
+ * of the unchanged lines that follow it as candidates.
+ */
+static void colorize_cache_update(ColorizeCache *c)
+{
+    EditBuffer *b = c->b;
+    int line_start, line_end, nb_lines, col, delta, cand_start, cand_end;
+
+    if (c->dirty_start == LLONG_MAX)
+        return;
+
+    eb_get_pos(b, &line_start, &col, min_offset(c->dirty_start, b->total_size));
+    eb_get_pos(b, &line_end, &col, min_offset(c->dirty_end, b->total_size));
+    eb_get_pos(b, &nb_lines, &col, b->total_size);
+    c->dirty_start = LLONG_MAX;
+    delta = nb_lines - c->nb_lines;
+    c->nb_lines = nb_lines;
+
+    /* line_end + 1 - delta is the first unchanged line in the old
+     * numbering */
+    cand_start = line_end + 1 - delta;
+    if (cand_start < c->nb_valid_lines) {
+        cand_end = c->nb_valid_lines;
+    } else {
+        cand_start = max(cand_start, c->cand_start);
+        cand_end = c->cand_end;
+    }
+    c->nb_valid_lines = min(c->nb_valid_lines, line_start + 1);
+    c->cand_start = c->cand_end = 0;
+    if (cand_start < cand_end
+    &&  colorize_cache_alloc(c, cand_end + delta)) {
+        memmove(c->states + cand_start + delta, c->states + cand_start,
+                (cand_end - cand_start) * sizeof(*c->states));
+        c->cand_start = cand_start + delta;
+        c->cand_end = cand_end + delta;
+    }
+}
+
+/* store the state before line 'line', the states before it are valid */
+static void colorize_cache_store(ColorizeCache *c, int line, int state)
+{
+    if (line < c->nb_valid_lines || !colorize_cache_alloc(c, line + 1))
+        return;
+
+    if (line >= c->cand_start && line < c->cand_end
+    &&  c->states[line] == (unsigned short)state) {
+        /* same state as before the modification: so are the next ones */
+        c->nb_valid_lines = c->cand_end;
+        c->cand_start = c->cand_end = 0;
+    } else {
+        c->states[line] = state;
+        c->nb_valid_lines = line + 1;
+        if (c->cand_start <= line)
+            c->cand_start = line + 1;
+    }
+}
+
+/* compute the states up to line 'line_num', return false if out of
+ * memory or interrupted after a time slice if 'sliced' is true.
+ */
+static int colorize_cache_propagate(ColorizeCache *c,
+                                    unsigned int *buf, int buf_size,
+                                    int line_num, int sliced)
+{
+    QEOffset offset = 0;
+    int line, len, bom, state, start_time = 0;
 
-        for (l = s->colorize_nb_valid_lines; l <= line_num; l++) {
-            len = eb_get_line(s->b, buf, buf_size, &offset);
-            bom = (len > 0 && buf[0] == 0xFEFF);
-            s->colorize_func(buf + bom, len - bom, s->mode_flags,
-                             &colorize_state, 1);
-            s->colorize_states[l] = colorize_state;
+    colorize_cache_update(c);
+    if (line_num < c->nb_valid_lines)
+        return 1;
+    if (!colorize_cache_alloc(c, line_num + 2))
+        return 0;
+
+    if (c->nb_valid_lines == 0) {
+        c->states[0] = 0; /* initial state : zero */
+        c->nb_valid_lines = 1;
+    }
+    if (sliced)
+        start_time = get_clock_ms();
+    line = -1;
+    while (line_num >= c->nb_valid_lines) {
+        if (line != c->nb_valid_lines - 1) {
+            line = c->nb_valid_lines - 1;
+            offset = eb_goto_pos(c->b, line, 0);
+        }
+        state = c->states[line];
+        len = eb_get_line(c->b, buf, buf_size, &offset);
+        bom = (len > 0 && buf[0] == 0xFEFF);
+        c->colorize_func(buf + bom, len - bom, c->mode_flags, &state, 1);
+        colorize_cache_store(c, ++line, state);
+        if (sliced && (line & 63) == 0
+        &&  (get_clock_ms() - start_time >= COLORIZE_IDLE_SLICE
+        ||   is_user_input_pending())) {
+            return line_num < c->nb_valid_lines;
         }
     }
+    return 1;
+}
 
-    /* compute line color */
-    colorize_state = s->colorize_states[line_num];
-    len = eb_get_line(s->b, buf, buf_size, offsetp);
-    bom = (len > 0 && buf[0] == 0xFEFF);
-    s->colorize_func(buf + bom, len - bom, s->mode_flags, &colorize_state, 0);
+static void colorize_idle_cb(void *opaque)
+{
+    ColorizeCache *c = opaque;
+    unsigned int buf[COLORED_MAX_LINE_SIZE];
 
-    /* XXX: if state is same as previous, minimize invalid region? */
-    s->colorize_states[line_num + 1] = colorize_state;
+    c->idle_timer = NULL;
+    colorize_cache_update(c);
+    if (!colorize_cache_propagate(c, buf, countof(buf), c->nb_lines, 1)
+    &&  c->nb_alloc > c->nb_lines) {
+        c->idle_timer = qe_add_timer(is_user_input_pending() ?
+                                     COLORIZE_IDLE_DELAY : 0,
+                                     c, colorize_idle_cb);
+    }
+}
 
-    s->colorize_nb_valid_lines = line_num + 2;
-    return len;
+static void colorize_cache_free(ColorizeCache **cp)
+{
+    ColorizeCache *c = *cp;
+    ColorizeCache **pc;
+
+    if (c) {
+        for (pc = &c->b->colorize_caches; *pc != c; pc = &(*pc)->next)
+            continue;
+        *pc = c->next;
+        eb_free_callback(c->b, colorize_callback, c);
+        qe_kill_timer(&c->idle_timer);
+        qe_free(&c->states);
+        qe_free(cp);
+    }
 }
 
-/* invalidate the colorize data */
-static void colorize_callback(__unused__ EditBuffer *b,
-                              void *opaque, __unused__ int arg,
-                              __unused__ enum LogOperation op,
-                              int offset,
-                              __unused__ int size)
+/* find or create the states of the buffer for the window colorizer */
+static ColorizeCache *colorize_cache_get(EditState *s)
 {
-    EditState *e = opaque;
+    ColorizeCache *c = s->colorize_cache;
+    int col;
 
-    if (offset < e->colorize_max_valid_offset)
-        e->colorize_max_valid_offset = offset;
+    if (c && c->b == s->b && c->colorize_func == s->colorize_func
+    &&  c->mode_flags == s->mode_flags) {
+        return c;
+    }
+    if (c && --c->ref_count == 0)
+        colorize_cache_free(&c);
+    s->colorize_cache = NULL;
+
+    for (c = s->b->colorize_caches; c != NULL; c = c->next) {
+        if (c->colorize_func == s->colorize_func
+        &&  c->mode_flags == s->mode_flags)
+            break;
+    }
+    if (!c) {
+        c = qe_mallocz(ColorizeCache);
+        if (!c)
+            return NULL;
+        c->b = s->b;
+        c->colorize_func = s->colorize_func;
+        c->mode_flags = s->mode_flags;
+        c->dirty_start = LLONG_MAX;
+        eb_get_pos(s->b, &c->nb_lines, &col, s->b->total_size);
+        if (eb_add_callback(s->b, colorize_callback, c, 0) < 0) {
+            qe_free(&c);
+            return NULL;
+        }
+        c->next = s->b->colorize_caches;
+        s->b->colorize_caches = c;
+    }
+    c->ref_count++;
+    s->colorize_cache = c;
+    return c;
+}
+
+/* called when the buffer is freed */
+void eb_free_colorize_caches(EditBuffer *b)
+{
+    QEmacsState *qs = &qe_state;
+    EditState *e;
+
+    for (e = qs->first_window; e != NULL; e = e->next_window) {
+        if (e->colorize_cache && e->colorize_cache->b == b)
+            e->colorize_cache = NULL;
+    }
+    while (b->colorize_caches)
+        colorize_cache_free(&b->colorize_caches);
+}
+
+/* Gets the colorized line beginning at 'offset'. Its length
+   excluding '\n' is returned */
+int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
+                               QEOffset *offsetp, int line_num)
+{
+    ColorizeCache *c;
+    int len, bom;
+    int colorize_state;
+
+    c = colorize_cache_get(s);
+    if (!c || !colorize_cache_propagate(c, buf, buf_size, line_num, 0))
+        return eb_get_line(s->b, buf, buf_size, offsetp);
+
+    /* compute line color */
+    colorize_state = c->states[line_num];
+    len = eb_get_line(s->b, buf, buf_size, offsetp);
+    bom = (len > 0 && buf[0] == 0xFEFF);
+    c->colorize_func(buf + bom, len - bom, c->mode_flags, &colorize_state, 0);
+    colorize_cache_store(c, line_num + 1, colorize_state);
+
+    /* colorize the rest of the buffer when idle */
+    if (!c->idle_timer && c->nb_valid_lines <= c->nb_lines)
+        c->idle_timer = qe_add_timer(COLORIZE_IDLE_DELAY, c, colorize_idle_cb);
+    return len;
 }
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
 {
-    /* invalidate the previous states & free previous colorizer */
-    eb_free_callback(s->b, colorize_callback, s);
-    qe_free(&s->colorize_states);
-    s->colorize_nb_lines = 0;
-    s->colorize_nb_valid_lines = 0;
-    s->colorize_max_valid_offset = INT_MAX;
+    /* release the previous states & free previous colorizer */
+    if (s->colorize_cache && --s->colorize_cache->ref_count == 0)
+        colorize_cache_free(&s->colorize_cache);
+    s->colorize_cache = NULL;
     s->get_colorized_line = get_non_colorized_line;
     s->colorize_func = NULL;
 
     if (colorize_func) {
-        eb_add_callback(s->b, colorize_callback, s, 0);
         s->get_colorized_line = generic_get_colorized_line;
         s->colorize_func = colorize_func;
     }
@@ -3352,36 +3600,20 @@ void set_colorize_func(EditState *s, ColorizeFunc colorize_func)
     s->get_colorized_line = get_non_colorized_line;
 }
 
+void eb_free_colorize_caches(EditBuffer *b)
+{
+}
+
 #endif /* CONFIG_TINY */
 
 int get_staticly_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                                int *offset_ptr, int line_num)
+                                QEOffset *offset_ptr, int line_num)
 {
-    EditBuffer *b = s->b;
-    unsigned int *buf_ptr, *buf_end;
-    int c, offset;
-
-    offset = *offset_ptr;
-
-    buf_ptr = buf;
-    buf_end = buf + buf_size - 1;
-    b->cur_style = 0;
-    for (;;) {
-        c = eb_nextc(b, offset, &offset);
-        if (c == '\n')
-            break;
-        if (buf_ptr < buf_end) {
-            c |= b->cur_style << STYLE_SHIFT;
-            *buf_ptr++ = c;
-        }
-    }
-    *buf_ptr = '\0';
-    *offset_ptr = offset;
-    return buf_ptr - buf;
+    return eb_get_styled_line(s->b, buf, buf_size, offset_ptr);
 }
 
 int get_non_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                           int *offsetp, int line_num)
+                           QEOffset *offsetp, int line_num)
 {
     if (s->b->b_styles) {
         return get_staticly_colorized_line(s, buf, buf_size, offsetp, line_num);
@@ -3392,10 +3624,10 @@ int get_non_colorized_line(EditState *s, unsigned int *buf, int buf_size,
 
 #define RLE_EMBEDDINGS_SIZE    128
 
-int text_display(EditState *s, DisplayState *ds, int offset)
+QEOffset text_display(EditState *s, DisplayState *ds, QEOffset offset)
 {
-    int c;
-    int offset0, offset1, line_num, col_num;
+    QEOffset offset0, offset1;
+    int c, line_num, col_num, line_known;
     TypeLink embeds[RLE_EMBEDDINGS_SIZE], *bd;
     int embedding_level, embedding_max_level;
     FriBidiCharType base;
@@ -3403,10 +3635,18 @@ int text_display(EditState *s, DisplayState *ds, int offset)
     int char_index, colored_nb_chars;
 
     line_num = 0;
+    line_known = 0;
     /* XXX: should test a flag, to avoid this call in hex/binary */
     if (s->line_numbers || s->get_colorized_line != get_non_colorized_line) {
-        eb_get_pos(s->b, &line_num, &col_num, offset);
+        if (offset == s->line_cache_offset
+        &&  s->b->version == s->line_cache_version) {
+            line_num = s->line_cache_num;
+        } else {
+            eb_get_pos(s->b, &line_num, &col_num, offset);
+        }
+        line_known = 1;
     }
+    s->line_cache_version = 0;
 
     offset1 = offset;
 
@@ -3465,24 +3705,25 @@ int text_display(EditState *s, DisplayState *ds, int offset)
     if (s->curline_style || s->region_style) {
         /* CG: Should combine styles instead of replacing */
         if (s->region_style) {
-            int line, start, stop;
+            QEOffset start, stop;
+            int line, col1, col2;
 
             if (s->b->mark < s->offset) {
-                start = max(offset, s->b->mark);
-                stop = min(offset0, s->offset);
+                start = max_offset(offset, s->b->mark);
+                stop = min_offset(offset0, s->offset);
             } else {
-                start = max(offset, s->offset);
-                stop = min(offset0, s->b->mark);
+                start = max_offset(offset, s->offset);
+                stop = min_offset(offset0, s->b->mark);
             }
             if (start < stop) {
                 /* Compute character positions */
-                eb_get_pos(s->b, &line, &start, start);
+                eb_get_pos(s->b, &line, &col1, start);
                 if (stop >= offset0)
-                    stop = colored_nb_chars;
+                    col2 = colored_nb_chars;
                 else
-                    eb_get_pos(s->b, &line, &stop, stop);
-                clear_color(colored_chars + start, stop - start);
-                set_color(colored_chars + start, colored_chars + stop,
+                    eb_get_pos(s->b, &line, &col2, stop);
+                clear_color(colored_chars + col1, col2 - col1);
+                set_color(colored_chars + col1, colored_chars + col2,
                           s->region_style);
             }
         } else
@@ -3513,10 +3754,16 @@ int text_display(EditState *s, DisplayState *ds, int offset)
             c = eb_nextc(s->b, offset, &offset);
             if (c == '\n') {
                 display_eol(ds, offset0, offset);
+                if (line_known) {
+                    /* next line is likely displayed next */
+                    s->line_cache_offset = offset;
+                    s->line_cache_num = line_num + 1;
+                    s->line_cache_version = s->b->version;
+                }
                 break;
             }
             /* compute embedding from RLE embedding list */
-            if (offset0 >= bd[1].pos)
+            if (offset0 - offset1 >= bd[1].pos)
                 bd++;
             embedding_level = bd[0].level;
             /* XXX: use embedding level for all cases ? */
@@ -3545,7 +3792,8 @@ static void generic_text_display(EditState *s)
 {
     CursorContext m1, *m = &m1;
     DisplayState ds1, *ds = &ds1;
-    int x1, xc, yc, offset;
+    QEOffset offset;
+    int x1, xc, yc;
 
     /* if the cursor is before the top of the display zone, we must
        resync backward */
@@ -4008,6 +4256,8 @@ static void parse_args(ExecCmdState *es)
     }
 
     qs->this_cmd_func = d->action.func;
+    /* the modifications made by the command form an undo unit */
+    qs->undo_unit++;
 
     do {
         /* special case for hex mode */
@@ -4030,6 +4280,7 @@ static void parse_args(ExecCmdState *es)
         /* CG: Should follow qs->active_window ? */
     } while (--rep_count > 0);
 
+    qs->undo_unit++;
     qs->last_cmd_func = qs->this_cmd_func;
  fail:
     free_cmd(&es);
@@ -4129,6 +4380,8 @@ void window_display(EditState *s)
     display_window_borders(s);
 }
 
+static void qe_display_bh(void *opaque);
+
 /* display all windows */
 /* XXX: should use correct clipping to avoid popups display hacks */
 void edit_display(QEmacsState *qs)
@@ -4170,6 +4423,54 @@ void edit_display(QEmacsState *qs)
     }
 
     qs->complete_refresh = 0;
+
+    /* a pending scheduled redisplay is now useless */
+    qs->display_frames++;
+    qs->display_time = get_clock_ms();
+    if (qs->display_pending) {
+        qs->display_pending = 0;
+        unregister_bottom_half(qe_display_bh, qs);
+        qe_kill_timer(&qs->display_timer);
+    }
+}
+
+/* Redisplay scheduler: asynchronous output such as subprocess output
+ * requests a redisplay with qe_display_request().  Requests are
+ * coalesced in a bottom half and frames are limited to display_fps per
+ * second.  Keyboard commands still call edit_display() directly for
+ * minimal echo latency, which also satisfies pending requests.
+ */
+static void qe_display_timer_cb(void *opaque)
+{
+    QEmacsState *qs = opaque;
+
+    qs->display_timer = NULL;
+    edit_display(qs);
+    dpy_flush(qs->screen);
+}
+
+static void qe_display_bh(void *opaque)
+{
+    QEmacsState *qs = opaque;
+    int delay = 0;
+
+    if (qs->display_fps > 0)
+        delay = qs->display_time + 1000 / qs->display_fps - get_clock_ms();
+    if (delay > 0) {
+        qs->display_timer = qe_add_timer(delay, qs, qe_display_timer_cb);
+    } else {
+        edit_display(qs);
+        dpy_flush(qs->screen);
+    }
+}
+
+void qe_display_request(QEmacsState *qs)
+{
+    qs->display_requests++;
+    if (!qs->display_pending) {
+        qs->display_pending = 1;
+        register_bottom_half(qe_display_bh, qs);
+    }
 }
 
 /* macros */
@@ -4850,6 +5151,7 @@ void edit_close(EditState **sp)
         qe_free(&s->mode_data);
         qe_free(&s->prompt);
         qe_free(&s->line_shadow);
+        qe_free(&s->hilite_matches);
         qe_free(sp);
     }
 }
@@ -4988,7 +5290,7 @@ static CompletionFunc completion_function;
 
 static StringArray *minibuffer_history;
 static int minibuffer_history_index;
-static int minibuffer_history_saved_offset;
+static QEOffset minibuffer_history_saved_offset;
 
 void do_completion(EditState *s)
 {
@@ -5091,8 +5393,8 @@ void do_completion(EditState *s)
     complete_end(&cs);
 }
 
-static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
-                                   int *offsetp)
+static int eb_match_string_reverse(EditBuffer *b, QEOffset offset,
+                                   const char *str, QEOffset *offsetp)
 {
     int len = strlen(str);
 
@@ -5106,7 +5408,8 @@ static int eb_match_string_reverse(EditBuffer *b, int offset, const char *str,
 
 void do_electric_filename(EditState *s, int key)
 {
-    int c, offset, stop;
+    QEOffset offset, stop;
+    int c;
 
     if (completion_function == file_completion) {
         stop = s->offset;
@@ -5232,7 +5535,7 @@ void do_minibuffer_exit(EditState *s, int do_abort)
     /* if completion is activated, then select current file only if
        the selection is highlighted */
     if (cw && cw->force_highlight) {
-        int offset;
+        QEOffset offset;
 
         offset = list_get_offset(cw);
         eb_get_strline(cw->b, buf, sizeof(buf), &offset);
@@ -5954,7 +6257,7 @@ void do_load_file_from_path(EditState *s, const char *filename)
 void do_insert_file(EditState *s, const char *filename)
 {
     FILE *f;
-    int size, lastsize = s->b->total_size;
+    QEOffset size, lastsize = s->b->total_size;
 
     f = fopen(filename, "r");
     if (!f) {
@@ -5991,10 +6294,17 @@ void do_set_visited_file_name(EditState *s, const char *filename,
     eb_set_filename(s->b, path);
 }
 
-static void put_save_message(EditState *s, const char *filename, int nb)
+static void put_save_message(EditState *s, const char *filename, QEOffset nb)
 {
+    QEmacsState *qs = s->qe_state;
+
     if (nb >= 0) {
-        put_status(s, "Wrote %d bytes to %s", nb, filename);
+        if (nb >= 1024 * 1024) {
+            put_status(s, "Wrote %lld bytes to %s in %d ms",
+                       nb, filename, qs->save_time);
+        } else {
+            put_status(s, "Wrote %lld bytes to %s", nb, filename);
+        }
     } else {
         put_status(s, "Could not write %s", filename);
     }
@@ -6002,6 +6312,10 @@ static void put_save_message(EditState *s, const char *filename, int nb)
 
 void do_save_buffer(EditState *s)
 {
+    if (s->b->flags & BF_LOADING) {
+        put_status(s, "Buffer is still loading");
+        return;
+    }
     if (!s->b->modified) {
         /* CG: This behaviour bugs me! */
         put_status(s, "(No changes need to be saved)");
@@ -6025,6 +6339,10 @@ void do_write_region(EditState *s, const char *filename)
     /* deactivate region hilite */
     s->region_style = 0;
 
+    if (s->b->flags & BF_LOADING) {
+        put_status(s, "Buffer is still loading");
+        return;
+    }
     canonicalize_absolute_path(absname, sizeof(absname), filename);
     put_save_message(s, filename,
                      eb_write_buffer(s->b, s->b->mark, s->offset, filename));
@@ -6163,22 +6481,238 @@ static void quit_confirm_cb(__unused__ void *opaque, char *reply)
 
 /* Search stuff */
 
-#define SEARCH_FLAG_IGNORECASE 0x0001
-#define SEARCH_FLAG_SMARTCASE  0x0002 /* case sensitive if upper case present */
-#define SEARCH_FLAG_WORD       0x0004
+/* Literal search on raw page contents.  For utf8 and 8-bit charsets,
+ * the pattern is matched bytewise using a Boyer-Moore-Horspool skip
+ * table.  Each buffer byte is mapped to a key, its decoded (and case
+ * folded) character, which pattern keys are compared against.
+ */
+typedef struct SearchPattern {
+    int len;
+    int key[256];       /* key for each byte value, -1 never matches */
+    int skip[256];      /* forward shift for the byte under the last position */
+    int bskip[256];     /* backward shift for the byte under the first position */
+    int pat[1024];      /* pattern keys */
+} SearchPattern;
+
+typedef struct SearchContext {
+    int flags;          /* search flags, smart case resolved */
+    int size;
+    char buf[1024];     /* pattern in utf8, upper cased if ignoring case */
+    int fast;           /* pattern matched bytewise on page data */
+    SearchPattern sp;
+} SearchContext;
 
-/* XXX: OPTIMIZE ! */
-int eb_search(EditBuffer *b, int offset, int dir, int flags,
-              const char *buf, int size,
-              CSSAbortFunc *abort_func, void *abort_opaque,
-              int *found_offset, int *found_end)
+/* Return 0 if the buffer charset or the pattern cannot be matched bytewise */
+static int search_pattern_init(SearchPattern *sp, EditBuffer *b, int flags,
+                               const char *buf, int size)
 {
-    int total_size = b->total_size;
-    int c, c2, offset1, offset2;
-    char buf1[1024];
+    QECharset *charset = b->charset;
     const char *bufp, *bufend;
+    int i, j, v, c, m;
 
-    if (size == 0 || size >= (int)sizeof(buf1))
+    if (charset->char_size != 1
+    ||  (charset != &charset_utf8 && charset->variable_size))
+        return 0;
+
+    if (charset == &charset_utf8) {
+        /* utf8 sequences compare bytewise, case folding is ASCII only */
+        for (v = 0; v < 256; v++)
+            sp->key[v] = (flags & SEARCH_FLAG_IGNORECASE) ? qe_toupper(v) : v;
+        for (m = 0; m < size; m++)
+            sp->pat[m] = (u8)buf[m];
+    } else {
+        if (!b->charset_state.table)
+            return 0;
+        for (v = 0; v < 256; v++) {
+            c = b->charset_state.table[v];
+            if (c == ESCAPE_CHAR)
+                return 0;
+            sp->key[v] = (flags & SEARCH_FLAG_IGNORECASE) ? qe_toupper(c) : c;
+        }
+        bufp = buf;
+        bufend = buf + size;
+        for (m = 0; bufp < bufend; m++)
+            sp->pat[m] = utf8_decode(&bufp);
+    }
+    if (b->eol_type != EOL_UNIX) {
+        /* end of lines span several bytes */
+        for (i = 0; i < m; i++) {
+            if (sp->pat[i] == '\r' || sp->pat[i] == '\n')
+                return 0;
+        }
+        sp->key['\r'] = -1;
+    }
+    sp->len = m;
+
+    for (v = 0; v < 256; v++) {
+        c = sp->key[v];
+        sp->skip[v] = m;
+        for (j = m - 2; j >= 0; j--) {
+            if (sp->pat[j] == c) {
+                sp->skip[v] = m - 1 - j;
+                break;
+            }
+        }
+        sp->bskip[v] = m;
+        for (j = 1; j < m; j++) {
+            if (sp->pat[j] == c) {
+                sp->bskip[v] = j;
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+static inline int search_pattern_match(const SearchPattern *sp, const u8 *p)
+{
+    int i;
+
+    for (i = 0; i < sp->len; i++) {
+        if (sp->key[p[i]] != sp->pat[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* Find the first match in 'data' starting in [lo, hi], -1 if none */
+static int search_pattern_forward(const SearchPattern *sp, const u8 *data,
+                                  int lo, int hi)
+{
+    int j, m = sp->len;
+
+    for (j = lo; j <= hi; j += sp->skip[data[j + m - 1]]) {
+        if (sp->key[data[j + m - 1]] == sp->pat[m - 1]
+        &&  search_pattern_match(sp, data + j))
+            return j;
+    }
+    return -1;
+}
+
+/* Find the last match in 'data' starting in [lo, hi], -1 if none */
+static int search_pattern_backward(const SearchPattern *sp, const u8 *data,
+                                   int lo, int hi)
+{
+    int j;
+
+    for (j = hi; j >= lo; j -= sp->bskip[data[j]]) {
+        if (search_pattern_match(sp, data + j))
+            return j;
+    }
+    return -1;
+}
+
+static int search_word_bounds(EditBuffer *b, QEOffset start, QEOffset end)
+{
+    QEOffset offset1;
+
+    return !qe_isword(eb_prevc(b, start, &offset1))
+        && !qe_isword(eb_nextc(b, end, &offset1));
+}
+
+/* Search page by page: matches contained in a page are found in place,
+ * those straddling a page boundary in a small copy of the boundary.
+ * Matches start before 'limit' going forward, at or after it backward.
+ */
+static int eb_search_pages(EditBuffer *b, QEOffset offset, QEOffset limit,
+                           int dir, int flags, const SearchPattern *sp,
+                           CSSAbortFunc *abort_func, void *abort_opaque,
+                           QEOffset *found_offset, QEOffset *found_end)
+{
+    u8 tmp[2 * 1024];
+    const u8 *data;
+    QEOffset total_size = b->total_size;
+    QEOffset pos, start, end, from;
+    int m = sp->len;
+    int size, lo, hi, len, j;
+
+    if (dir >= 0) {
+        limit = min_offset(limit, total_size);
+        for (pos = offset; pos < limit; pos = end) {
+            if (abort_func && abort_func(abort_opaque))
+                return 0;
+            data = eb_peek_page(b, pos, &start, &size);
+            if (!data)
+                return 0;
+            end = start + size;
+            /* matches contained in the page */
+            lo = (int)(pos - start);
+            hi = (int)min_offset(size - m, limit - 1 - start);
+            while ((j = search_pattern_forward(sp, data, lo, hi)) >= 0) {
+                if (!(flags & SEARCH_FLAG_WORD)
+                ||  search_word_bounds(b, start + j, start + j + m))
+                    goto found;
+                lo = j + 1;
+            }
+            /* matches straddling the end of the page */
+            from = max_offset(pos, end - m + 1);
+            len = (int)(min_offset(end + m - 1, total_size) - from);
+            if (from < end && len >= m) {
+                eb_read(b, from, tmp, len);
+                start = from;
+                hi = (int)min_offset(min_offset(end, limit) - 1 - from,
+                                     len - m);
+                lo = 0;
+                while ((j = search_pattern_forward(sp, tmp, lo, hi)) >= 0) {
+                    if (!(flags & SEARCH_FLAG_WORD)
+                    ||  search_word_bounds(b, start + j, start + j + m))
+                        goto found;
+                    lo = j + 1;
+                }
+            }
+        }
+    } else {
+        limit = max_offset(limit, 0);
+        for (pos = offset - 1; pos >= limit; pos = start - 1) {
+            if (abort_func && abort_func(abort_opaque))
+                return 0;
+            data = eb_peek_page(b, pos, &start, &size);
+            if (!data)
+                return 0;
+            end = start + size;
+            /* matches straddling the end of the page */
+            from = max_offset(max_offset(start, limit), end - m + 1);
+            len = (int)(min_offset(pos + m, total_size) - from);
+            if (from <= pos && len >= m) {
+                eb_read(b, from, tmp, len);
+                hi = (int)(min_offset(pos, end - 1) - from);
+                hi = min(hi, len - m);
+                while ((j = search_pattern_backward(sp, tmp, 0, hi)) >= 0) {
+                    if (!(flags & SEARCH_FLAG_WORD)
+                    ||  search_word_bounds(b, from + j, from + j + m)) {
+                        start = from;
+                        goto found;
+                    }
+                    hi = j - 1;
+                }
+            }
+            /* matches contained in the page */
+            lo = (int)max_offset(limit - start, 0);
+            hi = (int)min_offset(pos - start, size - m);
+            while ((j = search_pattern_backward(sp, data, lo, hi)) >= 0) {
+                if (!(flags & SEARCH_FLAG_WORD)
+                ||  search_word_bounds(b, start + j, start + j + m))
+                    goto found;
+                hi = j - 1;
+            }
+        }
+    }
+    return 0;
+
+ found:
+    *found_offset = start + j;
+    *found_end = start + j + m;
+    return 1;
+}
+
+/* Prepare a search: resolve smart case and fold the pattern */
+static int search_context_init(SearchContext *sc, EditBuffer *b, int flags,
+                               const char *buf, int size)
+{
+    const char *bufp, *bufend;
+    int c;
+
+    if (size == 0 || size >= (int)sizeof(sc->buf))
         return 0;
 
     /* analyze buffer if smart case */
@@ -6203,20 +6737,49 @@ int eb_search(EditBuffer *b, int offset, int dir, int flags,
         size = 0;
         while (bufp < bufend) {
             c = utf8_decode(&bufp);
-            size += utf8_encode(buf1 + size, qe_toupper(c));
+            size += utf8_encode(sc->buf + size, qe_toupper(c));
         }
     } else {
-        memcpy(buf1, buf, size);
+        memcpy(sc->buf, buf, size);
     }
+    sc->flags = flags;
+    sc->size = size;
+    sc->fast = search_pattern_init(&sc->sp, b, flags, sc->buf, size);
+    return 1;
+}
+
+/* Find the first match starting in [offset, limit) going forward, or
+ * the last one starting in [limit, offset) going backward.
+ */
+static int search_context_find(SearchContext *sc, EditBuffer *b,
+                               QEOffset offset, QEOffset limit, int dir,
+                               CSSAbortFunc *abort_func, void *abort_opaque,
+                               QEOffset *found_offset, QEOffset *found_end)
+{
+    QEOffset total_size = b->total_size;
+    QEOffset offset1, offset2;
+    int flags = sc->flags;
+    int c, c2;
+    const char *bufp, *bufend;
 
     *found_offset = -1;
     *found_end = -1;
 
+    if (sc->fast) {
+        return eb_search_pages(b, offset, limit, dir, flags, &sc->sp,
+                               abort_func, abort_opaque,
+                               found_offset, found_end);
+    }
+
+    /* generic path for multibyte charsets */
     for (;; (void)(dir >= 0 && eb_nextc(b, offset, &offset))) {
         if (dir < 0) {
-            if (offset == 0)
+            if (offset <= limit)
                 return 0;
             eb_prevc(b, offset, &offset);
+        } else {
+            if (offset >= limit)
+                return 0;
         }
         if (offset >= total_size)
             return 0;
@@ -6234,8 +6797,8 @@ int eb_search(EditBuffer *b, int offset, int dir, int flags,
                 continue;
         }
 
-        bufp = buf1;
-        bufend = buf1 + size;
+        bufp = sc->buf;
+        bufend = sc->buf + sc->size;
         offset2 = offset;
         while (offset2 < total_size) {
             /* CG: Should bufferize a bit ? */
@@ -6260,6 +6823,21 @@ int eb_search(EditBuffer *b, int offset, int dir, int flags,
     }
 }
 
+int eb_search(EditBuffer *b, QEOffset offset, int dir, int flags,
+              const char *buf, int size,
+              CSSAbortFunc *abort_func, void *abort_opaque,
+              QEOffset *found_offset, QEOffset *found_end)
+{
+    SearchContext sc;
+
+    if (!search_context_init(&sc, b, flags, buf, size))
+        return 0;
+
+    return search_context_find(&sc, b, offset, dir >= 0 ? b->total_size : 0,
+                               dir, abort_func, abort_opaque,
+                               found_offset, found_end);
+}
+
 /* should separate search string length and number of match positions */
 #define SEARCH_LENGTH  256
 #define FOUND_TAG      0x80000000
@@ -6273,26 +6851,182 @@ int search_abort_func(__unused__ void *opaque)
     return is_user_input_pending();
 }
 
+/* the background search scans this many bytes per step and yields
+ * to the event loop after SEARCH_JOB_SLICE ms.
+ */
+#define SEARCH_JOB_CHUNK    (256 * 1024)
+#define SEARCH_JOB_SLICE    10
+#define SEARCH_JOB_REFRESH  100
+
 typedef struct ISearchState {
     EditState *s;
-    int start_offset;
+    QEOffset start_offset;
     int dir;
     int pos;
     int stack_ptr;
     int search_flags;
-    int found_offset, found_end;
+    QEOffset found_offset, found_end;
+    int search_len;
     unsigned int search_string[SEARCH_LENGTH];
+    QEOffset search_offsets[SEARCH_LENGTH];    /* for FOUND_TAG entries */
+    /* background search of all the matches, to count and highlight them */
+    SearchContext *job;
+    QETimer *job_timer;
+    char job_bytes[2*SEARCH_LENGTH];    /* searched string and flags */
+    int job_len;
+    int job_flags;
+    QEOffset job_offset;        /* next offset to scan, -1 when done */
+    QEOffset job_dirty;         /* first modified offset, -1 if none */
+    int job_refresh_time;
 } ISearchState;
 
+static void isearch_put_status(ISearchState *is);
+
+static void isearch_add_match(EditState *s, QEOffset start, QEOffset end)
+{
+    if (s->nb_hilite_matches >= s->nb_hilite_alloc) {
+        int n = s->nb_hilite_alloc ? s->nb_hilite_alloc * 2 : 64;
+        if (!qe_realloc(&s->hilite_matches, n * sizeof(*s->hilite_matches)))
+            return;
+        s->nb_hilite_alloc = n;
+    }
+    s->hilite_matches[s->nb_hilite_matches].start = start;
+    s->hilite_matches[s->nb_hilite_matches].end = end;
+    s->nb_hilite_matches++;
+}
+
+static void isearch_job_slice(void *opaque);
+
+/* track buffer modifications: the matches from the first modified
+ * offset onwards are scanned again, also after the job completed.
+ */
+static void isearch_job_callback(__unused__ EditBuffer *b, void *opaque,
+                                 __unused__ int arg, enum LogOperation op,
+                                 QEOffset offset, __unused__ QEOffset size)
+{
+    ISearchState *is = opaque;
+
+    if (is->job_dirty < 0 || offset < is->job_dirty)
+        is->job_dirty = offset;
+    if (!is->job_timer)
+        is->job_timer = qe_add_timer(0, is, isearch_job_slice);
+}
+
+static void isearch_stop_job(ISearchState *is)
+{
+    if (is->job)
+        eb_free_callback(is->s->b, isearch_job_callback, is);
+    qe_kill_timer(&is->job_timer);
+    qe_free(&is->job);
+    is->job_offset = -1;
+    is->s->nb_hilite_matches = 0;
+}
+
+/* drop the matches that may have changed since the first modification
+ * and resume scanning where the first of them could start.
+ */
+static void isearch_job_resume(ISearchState *is)
+{
+    EditState *s = is->s;
+    QEOffset keep, resume;
+
+    /* matches are followed by at most one char checked for word bounds */
+    keep = is->job_dirty - MAX_CHAR_BYTES;
+    while (s->nb_hilite_matches > 0
+    &&     s->hilite_matches[s->nb_hilite_matches - 1].end > keep) {
+        s->nb_hilite_matches--;
+    }
+    /* a match spans at most MAX_CHAR_BYTES per pattern char, any match
+     * starting earlier but after the last one kept would have been kept.
+     */
+    resume = max_offset(keep - is->job->size * MAX_CHAR_BYTES, 0);
+    if (s->nb_hilite_matches > 0) {
+        resume = max_offset(resume,
+                            s->hilite_matches[s->nb_hilite_matches - 1].end);
+    }
+    if (is->job_offset >= 0)
+        resume = min_offset(resume, is->job_offset);
+    is->job_offset = resume;
+    is->job_dirty = -1;
+}
+
+/* scan the buffer for a time slice, then reschedule */
+static void isearch_job_slice(void *opaque)
+{
+    ISearchState *is = opaque;
+    EditState *s = is->s;
+    QEOffset limit, found_offset, found_end;
+    int start_time, cur_time;
+
+    is->job_timer = NULL;
+    if (!is->job)
+        return;
+
+    if (is->job_dirty >= 0)
+        isearch_job_resume(is);
+
+    start_time = cur_time = get_clock_ms();
+    while (is->job_offset >= 0 && cur_time - start_time < SEARCH_JOB_SLICE) {
+        limit = min_offset(is->job_offset + SEARCH_JOB_CHUNK, s->b->total_size);
+        if (search_context_find(is->job, s->b, is->job_offset, limit, 1,
+                                NULL, NULL, &found_offset, &found_end)) {
+            isearch_add_match(s, found_offset, found_end);
+            is->job_offset = max_offset(found_end, found_offset + 1);
+        } else {
+            is->job_offset = (limit >= s->b->total_size) ? -1 : limit;
+        }
+        cur_time = get_clock_ms();
+    }
+
+    if (is->job_offset >= 0)
+        is->job_timer = qe_add_timer(0, is, isearch_job_slice);
+
+    if (is->job_offset < 0
+    ||  cur_time - is->job_refresh_time >= SEARCH_JOB_REFRESH) {
+        is->job_refresh_time = cur_time;
+        isearch_put_status(is);
+        qe_display_request(s->qe_state);
+    }
+}
+
+/* (re)start counting matches if the searched string changed */
+static void isearch_start_job(ISearchState *is, const char *buf, int len,
+                              int flags)
+{
+    EditState *s = is->s;
+
+    if (is->job && is->job_flags == flags && is->job_len == len
+    &&  !memcmp(is->job_bytes, buf, len)) {
+        return;
+    }
+    isearch_stop_job(is);
+    if (len == 0 || len > (int)sizeof(is->job_bytes))
+        return;
+
+    is->job = qe_mallocz(SearchContext);
+    if (!is->job)
+        return;
+    if (!search_context_init(is->job, s->b, flags, buf, len)) {
+        qe_free(&is->job);
+        return;
+    }
+    memcpy(is->job_bytes, buf, len);
+    is->job_len = len;
+    is->job_flags = flags;
+    is->job_offset = 0;
+    is->job_dirty = -1;
+    eb_add_callback(s->b, isearch_job_callback, is, 0);
+    is->job_refresh_time = get_clock_ms();
+    is->job_timer = qe_add_timer(0, is, isearch_job_slice);
+}
+
 static void isearch_display(ISearchState *is)
 {
     EditState *s = is->s;
-    char ubuf[256];
-    buf_t outbuf, *out;
     char buf[2*SEARCH_LENGTH], *q; /* XXX: incorrect size */
     int i, len, hex_nibble, h;
     unsigned int v;
-    int search_offset;
+    QEOffset search_offset;
     int flags;
 
     /* prepare the search bytes */
@@ -6319,13 +7053,15 @@ static void isearch_display(ISearchState *is)
             }
         } else {
             /* CG: XXX: offset cannot be adjusted this way */
-            search_offset = (v & ~FOUND_TAG) + is->dir;
+            search_offset = is->search_offsets[i] + is->dir;
         }
     }
     len = q - buf;
+    is->search_len = len;
     if (len == 0) {
         s->offset = is->start_offset;
         is->found_offset = -1;
+        isearch_stop_job(is);
     } else {
         flags = is->search_flags;
         if (s->hex_mode)
@@ -6335,11 +7071,40 @@ static void isearch_display(ISearchState *is)
                       &is->found_offset, &is->found_end)) {
             s->offset = is->found_end;
         }
+        /* count and highlight all matches in the background */
+        isearch_start_job(is, buf, len, flags);
     }
 
-    /* display search string */
+    /* display text */
+    do_center_cursor(s);
+    edit_display(s->qe_state);
+
+    isearch_put_status(is);
+
+    dpy_flush(s->screen);
+}
+
+static void isearch_put_status(ISearchState *is)
+{
+    EditState *s = is->s;
+    char ubuf[256];
+    buf_t outbuf, *out;
+    unsigned int v;
+    int i;
+
     out = buf_init(&outbuf, ubuf, sizeof(ubuf));
-    if (is->found_offset < 0 && len > 0)
+    /* match N of M, M is partial while the buffer is being scanned */
+    if (is->job && is->found_offset >= 0) {
+        i = find_match_range(s->hilite_matches, s->nb_hilite_matches,
+                             is->found_offset);
+        if (i >= 0 && s->hilite_matches[i].start == is->found_offset)
+            buf_printf(out, "%d/", i + 1);
+        else
+            buf_printf(out, "?/");
+        buf_printf(out, "%d%s ", s->nb_hilite_matches,
+                   is->job_offset >= 0 ? "+" : "");
+    }
+    if (is->found_offset < 0 && is->search_len > 0)
         buf_printf(out, "Failing ");
     if (s->hex_mode) {
         buf_printf(out, "hex ");
@@ -6363,13 +7128,7 @@ static void isearch_display(ISearchState *is)
         }
     }
 
-    /* display text */
-    do_center_cursor(s);
-    edit_display(s->qe_state);
-
     put_status(NULL, "%s", out->buf);
-
-    dpy_flush(s->screen);
 }
 
 static void isearch_key(void *opaque, int ch)
@@ -6397,6 +7156,9 @@ static void isearch_key(void *opaque, int ch)
             }
             last_search_string_len = j;
         }
+        isearch_stop_job(is);
+        qe_free(&s->hilite_matches);
+        s->nb_hilite_alloc = 0;
         qe_ungrab_keys();
         qe_free(&is);
         edit_display(s->qe_state);
@@ -6415,8 +7177,10 @@ static void isearch_key(void *opaque, int ch)
             is->pos = last_search_string_len;
         } else {
             /* add the match position, if any */
-            if (is->pos < SEARCH_LENGTH && is->found_offset >= 0)
-                is->search_string[is->pos++] = FOUND_TAG | is->found_offset;
+            if (is->pos < SEARCH_LENGTH && is->found_offset >= 0) {
+                is->search_offsets[is->pos] = is->found_offset;
+                is->search_string[is->pos++] = FOUND_TAG;
+            }
         }
         break;
 #if 0
@@ -6480,6 +7244,7 @@ void do_isearch(EditState *s, int dir)
     is->pos = 0;
     is->stack_ptr = 0;
     is->search_flags = SEARCH_FLAG_SMARTCASE;
+    is->job_offset = -1;
 
     qe_grab_keys(isearch_key, is);
     isearch_display(is);
@@ -6525,13 +7290,19 @@ static int to_bytes(EditState *s1, char *dst, int dst_size, const char *str)
 typedef struct QueryReplaceState {
     EditState *s;
     int nb_reps;
-    int search_bytes_len, replace_bytes_len, found_offset, found_end;
+    int search_bytes_len, replace_bytes_len;
+    QEOffset found_offset, found_end;
     int replace_all;
     int flags;
     char search_str[SEARCH_LENGTH];     /* may be in hex */
     char replace_str[SEARCH_LENGTH];    /* may be in hex */
     char search_bytes[SEARCH_LENGTH];   /* utf8 bytes */
     char replace_bytes[SEARCH_LENGTH];  /* utf8 bytes */
+    int search_ok;                      /* sc is initialized */
+    SearchContext sc;                   /* literal search tables */
+    QERegex *re;                        /* NULL for literal replace */
+    QEOffset groups[2 * RE_MAX_GROUPS];
+    QEOffset last_end;                  /* end of the previous match */
 } QueryReplaceState;
 
 static void query_replace_abort(QueryReplaceState *is)
@@ -6540,39 +7311,126 @@ static void query_replace_abort(QueryReplaceState *is)
 
     qe_ungrab_keys();
     put_status(NULL, "Replaced %d occurrences", is->nb_reps);
+    qe_regex_free(&is->re);
     qe_free(&is);
     edit_display(s->qe_state);
     dpy_flush(&global_screen);
 }
 
+/* Resume searching at 'offset', past the end of the current match.
+ * An empty match must not be found again at the same place.
+ */
+static void query_replace_skip(QueryReplaceState *is, QEOffset offset)
+{
+    EditBuffer *b = is->s->b;
+
+    is->last_end = offset;
+    if (is->found_end == is->found_offset) {
+        if (offset < b->total_size)
+            eb_nextc(b, offset, &offset);
+        else
+            offset++;
+    }
+    is->found_offset = offset;
+}
+
 static void query_replace_replace(QueryReplaceState *is)
 {
     EditState *s = is->s;
+    char *buf;
+    int len;
 
-    eb_delete(s->b, is->found_offset, is->found_end - is->found_offset);
-    is->found_offset += eb_insert_utf8_buf(s->b, is->found_offset,
-                                           is->replace_bytes,
-                                           is->replace_bytes_len);
+    if (is->re) {
+        /* expand group references before the match is deleted */
+        buf = qe_regex_expand(s->b, is->groups, is->replace_bytes, &len);
+        if (!buf) {
+            query_replace_skip(is, is->found_end);
+            return;
+        }
+        eb_delete(s->b, is->found_offset, is->found_end - is->found_offset);
+        len = eb_insert_utf8_buf(s->b, is->found_offset, buf, len);
+        qe_free(&buf);
+    } else {
+        eb_delete(s->b, is->found_offset, is->found_end - is->found_offset);
+        len = eb_insert_utf8_buf(s->b, is->found_offset,
+                                 is->replace_bytes, is->replace_bytes_len);
+    }
+    query_replace_skip(is, is->found_offset + len);
     is->nb_reps++;
 }
 
+static int query_replace_find(QueryReplaceState *is)
+{
+    EditBuffer *b = is->s->b;
+
+    if (is->re) {
+        for (;;) {
+            if (!eb_regex_search(b, is->re, is->found_offset,
+                                 b->total_size + 1, 1, is->groups))
+                return 0;
+            is->found_offset = is->groups[0];
+            is->found_end = is->groups[1];
+            /* no empty match right after the previous match */
+            if (is->found_end > is->found_offset
+            ||  is->found_offset != is->last_end)
+                return 1;
+            query_replace_skip(is, is->found_offset);
+        }
+    }
+    return is->search_ok
+        && search_context_find(&is->sc, b, is->found_offset, b->total_size,
+                               1, NULL, NULL,
+                               &is->found_offset, &is->found_end);
+}
+
+/* Replace all remaining matches as a single buffer modification, or
+ * a few ones if the matches are far apart.
+ */
+static void query_replace_all(QueryReplaceState *is)
+{
+    EditBuffer *b = is->s->b;
+    EditBulk bulk;
+    QEOffset shift;
+    char *buf;
+    int len;
+
+    if (eb_bulk_init(&bulk, b, is->found_offset) < 0)
+        return;
+    /* the text after the last replaced region is left unchanged */
+    while (query_replace_find(is)) {
+        if (is->re) {
+            buf = qe_regex_expand(b, is->groups, is->replace_bytes, &len);
+            if (!buf)
+                break;
+            shift = eb_bulk_replace(&bulk, is->found_offset,
+                                    is->found_end - is->found_offset,
+                                    buf, len);
+            qe_free(&buf);
+        } else {
+            shift = eb_bulk_replace(&bulk, is->found_offset,
+                                    is->found_end - is->found_offset,
+                                    is->replace_bytes, is->replace_bytes_len);
+        }
+        is->found_offset += shift;
+        is->found_end += shift;
+        is->nb_reps++;
+        query_replace_skip(is, is->found_end);
+    }
+    eb_bulk_finish(&bulk);
+}
+
 static void query_replace_display(QueryReplaceState *is)
 {
     EditState *s = is->s;
 
- redo:
-    if (!eb_search(s->b, is->found_offset, 1, is->flags,
-                   is->search_bytes, is->search_bytes_len,
-                   NULL, NULL, &is->found_offset, &is->found_end)) {
+    if (is->replace_all)
+        query_replace_all(is);
+
+    if (is->replace_all || !query_replace_find(is)) {
         query_replace_abort(is);
         return;
     }
 
-    if (is->replace_all) {
-        query_replace_replace(is);
-        goto redo;
-    }
-
     /* display text */
     s->offset = is->found_offset;
     do_center_cursor(s);
@@ -6599,6 +7457,7 @@ static void query_replace_key(void *opaque, int ch)
     case 'N':
     case 'n':
     case KEY_DELETE:
+        query_replace_skip(is, is->found_end);
         break;
     case '.':
         query_replace_replace(is);
@@ -6612,27 +7471,45 @@ static void query_replace_key(void *opaque, int ch)
 
 static void query_replace(EditState *s,
                           const char *search_str,
-                          const char *replace_str, int all, int flags)
+                          const char *replace_str, int all, int flags,
+                          QERegex *re)
 {
     QueryReplaceState *is;
 
-    if (s->b->flags & BF_READONLY)
+    if (s->b->flags & BF_READONLY) {
+        qe_regex_free(&re);
         return;
+    }
 
     is = qe_mallocz(QueryReplaceState);
-    if (!is)
+    if (!is) {
+        qe_regex_free(&re);
         return;
+    }
     is->s = s;
+    is->re = re;
     pstrcpy(is->search_str, sizeof(is->search_str), search_str);
     pstrcpy(is->replace_str, sizeof(is->replace_str), replace_str);
 
-    is->search_bytes_len = to_bytes(s, is->search_bytes, sizeof(is->search_bytes),
-                                    search_str);
-    is->replace_bytes_len = to_bytes(s, is->replace_bytes, sizeof(is->replace_bytes),
-                                     replace_str);
+    if (re) {
+        /* regexps and their replacements are plain utf8 strings */
+        pstrcpy(is->replace_bytes, sizeof(is->replace_bytes), replace_str);
+        is->replace_bytes_len = strlen(is->replace_bytes);
+    } else {
+        is->search_bytes_len = to_bytes(s, is->search_bytes,
+                                        sizeof(is->search_bytes), search_str);
+        is->replace_bytes_len = to_bytes(s, is->replace_bytes,
+                                         sizeof(is->replace_bytes),
+                                         replace_str);
+        /* search tables are built once for all matches */
+        is->search_ok = search_context_init(&is->sc, s->b, flags,
+                                            is->search_bytes,
+                                            is->search_bytes_len);
+    }
     is->nb_reps = 0;
     is->replace_all = all;
     is->found_offset = is->found_end = s->offset;
+    is->last_end = -1;
     is->flags = flags;
 
     qe_grab_keys(query_replace_key, is);
@@ -6642,21 +7519,50 @@ static void query_replace(EditState *s,
 void do_query_replace(EditState *s, const char *search_str,
                       const char *replace_str)
 {
-    query_replace(s, search_str, replace_str, 0, 0);
+    query_replace(s, search_str, replace_str, 0, 0, NULL);
 }
 
 void do_replace_string(EditState *s, const char *search_str,
                        const char *replace_str, int argval)
 {
     query_replace(s, search_str, replace_str, 1,
-                  argval == NO_ARG ? 0 : SEARCH_FLAG_WORD);
+                  argval == NO_ARG ? 0 : SEARCH_FLAG_WORD, NULL);
+}
+
+static QERegex *regex_compile_status(EditState *s, const char *str)
+{
+    QERegex *re;
+    char errbuf[64];
+
+    re = qe_regex_compile(str, 0, errbuf, sizeof(errbuf));
+    if (!re)
+        put_status(s, "Invalid regexp '%s': %s", str, errbuf);
+    return re;
+}
+
+void do_query_replace_regexp(EditState *s, const char *search_str,
+                             const char *replace_str)
+{
+    QERegex *re = regex_compile_status(s, search_str);
+
+    if (re)
+        query_replace(s, search_str, replace_str, 0, 0, re);
+}
+
+void do_replace_regexp(EditState *s, const char *search_str,
+                       const char *replace_str)
+{
+    QERegex *re = regex_compile_status(s, search_str);
+
+    if (re)
+        query_replace(s, search_str, replace_str, 1, 0, re);
 }
 
 void do_search_string(EditState *s, const char *search_str, int dir)
 {
     char search_bytes[SEARCH_LENGTH];
     int search_bytes_len;
-    int found_offset, found_end;
+    QEOffset found_offset, found_end;
 
     search_bytes_len = to_bytes(s, search_bytes, sizeof(search_bytes),
                                 search_str);
@@ -6668,6 +7574,76 @@ void do_search_string(EditState *s, const char *search_str, int dir)
     }
 }
 
+void do_re_search_string(EditState *s, const char *search_str, int dir)
+{
+    QERegex *re;
+    QEOffset groups[2 * RE_MAX_GROUPS];
+
+    re = regex_compile_status(s, search_str);
+    if (!re)
+        return;
+    if (eb_regex_search(s->b, re, s->offset,
+                        dir < 0 ? 0 : s->b->total_size + 1, dir, groups)) {
+        s->offset = (dir < 0) ? groups[0] : groups[1];
+        do_center_cursor(s);
+    } else {
+        put_status(s, "Search failed: \"%s\"", search_str);
+    }
+    qe_regex_free(&re);
+}
+
+/* List the lines matching a regexp with their line numbers */
+void do_occur(EditState *s, const char *search_str)
+{
+    EditBuffer *b = s->b, *b1;
+    QERegex *re;
+    QEOffset groups[2 * RE_MAX_GROUPS];
+    QEOffset offset, bol, eol;
+    int line, col, nb_lines;
+
+    re = regex_compile_status(s, search_str);
+    if (!re)
+        return;
+
+    b1 = eb_find("*Occur*");
+    if (b1) {
+        b1->flags &= ~BF_READONLY;
+        eb_clear(b1);
+    } else {
+        b1 = eb_new("*Occur*", BF_UTF8);
+        if (!b1) {
+            qe_regex_free(&re);
+            return;
+        }
+    }
+    eb_printf(b1, "Lines matching \"%s\" in buffer %s:\n",
+              search_str, b->name);
+
+    nb_lines = 0;
+    for (offset = 0; offset <= b->total_size;) {
+        if (!eb_regex_search(b, re, offset, b->total_size + 1, 1, groups))
+            break;
+        bol = eb_goto_bol(b, groups[0]);
+        eol = eb_goto_eol(b, groups[0]);
+        eb_get_pos(b, &line, &col, bol);
+        /* copy the whole line, however long */
+        eb_printf(b1, "%6d: ", line + 1);
+        eb_insert_buffer_convert(b1, b1->total_size, b, bol, eol - bol);
+        eb_printf(b1, "\n");
+        nb_lines++;
+        if (eol >= b->total_size)
+            break;
+        offset = eb_next_line(b, eol);
+    }
+    qe_regex_free(&re);
+
+    b1->offset = 0;
+    b1->flags |= BF_READONLY;
+    put_status(s, "%d matching lines", nb_lines);
+    if (nb_lines)
+        show_popup(b1);
+}
+
 /*----------------*/
 
 void do_doctor(EditState *s)
@@ -7399,8 +8375,8 @@ int text_mode_init(EditState *s, ModeSavedData *saved_data)
         s->default_style = QE_STYLE_DEFAULT;
         s->wrap = WRAP_LINE;
     }
-    s->offset = min(s->offset, s->b->total_size);
-    s->offset_top = min(s->offset_top, s->b->total_size);
+    s->offset = min_offset(s->offset, s->b->total_size);
+    s->offset_top = min_offset(s->offset_top, s->b->total_size);
     s->hex_mode = 0;
     s->insert = 1;
     eb_add_callback(s->b, eb_offset_callback, &s->offset, 0);
@@ -7870,6 +8846,10 @@ static void qe_init(void *opaque)
     qs->default_fill_column = 70;
     qs->mmap_threshold = MIN_MMAP_SIZE;
     qs->max_load_size = MAX_LOAD_SIZE;
+    qs->undo_limit = UNDO_LIMIT;
+    qs->undo_tree = 1;
+    qs->display_fps = DEFAULT_DISPLAY_FPS;
+    qs->tty_scroll = 1;
 
     /* setup resource path */
     set_user_option(NULL);
@@ -8060,6 +9040,9 @@ int main(int argc, char **argv)
                 qe_free(&d);
             }
         }
+        qe_hash_free(&qs->cmd_table);
+        qe_hash_free(&qs->mode_table);
+        qe_hash_free(&style_table);
         while (qs->first_key) {
             KeyDef *p = qs->first_key;
             qs->first_key = p->next;
@@ -129,6 +129,9 @@ void *qe_realloc(void *pp, size_t size);
 /************************/
 
 typedef unsigned char u8;
+/* buffer offsets and sizes, 64 bit to handle files larger than 2 GB */
+typedef long long QEOffset;
+#define MAX_OFFSET  0x7fffffffffffffffLL
 typedef struct EditState EditState;
 typedef struct EditBuffer EditBuffer;
 typedef struct QEmacsState QEmacsState;
@@ -373,6 +376,23 @@ StringItem *set_string(StringArray *cs, int index, const char *str);
 StringItem *add_string(StringArray *cs, const char *str);
 void free_strings(StringArray *cs);
 
+/* hash tables of pointers: the items are indexed by a hash value of
+   their key, the callers compare the keys of the items returned by
+   qe_hash_next() */
+typedef struct QEHashTable {
+    void **items;           /* NULL for free slots */
+    unsigned int *hashes;
+    int size;               /* power of 2 */
+    int nb_items;
+    int nb_used;            /* items and deleted slots */
+} QEHashTable;
+
+unsigned int qe_hash_string(const char *str);
+int qe_hash_add(QEHashTable *ht, unsigned int hash, void *item);
+void qe_hash_remove(QEHashTable *ht, unsigned int hash, void *item);
+void *qe_hash_next(QEHashTable *ht, unsigned int hash, int *pos_ptr);
+void qe_hash_free(QEHashTable *ht);
+
 /* simple dynamic strings wrappers. The strings are always terminated
    by zero except if they are empty. */
 typedef struct QEString {
@@ -488,8 +508,20 @@ static inline int clamp(int a, int b, int c) {
         return a;
 }
 
-static inline int compute_percent(int a, int b) {
-    return b <= 0 ? 0 : (int)((long long)a * 100 / b);
+static inline QEOffset max_offset(QEOffset a, QEOffset b) {
+    return a > b ? a : b;
+}
+
+static inline QEOffset min_offset(QEOffset a, QEOffset b) {
+    return a < b ? a : b;
+}
+
+static inline QEOffset clamp_offset(QEOffset a, QEOffset b, QEOffset c) {
+    return a < b ? b : a > c ? c : a;
+}
+
+static inline int compute_percent(QEOffset a, QEOffset b) {
+    return b <= 0 ? 0 : (int)(a * 100 / b);
 }
 
 int compose_keys(unsigned int *keys, int *nb_keys);
@@ -732,28 +764,121 @@ struct KeyDef *qe_find_binding(unsigned int *keys, int nb_keys, int nroots, ...)
 /* begin to mmap files from this size */
 #define MIN_MMAP_SIZE  (1024*1024)
 #define MAX_LOAD_SIZE  (512*1024*1024)
+#define UNDO_LIMIT     (64*1024*1024)  /* default memory budget for undo */
+/* mapped files are accessed through windows of this size */
+#define MMAP_WINDOW_SIZE  (16*1024*1024)
+#define MMAP_MAX_WINDOWS  16  /* windows kept mapped per file */
+/* mapped files are described with pages of this size */
+#define MAPPED_PAGE_SIZE  (64*1024)
+#define DEFAULT_DISPLAY_FPS  50
 
 #define MAX_PAGE_SIZE 4096
 //#define MAX_PAGE_SIZE 16
+/* pages created by bulk insertions, split when modified */
+#define LARGE_PAGE_SIZE  (256*1024)
 
-#define NB_LOGS_MAX     100000  /* need better way to limit undo information */
 
 #define PG_READ_ONLY    0x0001 /* the page is read only */
 #define PG_VALID_POS    0x0002 /* set if the nb_lines / col fields are up to date */
 #define PG_VALID_CHAR   0x0004 /* nb_chars is valid */
 #define PG_VALID_COLORS 0x0008 /* color state is valid */
+#define PG_MAPPED       0x0010 /* data is in a mapped file */
+#define PG_SHARED       0x0020 /* data is in a reference counted block */
+
+/* Page data shared by several pages, possibly in different buffers.
+ * Shared pages are read only and copied when modified, see buffer.c
+ */
+typedef struct PageBlock {
+    int ref_count;
+    u8 *data;     /* allocated block, PG_SHARED pages point inside it */
+} PageBlock;
 
 typedef struct Page {
     int size; /* data size */
-    u8 *data;
+    u8 *data; /* NULL for mapped pages, use page_data() */
     int flags;
     /* the following are needed to handle line / column computation */
     int nb_lines; /* Number of EOL characters in data */
     int col;      /* Number of chars since the last EOL */
     /* the following is needed for char offset computation */
     int nb_chars;
+    QEOffset map_offset; /* file offset of the data if PG_MAPPED */
+    PageBlock *block;    /* data block if PG_SHARED */
+    struct MappedFile *map; /* file holding the data if PG_MAPPED */
 } Page;
 
+/* File mapped lazily by windows of MMAP_WINDOW_SIZE bytes, referenced
+ * by each page holding its data, see buffer.c
+ */
+typedef struct MapWindow {
+    u8 *addr;               /* NULL if not mapped */
+    unsigned int last_used; /* for least recently used release */
+    int error;              /* errno if the window could not be mapped */
+} MapWindow;
+
+typedef struct MappedFile {
+    int fd;
+    int ref_count;          /* number of pages referencing the file */
+    QEOffset file_size;
+    int nb_windows;
+    int nb_mapped;          /* number of windows currently mapped */
+    unsigned int clock;
+    MapWindow *windows;
+} MappedFile;
+
+/* Fenwick tree of cumulative metrics, see buffer.c */
+typedef struct PageIndex {
+    QEOffset *tree; /* 1-based partial sums */
+    int nb_valid;   /* number of leading entries accounted for */
+    int nb_alloc;   /* number of allocated tree entries */
+} PageIndex;
+
+enum PageIndexMetric {
+    PI_PAGES = 0,   /* pages */
+    PI_SIZE,        /* bytes */
+    PI_LINES,       /* EOL characters */
+    PI_COL,         /* chars since last EOL */
+    PI_CHARS,       /* chars */
+    PI_NB,
+};
+
+/* metrics of a run of consecutive pages of a buffer */
+typedef struct PageGroup {
+    QEOffset metric[PI_NB];
+} PageGroup;
+
+/* Run length encoded styles of a buffer, see buffer.c */
+typedef struct StyleRun {
+    int len;                /* number of chars */
+    int style;
+} StyleRun;
+
+typedef struct StyleBlock {
+    StyleRun *runs;         /* STYLE_BLOCK_RUNS entries */
+    int nb_runs;
+    QEOffset size;          /* number of chars of the runs */
+} StyleBlock;
+
+enum StyleIndexMetric {
+    SI_BLOCKS = 0,          /* blocks */
+    SI_SIZE,                /* chars */
+    SI_NB,
+};
+
+/* metrics of a run of consecutive style blocks */
+typedef struct StyleGroup {
+    QEOffset metric[SI_NB];
+} StyleGroup;
+
+typedef struct StyleMap {
+    StyleBlock *blocks;
+    int nb_blocks, nb_alloc;
+    QEOffset size;
+    StyleGroup *groups;
+    int nb_groups;
+    PageIndex index[SI_NB]; /* cumulative style group metrics */
+} StyleMap;
+
 #define DIR_LTR 0
 #define DIR_RTL 1
 
@@ -764,11 +889,13 @@ enum LogOperation {
     LOGOP_WRITE,
     LOGOP_INSERT,
     LOGOP_DELETE,
+    LOGOP_REPLACE,  /* logged only, callbacks get a delete and an insert */
 };
 
 /* Each buffer modification can be caught with this callback */
 typedef void (*EditBufferCallback)(EditBuffer *b, void *opaque, int arg,
-                                   enum LogOperation op, int offset, int size);
+                                   enum LogOperation op,
+                                   QEOffset offset, QEOffset size);
 
 typedef struct EditBufferCallbackList {
     void *opaque;
@@ -796,15 +923,19 @@ typedef struct EditBufferCallbackList {
 struct EditBuffer {
     Page *page_table;
     int nb_pages;
-    int mark;       /* current mark (moved with text) */
-    int total_size; /* total size of the buffer */
+    PageGroup *page_groups;
+    int nb_page_groups;
+    PageIndex page_index[PI_NB];    /* cumulative page group metrics */
+    int page_index_stale;   /* 1 + index of page modified since indexed */
+    int coalesce_start;     /* 1 + index of first page to coalesce */
+    QEOffset mark;       /* current mark (moved with text) */
+    QEOffset total_size; /* total size of the buffer */
     int modified;
+    unsigned int version;   /* unique tag changed upon each modification */
 
     /* page cache */
     Page *cur_page;
-    int cur_offset;
-    int file_handle; /* if the file is kept open because it is mapped,
-                        its handle is there */
+    QEOffset cur_offset;
     int flags;
 
     /* buffer data type (default is raw) */
@@ -818,18 +949,26 @@ struct EditBuffer {
 
     /* undo system */
     int save_log;    /* if true, each buffer operation is logged */
-    int log_new_index, log_current;
     enum LogOperation last_log;
     int last_log_char;
-    EditBuffer *log_buffer;
-    int nb_logs;
+    EditBuffer *log_buffer;     /* bytes saved by the undo records */
+    struct UndoRecord *undo_records;  /* ring buffer of undo_size records */
+    int undo_size, undo_first, undo_count;
+    int undo_current;           /* number of records before undo position */
+    QEOffset undo_dead;         /* log buffer bytes no longer referenced */
+    QEOffset undo_base;         /* serial number of the first record */
+    QEOffset undo_synced;       /* records before this serial are journaled */
+    QEOffset undo_journal_size; /* journal size when last read or written */
 
     /* style system */
-    EditBuffer *b_styles;
+    StyleMap *b_styles;
     int cur_style;
     int style_bytes;
     int style_shift;
 
+    /* colorizer states shared by the windows, see qe.c */
+    struct ColorizeCache *colorize_caches;
+
     /* modification callbacks */
     EditBufferCallbackList *first_callback;
 
@@ -853,7 +992,7 @@ struct EditBuffer {
     struct ModeSavedData *saved_data;
 
     /* default mode stuff when buffer is detached from window */
-    int offset;         /* used in eval.c */
+    QEOffset offset;    /* used in eval.c */
 
     int tab_width;
     int fill_column;
@@ -864,6 +1003,8 @@ struct EditBuffer {
     int st_mode;                        /* unix file mode */
     char name[MAX_BUFFERNAME_SIZE];     /* buffer name */
     char filename[MAX_FILENAME_SIZE];   /* file name */
+    dev_t file_dev;             /* identity of the file, see eb_find_file */
+    ino_t file_ino;             /* 0 if unknown */
 
     /* Should keep a stat buffer to check for file type and
      * asynchronous modifications
@@ -874,32 +1015,56 @@ struct EditBuffer {
 typedef struct EditBufferDataType {
     const char *name; /* name of buffer data type (text, image, ...) */
     int (*buffer_load)(EditBuffer *b, FILE *f);
-    int (*buffer_save)(EditBuffer *b, int start, int end, const char *filename);
+    QEOffset (*buffer_save)(EditBuffer *b, QEOffset start, QEOffset end,
+                            const char *filename);
     void (*buffer_close)(EditBuffer *b);
     struct EditBufferDataType *next;
 } EditBufferDataType;
 
-/* the log buffer is used for the undo operation */
-/* header of log operation */
-typedef struct LogBuffer {
-    u8 pad1, pad2;    /* for Log buffer readability */
-    u8 op;
+/* undo record of a buffer modification, see buffer.c */
+typedef struct UndoRecord {
+    u8 op;              /* enum LogOperation */
     u8 was_modified;
-    int offset;
-    int size;
-} LogBuffer;
+    int unit;           /* records of a unit are undone together */
+    QEOffset offset;
+    QEOffset size;      /* bytes inserted, deleted or overwritten */
+    QEOffset size1;     /* bytes inserted by LOGOP_REPLACE */
+    QEOffset data;      /* offset of the saved bytes in the log buffer */
+} UndoRecord;
 
 void eb_trace_bytes(const void *buf, int size, int state);
 
 void eb_init(void);
-int eb_read(EditBuffer *b, int offset, void *buf, int size);
-void eb_write(EditBuffer *b, int offset, const void *buf, int size);
-int eb_insert_buffer(EditBuffer *dest, int dest_offset,
-                     EditBuffer *src, int src_offset,
-                     int size);
-int eb_insert(EditBuffer *b, int offset, const void *buf, int size);
-int eb_delete(EditBuffer *b, int offset, int size);
-void eb_replace(EditBuffer *b, int offset, int size,
+int eb_read(EditBuffer *b, QEOffset offset, void *buf, int size);
+const u8 *eb_peek(EditBuffer *b, QEOffset offset, int *size_ptr);
+const u8 *eb_peek_page(EditBuffer *b, QEOffset offset,
+                       QEOffset *start_ptr, int *size_ptr);
+void eb_write(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_insert_buffer(EditBuffer *dest, QEOffset dest_offset,
+                          EditBuffer *src, QEOffset src_offset,
+                          QEOffset size);
+int eb_insert(EditBuffer *b, QEOffset offset, const void *buf, int size);
+QEOffset eb_delete(EditBuffer *b, QEOffset offset, QEOffset size);
+/* Bulk edits rebuild a region of a buffer in a single pass: unchanged
+ * spans and replacement text are appended to a scratch buffer, which
+ * then replaces the region as one modification with one undo record.
+ * Replacements separated by long unchanged spans make separate regions.
+ */
+typedef struct EditBulk {
+    EditBuffer *b;
+    EditBuffer *out;        /* new contents of the region */
+    QEOffset start;         /* start of the region in the source */
+    QEOffset offset;        /* end of the source copied so far */
+    QEOffset delta;         /* size change of the regions already replaced */
+    int len;                /* bytes pending in buf */
+    u8 buf[MAX_PAGE_SIZE];
+} EditBulk;
+
+int eb_bulk_init(EditBulk *bk, EditBuffer *b, QEOffset start);
+QEOffset eb_bulk_replace(EditBulk *bk, QEOffset offset, QEOffset size,
+                         const char *buf, int len);
+QEOffset eb_bulk_finish(EditBulk *bk);
+void eb_replace(EditBuffer *b, QEOffset offset, QEOffset size,
                 const void *buf, int size1);
 void log_reset(EditBuffer *b);
 EditBuffer *eb_new(const char *name, int flags);
@@ -913,24 +1078,26 @@ EditState *eb_find_window(EditBuffer *b, EditState *e);
 
 void eb_set_charset(EditBuffer *b, QECharset *charset, EOLType eol_type);
 __attr_nonnull((3))
-int eb_nextc(EditBuffer *b, int offset, int *next_ptr);
+int eb_nextc(EditBuffer *b, QEOffset offset, QEOffset *next_ptr);
 __attr_nonnull((3))
-int eb_prevc(EditBuffer *b, int offset, int *prev_ptr);
-int eb_skip_chars(EditBuffer *b, int offset, int n);
-int eb_delete_chars(EditBuffer *b, int offset, int n);
-int eb_goto_pos(EditBuffer *b, int line1, int col1);
-int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, int offset);
-int eb_goto_char(EditBuffer *b, int pos);
-int eb_get_char_offset(EditBuffer *b, int offset);
-int eb_delete_range(EditBuffer *b, int p1, int p2);
-//int eb_clip_offset(EditBuffer *b, int offset);
+int eb_prevc(EditBuffer *b, QEOffset offset, QEOffset *prev_ptr);
+QEOffset eb_skip_chars(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_delete_chars(EditBuffer *b, QEOffset offset, int n);
+QEOffset eb_goto_pos(EditBuffer *b, int line1, int col1);
+int eb_get_pos(EditBuffer *b, int *line_ptr, int *col_ptr, QEOffset offset);
+QEOffset eb_goto_char(EditBuffer *b, QEOffset pos);
+QEOffset eb_get_char_offset(EditBuffer *b, QEOffset offset);
+QEOffset eb_delete_range(EditBuffer *b, QEOffset p1, QEOffset p2);
+//QEOffset eb_clip_offset(EditBuffer *b, QEOffset offset);
 void do_undo(EditState *s);
 void do_redo(EditState *s);
 
-int raw_buffer_load1(EditBuffer *b, FILE *f, int offset);
+QEOffset raw_buffer_load1(EditBuffer *b, FILE *f, QEOffset offset);
+int eb_load_percent(EditBuffer *b);
 int mmap_buffer(EditBuffer *b, const char *filename);
-int eb_write_buffer(EditBuffer *b, int start, int end, const char *filename);
-int eb_save_buffer(EditBuffer *b);
+QEOffset eb_write_buffer(EditBuffer *b, QEOffset start, QEOffset end,
+                         const char *filename);
+QEOffset eb_save_buffer(EditBuffer *b);
 
 void eb_set_buffer_name(EditBuffer *b, const char *name1);
 void eb_set_filename(EditBuffer *b, const char *filename);
@@ -938,47 +1105,56 @@ void eb_set_filename(EditBuffer *b, const char *filename);
 int eb_add_callback(EditBuffer *b, EditBufferCallback cb, void *opaque, int arg);
 void eb_free_callback(EditBuffer *b, EditBufferCallback cb, void *opaque);
 void eb_offset_callback(EditBuffer *b, void *opaque, int edge,
-                        enum LogOperation op, int offset, int size);
+                        enum LogOperation op, QEOffset offset, QEOffset size);
 int eb_create_style_buffer(EditBuffer *b, int flags);
 void eb_free_style_buffer(EditBuffer *b);
 void eb_set_style(EditBuffer *b, int style, enum LogOperation op,
-                  int offset, int size);
+                  QEOffset offset, QEOffset size);
+int eb_get_style(EditBuffer *b, QEOffset offset,
+                 QEOffset *start_ptr, QEOffset *end_ptr);
+void style_map_free(StyleMap **mp);
 void eb_style_callback(EditBuffer *b, void *opaque, int arg,
-                       enum LogOperation op, int offset, int size);
-int eb_delete_uchar(EditBuffer *b, int offset);
+                       enum LogOperation op, QEOffset offset, QEOffset size);
+int eb_delete_uchar(EditBuffer *b, QEOffset offset);
 int eb_encode_uchar(EditBuffer *b, char *buf, unsigned int c);
-int eb_insert_uchar(EditBuffer *b, int offset, int c);
-int eb_insert_spaces(EditBuffer *b, int offset, int n);
-int eb_insert_utf8_buf(EditBuffer *b, int offset, const char *buf, int len);
-int eb_insert_str(EditBuffer *b, int offset, const char *str);
-int eb_match_uchar(EditBuffer *b, int offset, int c, int *offsetp);
-int eb_match_str(EditBuffer *b, int offset, const char *str, int *offsetp);
-int eb_match_istr(EditBuffer *b, int offset, const char *str, int *offsetp);
+int eb_insert_uchar(EditBuffer *b, QEOffset offset, int c);
+int eb_insert_spaces(EditBuffer *b, QEOffset offset, int n);
+int eb_insert_utf8_buf(EditBuffer *b, QEOffset offset,
+                       const char *buf, int len);
+int eb_insert_str(EditBuffer *b, QEOffset offset, const char *str);
+int eb_match_uchar(EditBuffer *b, QEOffset offset, int c, QEOffset *offsetp);
+int eb_match_str(EditBuffer *b, QEOffset offset, const char *str,
+                 QEOffset *offsetp);
+int eb_match_istr(EditBuffer *b, QEOffset offset, const char *str,
+                  QEOffset *offsetp);
 int eb_printf(EditBuffer *b, const char *fmt, ...) __attr_printf(2,3);
 void eb_line_pad(EditBuffer *b, int n);
-int eb_get_region_content_size(EditBuffer *b, int start, int stop);
-static inline int eb_get_content_size(EditBuffer *b) {
+QEOffset eb_get_region_content_size(EditBuffer *b,
+                                    QEOffset start, QEOffset stop);
+static inline QEOffset eb_get_content_size(EditBuffer *b) {
     return eb_get_region_content_size(b, 0, b->total_size);
 }
-int eb_get_region_contents(EditBuffer *b, int start, int stop,
+int eb_get_region_contents(EditBuffer *b, QEOffset start, QEOffset stop,
                            char *buf, int buf_size);
 static inline int eb_get_contents(EditBuffer *b, char *buf, int buf_size) {
     return eb_get_region_contents(b, 0, b->total_size, buf, buf_size);
 }
-int eb_insert_buffer_convert(EditBuffer *dest, int dest_offset,
-                             EditBuffer *src, int src_offset,
-                             int size);
+QEOffset eb_insert_buffer_convert(EditBuffer *dest, QEOffset dest_offset,
+                                  EditBuffer *src, QEOffset src_offset,
+                                  QEOffset size);
 int eb_get_line(EditBuffer *b, unsigned int *buf, int buf_size,
-                int *offset_ptr);
+                QEOffset *offset_ptr);
+int eb_get_styled_line(EditBuffer *b, unsigned int *buf, int buf_size,
+                       QEOffset *offset_ptr);
 int eb_get_strline(EditBuffer *b, char *buf, int buf_size,
-                   int *offset_ptr);
-int eb_prev_line(EditBuffer *b, int offset);
-int eb_goto_bol(EditBuffer *b, int offset);
-int eb_goto_bol2(EditBuffer *b, int offset, int *countp);
-int eb_is_blank_line(EditBuffer *b, int offset, int *offset1);
-int eb_is_in_indentation(EditBuffer *b, int offset);
-int eb_goto_eol(EditBuffer *b, int offset);
-int eb_next_line(EditBuffer *b, int offset);
+                   QEOffset *offset_ptr);
+QEOffset eb_prev_line(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_bol2(EditBuffer *b, QEOffset offset, int *countp);
+int eb_is_blank_line(EditBuffer *b, QEOffset offset, QEOffset *offset1);
+int eb_is_in_indentation(EditBuffer *b, QEOffset offset);
+QEOffset eb_goto_eol(EditBuffer *b, QEOffset offset);
+QEOffset eb_next_line(EditBuffer *b, QEOffset offset);
 
 void eb_register_data_type(EditBufferDataType *bdt);
 EditBufferDataType *eb_probe_data_type(const char *filename, int st_mode,
@@ -1044,7 +1220,7 @@ extern EditBufferDataType raw_data_type;
 /* colorize & transform a line, lower level then ColorizeFunc */
 typedef int (*GetColorizedLineFunc)(EditState *s,
                                     unsigned int *buf, int buf_size,
-                                    int *offset1, int line_num);
+                                    QEOffset *offset1, int line_num);
 
 /* colorize a line: this function modifies buf to set the char
  * styles. 'buf' is guaranted to have one more '\0' char after its len.
@@ -1052,6 +1228,23 @@ typedef int (*GetColorizedLineFunc)(EditState *s,
 typedef void (*ColorizeFunc)(unsigned int *buf, int len, int mode_flags,
                              int *colorize_state_ptr, int state_only);
 
+/* colorizer states of a buffer for a colorize function and mode flags */
+typedef struct ColorizeCache {
+    struct ColorizeCache *next;
+    EditBuffer *b;
+    ColorizeFunc colorize_func;
+    int mode_flags;
+    int ref_count;              /* number of windows using the states */
+    unsigned short *states;     /* state before line n */
+    int nb_alloc;
+    int nb_valid_lines;         /* states of the first lines are valid */
+    int cand_start, cand_end;   /* states kept across a modification */
+    int nb_lines;               /* buffer lines when last updated */
+    QEOffset dirty_start;       /* modified range, LLONG_MAX if none */
+    QEOffset dirty_end;
+    QETimer *idle_timer;        /* colorizes ahead of the display */
+} ColorizeCache;
+
 /* contains all the information necessary to uniquely identify a line,
    to avoid displaying it */
 typedef struct QELineShadow {
@@ -1070,10 +1263,15 @@ enum WrapType {
 #define DIR_LTR 0
 #define DIR_RTL 1
 
+/* buffer range of a search match */
+typedef struct MatchRange {
+    QEOffset start, end;
+} MatchRange;
+
 struct EditState {
-    int offset;     /* offset of the cursor */
+    QEOffset offset;     /* offset of the cursor */
     /* text display state */
-    int offset_top;
+    QEOffset offset_top;
     int y_disp;    /* virtual position of the displayed text */
     int x_disp[2]; /* position for LTR and RTL text resp. */
     int minibuf;   /* true if single line editing */
@@ -1086,6 +1284,11 @@ struct EditState {
     int cur_rtl;     /* TRUE if the cursor on over RTL chars */
     enum WrapType wrap;
     int line_numbers;
+    /* line number of the next line to display, valid for a given
+       buffer version: avoids eb_get_pos calls on successive lines */
+    QEOffset line_cache_offset;
+    int line_cache_num;
+    unsigned int line_cache_version;
     /* XXX: these should be buffer specific rather than window specific */
     int indent_size;
     int indent_tabs_mode; /* if true, use tabs to indent */
@@ -1111,13 +1314,8 @@ struct EditState {
 
     EditBuffer *b;
 
-    /* state before line n, one byte per line */
-    unsigned short *colorize_states;
-    int colorize_nb_lines;
-    int colorize_nb_valid_lines;
-    /* maximum valid offset, INT_MAX if not modified. Needed to invalide
-       'colorize_states' */
-    int colorize_max_valid_offset;
+    /* colorizer states, shared with the windows on the same buffer */
+    ColorizeCache *colorize_cache;
     int mode_flags;            /* local mode flags for flavors */
     const char *mode_name;     /* name for mode flavor */
 
@@ -1131,6 +1329,10 @@ struct EditState {
 
     int region_style;
     int curline_style;
+    /* search matches highlighted in the window, sorted by offset */
+    MatchRange *hilite_matches;
+    int nb_hilite_matches;
+    int nb_hilite_alloc;
 
     /* display area info */
     int width, height;
@@ -1157,7 +1359,7 @@ struct EditState {
     struct InputMethod *input_method; /* current input method */
     struct InputMethod *selected_input_method; /* selected input method (used to switch) */
     int compose_len;
-    int compose_start_offset;
+    QEOffset compose_start_offset;
     unsigned int compose_buf[20];
     EditState *next_window;
 };
@@ -1177,7 +1379,7 @@ struct ModeProbeData {
     int buf_size;
     int line_len;
     int st_mode;     /* unix file mode */
-    long total_size;
+    QEOffset total_size;
     EOLType eol_type;
     CharsetDecodeState charset_state;
     QECharset *charset;
@@ -1212,8 +1414,8 @@ struct ModeDef {
     void (*display)(EditState *);
 
     /* text related functions */
-    int (*text_display)(EditState *, DisplayState *, int);
-    int (*text_backward_offset)(EditState *, int);
+    QEOffset (*text_display)(EditState *, DisplayState *, QEOffset);
+    QEOffset (*text_backward_offset)(EditState *, QEOffset);
     ColorizeFunc colorize_func;
 
     /* common functions are defined here */
@@ -1233,7 +1435,7 @@ struct ModeDef {
 
     EditBufferDataType *data_type; /* native buffer data type (NULL = raw) */
     void (*get_mode_line)(EditState *s, buf_t *out);
-    void (*indent_func)(EditState *s, int offset);
+    void (*indent_func)(EditState *s, QEOffset offset);
 
     /* mode specific key bindings */
     struct KeyDef *first_key;
@@ -1305,6 +1507,8 @@ struct QEmacsState {
     struct ModeDef *first_mode;
     struct KeyDef *first_key;
     struct CmdDef *first_cmd;
+    QEHashTable cmd_table;      /* commands by name */
+    QEHashTable mode_table;     /* modes by name */
     struct CompletionEntry *first_completion;
     struct HistoryEntry *first_history;
     //struct QECharset *first_charset;
@@ -1314,6 +1518,9 @@ struct QEmacsState {
     EditState *first_window;
     EditState *active_window; /* window in which we edit */
     EditBuffer *first_buffer;
+    QEHashTable buffer_table;   /* buffers by name */
+    QEHashTable file_table;     /* buffers by file name */
+    QEHashTable file_id_table;  /* buffers by file device and inode */
     EditBufferDataType *first_buffer_data_type;
     //EditBuffer *message_buffer;
     EditBuffer *trace_buffer;
@@ -1379,6 +1586,20 @@ struct QEmacsState {
     int default_fill_column;    /* 70 */
     EOLType default_eol_type;  /* EOL_UNIX */
     int backup_inhibited;  /* prevent qemacs from backing up files */
+    int undo_limit;        /* memory budget for the undo of a buffer */
+    int undo_tree;         /* undos are undoable modifications */
+    int undo_unit;         /* undo unit of the current command */
+    int undo_journal;      /* keep the undo history of files on disk */
+    int save_time;         /* duration of the last file save in ms */
+    /* redisplay scheduler */
+    int display_fps;       /* maximum frame rate for scheduled redisplays */
+    int display_requests;  /* number of redisplay requests */
+    int display_frames;    /* number of frames drawn */
+    long long display_bytes; /* number of bytes sent to the terminal */
+    int tty_scroll;        /* scroll the terminal instead of repainting */
+    int display_time;      /* time of the last frame in ms */
+    int display_pending;   /* a scheduled redisplay is pending */
+    QETimer *display_timer;
 };
 
 extern QEmacsState qe_state;
@@ -1511,7 +1732,7 @@ struct DisplayState {
     int hex_mode;       /* hex mode from edit_state, -1 if all chars wanted */
     void *cursor_opaque;
     int (*cursor_func)(struct DisplayState *,
-                       int offset1, int offset2, int line_num,
+                       QEOffset offset1, QEOffset offset2, int line_num,
                        int x, int y, int w, int h, int hex_mode);
     int eod;            /* end of display requested */
     /* if base == RTL, then all x are equivalent to width - x */
@@ -1530,13 +1751,13 @@ struct DisplayState {
     /* line char (in fact glyph) buffer */
     unsigned int line_chars[MAX_SCREEN_WIDTH];
     short line_char_widths[MAX_SCREEN_WIDTH];
-    int line_offsets[MAX_SCREEN_WIDTH][2];
+    QEOffset line_offsets[MAX_SCREEN_WIDTH][2];
     unsigned char line_hex_mode[MAX_SCREEN_WIDTH];
     int line_index;
 
     /* fragment temporary buffer */
     unsigned int fragment_chars[MAX_WORD_SIZE];
-    int fragment_offsets[MAX_WORD_SIZE][2];
+    QEOffset fragment_offsets[MAX_WORD_SIZE][2];
     unsigned char fragment_hex_mode[MAX_WORD_SIZE];
     int fragment_index;
     int last_space;
@@ -1553,17 +1774,17 @@ enum DisplayType {
 void display_init(DisplayState *s, EditState *e, enum DisplayType do_disp);
 void display_bol(DisplayState *s);
 void display_setcursor(DisplayState *s, DirType dir);
-int display_char_bidir(DisplayState *s, int offset1, int offset2,
+int display_char_bidir(DisplayState *s, QEOffset offset1, QEOffset offset2,
                        int embedding_level, int ch);
-void display_eol(DisplayState *s, int offset1, int offset2);
+void display_eol(DisplayState *s, QEOffset offset1, QEOffset offset2);
 
-void display_printf(DisplayState *ds, int offset1, int offset2,
+void display_printf(DisplayState *ds, QEOffset offset1, QEOffset offset2,
                     const char *fmt, ...) __attr_printf(4,5);
-void display_printhex(DisplayState *s, int offset1, int offset2,
+void display_printhex(DisplayState *s, QEOffset offset1, QEOffset offset2,
                       unsigned int h, int n);
 
-static inline int display_char(DisplayState *s, int offset1, int offset2,
-                               int ch)
+static inline int display_char(DisplayState *s,
+                               QEOffset offset1, QEOffset offset2, int ch)
 {
     return display_char_bidir(s, offset1, offset2, 0, ch);
 }
@@ -1621,7 +1842,7 @@ void unload_input_methods(void);
 /* the following will be suppressed */
 #define LINE_MAX_SIZE 256
 
-static inline int align(int a, int n) {
+static inline QEOffset align(QEOffset a, int n) {
     return (a / n) * n;
 }
 
@@ -1701,6 +1922,7 @@ void do_delete_window(EditState *s, int force);
 // should take argval
 void do_split_window(EditState *s, int horiz);
 void edit_display(QEmacsState *qs);
+void qe_display_request(QEmacsState *qs);
 void edit_invalidate(EditState *s);
 void display_mode_line(EditState *s);
 void edit_set_mode(EditState *s, ModeDef *m);
@@ -1725,6 +1947,12 @@ void do_query_replace(EditState *s, const char *search_str,
 void do_replace_string(EditState *s, const char *search_str,
                        const char *replace_str, int argval);
 void do_search_string(EditState *s, const char *search_str, int dir);
+void do_query_replace_regexp(EditState *s, const char *search_str,
+                             const char *replace_str);
+void do_replace_regexp(EditState *s, const char *search_str,
+                       const char *replace_str);
+void do_re_search_string(EditState *s, const char *search_str, int dir);
+void do_occur(EditState *s, const char *search_str);
 void do_refresh_complete(EditState *s);
 void do_kill_buffer(EditState *s, const char *bufname1);
 void switch_to_buffer(EditState *s, EditBuffer *b);
@@ -1736,14 +1964,15 @@ extern ModeDef text_mode;
 
 int text_mode_init(EditState *s, ModeSavedData *saved_data);
 void text_mode_close(EditState *s);
-int text_backward_offset(EditState *s, int offset);
-int text_display(EditState *s, DisplayState *ds, int offset);
+QEOffset text_backward_offset(EditState *s, QEOffset offset);
+QEOffset text_display(EditState *s, DisplayState *ds, QEOffset offset);
 
 void set_colorize_func(EditState *s, ColorizeFunc colorize_func);
+void eb_free_colorize_caches(EditBuffer *b);
 int generic_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                               int *offsetp, int line_num);
+                               QEOffset *offsetp, int line_num);
 int get_non_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                           int *offsetp, int line_num);
+                           QEOffset *offsetp, int line_num);
 
 void do_char(EditState *s, int key, int argval);
 void do_combine_char(EditState *s, int accent);
@@ -1759,7 +1988,7 @@ void do_delete_char(EditState *s, int argval);
 void do_tab(EditState *s, int argval);
 EditBuffer *new_yank_buffer(QEmacsState *qs, EditBuffer *base);
 void do_append_next_kill(EditState *s);
-void do_kill(EditState *s, int p1, int p2, int dir);
+void do_kill(EditState *s, QEOffset p1, QEOffset p2, int dir);
 void do_kill_region(EditState *s, int killtype);
 void do_kill_line(EditState *s, int dir);
 void do_kill_word(EditState *s, int dir);
@@ -1791,9 +2020,9 @@ void do_eof(EditState *s);
 void do_bol(EditState *s);
 void do_eol(EditState *s);
 void do_word_right(EditState *s, int dir);
-void do_mark_region(EditState *s, int mark, int offset);
-int eb_next_paragraph(EditBuffer *b, int offset);
-int eb_start_paragraph(EditBuffer *b, int offset);
+void do_mark_region(EditState *s, QEOffset mark, QEOffset offset);
+QEOffset eb_next_paragraph(EditBuffer *b, QEOffset offset);
+QEOffset eb_start_paragraph(EditBuffer *b, QEOffset offset);
 void do_mark_paragraph(EditState *s);
 void do_backward_paragraph(EditState *s);
 void do_forward_paragraph(EditState *s);
@@ -1803,7 +2032,7 @@ void do_changecase_word(EditState *s, int up);
 void do_changecase_region(EditState *s, int up);
 void do_delete_word(EditState *s, int dir);
 int cursor_func(DisplayState *ds,
-                int offset1, int offset2, int line_num,
+                QEOffset offset1, QEOffset offset2, int line_num,
                 int x, int y, int w, int h, int hex_mode);
 // should take argval
 void do_scroll_left_right(EditState *s, int dir);
@@ -1878,10 +2107,15 @@ void do_find_alternate_file(EditState *s, const char *filename);
 void do_load_file_from_path(EditState *s, const char *filename);
 void do_set_visited_file_name(EditState *s, const char *filename,
                               const char *renamefile);
-int eb_search(EditBuffer *b, int offset, int dir, int flags,
+
+#define SEARCH_FLAG_IGNORECASE 0x0001
+#define SEARCH_FLAG_SMARTCASE  0x0002 /* case sensitive if upper case present */
+#define SEARCH_FLAG_WORD       0x0004
+
+int eb_search(EditBuffer *b, QEOffset offset, int dir, int flags,
               const char *buf, int size,
               CSSAbortFunc *abort_func, void *abort_opaque,
-              int *found_start, int *found_end);
+              QEOffset *found_start, QEOffset *found_end);
 int search_abort_func(void *opaque);
 void do_doctor(EditState *s);
 void do_delete_other_windows(EditState *s);
@@ -1901,6 +2135,21 @@ int parse_command_line(int argc, char **argv);
 void set_user_option(const char *user);
 void set_tty_charset(const char *name);
 
+/* regex.c */
+
+#define RE_MAX_GROUPS  10   /* whole match and groups \1 to \9 */
+
+typedef struct QERegex QERegex;
+
+QERegex *qe_regex_compile(const char *pattern, int flags,
+                          char *errbuf, int errbuf_size);
+void qe_regex_free(QERegex **rep);
+int eb_regex_search(EditBuffer *b, QERegex *re,
+                    QEOffset offset, QEOffset limit,
+                    int dir, QEOffset *groups);
+char *qe_regex_expand(EditBuffer *b, const QEOffset *groups,
+                      const char *replace, int *len_ptr);
+
 /* parser.c */
 
 int parse_config_file(EditState *s, const char *filename);
@@ -1930,7 +2179,7 @@ extern ModeDef list_mode;
 
 void list_toggle_selection(EditState *s);
 int list_get_pos(EditState *s);
-int list_get_offset(EditState *s);
+QEOffset list_get_offset(EditState *s);
 
 /* dired.c */
 
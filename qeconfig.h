@@ -195,6 +195,25 @@ static CmdDef basic_commands[] = {
 	  "*" "s{Replace String: }|search|"
 	  "s{With: }|replace|"
 	  "ui")
+    CMD3( KEY_NONE, KEY_NONE,
+          "re-search-forward", do_re_search_string, ESsi, 1,
+	  "s{RE search: }|regexp|"
+	  "v")
+    CMD3( KEY_NONE, KEY_NONE,
+          "re-search-backward", do_re_search_string, ESsi, -1,
+	  "s{RE search backward: }|regexp|"
+	  "v")
+    CMD2( KEY_NONE, KEY_NONE,
+          "query-replace-regexp", do_query_replace_regexp, ESss,
+	  "*" "s{Query replace regexp: }|regexp|"
+	  "s{With: }|replace|")
+    CMD2( KEY_NONE, KEY_NONE,
+          "replace-regexp", do_replace_regexp, ESss,
+	  "*" "s{Replace regexp: }|regexp|"
+	  "s{With: }|replace|")
+    CMD2( KEY_NONE, KEY_NONE,
+          "occur", do_occur, ESs,
+	  "s{List lines matching regexp: }|regexp|")
 
     /*---------------- Paragraph / case handling ----------------*/
 
@@ -67,6 +67,9 @@
     STYLE_DEF(QE_STYLE_REGION_HILITE, "region-hilite",
               COLOR_TRANSPARENT, QERGB(0x80, 0xf0, 0xf0),
               0, 0)
+    STYLE_DEF(QE_STYLE_SEARCH_HILITE, "search-hilite",
+              QERGB(0x00, 0x00, 0x00), QERGB(0xf0, 0xc0, 0x40),
+              0, 0)
 
     /* HTML coloring styles */
     STYLE_DEF(QE_STYLE_HTML_COMMENT, "html-comment",
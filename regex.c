@@ -0,0 +1,1417 @@
+/*
+ * Regular expression search for QEmacs.
+ *
+ * Copyright (c) 2026 the QEmacs contributors.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "qe.h"
+
+/* The syntax follows Emacs regular expressions:
+ *   .  [...]  [^...]  [[:class:]]  *  +  ?  *?  +?  ??  \{m,n\}
+ *   \(...\)  \(?:...\)  \|  ^  $  \`  \'  \b  \B  \<  \>
+ *   \w  \W  \s-  \S-  and \n, \t for newline and tab.
+ * Back references are not supported.
+ *
+ * Patterns compile to a program for a Pike VM, which reports capture
+ * groups.  A search first runs a DFA built lazily from the program
+ * directly on page data: it finds where the first match ends, and the
+ * last position before it where no partial match was in progress.
+ * The VM only runs from that position to compute the match bounds.
+ * While no match is in progress, bytes that cannot start a match are
+ * skipped without running the DFA.
+ */
+
+#define RE_MAX_INSTS    4096
+#define RE_MAX_DSTATES  1024    /* cached DFA states, flushed when full */
+#define RE_DHASH_SIZE   1024
+#define RE_NB_ASCII     128
+#define RE_BACKWARD_BLOCK 65536
+
+enum {
+    RE_CHAR,        /* x: character */
+    RE_ANY,         /* any character but newline */
+    RE_CLASS,       /* x: class index */
+    RE_ASSERT,      /* x: assertion kind */
+    RE_SPLIT,       /* x: preferred branch, y: other branch */
+    RE_JMP,         /* x: target */
+    RE_SAVE,        /* x: capture slot */
+    RE_MATCH,
+};
+
+enum {
+    RE_AT_BOL,
+    RE_AT_EOL,
+    RE_AT_BOB,
+    RE_AT_EOB,
+    RE_AT_WORD_BOUNDARY,
+    RE_AT_NOT_WORD_BOUNDARY,
+    RE_AT_BOW,
+    RE_AT_EOW,
+};
+
+/* context of the characters around a position */
+enum {
+    RE_CTX_EDGE,        /* beginning or end of buffer */
+    RE_CTX_NEWLINE,
+    RE_CTX_WORD,
+    RE_CTX_OTHER,
+};
+
+/* predicates for character classes */
+#define RE_CL_WORD    0x0001
+#define RE_CL_SPACE   0x0002
+#define RE_CL_DIGIT   0x0004
+#define RE_CL_ALPHA   0x0008
+#define RE_CL_ALNUM   0x0010
+#define RE_CL_UPPER   0x0020
+#define RE_CL_LOWER   0x0040
+#define RE_CL_PUNCT   0x0080
+#define RE_CL_XDIGIT  0x0100
+#define RE_CL_BLANK   0x0200
+
+typedef struct ReInst {
+    int op, x, y;
+} ReInst;
+
+typedef struct ReClass {
+    int negate;
+    int bits;           /* RE_CL_xxx predicates */
+    int start, count;   /* character ranges in QERegex.ranges */
+} ReClass;
+
+/* A DFA state is the set of instructions waiting for the next
+ * character, including the unanchored start, and the context of the
+ * previous character needed to evaluate assertions.
+ */
+typedef struct ReDState {
+    int ctx;
+    int live;           /* a match is in progress besides the start */
+    int nb_pcs;
+    int *pcs;
+    int hash_next;
+    /* 0 if not computed yet, else (next state + 1) << 2, with bit 1 set
+     * if the next state is live and bit 0 if a match ends here.
+     */
+    int trans[RE_NB_ASCII];
+} ReDState;
+
+struct QERegex {
+    int flags;
+    int nb_insts;
+    ReInst insts[RE_MAX_INSTS];
+    int nb_classes;
+    ReClass *classes;
+    int nb_ranges;
+    int *ranges;
+    /* bytes that may start a match, used to skip text quickly */
+    int has_first;
+    int first_char;     /* the only such byte or -1 */
+    u8 first[256];
+    /* lazy DFA */
+    int start_idx[4];   /* start state for each context or -1 */
+    int nb_dstates;
+    ReDState *dstates[RE_MAX_DSTATES];
+    int dhash[RE_DHASH_SIZE];
+    /* work areas */
+    unsigned int gen;
+    unsigned int *marks;
+    int *pcs;
+    QEOffset *caps;
+};
+
+/*---------------- character matching ----------------*/
+
+static int re_ctx(int c)
+{
+    if (c < 0)
+        return RE_CTX_EDGE;
+    if (c == '\n')
+        return RE_CTX_NEWLINE;
+    if (qe_isword(c))
+        return RE_CTX_WORD;
+    return RE_CTX_OTHER;
+}
+
+static int re_check_assert(int kind, int prev, int next)
+{
+    switch (kind) {
+    case RE_AT_BOL:
+        return prev == RE_CTX_EDGE || prev == RE_CTX_NEWLINE;
+    case RE_AT_EOL:
+        return next == RE_CTX_EDGE || next == RE_CTX_NEWLINE;
+    case RE_AT_BOB:
+        return prev == RE_CTX_EDGE;
+    case RE_AT_EOB:
+        return next == RE_CTX_EDGE;
+    case RE_AT_WORD_BOUNDARY:
+        return (prev == RE_CTX_WORD) != (next == RE_CTX_WORD);
+    case RE_AT_NOT_WORD_BOUNDARY:
+        return (prev == RE_CTX_WORD) == (next == RE_CTX_WORD);
+    case RE_AT_BOW:
+        return prev != RE_CTX_WORD && next == RE_CTX_WORD;
+    case RE_AT_EOW:
+        return prev == RE_CTX_WORD && next != RE_CTX_WORD;
+    }
+    return 0;
+}
+
+static int re_class_bits_match(int bits, int c)
+{
+    return ((bits & RE_CL_WORD) && qe_isword(c))
+        || ((bits & RE_CL_SPACE) && qe_isspace(c))
+        || ((bits & RE_CL_DIGIT) && qe_isdigit(c))
+        || ((bits & RE_CL_ALPHA) && qe_isalpha(c))
+        || ((bits & RE_CL_ALNUM) && qe_isalnum(c))
+        || ((bits & RE_CL_UPPER) && qe_isupper(c))
+        || ((bits & RE_CL_LOWER) && qe_islower(c))
+        || ((bits & RE_CL_PUNCT) && c > ' ' && c < 127 && !qe_isalnum(c))
+        || ((bits & RE_CL_XDIGIT) && qe_isxdigit(c))
+        || ((bits & RE_CL_BLANK) && qe_isblank(c));
+}
+
+static int re_class_match1(const QERegex *re, const ReClass *cl, int c)
+{
+    const int *r = re->ranges + cl->start;
+    int i;
+
+    if (cl->bits && re_class_bits_match(cl->bits, c))
+        return 1;
+    for (i = 0; i < cl->count; i++, r += 2) {
+        if (c >= r[0] && c <= r[1])
+            return 1;
+    }
+    return 0;
+}
+
+static int re_class_match(const QERegex *re, const ReClass *cl, int c)
+{
+    int found = re_class_match1(re, cl, c);
+
+    if (!found && (re->flags & SEARCH_FLAG_IGNORECASE)) {
+        found = re_class_match1(re, cl, qe_toupper(c))
+            ||  re_class_match1(re, cl, qe_tolower(c));
+    }
+    return found ^ cl->negate;
+}
+
+/* Return true if the consuming instruction 'ip' accepts character 'c' */
+static int re_inst_match(const QERegex *re, const ReInst *ip, int c)
+{
+    if (c < 0)
+        return 0;
+    switch (ip->op) {
+    case RE_CHAR:
+        if (c == ip->x)
+            return 1;
+        return (re->flags & SEARCH_FLAG_IGNORECASE)
+            && qe_toupper(c) == qe_toupper(ip->x);
+    case RE_ANY:
+        return c != '\n';
+    case RE_CLASS:
+        return re_class_match(re, &re->classes[ip->x], c);
+    }
+    return 0;
+}
+
+/*---------------- compiler ----------------*/
+
+enum {
+    RE_N_EMPTY,
+    RE_N_CHAR,      /* leaf nodes map to instructions */
+    RE_N_ANY,
+    RE_N_CLASS,
+    RE_N_ASSERT,
+    RE_N_CAT,
+    RE_N_ALT,
+    RE_N_REPEAT,
+    RE_N_GROUP,
+};
+
+typedef struct ReNode ReNode;
+struct ReNode {
+    int type;
+    int x;                      /* leaf argument or group number */
+    int min, max, greedy;       /* repetition bounds, max < 0 if none */
+    ReNode *left, *right;
+};
+
+typedef struct ReCompiler {
+    QERegex *re;
+    const char *p;
+    const char *error;
+    ReNode *nodes;
+    int nb_nodes, nb_nodes_alloc;
+    int nb_groups;
+    int nb_ranges_alloc;
+    int nb_classes_alloc;
+} ReCompiler;
+
+static ReNode *re_node(ReCompiler *cp, int type, ReNode *left, ReNode *right)
+{
+    ReNode *n;
+
+    if (cp->nb_nodes >= cp->nb_nodes_alloc) {
+        cp->error = "regexp too complex";
+        return NULL;
+    }
+    n = &cp->nodes[cp->nb_nodes++];
+    memset(n, 0, sizeof(*n));
+    n->type = type;
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+static ReNode *re_leaf(ReCompiler *cp, int type, int x)
+{
+    ReNode *n = re_node(cp, type, NULL, NULL);
+
+    if (n)
+        n->x = x;
+    return n;
+}
+
+static int re_new_class(ReCompiler *cp, int negate, int bits)
+{
+    QERegex *re = cp->re;
+    ReClass *cl;
+
+    if (re->nb_classes >= cp->nb_classes_alloc) {
+        int n = cp->nb_classes_alloc ? cp->nb_classes_alloc * 2 : 8;
+        if (!qe_realloc(&re->classes, n * sizeof(*re->classes))) {
+            cp->error = "out of memory";
+            return -1;
+        }
+        cp->nb_classes_alloc = n;
+    }
+    cl = &re->classes[re->nb_classes];
+    cl->negate = negate;
+    cl->bits = bits;
+    cl->start = re->nb_ranges;
+    cl->count = 0;
+    return re->nb_classes++;
+}
+
+/* add a range to the last class */
+static void re_add_range(ReCompiler *cp, int c1, int c2)
+{
+    QERegex *re = cp->re;
+
+    if (re->nb_ranges + 2 > cp->nb_ranges_alloc) {
+        int n = cp->nb_ranges_alloc ? cp->nb_ranges_alloc * 2 : 32;
+        if (!qe_realloc(&re->ranges, n * sizeof(*re->ranges))) {
+            cp->error = "out of memory";
+            return;
+        }
+        cp->nb_ranges_alloc = n;
+    }
+    re->ranges[re->nb_ranges++] = c1;
+    re->ranges[re->nb_ranges++] = c2;
+    re->classes[re->nb_classes - 1].count++;
+}
+
+static const struct {
+    const char *name;
+    int bits;
+} re_class_names[] = {
+    { "word", RE_CL_WORD },
+    { "space", RE_CL_SPACE },
+    { "digit", RE_CL_DIGIT },
+    { "alpha", RE_CL_ALPHA },
+    { "alnum", RE_CL_ALNUM },
+    { "upper", RE_CL_UPPER },
+    { "lower", RE_CL_LOWER },
+    { "punct", RE_CL_PUNCT },
+    { "xdigit", RE_CL_XDIGIT },
+    { "blank", RE_CL_BLANK },
+};
+
+/* parse a bracket expression, cp->p is after the '[' */
+static ReNode *re_parse_class(ReCompiler *cp)
+{
+    QERegex *re = cp->re;
+    const char *p = cp->p;
+    int negate = 0, idx, c, c2, i, first = 1;
+
+    if (*p == '^') {
+        negate = 1;
+        p++;
+    }
+    idx = re_new_class(cp, negate, 0);
+    if (idx < 0)
+        return NULL;
+
+    for (;;) {
+        if (*p == '\0') {
+            cp->error = "unmatched [";
+            return NULL;
+        }
+        if (*p == ']' && !first)
+            break;
+        first = 0;
+        if (p[0] == '[' && p[1] == ':') {
+            for (i = 0; i < countof(re_class_names); i++) {
+                int len = strlen(re_class_names[i].name);
+                if (!memcmp(p + 2, re_class_names[i].name, len)
+                &&  p[2 + len] == ':' && p[3 + len] == ']') {
+                    re->classes[idx].bits |= re_class_names[i].bits;
+                    p += 4 + len;
+                    break;
+                }
+            }
+            if (i < countof(re_class_names))
+                continue;
+        }
+        c = utf8_decode(&p);
+        c2 = c;
+        if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+            p++;
+            c2 = utf8_decode(&p);
+            if (c2 < c) {
+                cp->error = "invalid range";
+                return NULL;
+            }
+        }
+        re_add_range(cp, c, c2);
+        if (cp->error)
+            return NULL;
+    }
+    cp->p = p + 1;
+    return re_leaf(cp, RE_N_CLASS, idx);
+}
+
+static ReNode *re_class_node(ReCompiler *cp, int negate, int bits)
+{
+    int idx = re_new_class(cp, negate, bits);
+
+    if (idx < 0)
+        return NULL;
+    return re_leaf(cp, RE_N_CLASS, idx);
+}
+
+static ReNode *re_parse_alt(ReCompiler *cp);
+
+/* parse \{m,n\}, cp->p is after the '\{' */
+static int re_parse_interval(ReCompiler *cp, int *min_ptr, int *max_ptr)
+{
+    const char *p = cp->p;
+    int min = 0, max;
+
+    while (qe_isdigit(*p))
+        min = min * 10 + *p++ - '0';
+    max = min;
+    if (*p == ',') {
+        p++;
+        if (qe_isdigit(*p)) {
+            max = 0;
+            while (qe_isdigit(*p))
+                max = max * 10 + *p++ - '0';
+        } else {
+            max = -1;
+        }
+    }
+    if (p[0] != '\\' || p[1] != '}' || (max >= 0 && max < min)
+    ||  min > 255 || max > 255) {
+        cp->error = "invalid \\{ \\} interval";
+        return -1;
+    }
+    cp->p = p + 2;
+    *min_ptr = min;
+    *max_ptr = max;
+    return 0;
+}
+
+/* parse a sequence of atoms up to \| or \) */
+static ReNode *re_parse_seq(ReCompiler *cp)
+{
+    ReNode *seq = NULL, *atom, *n;
+    const char *p;
+    int c, min, max;
+
+    for (;;) {
+        p = cp->p;
+        c = *p;
+        if (c == '\0' || (c == '\\' && (p[1] == '|' || p[1] == ')')))
+            break;
+
+        atom = NULL;
+        if (seq == NULL && c == '^') {
+            cp->p++;
+            atom = re_leaf(cp, RE_N_ASSERT, RE_AT_BOL);
+        } else
+        if (c == '$' && (p[1] == '\0'
+                     ||  (p[1] == '\\' && (p[2] == '|' || p[2] == ')')))) {
+            cp->p++;
+            atom = re_leaf(cp, RE_N_ASSERT, RE_AT_EOL);
+        } else
+        if (c == '.') {
+            cp->p++;
+            atom = re_leaf(cp, RE_N_ANY, 0);
+        } else
+        if (c == '[') {
+            cp->p++;
+            atom = re_parse_class(cp);
+        } else
+        if (c == '\\') {
+            c = p[1];
+            cp->p += 2;
+            switch (c) {
+            case '(':
+                if (p[2] == '?' && p[3] == ':') {
+                    cp->p += 2;
+                    n = re_parse_alt(cp);
+                } else {
+                    int group = ++cp->nb_groups;
+                    if (group >= RE_MAX_GROUPS) {
+                        cp->error = "too many groups";
+                        return NULL;
+                    }
+                    n = re_parse_alt(cp);
+                    if (n) {
+                        n = re_node(cp, RE_N_GROUP, n, NULL);
+                        if (n)
+                            n->x = group;
+                    }
+                }
+                if (!n)
+                    return NULL;
+                if (cp->p[0] != '\\' || cp->p[1] != ')') {
+                    cp->error = "unmatched \\(";
+                    return NULL;
+                }
+                cp->p += 2;
+                atom = n;
+                break;
+            case 'w':
+            case 'W':
+                atom = re_class_node(cp, c == 'W', RE_CL_WORD);
+                break;
+            case 's':
+            case 'S':
+                if (p[2] != '-' && p[2] != ' ') {
+                    cp->error = "unsupported syntax class";
+                    return NULL;
+                }
+                cp->p++;
+                atom = re_class_node(cp, c == 'S', RE_CL_SPACE);
+                break;
+            case 'b':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_WORD_BOUNDARY);
+                break;
+            case 'B':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_NOT_WORD_BOUNDARY);
+                break;
+            case '<':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_BOW);
+                break;
+            case '>':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_EOW);
+                break;
+            case '`':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_BOB);
+                break;
+            case '\'':
+                atom = re_leaf(cp, RE_N_ASSERT, RE_AT_EOB);
+                break;
+            case 'n':
+                atom = re_leaf(cp, RE_N_CHAR, '\n');
+                break;
+            case 't':
+                atom = re_leaf(cp, RE_N_CHAR, '\t');
+                break;
+            case '\0':
+                cp->error = "trailing backslash";
+                return NULL;
+            default:
+                if (qe_isdigit(c)) {
+                    cp->error = "back references are not supported";
+                    return NULL;
+                }
+                cp->p = p + 1;
+                atom = re_leaf(cp, RE_N_CHAR, utf8_decode(&cp->p));
+                break;
+            }
+        } else {
+            /* repetition operators at the start are literal */
+            atom = re_leaf(cp, RE_N_CHAR, utf8_decode(&cp->p));
+        }
+        if (!atom)
+            return NULL;
+
+        /* postfix operators */
+        for (;;) {
+            p = cp->p;
+            if (*p == '*' || *p == '+' || *p == '?') {
+                min = (*p == '+');
+                max = (*p == '?') ? 1 : -1;
+                cp->p++;
+            } else
+            if (p[0] == '\\' && p[1] == '{') {
+                cp->p += 2;
+                if (re_parse_interval(cp, &min, &max))
+                    return NULL;
+            } else {
+                break;
+            }
+            n = re_node(cp, RE_N_REPEAT, atom, NULL);
+            if (!n)
+                return NULL;
+            n->min = min;
+            n->max = max;
+            n->greedy = 1;
+            if (*cp->p == '?' && *p != '\\') {
+                n->greedy = 0;
+                cp->p++;
+            }
+            atom = n;
+        }
+        seq = seq ? re_node(cp, RE_N_CAT, seq, atom) : atom;
+        if (!seq)
+            return NULL;
+    }
+    return seq ? seq : re_node(cp, RE_N_EMPTY, NULL, NULL);
+}
+
+static ReNode *re_parse_alt(ReCompiler *cp)
+{
+    ReNode *n, *right;
+
+    n = re_parse_seq(cp);
+    while (n && cp->p[0] == '\\' && cp->p[1] == '|') {
+        cp->p += 2;
+        right = re_parse_seq(cp);
+        if (!right)
+            return NULL;
+        n = re_node(cp, RE_N_ALT, n, right);
+    }
+    return n;
+}
+
+static int re_emit(ReCompiler *cp, int op, int x, int y)
+{
+    QERegex *re = cp->re;
+
+    if (re->nb_insts >= RE_MAX_INSTS) {
+        cp->error = "regexp too big";
+        return 0;
+    }
+    re->insts[re->nb_insts].op = op;
+    re->insts[re->nb_insts].x = x;
+    re->insts[re->nb_insts].y = y;
+    return re->nb_insts++;
+}
+
+static void re_gen(ReCompiler *cp, const ReNode *n)
+{
+    QERegex *re = cp->re;
+    int i, pc, pc1, end;
+
+    if (cp->error)
+        return;
+
+    switch (n->type) {
+    case RE_N_EMPTY:
+        break;
+    case RE_N_CHAR:
+        re_emit(cp, RE_CHAR, n->x, 0);
+        break;
+    case RE_N_ANY:
+        re_emit(cp, RE_ANY, 0, 0);
+        break;
+    case RE_N_CLASS:
+        re_emit(cp, RE_CLASS, n->x, 0);
+        break;
+    case RE_N_ASSERT:
+        re_emit(cp, RE_ASSERT, n->x, 0);
+        break;
+    case RE_N_CAT:
+        re_gen(cp, n->left);
+        re_gen(cp, n->right);
+        break;
+    case RE_N_ALT:
+        pc = re_emit(cp, RE_SPLIT, 0, 0);
+        re_gen(cp, n->left);
+        pc1 = re_emit(cp, RE_JMP, 0, 0);
+        re->insts[pc].x = pc + 1;
+        re->insts[pc].y = re->nb_insts;
+        re_gen(cp, n->right);
+        re->insts[pc1].x = re->nb_insts;
+        break;
+    case RE_N_GROUP:
+        re_emit(cp, RE_SAVE, 2 * n->x, 0);
+        re_gen(cp, n->left);
+        re_emit(cp, RE_SAVE, 2 * n->x + 1, 0);
+        break;
+    case RE_N_REPEAT:
+        for (i = 0; i < n->min; i++)
+            re_gen(cp, n->left);
+        if (n->max < 0) {
+            /* loop back */
+            pc = re_emit(cp, RE_SPLIT, 0, 0);
+            re_gen(cp, n->left);
+            re_emit(cp, RE_JMP, pc, 0);
+            end = re->nb_insts;
+            re->insts[pc].x = n->greedy ? pc + 1 : end;
+            re->insts[pc].y = n->greedy ? end : pc + 1;
+        } else {
+            /* optional copies all skip to the end */
+            int first = re->nb_insts;
+            for (i = n->min; i < n->max && !cp->error; i++) {
+                re_emit(cp, RE_SPLIT, 0, 0);
+                re_gen(cp, n->left);
+            }
+            end = re->nb_insts;
+            for (pc = first; pc < end && !cp->error; pc++) {
+                ReInst *ip = &re->insts[pc];
+                /* only patch the SPLIT heading each copy */
+                if (ip->op == RE_SPLIT && ip->x == 0 && ip->y == 0) {
+                    ip->x = n->greedy ? pc + 1 : end;
+                    ip->y = n->greedy ? end : pc + 1;
+                }
+            }
+        }
+        break;
+    }
+}
+
+/* Smart case: ignore case if the pattern has no upper case letter
+ * outside of escapes.
+ */
+static int re_has_upper(const char *pattern)
+{
+    const char *p = pattern;
+    int c;
+
+    while (*p) {
+        if (*p == '\\') {
+            p += (p[1] != '\0') + 1;
+            continue;
+        }
+        if (p[0] == '[' && p[1] == ':') {
+            while (*p && !(p[0] == ':' && p[1] == ']'))
+                p++;
+            continue;
+        }
+        c = utf8_decode(&p);
+        if (qe_isupper(c))
+            return 1;
+    }
+    return 0;
+}
+
+static void re_compute_first(QERegex *re);
+
+QERegex *qe_regex_compile(const char *pattern, int flags,
+                          char *errbuf, int errbuf_size)
+{
+    ReCompiler cp1, *cp = &cp1;
+    QERegex *re;
+    ReNode *n;
+    int len = strlen(pattern);
+
+    if (errbuf_size > 0)
+        *errbuf = '\0';
+    if ((flags & SEARCH_FLAG_SMARTCASE) && !re_has_upper(pattern))
+        flags |= SEARCH_FLAG_IGNORECASE;
+
+    re = qe_mallocz(QERegex);
+    if (!re)
+        return NULL;
+    re->flags = flags;
+
+    memset(cp, 0, sizeof(*cp));
+    cp->re = re;
+    cp->p = pattern;
+    /* each pattern character produces at most a few nodes */
+    cp->nb_nodes_alloc = 4 * len + 8;
+    cp->nodes = qe_malloc_array(ReNode, cp->nb_nodes_alloc);
+    if (!cp->nodes) {
+        qe_free(&re);
+        return NULL;
+    }
+    n = re_parse_alt(cp);
+    if (n && *cp->p != '\0')
+        cp->error = "unmatched \\)";
+    if (!cp->error) {
+        re_emit(cp, RE_SAVE, 0, 0);
+        re_gen(cp, n);
+        re_emit(cp, RE_SAVE, 1, 0);
+        re_emit(cp, RE_MATCH, 0, 0);
+    }
+    qe_free(&cp->nodes);
+
+    if (!cp->error) {
+        re->marks = qe_mallocz_array(unsigned int, re->nb_insts);
+        re->pcs = qe_malloc_array(int, 2 * re->nb_insts);
+        re->caps = qe_malloc_array(QEOffset,
+                                    2 * re->nb_insts * 2 * RE_MAX_GROUPS);
+        if (!re->marks || !re->pcs || !re->caps)
+            cp->error = "out of memory";
+    }
+    if (cp->error) {
+        if (errbuf_size > 0)
+            pstrcpy(errbuf, errbuf_size, cp->error);
+        qe_regex_free(&re);
+        return NULL;
+    }
+    memset(re->dhash, -1, sizeof(re->dhash));
+    memset(re->start_idx, -1, sizeof(re->start_idx));
+    re_compute_first(re);
+    return re;
+}
+
+static void re_dfa_flush(QERegex *re)
+{
+    int i;
+
+    for (i = 0; i < re->nb_dstates; i++)
+        qe_free(&re->dstates[i]);
+    re->nb_dstates = 0;
+    memset(re->dhash, -1, sizeof(re->dhash));
+    memset(re->start_idx, -1, sizeof(re->start_idx));
+}
+
+void qe_regex_free(QERegex **rep)
+{
+    QERegex *re = *rep;
+
+    if (re) {
+        re_dfa_flush(re);
+        qe_free(&re->classes);
+        qe_free(&re->ranges);
+        qe_free(&re->marks);
+        qe_free(&re->pcs);
+        qe_free(&re->caps);
+        qe_free(rep);
+    }
+}
+
+/*---------------- buffer access ----------------*/
+
+/* Characters below 128 are read from page data when the charset maps
+ * them to themselves, others are decoded with eb_nextc().
+ */
+typedef struct ReReader {
+    EditBuffer *b;
+    int fast;
+    const u8 *data;
+    QEOffset start, end;    /* buffer offsets of the current page */
+} ReReader;
+
+static void re_reader_init(ReReader *rd, EditBuffer *b)
+{
+    int c;
+
+    rd->b = b;
+    rd->data = NULL;
+    rd->start = rd->end = 0;
+    rd->fast = (b->charset->char_size == 1 && b->eol_type == EOL_UNIX);
+    if (b->charset != &charset_utf8) {
+        /* trailing bytes of multibyte charsets may be below 128 */
+        if (b->charset->variable_size || !b->charset_state.table)
+            rd->fast = 0;
+        for (c = 0; rd->fast && c < RE_NB_ASCII; c++) {
+            if (b->charset_state.table[c] != c)
+                rd->fast = 0;
+        }
+    }
+}
+
+static int re_getc_slow(ReReader *rd, QEOffset offset, QEOffset *next_ptr)
+{
+    int size, c;
+
+    if (offset >= rd->b->total_size) {
+        *next_ptr = offset;
+        return -1;
+    }
+    if (rd->fast) {
+        if (offset < rd->start || offset >= rd->end) {
+            rd->data = eb_peek_page(rd->b, offset, &rd->start, &size);
+            rd->end = rd->start + size;
+        }
+        /* no data upon read error */
+        if (rd->data) {
+            c = rd->data[offset - rd->start];
+            if (c < RE_NB_ASCII) {
+                *next_ptr = offset + 1;
+                return c;
+            }
+        }
+    }
+    return eb_nextc(rd->b, offset, next_ptr);
+}
+
+static inline int re_getc(ReReader *rd, QEOffset offset, QEOffset *next_ptr)
+{
+    if (offset >= rd->start && offset < rd->end) {
+        int c = rd->data[offset - rd->start];
+        if (c < RE_NB_ASCII) {
+            *next_ptr = offset + 1;
+            return c;
+        }
+    }
+    return re_getc_slow(rd, offset, next_ptr);
+}
+
+static int re_prevc(ReReader *rd, QEOffset offset)
+{
+    QEOffset offset1;
+
+    if (offset <= 0)
+        return -1;
+    return eb_prevc(rd->b, offset, &offset1);
+}
+
+/*---------------- lazy DFA ----------------*/
+
+/* Collect the instructions reachable from 'pc' without consuming a
+ * character between contexts 'prev' and 'next'.  Return true if the
+ * match instruction is reached.
+ */
+static int re_closure(QERegex *re, int pc, int prev, int next,
+                      int *out, int *nb_out)
+{
+    const ReInst *ip;
+
+    for (;;) {
+        if (re->marks[pc] == re->gen)
+            return 0;
+        re->marks[pc] = re->gen;
+        ip = &re->insts[pc];
+        switch (ip->op) {
+        case RE_JMP:
+            pc = ip->x;
+            continue;
+        case RE_SPLIT:
+            if (re_closure(re, ip->x, prev, next, out, nb_out)) {
+                re_closure(re, ip->y, prev, next, out, nb_out);
+                return 1;
+            }
+            pc = ip->y;
+            continue;
+        case RE_SAVE:
+            pc++;
+            continue;
+        case RE_ASSERT:
+            if (!re_check_assert(ip->x, prev, next))
+                return 0;
+            pc++;
+            continue;
+        case RE_MATCH:
+            return 1;
+        default:
+            out[(*nb_out)++] = pc;
+            return 0;
+        }
+    }
+}
+
+/* Return true if instruction 'ip' may match a non ASCII character */
+static int re_inst_nonascii(const QERegex *re, const ReInst *ip)
+{
+    const ReClass *cl;
+    int i;
+
+    switch (ip->op) {
+    case RE_CHAR:
+        return ip->x >= RE_NB_ASCII;
+    case RE_CLASS:
+        cl = &re->classes[ip->x];
+        if (cl->negate || cl->bits)
+            return 1;
+        for (i = 0; i < cl->count; i++) {
+            if (re->ranges[cl->start + 2 * i + 1] >= RE_NB_ASCII)
+                return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Compute the set of bytes that may start a match in page data.  When
+ * non ASCII characters may start a match, all bytes above 127 are
+ * included.
+ */
+static void re_compute_first(QERegex *re)
+{
+    const ReInst *ip;
+    int prev, next, i, c, n, nb_out, nonascii;
+
+    re->has_first = 0;
+    re->first_char = -1;
+    memset(re->first, 0, sizeof(re->first));
+    nonascii = 0;
+    for (prev = RE_CTX_EDGE; prev <= RE_CTX_OTHER; prev++) {
+        for (next = RE_CTX_EDGE; next <= RE_CTX_OTHER; next++) {
+            re->gen++;
+            nb_out = 0;
+            if (re_closure(re, 0, prev, next, re->pcs, &nb_out))
+                return;     /* empty matches */
+            for (i = 0; i < nb_out; i++) {
+                ip = &re->insts[re->pcs[i]];
+                nonascii |= re_inst_nonascii(re, ip);
+                for (c = 0; c < RE_NB_ASCII; c++) {
+                    if (!re->first[c] && re_inst_match(re, ip, c))
+                        re->first[c] = 1;
+                }
+            }
+        }
+    }
+    for (c = n = 0; c < RE_NB_ASCII; c++) {
+        if (re->first[c]) {
+            re->first_char = c;
+            n++;
+        }
+    }
+    if (nonascii) {
+        memset(re->first + RE_NB_ASCII, 1, 256 - RE_NB_ASCII);
+        n += 256 - RE_NB_ASCII;
+    }
+    if (n != 1)
+        re->first_char = -1;
+    /* not worth it if most bytes qualify */
+    re->has_first = (n < 128);
+}
+
+static int re_cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+static unsigned int re_dstate_hash(const int *pcs, int nb_pcs, int ctx)
+{
+    unsigned int h = ctx;
+    int i;
+
+    for (i = 0; i < nb_pcs; i++)
+        h = h * 31 + pcs[i];
+    return h % RE_DHASH_SIZE;
+}
+
+/* Find or create the state for a sorted instruction set, return its
+ * index or -1 if the cache is full.
+ */
+static int re_dstate_get(QERegex *re, const int *pcs, int nb_pcs, int ctx)
+{
+    unsigned int h = re_dstate_hash(pcs, nb_pcs, ctx);
+    ReDState *ds;
+    int i;
+
+    for (i = re->dhash[h]; i >= 0; i = re->dstates[i]->hash_next) {
+        ds = re->dstates[i];
+        if (ds->ctx == ctx && ds->nb_pcs == nb_pcs
+        &&  !memcmp(ds->pcs, pcs, nb_pcs * sizeof(*pcs)))
+            return i;
+    }
+    if (re->nb_dstates >= RE_MAX_DSTATES)
+        return -1;
+
+    ds = qe_malloc_bytes(sizeof(ReDState) + nb_pcs * sizeof(int));
+    if (!ds)
+        return -1;
+    memset(ds, 0, sizeof(ReDState));
+    ds->ctx = ctx;
+    ds->nb_pcs = nb_pcs;
+    ds->pcs = (int *)(ds + 1);
+    memcpy(ds->pcs, pcs, nb_pcs * sizeof(*pcs));
+    /* the unanchored start is instruction 0 */
+    ds->live = (nb_pcs > 1 || (nb_pcs == 1 && pcs[0] != 0));
+    ds->hash_next = re->dhash[h];
+    re->dhash[h] = re->nb_dstates;
+    re->dstates[re->nb_dstates] = ds;
+    return re->nb_dstates++;
+}
+
+static int re_dstate_start(QERegex *re, int ctx)
+{
+    int pc = 0;
+    int idx = re->start_idx[ctx];
+
+    if (idx < 0) {
+        idx = re_dstate_get(re, &pc, 1, ctx);
+        if (idx < 0) {
+            re_dfa_flush(re);
+            idx = re_dstate_get(re, &pc, 1, ctx);
+        }
+        re->start_idx[ctx] = idx;
+    }
+    return idx;
+}
+
+/* Compute the transition of state 'idx' on character 'c' (-1 at end of
+ * buffer).  Return the next state index and set *matched if a match
+ * ends before 'c'.  The cache may be flushed: indexes of other states
+ * become invalid.
+ */
+static int re_dfa_next(QERegex *re, int idx, int c, int *matched)
+{
+    ReDState *ds = re->dstates[idx];
+    int *out = re->pcs;
+    int *next = re->pcs + re->nb_insts;
+    int i, nb_out, nb_next, ctx, next_idx, m;
+
+    if (c >= 0 && c < RE_NB_ASCII && ds->trans[c]) {
+        *matched = ds->trans[c] & 1;
+        return (ds->trans[c] >> 2) - 1;
+    }
+
+    ctx = re_ctx(c);
+    re->gen++;
+    nb_out = 0;
+    m = 0;
+    for (i = 0; i < ds->nb_pcs; i++)
+        m |= re_closure(re, ds->pcs[i], ds->ctx, ctx, out, &nb_out);
+
+    nb_next = 0;
+    for (i = 0; i < nb_out; i++) {
+        if (re_inst_match(re, &re->insts[out[i]], c))
+            next[nb_next++] = out[i] + 1;
+    }
+    /* a match may start at every position */
+    next[nb_next++] = 0;
+    qsort(next, nb_next, sizeof(*next), re_cmp_int);
+    for (i = 1, nb_out = 1; i < nb_next; i++) {
+        if (next[i] != next[nb_out - 1])
+            next[nb_out++] = next[i];
+    }
+    nb_next = nb_out;
+
+    *matched = m;
+    next_idx = re_dstate_get(re, next, nb_next, ctx);
+    if (next_idx < 0) {
+        re_dfa_flush(re);
+        return re_dstate_get(re, next, nb_next, ctx);
+    }
+    if (c >= 0 && c < RE_NB_ASCII) {
+        ds->trans[c] = ((next_idx + 1) << 2) | m
+            | (re->dstates[next_idx]->live << 1);
+    }
+    return next_idx;
+}
+
+/* Scan from 'offset' for the end of the first match starting before
+ * 'limit'.  Store in *restart_ptr the last position before it with no
+ * match in progress.
+ */
+static int re_dfa_search(QERegex *re, ReReader *rd, QEOffset offset,
+                         QEOffset limit, QEOffset *restart_ptr)
+{
+    EditBuffer *b = rd->b;
+    QEOffset pos, next_pos, restart;
+    int idx, c, matched;
+    ReDState *ds;
+
+    idx = re_dstate_start(re, re_ctx(re_prevc(rd, offset)));
+    if (idx < 0)
+        return 0;
+    restart = pos = offset;
+    for (;;) {
+        ds = re->dstates[idx];
+        if (!ds->live) {
+            restart = pos;
+            if (pos >= limit)
+                return 0;
+        }
+        /* fast path: scan ASCII page data with cached transitions */
+        if (pos >= rd->start && pos < rd->end) {
+            const u8 *p = rd->data + (pos - rd->start);
+            const u8 *p_end = rd->data + (rd->end - rd->start);
+            const u8 *p1;
+            int t, live = ds->live;
+
+            for (;;) {
+                if (!live && re->has_first) {
+                    /* skip bytes that cannot start a match */
+                    if (re->first_char >= 0) {
+                        p1 = memchr(p, re->first_char, p_end - p);
+                        if (!p1)
+                            p1 = p_end;
+                    } else {
+                        for (p1 = p; p1 < p_end && !re->first[*p1]; p1++)
+                            continue;
+                    }
+                    if (p1 > p) {
+                        p = p1;
+                        restart = rd->start + (p - rd->data);
+                        if (restart >= limit)
+                            return 0;
+                        /* bytes above 127 are parts of word characters */
+                        idx = re_dstate_start(re, re_ctx(p[-1]));
+                        if (idx < 0)
+                            return 0;
+                        ds = re->dstates[idx];
+                    }
+                }
+                if (p >= p_end || (c = *p) >= RE_NB_ASCII
+                ||  (t = ds->trans[c]) == 0 || (t & 1))
+                    break;
+                p++;
+                idx = (t >> 2) - 1;
+                ds = re->dstates[idx];
+                live = t & 2;
+                if (!live) {
+                    restart = rd->start + (p - rd->data);
+                    if (restart >= limit)
+                        return 0;
+                }
+            }
+            pos = rd->start + (p - rd->data);
+        }
+        if (pos >= b->total_size) {
+            c = -1;
+            next_pos = pos;
+        } else {
+            c = re_getc_slow(rd, pos, &next_pos);
+        }
+        idx = re_dfa_next(re, idx, c, &matched);
+        if (matched) {
+            *restart_ptr = restart;
+            return 1;
+        }
+        if (c < 0 || idx < 0)
+            return 0;
+        pos = next_pos;
+    }
+}
+
+/*---------------- Pike VM ----------------*/
+
+typedef struct RePike {
+    QERegex *re;
+    int nslots;
+    int nb_threads[2];
+    int *pcs[2];
+    QEOffset *caps[2];
+} RePike;
+
+static void re_addthread(RePike *vm, int l, int pc, QEOffset *caps,
+                         int prev, int next, QEOffset pos)
+{
+    QERegex *re = vm->re;
+    const ReInst *ip;
+    QEOffset old;
+    int n;
+
+    for (;;) {
+        if (re->marks[pc] == re->gen)
+            return;
+        re->marks[pc] = re->gen;
+        ip = &re->insts[pc];
+        switch (ip->op) {
+        case RE_JMP:
+            pc = ip->x;
+            continue;
+        case RE_SPLIT:
+            re_addthread(vm, l, ip->x, caps, prev, next, pos);
+            pc = ip->y;
+            continue;
+        case RE_SAVE:
+            old = caps[ip->x];
+            caps[ip->x] = pos;
+            re_addthread(vm, l, pc + 1, caps, prev, next, pos);
+            caps[ip->x] = old;
+            return;
+        case RE_ASSERT:
+            if (!re_check_assert(ip->x, prev, next))
+                return;
+            pc++;
+            continue;
+        default:
+            n = vm->nb_threads[l]++;
+            vm->pcs[l][n] = pc;
+            memcpy(vm->caps[l] + n * vm->nslots, caps,
+                   vm->nslots * sizeof(*caps));
+            return;
+        }
+    }
+}
+
+/* Find the leftmost match starting in [offset, limit), preferring
+ * branches in pattern order.
+ */
+static int re_pike_search(QERegex *re, ReReader *rd, QEOffset offset,
+                          QEOffset limit, QEOffset *groups)
+{
+    RePike vm1, *vm = &vm1;
+    QEOffset caps[2 * RE_MAX_GROUPS];
+    QEOffset pos, next_pos, next_pos2;
+    int i, l, pc, c, c2, prev, matched;
+
+    vm->re = re;
+    vm->nslots = 2 * RE_MAX_GROUPS;
+    vm->pcs[0] = re->pcs;
+    vm->pcs[1] = re->pcs + re->nb_insts;
+    vm->caps[0] = re->caps;
+    vm->caps[1] = re->caps + re->nb_insts * vm->nslots;
+    vm->nb_threads[0] = vm->nb_threads[1] = 0;
+    matched = 0;
+
+    for (i = 0; i < 2 * RE_MAX_GROUPS; i++)
+        caps[i] = -1;
+
+    l = 0;
+    pos = offset;
+    prev = re_prevc(rd, pos);
+    c = re_getc(rd, pos, &next_pos);
+    re->gen++;
+    re_addthread(vm, l, 0, caps, re_ctx(prev), re_ctx(c), pos);
+
+    while (vm->nb_threads[l] > 0) {
+        c2 = (c < 0) ? -1 : re_getc(rd, next_pos, &next_pos2);
+        re->gen++;
+        vm->nb_threads[l ^ 1] = 0;
+        for (i = 0; i < vm->nb_threads[l]; i++) {
+            QEOffset *tcaps = vm->caps[l] + i * vm->nslots;
+            pc = vm->pcs[l][i];
+            if (re->insts[pc].op == RE_MATCH) {
+                matched = 1;
+                memcpy(groups, tcaps, vm->nslots * sizeof(*groups));
+                /* lower priority threads are dropped */
+                break;
+            }
+            if (re_inst_match(re, &re->insts[pc], c)) {
+                re_addthread(vm, l ^ 1, pc + 1, tcaps,
+                             re_ctx(c), re_ctx(c2), next_pos);
+            }
+        }
+        if (c < 0)
+            break;
+        if (!matched && next_pos < limit) {
+            for (i = 0; i < 2 * RE_MAX_GROUPS; i++)
+                caps[i] = -1;
+            re_addthread(vm, l ^ 1, 0, caps, re_ctx(c), re_ctx(c2), next_pos);
+        }
+        l ^= 1;
+        pos = next_pos;
+        next_pos = next_pos2;
+        c = c2;
+    }
+    return matched;
+}
+
+/*---------------- search API ----------------*/
+
+/* Search the first match starting in [offset, limit) going forward, or
+ * the last one starting in [limit, offset) going backward.  Match
+ * bounds are stored in groups[0] and groups[1], groups in the next
+ * pairs of the array of 2 * RE_MAX_GROUPS offsets, -1 if unmatched.
+ */
+int eb_regex_search(EditBuffer *b, QERegex *re, QEOffset offset,
+                    QEOffset limit, int dir, QEOffset *groups)
+{
+    ReReader rd;
+    QEOffset pos, restart, stop, start;
+    QEOffset groups1[2 * RE_MAX_GROUPS];
+    int i, found;
+
+    re_reader_init(&rd, b);
+    for (i = 0; i < 2 * RE_MAX_GROUPS; i++)
+        groups[i] = -1;
+
+    if (dir >= 0) {
+        limit = min_offset(limit, b->total_size + 1);
+        if (offset >= limit)
+            return 0;
+        if (!re_dfa_search(re, &rd, offset, limit, &restart))
+            return 0;
+        return re_pike_search(re, &rd, restart, limit, groups);
+    }
+
+    /* backward: search forward in blocks starting at the beginning of
+     * a line, keep the last match.
+     */
+    limit = max_offset(limit, 0);
+    stop = offset;
+    while (stop > limit) {
+        start = max_offset(stop - RE_BACKWARD_BLOCK, limit);
+        start = max_offset(eb_goto_bol(b, start), limit);
+        found = 0;
+        for (pos = start; pos < stop; eb_nextc(b, groups1[0], &pos)) {
+            if (!re_dfa_search(re, &rd, pos, stop, &restart)
+            ||  !re_pike_search(re, &rd, restart, stop, groups1))
+                break;
+            memcpy(groups, groups1, sizeof(groups1));
+            found = 1;
+        }
+        if (found)
+            return 1;
+        stop = start;
+    }
+    return 0;
+}
+
+/* Expand \& and \N in 'replace' for the match described by 'groups'.
+ * Return a newly allocated utf8 string, its length in *len_ptr.
+ */
+char *qe_regex_expand(EditBuffer *b, const QEOffset *groups,
+                      const char *replace, int *len_ptr)
+{
+    const char *p;
+    char *buf;
+    int size, len, n, pass;
+
+    /* first pass computes the size, second pass fills the buffer */
+    buf = NULL;
+    size = 0;
+    for (pass = 0; pass < 2; pass++) {
+        len = 0;
+        for (p = replace; *p; p++) {
+            n = -1;
+            if (p[0] == '\\' && p[1] == '&') {
+                n = 0;
+            } else
+            if (p[0] == '\\' && qe_isdigit(p[1]) && p[1] != '0') {
+                n = p[1] - '0';
+            } else
+            if (p[0] == '\\' && p[1] != '\0') {
+                p++;
+            }
+            if (n < 0) {
+                if (buf)
+                    buf[len] = *p;
+                len++;
+                continue;
+            }
+            p++;
+            if (n >= RE_MAX_GROUPS || groups[2 * n] < 0)
+                continue;
+            if (buf) {
+                len += eb_get_region_contents(b, groups[2 * n],
+                                              groups[2 * n + 1],
+                                              buf + len, size + 1 - len);
+            } else {
+                /* the expansion must fit in a memory block */
+                QEOffset group_size =
+                    eb_get_region_content_size(b, groups[2 * n],
+                                               groups[2 * n + 1]);
+                if (group_size >= INT_MAX - len)
+                    return NULL;
+                len += (int)group_size;
+            }
+        }
+        if (!buf) {
+            size = len;
+            buf = qe_malloc_array(char, size + 1);
+            if (!buf)
+                return NULL;
+        }
+    }
+    buf[len] = '\0';
+    *len_ptr = len;
+    return buf;
+}
@@ -60,7 +60,7 @@ typedef struct ShellState {
     int pty_fd;
     int pid; /* -1 if not launched */
     int color, attr, def_color;
-    int cur_offset; /* current offset at position x, y */
+    QEOffset cur_offset; /* current offset at position x, y */
     int esc_params[MAX_ESC_PARAMS];
     int has_params[MAX_ESC_PARAMS];
     int nb_esc_params;
@@ -89,11 +89,11 @@ typedef struct ShellState {
 
 /* CG: these variables should be encapsulated in a global structure */
 static char error_buffer[MAX_BUFFERNAME_SIZE];
-static int error_offset = -1;
+static QEOffset error_offset = -1;
 static int error_line_num = -1;
 static char error_filename[MAX_FILENAME_SIZE];
 
-static void set_error_offset(EditBuffer *b, int offset)
+static void set_error_offset(EditBuffer *b, QEOffset offset)
 {
     pstrcpy(error_buffer, sizeof(error_buffer), b ? b->name : "");
     error_offset = offset - 1;
@@ -434,7 +434,8 @@ static void tty_write(ShellState *s, const char *buf, int len)
 /* XXX: optimize !!!!! */
 static void tty_goto_xy(ShellState *s, int x, int y, int relative)
 {
-    int total_lines, cur_line, line_num, col_num, offset, offset1, c;
+    QEOffset offset, offset1;
+    int total_lines, cur_line, line_num, col_num, c;
 
     /* compute offset */
     eb_get_pos(s->b, &total_lines, &col_num, s->b->total_size);
@@ -487,10 +488,11 @@ static void tty_goto_xy(ShellState *s, int x, int y, int relative)
 }
 
 /* CG: XXX: tty_put_char purposely ignores charset when inserting chars */
-static int tty_put_char(ShellState *s, int c)
+static QEOffset tty_put_char(ShellState *s, int c)
 {
     char buf[1];
-    int c1, cur_len, offset, offset1;
+    QEOffset offset, offset1;
+    int c1, cur_len;
 
     offset = s->cur_offset;
     buf[0] = c;
@@ -503,7 +505,7 @@ static int tty_put_char(ShellState *s, int c)
         /* check for (c1 != c) is not advisable optimisation because
          * re-writing the same character may cause color changes.
          */
-        cur_len = offset1 - offset;
+        cur_len = (int)(offset1 - offset);
         if (cur_len == 1) {
             eb_write(s->b, offset, buf, 1);
         } else {
@@ -514,6 +516,61 @@ static int tty_put_char(ShellState *s, int c)
     return s->cur_offset = offset + 1;
 }
 
+/* Return the length of the run of printable text at 'buf' that
+ * tty_emulate() would store verbatim, stopping before control codes and
+ * incomplete utf8 sequences.  Store the number of characters in
+ * *nchars_ptr.
+ */
+static int tty_text_run(ShellState *s, const unsigned char *buf, int len,
+                        int *nchars_ptr)
+{
+    int i, j, n, nchars, utf8;
+
+    utf8 = (s->b->charset == &charset_utf8);
+    for (i = nchars = 0; i < len; i += n, nchars++) {
+        if (buf[i] < 32)
+            break;
+        n = 1;
+        if (utf8 && utf8_length[buf[i]] > 1) {
+            n = utf8_length[buf[i]];
+            if (i + n > len)
+                break;
+            for (j = 1; j < n && buf[i + j] >= 0x80; j++)
+                continue;
+            if (j < n)
+                break;
+        }
+    }
+    *nchars_ptr = nchars;
+    return i;
+}
+
+/* Store a run of 'nchars' printable characters at the cursor in one
+ * buffer operation: existing characters are overwritten up to the end
+ * of line, the rest is inserted.
+ */
+static void tty_put_text(ShellState *s, const unsigned char *buf, int len,
+                         int nchars)
+{
+    EditBuffer *b = s->b;
+    QEOffset offset, end, next;
+
+    offset = end = s->cur_offset;
+    for (; nchars > 0 && end < b->total_size; nchars--) {
+        if (eb_nextc(b, end, &next) == '\n')
+            break;
+        end = next;
+    }
+    b->cur_style = QE_STYLE_TTY | s->color | s->attr;
+    if (end - offset == len) {
+        eb_write(b, offset, buf, len);
+    } else {
+        eb_delete(b, offset, end - offset);
+        eb_insert(b, offset, buf, len);
+    }
+    s->cur_offset = offset + len;
+}
+
 static void tty_csi_m(ShellState *s, int c, int has_param)
 {
     /* Comment from putty/terminal.c:
@@ -762,7 +819,8 @@ static unsigned char const sco_color[16] = {
 
 static void tty_emulate(ShellState *s, int c)
 {
-    int i, offset, offset1, offset2, n;
+    QEOffset offset, offset1, offset2;
+    int i, n;
     char buf1[10];
 
     offset = s->cur_offset;
@@ -903,7 +961,7 @@ static void tty_emulate(ShellState *s, int c)
                     /* insert */
                     eb_insert(s->b, offset, buf1, len);
                 } else {
-                    cur_len = offset1 - offset;
+                    cur_len = (int)(offset1 - offset);
                     if (cur_len == len) {
                         eb_write(s->b, offset, buf1, len);
                     } else {
@@ -928,7 +986,7 @@ static void tty_emulate(ShellState *s, int c)
                 /* insert */
                 eb_insert(s->b, offset, s->utf8_buf, len);
             } else {
-                cur_len = offset1 - offset;
+                cur_len = (int)(offset1 - offset);
                 if (cur_len == len) {
                     eb_write(s->b, offset, s->utf8_buf, len);
                 } else {
@@ -1242,7 +1300,7 @@ static void shell_read_cb(void *opaque)
     ShellState *s = opaque;
     QEmacsState *qs;
     unsigned char buf[16 * 1024];
-    int len, i;
+    int len, i, n, nchars;
 
     if (!s || s->signature != &shell_signature)
         return;
@@ -1261,14 +1319,23 @@ static void shell_read_cb(void *opaque)
         s->b->flags &= ~BF_READONLY;
         s->b->last_log = 0;
 
-        for (i = 0; i < len; i++)
-            tty_emulate(s, buf[i]);
+        for (i = 0; i < len;) {
+            /* plain text is stored by runs instead of byte by byte */
+            if (s->state == TTY_STATE_NORM && !s->shifted) {
+                n = tty_text_run(s, buf + i, len - i, &nchars);
+                if (n > 0) {
+                    tty_put_text(s, buf + i, n, nchars);
+                    i += n;
+                    continue;
+                }
+            }
+            tty_emulate(s, buf[i++]);
+        }
 
         s->b->flags |= save_readonly;
     }
     /* now we do some refresh */
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    qe_display_request(qs);
 }
 
 static void shell_close(EditBuffer *b)
@@ -1375,8 +1442,7 @@ static void shell_pid_cb(void *opaque, int status)
     if (!(s->shell_flags & SF_INTERACTIVE)) {
         shell_close(b);
     }
-    edit_display(qs);
-    dpy_flush(qs->screen);
+    qe_display_request(qs);
 }
 
 EditBuffer *new_shell_buffer(EditBuffer *b0, const char *bufname,
@@ -1790,7 +1856,7 @@ static void do_compile_error(EditState *s, int dir)
     QEmacsState *qs = s->qe_state;
     EditState *e;
     EditBuffer *b;
-    int offset, found_offset;
+    QEOffset offset, found_offset;
     char filename[MAX_FILENAME_SIZE], *q;
     int line_num, c;
     char error_message[128];
@@ -0,0 +1,121 @@
+/*
+ * Line and column lookups on a 1 GB buffer
+ *
+ * usage: bench-pos [FILE]
+ *
+ * FILE is created with 16M lines of 64 bytes if it does not exist
+ * yet, $TMPDIR/qe-bench-1g.txt by default.  The buffer is mapped
+ * as for large files.
+ */
+
+#include "qe.h"
+
+#define NB_LINES   (1 << 24)
+#define LINE_SIZE  64
+
+static QEditScreen bench_screen;
+
+static unsigned int rand_state = 1;
+
+static int bench_rand(int n)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 8) % n;
+}
+
+static double elapsed_ms(int start)
+{
+    return (unsigned int)(get_clock_usec() - start) / 1000.0;
+}
+
+static int make_file(const char *filename)
+{
+    char buf[LINE_SIZE * 1024];
+    struct stat st;
+    FILE *f;
+    int i, j;
+
+    if (!stat(filename, &st) && st.st_size == (off_t)NB_LINES * LINE_SIZE)
+        return 0;
+
+    printf("creating %s\n", filename);
+    f = fopen(filename, "w");
+    if (!f)
+        return -1;
+    for (i = 0; i < NB_LINES; i += 1024) {
+        for (j = 0; j < 1024; j++) {
+            snprintf(buf + j * LINE_SIZE, LINE_SIZE + 1, "%08d %-*s\n",
+                     i + j, LINE_SIZE - 10, "the quick brown fox jumps");
+        }
+        fwrite(buf, LINE_SIZE, 1024, f);
+    }
+    return fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+    char filename[MAX_FILENAME_SIZE];
+    EditBuffer *b;
+    QEOffset offset;
+    int start, i, line, col, errors = 0;
+
+    if (argc > 1) {
+        pstrcpy(filename, sizeof(filename), argv[1]);
+    } else {
+        snprintf(filename, sizeof(filename), "%s/qe-bench-1g.txt",
+                 getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+    }
+    if (make_file(filename)) {
+        fprintf(stderr, "cannot create %s\n", filename);
+        return 1;
+    }
+
+    qe_state.screen = &bench_screen;
+    charset_init();
+    b = eb_new("bench", 0);
+    eb_set_charset(b, &charset_utf8, EOL_UNIX);
+    start = get_clock_usec();
+    if (mmap_buffer(b, filename)) {
+        fprintf(stderr, "cannot map %s\n", filename);
+        return 1;
+    }
+    printf("%lld bytes mapped:           %9.3f ms\n",
+           (long long)b->total_size, elapsed_ms(start));
+
+    start = get_clock_usec();
+    offset = eb_goto_pos(b, NB_LINES - 10, 0);
+    errors += (offset != (QEOffset)(NB_LINES - 10) * LINE_SIZE);
+    printf("first goto-line near the end: %9.3f ms\n", elapsed_ms(start));
+
+    start = get_clock_usec();
+    for (i = 0; i < 100; i++) {
+        line = bench_rand(NB_LINES);
+        offset = eb_goto_pos(b, line, 0);
+        errors += (offset != (QEOffset)line * LINE_SIZE);
+    }
+    printf("100 further goto-line:        %9.3f ms\n", elapsed_ms(start));
+
+    start = get_clock_usec();
+    offset = (QEOffset)(NB_LINES - 50000) * LINE_SIZE;
+    for (i = 0; i < 50000; i++) {
+        eb_get_pos(b, &line, &col, offset);
+        errors += (line != NB_LINES - 50000 + i);
+        offset = eb_next_line(b, offset);
+    }
+    printf("eb_get_pos over 50k lines:    %9.3f ms\n", elapsed_ms(start));
+
+    start = get_clock_usec();
+    for (i = 0; i < 1000; i++) {
+        eb_insert(b, (QEOffset)bench_rand(NB_LINES) * LINE_SIZE, "\n", 1);
+        eb_get_pos(b, &line, &col, b->total_size);
+        errors += (line != NB_LINES + i + 1);
+    }
+    printf("1000 inserts + eb_get_pos:    %9.3f ms\n", elapsed_ms(start));
+
+    eb_free(&b);
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+    return 0;
+}
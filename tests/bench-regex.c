@@ -0,0 +1,88 @@
+/*
+ * Regular expression search compared with literal search
+ *
+ * usage: bench-regex
+ *
+ * The buffer holds 4M lines of log messages, about 240 MB, followed
+ * by a single line matching the searched patterns.
+ */
+
+#include "qe.h"
+
+#define NB_LINES  4000000
+
+static QEditScreen bench_screen;
+
+static double elapsed_ms(int start)
+{
+    return (unsigned int)(get_clock_usec() - start) / 1000.0;
+}
+
+static int bench_regex(EditBuffer *b, const char *pattern, int flags, int dir)
+{
+    char error[128];
+    QEOffset groups[2 * RE_MAX_GROUPS];
+    QERegex *re;
+    int start, found;
+
+    re = qe_regex_compile(pattern, flags, error, sizeof(error));
+    if (!re) {
+        printf("%s: %s\n", pattern, error);
+        return 0;
+    }
+    start = get_clock_usec();
+    if (dir > 0)
+        found = eb_regex_search(b, re, 0, b->total_size + 1, 1, groups);
+    else
+        found = eb_regex_search(b, re, b->total_size, 0, -1, groups);
+    printf("regex %-24s %s %9.3f ms  found at %lld\n",
+           pattern, dir > 0 ? "fwd" : "bwd", elapsed_ms(start),
+           found ? (long long)groups[0] : -1LL);
+    qe_regex_free(&re);
+    return found;
+}
+
+int main(void)
+{
+    EditBuffer *b;
+    char line[128];
+    QEOffset found_offset, found_end;
+    int start, i, len, errors = 0;
+
+    qe_state.screen = &bench_screen;
+    charset_init();
+    b = eb_new("bench", 0);
+    eb_set_charset(b, &charset_utf8, EOL_UNIX);
+    for (i = 0; i < NB_LINES; i++) {
+        len = snprintf(line, sizeof(line),
+                       "%08d INFO request served in %d ms from host-%d.example.com\n",
+                       i, i % 977, i % 13);
+        eb_insert(b, b->total_size, line, len);
+    }
+    eb_insert_str(b, b->total_size, "NEEDLE in the haystack took 1234ms\n");
+    printf("%lld bytes\n", (long long)b->total_size);
+
+    start = get_clock_usec();
+    if (!eb_search(b, 0, 1, 0, "NEEDLE", 6, NULL, NULL,
+                   &found_offset, &found_end)) {
+        found_offset = -1;
+    }
+    printf("literal %-22s fwd %9.3f ms  found at %lld\n",
+           "NEEDLE", elapsed_ms(start), (long long)found_offset);
+
+    errors += !bench_regex(b, "NEEDLE", 0, 1);
+    errors += !bench_regex(b, "needle", SEARCH_FLAG_IGNORECASE, 1);
+    errors += !bench_regex(b, "NEED\\(LE\\|ED\\)", 0, 1);
+    errors += !bench_regex(b, "[0-9]+ms\\>", 0, 1);
+    errors += !bench_regex(b, "^NEEDLE.*took", 0, 1);
+    errors += bench_regex(b, "host-[0-9]\\{3\\}", 0, 1);
+    errors += bench_regex(b, "\\<[a-z]+-99\\.", 0, 1);
+    errors += !bench_regex(b, "^00000000 INFO", 0, -1);
+
+    eb_free(&b);
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+    return 0;
+}
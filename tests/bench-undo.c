@@ -0,0 +1,107 @@
+/*
+ * Undo log of many small edits
+ *
+ * usage: bench-undo
+ *
+ * A buffer of 20k lines gets 1M single byte insertions and deletions
+ * at random offsets, each one as a separate command, then the last
+ * 100k edits are undone and the contents compared with a copy made
+ * before them.
+ */
+
+#include "qe.h"
+
+#include <sys/resource.h>
+
+#define NB_LINES  20000
+#define NB_EDITS  1000000
+#define NB_UNDOS  100000
+
+static QEditScreen bench_screen;
+
+static unsigned int rand_state = 1;
+
+static int bench_rand(int n)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 8) % n;
+}
+
+static double elapsed_ms(int start)
+{
+    return (unsigned int)(get_clock_usec() - start) / 1000.0;
+}
+
+/* return true if the buffers have the same contents */
+static int eb_equal(EditBuffer *b1, EditBuffer *b2)
+{
+    char buf1[4096], buf2[4096];
+    QEOffset offset;
+    int len;
+
+    if (b1->total_size != b2->total_size)
+        return 0;
+    for (offset = 0; offset < b1->total_size; offset += len) {
+        len = eb_read(b1, offset, buf1, sizeof(buf1));
+        if (eb_read(b2, offset, buf2, len) != len || memcmp(buf1, buf2, len))
+            return 0;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    QEmacsState *qs = &qe_state;
+    EditState s;
+    EditBuffer *b, *copy;
+    struct rusage ru;
+    int start, i, errors = 0;
+
+    qs->screen = &bench_screen;
+    qs->undo_limit = UNDO_LIMIT;
+    charset_init();
+    b = eb_new("bench", BF_SAVELOG);
+    copy = eb_new("bench-copy", 0);
+    for (i = 0; i < NB_LINES; i++)
+        eb_insert_str(b, b->total_size, "line of text for the undo benchmark\n");
+    memset(&s, 0, sizeof(s));
+    s.qe_state = qs;
+    s.b = b;
+
+    start = get_clock_usec();
+    for (i = 0; i < NB_EDITS; i++) {
+        if (i == NB_EDITS - NB_UNDOS)
+            eb_insert_buffer(copy, 0, b, 0, b->total_size);
+        /* each edit is a separate command */
+        qs->undo_unit++;
+        b->last_log = 0;
+        if (i & 1)
+            eb_delete(b, bench_rand(b->total_size), 1);
+        else
+            eb_insert(b, bench_rand(b->total_size), "x", 1);
+    }
+    printf("1M edits:     %9.3f ms  log %lld bytes, %d records\n",
+           elapsed_ms(start), (long long)b->log_buffer->total_size,
+           b->undo_count);
+
+    start = get_clock_usec();
+    qs->last_cmd_func = NULL;
+    for (i = 0; i < NB_UNDOS; i++) {
+        qs->undo_unit++;
+        do_undo(&s);
+        qs->last_cmd_func = (CmdFunc)do_undo;
+    }
+    printf("100k undos:   %9.3f ms\n", elapsed_ms(start));
+    errors += !eb_equal(b, copy);
+
+    getrusage(RUSAGE_SELF, &ru);
+    printf("max resident: %9ld KB\n", ru.ru_maxrss);
+
+    eb_free(&copy);
+    eb_free(&b);
+    if (errors) {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+    return 0;
+}
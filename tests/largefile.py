@@ -0,0 +1,81 @@
+#!/usr/bin/env python3
+#
+# Open a sparse 8 GB file in qemacs and navigate past 4 GB with
+# goto-char, goto-line and end-of-buffer, checking the offsets shown
+# by what-cursor-position.
+#
+# usage: largefile.py [QE]
+#
+
+import fcntl, os, pty, select, shutil, struct, subprocess, sys, tempfile
+import termios, time
+
+QE = sys.argv[1] if len(sys.argv) > 1 else '../qe'
+SIZE = 8 << 30
+TEXT_OFFSET = 5000000000
+TEXT = b'first\nsecond\nthird\n'
+TIMEOUT = 60
+
+def start(filename, home):
+    pid, fd = pty.fork()
+    if pid == 0:
+        fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', 25, 80, 0, 0))
+        env = dict(os.environ, TERM='xterm', HOME=home)
+        os.execve(QE, [QE, '-q', '-c', 'utf8', filename], env)
+    return pid, fd
+
+def expect(fd, keys, pattern):
+    """send keys, wait for pattern in the terminal output"""
+    os.write(fd, keys)
+    output = b''
+    deadline = time.time() + TIMEOUT
+    while time.time() < deadline:
+        r, _, _ = select.select([fd], [], [], 0.1)
+        if r:
+            try:
+                data = os.read(fd, 65536)
+            except OSError:
+                break
+            if not data:
+                break
+            output += data
+            if pattern in output:
+                return True
+    return False
+
+def main():
+    tmpdir = tempfile.mkdtemp(prefix='qe-test-')
+    filename = os.path.join(tmpdir, 'sparse.bin')
+    failed = 0
+    try:
+        subprocess.check_call(['truncate', '-s', str(SIZE), filename])
+        with open(filename, 'r+b') as f:
+            f.seek(TEXT_OFFSET)
+            f.write(TEXT)
+        pid, fd = start(filename, tmpdir)
+        expect(fd, b'', b'sparse.bin')
+        # C-g clears the status line so the next message is redrawn
+        checks = [
+            ('goto-char', b'\x1bxgoto-char\r%d\r' % TEXT_OFFSET,
+             b'point=%d ' % TEXT_OFFSET),
+            ('goto-line', b'\x1bxgoto-line\r3\r',
+             b'point=%d ' % (TEXT_OFFSET + TEXT.index(b'third'))),
+            ('end-of-buffer', b'\x1bxend-of-buffer\r',
+             b'point=%d ' % SIZE),
+            ('beginning-of-buffer', b'\x1bxbeginning-of-buffer\r',
+             b'point=0 '),
+        ]
+        for name, keys, pattern in checks:
+            if expect(fd, keys + b'\x07\x18=', pattern):
+                print('%s: ok' % name)
+            else:
+                print('%s: FAILED, expected %s' % (name, pattern.decode()))
+                failed += 1
+        os.kill(pid, 9)
+        os.waitpid(pid, 0)
+    finally:
+        shutil.rmtree(tmpdir)
+    return 1 if failed else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -52,73 +52,255 @@ static int treesitter_mode_probe(ModeDef *mode, ModeProbeData *p)
     return 1000000;
 }
 
-// implements TSInput read
-static const char *ts_input_read(void *payload, uint32_t byte_index, TSPoint position, uint32_t *bytes_read) {
-    EditBuffer *b = (EditBuffer *)payload;
+// maps grammar node types to styles, per language
+typedef struct TreeSitterStyle {
+    const char *type;
+    int style;
+} TreeSitterStyle;
+
+static const TreeSitterStyle treesitter_json_styles[] = {
+    { "object", QE_STYLE_HTML_COMMENT },
+    { "string_content", QE_STYLE_STRING },
+    { "string", QE_STYLE_STRING },
+    { "comment", QE_STYLE_COMMENT },
+    { NULL, 0 },
+};
+
+static const TreeSitterStyle treesitter_go_styles[] = {
+    { "comment", QE_STYLE_COMMENT },
+    { "identifier", QE_STYLE_VARIABLE },
+    { "package_clause", QE_STYLE_KEYWORD },
+    { "literal_value", QE_STYLE_NUMBER },
+    { "import_declaration", QE_STYLE_KEYWORD },
+    { "interpreted_string_literal", QE_STYLE_STRING },
+    { NULL, 0 },
+};
+
+typedef struct TreeSitterLanguage {
+    const char *extensions;
+    const char *mode_name;
+    int mode_flags;
+    TSLanguage *(*language)(void);
+    const TreeSitterStyle *styles;
+    // style indexed by grammar symbol, computed on first use
+    unsigned short *symbol_styles;
+    int nb_symbols;
+} TreeSitterLanguage;
+
+static TreeSitterLanguage treesitter_languages[] = {
+    { "c|h|C|H", "treesitter/c", TREESITTER_C, NULL, NULL, NULL, 0 },
+    { "json", "treesitter/json", TREESITTER_JSON, tree_sitter_json,
+      treesitter_json_styles, NULL, 0 },
+    { "go", "treesitter/go", TREESITTER_GO, tree_sitter_go,
+      treesitter_go_styles, NULL, 0 },
+};
+
+// find the style of a node type by name
+static int treesitter_find_style(const TreeSitterStyle *styles, const char *name) {
+    const TreeSitterStyle *ts;
+
+    for (ts = styles; ts->type; ts++) {
+        if (!strcmp(name, ts->type))
+            return ts->style;
+    }
+    return 0;
+}
 
-    char *buf = qe_malloc_array(char, b->total_size);
+// build the dense symbol to style table of a language, if memory is
+// short the styles are looked up by node name instead
+static void treesitter_compile_styles(TreeSitterLanguage *tl) {
+    const TSLanguage *language = tl->language();
+    int sym, nb_symbols;
+
+    nb_symbols = ts_language_symbol_count(language);
+    tl->symbol_styles = qe_malloc_array(unsigned short, nb_symbols);
+    if (!tl->symbol_styles) {
+        tl->nb_symbols = 0;
+        return;
+    }
+    tl->nb_symbols = nb_symbols;
+    for (sym = 0; sym < nb_symbols; sym++) {
+        tl->symbol_styles[sym] = 0;
+        if (ts_language_symbol_type(language, sym) != TSSymbolTypeRegular)
+            continue;
+        // several symbols may share a name through aliases
+        tl->symbol_styles[sym] =
+            treesitter_find_style(tl->styles,
+                                  ts_language_symbol_name(language, sym));
+    }
+}
 
-    *bytes_read = eb_get_region_contents(b, byte_index, b->total_size,
-                           buf, b->total_size);
-    return buf;
+static int treesitter_node_style(const TreeSitterLanguage *tl, TSNode node) {
+    TSSymbol sym;
+
+    if (!tl->symbol_styles)
+        return treesitter_find_style(tl->styles, ts_node_type(node));
+    sym = ts_node_symbol(node);
+    return (sym < tl->nb_symbols) ? tl->symbol_styles[sym] : 0;
 }
 
+// number of cached colorized lines, indexed by line number
+#define TS_LINE_CACHE_SIZE 256
+
+typedef struct TreeSitterRun {
+    int start, end, style;
+} TreeSitterRun;
+
+// style runs of a line, valid for a given tree version
+typedef struct TreeSitterLineCache {
+    int line_num;
+    QEOffset line_offset;
+    int line_len;
+    unsigned int version;   // 0 for unused entries
+    int nb_runs;
+    int nb_alloc;
+    TreeSitterRun *runs;
+} TreeSitterLineCache;
+
+// size of the chunks converted to UTF-8 for other charsets
+#define TS_CHUNK_SIZE 1024
+
 typedef struct TreeSitterModeState {
     EditState *s;
+    EditBuffer *b;
     TSTree *tree;
     TSParser *parser;
+    TSInput input;
+    TreeSitterLanguage *language;
+    // incremented upon each parse, keys the line cache
+    unsigned int tree_version;
+    TreeSitterLineCache line_cache[TS_LINE_CACHE_SIZE];
+    // tree was edited since last parse
+    int dirty;
+    // insert and overwrite edits are completed once the buffer is updated
+    int pending;
+    TSInputEdit pending_edit;
+    char chunk[TS_CHUNK_SIZE * 4];
 } TreeSitterModeState;
 
-// updates the treesitter AST as buffer edits are performed
+// implements TSInput read: hand out page data directly, no copy
+static const char *ts_input_read(void *payload, uint32_t byte_index, TSPoint position, uint32_t *bytes_read) {
+    TreeSitterModeState *tsstate = (TreeSitterModeState *)payload;
+    EditBuffer *b = tsstate->b;
+    const u8 *data;
+    int size;
+
+    if (b->charset == &charset_utf8 && b->eol_type == EOL_UNIX) {
+        data = eb_peek(b, byte_index, &size);
+        *bytes_read = size;
+        return size ? cs8(data) : "";
+    }
+    // other charsets: convert a chunk into the state buffer
+    *bytes_read = eb_get_region_contents(b, byte_index, byte_index + TS_CHUNK_SIZE,
+                                         tsstate->chunk, sizeof(tsstate->chunk));
+    return tsstate->chunk;
+}
+
+// tree-sitter columns are byte offsets from the start of the line
+static TSPoint ts_point_at(EditBuffer *b, QEOffset offset) {
+    int line_num, col;
+
+    eb_get_pos(b, &line_num, &col, offset);
+    return (TSPoint){.row = line_num,
+                     .column = offset - eb_goto_pos(b, line_num, 0)};
+}
+
+// complete and apply the last insert or overwrite edit
+static void treesitter_flush_edit(TreeSitterModeState *tsstate) {
+    if (tsstate->pending) {
+        tsstate->pending = 0;
+        tsstate->pending_edit.new_end_point =
+            ts_point_at(tsstate->b, tsstate->pending_edit.new_end_byte);
+        ts_tree_edit(tsstate->tree, &tsstate->pending_edit);
+    }
+}
+
+// updates the treesitter AST as buffer edits are performed: the
+// callback is invoked before the buffer is modified, so the new end
+// point of inserted text is computed upon the next edit or reparse.
 static void treesitter_edit_buffer_callback(EditBuffer *b, void *opaque,
                                             int arg, enum LogOperation op,
-                                            int offset, int size) {
+                                            QEOffset offset, QEOffset size) {
 
-    dprintf("treesitter_edit_buffer_callback: OP:%d OFFSET:%d SIZE:%d\n", op, offset, size);
+    dprintf("treesitter_edit_buffer_callback: OP:%d OFFSET:%lld SIZE:%lld\n", op, offset, size);
 
     TreeSitterModeState *tsstate = (TreeSitterModeState *) opaque;
-    TSTree *tree = (TSTree *) tsstate->tree;
+    TSInputEdit edit;
 
-    int line_num, col;
+    if (!tsstate->tree)
+        return;
 
-    TSInputEdit edit;
-    edit.start_byte = offset;
+    treesitter_flush_edit(tsstate);
 
-    eb_get_pos(b, &line_num, &col, offset);
-    edit.start_point = (TSPoint){.row = line_num, .column = col};
+    edit.start_byte = offset;
+    edit.start_point = ts_point_at(b, offset);
 
     switch (op) {
     case LOGOP_INSERT:
         edit.old_end_byte = offset;
+        edit.old_end_point = edit.start_point;
         edit.new_end_byte = offset + size;
-
-        eb_get_pos(b, &line_num, &col, offset);
-        edit.old_end_point = (TSPoint){.row = line_num, .column = col};
-
-        eb_get_pos(b, &line_num, &col, offset + size);
-        edit.new_end_point = (TSPoint){.row = line_num, .column = col};
+        tsstate->pending_edit = edit;
+        tsstate->pending = 1;
+        break;
+    case LOGOP_WRITE:
+        edit.old_end_byte = offset + size;
+        edit.old_end_point = ts_point_at(b, offset + size);
+        edit.new_end_byte = offset + size;
+        tsstate->pending_edit = edit;
+        tsstate->pending = 1;
         break;
     case LOGOP_DELETE:
-        edit.old_end_byte = offset;
-        edit.new_end_byte = offset - size;
-
-        eb_get_pos(b, &line_num, &col, offset);
-        edit.old_end_point = (TSPoint){.row = line_num, .column = col};
-
-        eb_get_pos(b, &line_num, &col, offset - size);
-        edit.new_end_point = (TSPoint){.row = line_num, .column = col};
+        edit.old_end_byte = offset + size;
+        edit.old_end_point = ts_point_at(b, offset + size);
+        edit.new_end_byte = offset;
+        edit.new_end_point = edit.start_point;
+        ts_tree_edit(tsstate->tree, &edit);
         break;
     default:
         put_error(tsstate->s, "LOGOP not implemented: %d", op);
+        return;
+    }
+    tsstate->dirty = 1;
+}
+
+// reparse incrementally, reusing the unchanged parts of the edited tree
+static void treesitter_update_tree(TreeSitterModeState *tsstate) {
+    TSTree *tree;
+
+    if (!tsstate->dirty)
+        return;
+
+    treesitter_flush_edit(tsstate);
+    tree = ts_parser_parse(tsstate->parser, tsstate->tree, tsstate->input);
+    if (tree) {
+        ts_tree_delete(tsstate->tree);
+        tsstate->tree = tree;
+        tsstate->tree_version++;
+    }
+    tsstate->dirty = 0;
+}
+
+static void treesitter_add_run(TreeSitterLineCache *lc, int start, int end, int style) {
+    if (lc->nb_runs >= lc->nb_alloc) {
+        lc->nb_alloc = lc->nb_alloc ? lc->nb_alloc * 2 : 8;
+        qe_realloc(&lc->runs, lc->nb_alloc * sizeof(*lc->runs));
     }
-    ts_tree_edit(tree, &edit);
+    lc->runs[lc->nb_runs].start = start;
+    lc->runs[lc->nb_runs].end = end;
+    lc->runs[lc->nb_runs].style = style;
+    lc->nb_runs++;
 }
 
-/* colorize nodes for a single line
-   receives the root node, the original code point buffer, line length, file byte offset for the line
+/* collect style runs of the nodes for a single line
+   receives the root node, the symbol style table, the line cache entry to fill
  */
-void treesitter_mode_colorize_node_line(TSNode root, unsigned int *buf, int line_len, int line_num,
-                                   int line_offset) {
+static void treesitter_mode_colorize_node_line(TSNode root, const TreeSitterLanguage *tl,
+                                               TreeSitterLineCache *lc) {
+    int line_len = lc->line_len;
+    int line_num = lc->line_num;
+    QEOffset line_offset = lc->line_offset;
+
     // do not botter with empty lines
     if (line_len == 0) {
         goto exit;
@@ -130,110 +312,121 @@ void treesitter_mode_colorize_node_line(TSNode root, unsigned int *buf, int line
     int idx = ts_tree_cursor_goto_first_child_for_point(&cursor, line_start);
     // don't bother if no children
     if (idx < 0) {
-        goto exit;
+        goto done;
     }
 
     while (1) {
         TSNode node = ts_tree_cursor_current_node(&cursor);
         // skip literals
         if (!ts_node_is_named(node)) {
-            goto exit;
+            goto done;
         }
 
         // doc relative offset
-        int start_byte = ts_node_start_byte(node);
-        int end_byte = ts_node_end_byte(node);
+        QEOffset start_byte = ts_node_start_byte(node);
+        QEOffset end_byte = ts_node_end_byte(node);
 
         // restrict to inside of line
-        start_byte = max(line_offset, start_byte) - line_offset;
-        end_byte = min(end_byte, line_offset + line_len) - line_offset;
-
-        dprintf("LINE_NUM:%d LINE_LEN::%d line_offset:%d | NODE idx:%d SB:%d EB:%d RANGE: %d-%d %s\n", line_num, line_len, line_offset, idx, ts_node_start_byte(node), ts_node_end_byte(node), start_byte, end_byte, ts_node_type(node));
-
-        int style = -1;
-        if (!strcmp(ts_node_type(node), "object")) {
-            style = QE_STYLE_HTML_COMMENT;
-        } else if (!strcmp(ts_node_type(node), "string_content")) {
-            style = QE_STYLE_STRING;
-        } else if (!strcmp(ts_node_type(node), "string")) {
-            style = QE_STYLE_STRING;
-        } else if (!strcmp(ts_node_type(node), "comment")) {
-            style = QE_STYLE_COMMENT;
-        } else if (!strcmp(ts_node_type(node), "identifier")) {
-            style = QE_STYLE_VARIABLE;
-        } else if (!strcmp(ts_node_type(node), "package_clause")) {
-            style = QE_STYLE_KEYWORD;
-        } else if (!strcmp(ts_node_type(node), "literal_value")) {
-            style = QE_STYLE_NUMBER;
-        } else if (!strcmp(ts_node_type(node), "import_declaration")) {
-            style = QE_STYLE_KEYWORD;
-        } else if (!strcmp(ts_node_type(node), "interpreted_string_literal")) {
-            style = QE_STYLE_STRING;
-        }
+        start_byte = max_offset(line_offset, start_byte) - line_offset;
+        end_byte = min_offset(end_byte, line_offset + line_len) - line_offset;
+
+        dprintf("LINE_NUM:%d LINE_LEN::%d line_offset:%lld | NODE idx:%d SB:%d EB:%d RANGE: %lld-%lld %s\n", line_num, line_len, line_offset, idx, ts_node_start_byte(node), ts_node_end_byte(node), start_byte, end_byte, ts_node_type(node));
+
+        int style = treesitter_node_style(tl, node);
 
         if (style > 0) {
-            dprintf("set_color(%d, %d, %s)\n", start_byte, end_byte, qe_styles[style].name);
-            set_color(buf + start_byte, buf + end_byte, style);
+            dprintf("set_color(%lld, %lld, %s)\n", start_byte, end_byte, qe_styles[style].name);
+            treesitter_add_run(lc, (int)start_byte, (int)end_byte, style);
         }
 
-        treesitter_mode_colorize_node_line(node, buf, line_len, line_num, line_offset);
+        treesitter_mode_colorize_node_line(node, tl, lc);
 
-        TSNode ts_tree_cursor_current_node(const TSTreeCursor *);
         if (!ts_tree_cursor_goto_next_sibling(&cursor)) {
             break;
-        } 
+        }
     }
+ done:
+    ts_tree_cursor_delete(&cursor);
  exit:
-    //ts_tree_cursor_delete(&cursor);
+    return;
 }
 
 int treesitter_get_colorized_line(EditState *s, unsigned int *buf, int buf_size,
-                                  int *offsetp, int line_num) {
+                                  QEOffset *offsetp, int line_num) {
     // eb_get_line will set offset to next line, so save it
-    int line_offset = *offsetp;
+    QEOffset line_offset = *offsetp;
+    int i;
 
     TreeSitterModeState *tsstate = (TreeSitterModeState *) s->b->priv_data;
     int line_len = eb_get_line(s->b, buf, buf_size, offsetp);
 
-    TSTree *tree = (TSTree *) tsstate->tree;
-    TSNode root = ts_tree_root_node(tree);
+    if (!tsstate->tree)
+        return line_len;
 
-    dprintf("treesitter_get_colorized_line: BUF:%d SIZE:%d OFFSETP:%d LINE:%d LINE_LEN:%d\n", buf, buf_size, line_offset, line_num, line_len);
+    // reparse lazily, once per batch of edits
+    treesitter_update_tree(tsstate);
 
     int bom = (line_len > 0 && buf[0] == 0xFEFF);
-    treesitter_mode_colorize_node_line(root, buf + bom, line_len - bom, line_num, line_offset);
+    TreeSitterLineCache *lc = &tsstate->line_cache[line_num % TS_LINE_CACHE_SIZE];
+
+    if (lc->version != tsstate->tree_version
+    ||  lc->line_num != line_num
+    ||  lc->line_offset != line_offset
+    ||  lc->line_len != line_len - bom) {
+        TSNode root = ts_tree_root_node(tsstate->tree);
+
+        dprintf("treesitter_get_colorized_line: BUF:%d SIZE:%d OFFSETP:%lld LINE:%d LINE_LEN:%d\n", buf, buf_size, line_offset, line_num, line_len);
+
+        lc->version = tsstate->tree_version;
+        lc->line_num = line_num;
+        lc->line_offset = line_offset;
+        lc->line_len = line_len - bom;
+        lc->nb_runs = 0;
+        treesitter_mode_colorize_node_line(root, tsstate->language, lc);
+    }
 
+    for (i = 0; i < lc->nb_runs; i++) {
+        set_color(buf + bom + lc->runs[i].start, buf + bom + lc->runs[i].end,
+                  lc->runs[i].style);
+    }
     return line_len;
 }
 
 static int treesitter_mode_init(EditState *s, ModeSavedData *saved_data)
 {
     TSParser *parser = ts_parser_new();
+    TreeSitterLanguage *tl = NULL;
+    int i;
 
-    if (match_extension(s->b->filename, "c|h|C|H")) {
-        s->mode_name = "treesitter/c";
-        s->mode_flags = TREESITTER_C;
-    } else if (match_extension(s->b->filename, "json")) {
-        ts_parser_set_language(parser, tree_sitter_json());
-        s->mode_name = "treesitter/json";
-        s->mode_flags = TREESITTER_JSON;
-    } else if (match_extension(s->b->filename, "go")) {
-        ts_parser_set_language(parser, tree_sitter_go());
-        s->mode_name = "treesitter/go";
-        s->mode_flags = TREESITTER_GO;
+    for (i = 0; i < countof(treesitter_languages); i++) {
+        if (match_extension(s->b->filename, treesitter_languages[i].extensions)) {
+            tl = &treesitter_languages[i];
+            break;
+        }
+    }
+    if (tl) {
+        s->mode_name = tl->mode_name;
+        s->mode_flags = tl->mode_flags;
+        if (tl->language) {
+            ts_parser_set_language(parser, tl->language());
+            if (!tl->symbol_styles)
+                treesitter_compile_styles(tl);
+        }
     }
 
-    TSInput input;
-    input.encoding = TSInputEncodingUTF8;
-    input.payload = s->b;
-    input.read = ts_input_read;
-
-    TSTree *tree = ts_parser_parse(parser, NULL, input);
-
-    TreeSitterModeState *tsstate = qe_malloc(TreeSitterModeState);
+    TreeSitterModeState *tsstate = qe_mallocz(TreeSitterModeState);
     tsstate->s = s;
+    tsstate->b = s->b;
     tsstate->parser = parser;
-    tsstate->tree = tree;
+    tsstate->language = tl;
+    tsstate->tree_version = 1;
+
+    tsstate->input.encoding = TSInputEncodingUTF8;
+    tsstate->input.payload = tsstate;
+    tsstate->input.read = ts_input_read;
+
+    // NULL if no language could be set
+    tsstate->tree = ts_parser_parse(parser, NULL, tsstate->input);
 
     // perhaps s->mode_data is better
     s->b->priv_data = tsstate;
@@ -246,8 +439,20 @@ static int treesitter_mode_init(EditState *s, ModeSavedData *saved_data)
 
 static void treesitter_mode_close(EditState *e)
 {
-    TSParser *parser = (TSParser *)e->b->priv_data;
-    ts_parser_delete(parser);
+    TreeSitterModeState *tsstate = (TreeSitterModeState *)e->b->priv_data;
+    int i;
+
+    if (!tsstate)
+        return;
+
+    eb_free_callback(e->b, treesitter_edit_buffer_callback, tsstate);
+    if (tsstate->tree)
+        ts_tree_delete(tsstate->tree);
+    ts_parser_delete(tsstate->parser);
+    for (i = 0; i < TS_LINE_CACHE_SIZE; i++) {
+        qe_free(&tsstate->line_cache[i].runs);
+    }
+    qe_free(&e->b->priv_data);
 }
 
 static int treesitter_init()
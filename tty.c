@@ -28,19 +28,27 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
 
 #include "qe.h"
 
-typedef unsigned int TTYChar;
-#define TTYCHAR(ch,fg,bg)   ((ch) | ((fg) << 16) | ((bg) << 24))
-#define TTYCHAR2(ch,col)    ((ch) | ((col) << 16))
-#define TTYCHAR_GETCH(cc)   ((cc) & 0xFFFF)
-#define TTYCHAR_GETCOL(cc)  (((cc) >> 16) & 0xFFFF)
-#define TTYCHAR_GETFG(cc)   (((cc) >> 16) & 0xFF)
-#define TTYCHAR_GETBG(cc)   (((cc) >> 24) & 0xFF)
+/* A screen cell holds the char in the low 32 bits and the foreground
+ * and background color codes in the next 16 bit fields.  Color codes
+ * below 256 are palette indexes, the others index the 24-bit colors
+ * of the terminal state.
+ */
+typedef unsigned long long TTYChar;
+#define TTYCHAR(ch,fg,bg)   ((TTYChar)(ch) | ((TTYChar)(fg) << 32) | \
+                             ((TTYChar)(bg) << 48))
+#define TTYCHAR2(ch,col)    ((TTYChar)(ch) | ((TTYChar)(col) << 32))
+#define TTYCHAR_GETCH(cc)   ((unsigned int)((cc) & 0xFFFFFFFF))
+#define TTYCHAR_GETCOL(cc)  ((unsigned int)((cc) >> 32))
+#define TTYCHAR_GETFG(cc)   ((unsigned int)((cc) >> 32) & 0xFFFF)
+#define TTYCHAR_GETBG(cc)   ((unsigned int)((cc) >> 48) & 0xFFFF)
 #define TTYCHAR_DEFAULT     TTYCHAR(' ', 7, 0)
+#define TTYCHAR_NONE        0xFFFFF  /* right half of a wide glyph */
 
 #if defined(CONFIG_UNLOCKIO)
 #  define TTY_PUTC(c,f)         putc_unlocked(c, f)
@@ -92,6 +100,17 @@ typedef struct TTYState {
 #define USE_BOLD_AS_BRIGHT     2
 #define USE_BLINK_AS_BRIGHT    4
 #define USE_ERASE_END_OF_LINE  8
+    int term_colors;            /* 16, 256 or 0x1000000 colors */
+    /* memoized color codes of QEColor values */
+    QEColor *color_keys;
+    int *color_codes;           /* -1 for empty slots */
+    int color_cache_size, color_cache_count;
+    /* 24-bit colors of the codes from 256 on */
+    QEColor *rgb_colors;
+    int nb_rgb_colors, rgb_colors_alloc;
+    /* output buffer of tty_term_flush() */
+    unsigned char *out;
+    int out_len, out_size;
 } TTYState;
 
 static void tty_resize(int sig);
@@ -112,6 +131,7 @@ static int tty_term_init(QEditScreen *s,
     TTYState *ts;
     struct termios tty;
     struct sigaction sig;
+    const char *p;
 
     s->STDIN = stdin;
     s->STDOUT = stdout;
@@ -150,6 +170,18 @@ static int tty_term_init(QEditScreen *s,
         }
     }
 
+    /* Color support: xterm-256color and the like have 256 colors,
+     * COLORTERM tells if 24-bit colors are supported.
+     */
+    tty_state.term_colors = 16;
+    if (tty_state.term_name && strstr(tty_state.term_name, "256color"))
+        tty_state.term_colors = 256;
+    p = getenv("COLORTERM");
+    if (p && (strstr(p, "truecolor") || strstr(p, "24bit"))
+    &&  tty_state.term_code != TERM_CYGWIN) {
+        tty_state.term_colors = 0x1000000;
+    }
+
     tcgetattr(fileno(s->STDIN), &tty);
     ts->oldtty = tty;
 
@@ -263,6 +295,13 @@ static void tty_term_close(QEditScreen *s)
 
     qe_free(&ts->screen);
     qe_free(&ts->line_updated);
+    qe_free(&ts->color_keys);
+    qe_free(&ts->color_codes);
+    qe_free(&ts->rgb_colors);
+    qe_free(&ts->out);
+    ts->out_len = ts->out_size = 0;
+    ts->color_cache_size = ts->color_cache_count = 0;
+    ts->nb_rgb_colors = ts->rgb_colors_alloc = 0;
 }
 
 static void tty_term_exit(void)
@@ -841,6 +880,97 @@ int get_tty_color(QEColor color, unsigned int const *colors, int count)
     return cmin;
 }
 
+/* Map a color to a terminal color code: the 16 basic colors are kept
+ * as such, other colors get the nearest palette entry or a 24-bit
+ * color code depending on the terminal.
+ */
+static int tty_map_color(TTYState *ts, QEColor color)
+{
+    int code;
+
+    code = get_tty_color(color, tty_fg_colors, 16);
+    if (ts->term_colors <= 16 || (tty_fg_colors[code] & 0xFFFFFF) == color)
+        return code;
+
+    if (ts->term_colors > 256 && ts->nb_rgb_colors < 0x10000 - 256) {
+        if (ts->nb_rgb_colors >= ts->rgb_colors_alloc) {
+            int n = ts->rgb_colors_alloc ? ts->rgb_colors_alloc * 2 : 64;
+            if (qe_realloc(&ts->rgb_colors, n * sizeof(*ts->rgb_colors)))
+                ts->rgb_colors_alloc = n;
+        }
+        if (ts->nb_rgb_colors < ts->rgb_colors_alloc) {
+            ts->rgb_colors[ts->nb_rgb_colors] = color;
+            return 256 + ts->nb_rgb_colors++;
+        }
+    }
+    return get_tty_color(color, tty_fg_colors, 256);
+}
+
+static inline unsigned int tty_color_hash(QEColor color, int size)
+{
+    return (color * 2654435761U) >> 8 & (size - 1);
+}
+
+/* Return the terminal color code for a color, memoized in an open
+ * addressing hash table.
+ */
+static int tty_color_code(TTYState *ts, QEColor color)
+{
+    unsigned int h;
+    int i, code, size;
+    QEColor *keys;
+    int *codes;
+
+    color &= 0xFFFFFF;
+    if (ts->color_cache_size) {
+        h = tty_color_hash(color, ts->color_cache_size);
+        while ((code = ts->color_codes[h]) >= 0) {
+            if (ts->color_keys[h] == color)
+                return code;
+            h = (h + 1) & (ts->color_cache_size - 1);
+        }
+    }
+    code = tty_map_color(ts, color);
+
+    if (2 * (ts->color_cache_count + 1) > ts->color_cache_size) {
+        /* grow the table and rehash */
+        size = ts->color_cache_size ? ts->color_cache_size * 2 : 256;
+        keys = qe_malloc_array(QEColor, size);
+        codes = qe_malloc_array(int, size);
+        if (!keys || !codes) {
+            qe_free(&keys);
+            qe_free(&codes);
+            return code;
+        }
+        memset(codes, 0xFF, size * sizeof(*codes));
+        for (i = 0; i < ts->color_cache_size; i++) {
+            if (ts->color_codes[i] >= 0) {
+                h = tty_color_hash(ts->color_keys[i], size);
+                while (codes[h] >= 0)
+                    h = (h + 1) & (size - 1);
+                keys[h] = ts->color_keys[i];
+                codes[h] = ts->color_codes[i];
+            }
+        }
+        qe_free(&ts->color_keys);
+        qe_free(&ts->color_codes);
+        ts->color_keys = keys;
+        ts->color_codes = codes;
+        ts->color_cache_size = size;
+    }
+    h = tty_color_hash(color, ts->color_cache_size);
+    while (ts->color_codes[h] >= 0)
+        h = (h + 1) & (ts->color_cache_size - 1);
+    ts->color_keys[h] = color;
+    ts->color_codes[h] = code;
+    ts->color_cache_count++;
+    return code;
+}
+
+/* output the SGR sequence for color codes from 16 on, 'base' is 38
+ * for the foreground and 48 for the background.
+ */
+
 static void tty_term_fill_rectangle(QEditScreen *s,
                                     int x1, int y1, int w, int h, QEColor color)
 {
@@ -857,13 +987,19 @@ static void tty_term_fill_rectangle(QEditScreen *s,
         for (y = y1; y < y2; y++) {
             ts->line_updated[y] = 1;
             for (x = x1; x < x2; x++) {
-                *ptr ^= TTYCHAR(0, 7, 7);
+                if (TTYCHAR_GETFG(*ptr) < 16 && TTYCHAR_GETBG(*ptr) < 16) {
+                    *ptr ^= TTYCHAR(0, 7, 7);
+                } else {
+                    /* swap the extended colors */
+                    *ptr = TTYCHAR(TTYCHAR_GETCH(*ptr), TTYCHAR_GETBG(*ptr),
+                                   TTYCHAR_GETFG(*ptr));
+                }
                 ptr++;
             }
             ptr += wrap;
         }
     } else {
-        bgcolor = get_tty_color(color, tty_bg_colors, tty_bg_colors_count);
+        bgcolor = tty_color_code(ts, color);
         for (y = y1; y < y2; y++) {
             ts->line_updated[y] = 1;
             for (x = x1; x < x2; x++) {
@@ -1008,7 +1144,7 @@ static void tty_term_draw_text(QEditScreen *s, __unused__ QEFont *font,
         return;
 
     ts->line_updated[y] = 1;
-    fgcolor = get_tty_color(color, tty_fg_colors, tty_fg_colors_count);
+    fgcolor = tty_color_code(ts, color);
     ptr = ts->screen + y * s->width;
 
     if (x < s->clip_x1) {
@@ -1046,7 +1182,7 @@ static void tty_term_draw_text(QEditScreen *s, __unused__ QEFont *font,
         ptr++;
         n = w - 1;
         while (n > 0) {
-            *ptr = TTYCHAR(0xFFFFF, fgcolor, TTYCHAR_GETBG(*ptr));
+            *ptr = TTYCHAR(TTYCHAR_NONE, fgcolor, TTYCHAR_GETBG(*ptr));
             ptr++;
             n--;
         }
@@ -1060,27 +1196,225 @@ static void tty_term_set_clip(__unused__ QEditScreen *s,
 {
 }
 
+/* The update of a frame is assembled in ts->out and written to the
+ * terminal in a single write() call.
+ */
+static int tty_out_grow(TTYState *ts, int n)
+{
+    int size;
+
+    if (ts->out_len + n > ts->out_size) {
+        size = max(ts->out_len + n, ts->out_size + (ts->out_size >> 1) + 4096);
+        if (!qe_realloc(&ts->out, size))
+            return 0;
+        ts->out_size = size;
+    }
+    return 1;
+}
+
+static inline void tty_out_putc(TTYState *ts, int c)
+{
+    if (ts->out_len < ts->out_size || tty_out_grow(ts, 1))
+        ts->out[ts->out_len++] = c;
+}
+
+static void tty_out_write(TTYState *ts, const void *buf, int n)
+{
+    if (tty_out_grow(ts, n)) {
+        memcpy(ts->out + ts->out_len, buf, n);
+        ts->out_len += n;
+    }
+}
+
+static void tty_out_puts(TTYState *ts, const char *str)
+{
+    tty_out_write(ts, str, strlen(str));
+}
+
+static void __attr_printf(2,3) tty_out_printf(TTYState *ts,
+                                              const char *fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    tty_out_write(ts, buf, min(len, (int)sizeof(buf) - 1));
+}
+
+static void tty_out_flush(QEditScreen *s, TTYState *ts)
+{
+    const unsigned char *p = ts->out;
+    int n = ts->out_len;
+    int len;
+
+    /* output from stdio, if any, goes first */
+    fflush(s->STDOUT);
+    while (n > 0) {
+        len = write(fileno(s->STDOUT), p, n);
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                /* non blocking terminal: wait until it drains */
+                struct pollfd pfd;
+                pfd.fd = fileno(s->STDOUT);
+                pfd.events = POLLOUT;
+                if (poll(&pfd, 1, -1) >= 0 || errno == EINTR)
+                    continue;
+            }
+            break;
+        }
+        p += len;
+        n -= len;
+    }
+    qe_state.display_bytes += ts->out_len;
+    ts->out_len = 0;
+}
+
+/* output the SGR sequence for color codes from 16 on, 'base' is 38
+ * for the foreground and 48 for the background.
+ */
+static void tty_put_color(TTYState *ts, int base, int code)
+{
+    QEColor color;
+
+    if (code < 256) {
+        tty_out_printf(ts, "\033[%d;5;%dm", base, code);
+    } else {
+        color = ts->rgb_colors[code - 256];
+        tty_out_printf(ts, "\033[%d;2;%d;%d;%dm", base,
+                       (color >> 16) & 0xff, (color >> 8) & 0xff,
+                       color & 0xff);
+    }
+}
+
+static unsigned int tty_row_hash(const TTYChar *p, int w)
+{
+    unsigned int h = 0;
+
+    while (w-- > 0) {
+        TTYChar c = *p++;
+        h = (h ^ (unsigned int)c ^ (unsigned int)(c >> 32)) * 0x01000193;
+    }
+    return h;
+}
+
+/* Find the vertical shift of rows between the shadow buffer and the
+ * screen that saves the most rows, and scroll the terminal instead of
+ * repainting them: the rows are moved within a scroll region with
+ * delete line or insert line, and the shadow buffer is updated.
+ */
+static void tty_term_scroll(QEditScreen *s, TTYState *ts)
+{
+    int w = s->width, h = s->height, shadow = ts->screen_size;
+    int y, y0, r, k, n, gain, best_gain, best_k, best_y0, best_n, top, bot;
+    unsigned int *hnew, *hold;
+    TTYChar *screen = ts->screen, *old = ts->screen + shadow;
+
+    if (h < 4)
+        return;
+
+    hnew = qe_malloc_array(unsigned int, 2 * h);
+    if (!hnew)
+        return;
+    hold = hnew + h;
+    for (y = 0; y < h; y++) {
+        hnew[y] = tty_row_hash(screen + y * w, w);
+        hold[y] = tty_row_hash(old + y * w, w);
+    }
+
+    /* rows y0 .. y0 + n - 1 of the screen are rows y0 + k .. of the
+     * shadow buffer: the gain is the number of these rows not already
+     * in place minus the rows in place that the scroll clears.
+     */
+    best_gain = 1;
+    best_k = best_y0 = best_n = 0;
+    for (k = 1 - h; k < h; k++) {
+        if (k == 0)
+            continue;
+        for (y = max(0, -k); y < h && y + k < h; y = y0 + n + 1) {
+            y0 = y;
+            gain = 0;
+            for (n = 0; y0 + n < h && y0 + n + k < h
+                 && hnew[y0 + n] == hold[y0 + n + k]; n++) {
+                gain += (hnew[y0 + n] != hold[y0 + n]);
+            }
+            if (gain <= best_gain)
+                continue;
+            /* rows cleared by the scroll */
+            top = k > 0 ? y0 + n : y0 + k;
+            for (r = top; r < top + abs(k); r++)
+                gain -= (hnew[r] == hold[r]);
+            if (gain > best_gain) {
+                best_gain = gain;
+                best_k = k;
+                best_y0 = y0;
+                best_n = n;
+            }
+        }
+    }
+    qe_free(&hnew);
+    if (!best_n)
+        return;
+
+    /* check the rows, hashes may collide */
+    k = best_k;
+    y0 = best_y0;
+    for (n = 0; n < best_n; n++) {
+        if (memcmp(screen + (y0 + n) * w, old + (y0 + n + k) * w,
+                   w * sizeof(TTYChar)))
+            break;
+    }
+    if (n < 2)
+        return;
+
+    /* scroll region: rows top .. bot of the terminal */
+    if (k > 0) {
+        top = y0;
+        bot = y0 + n + k - 1;
+    } else {
+        top = y0 + k;
+        bot = y0 + n - 1;
+    }
+    tty_out_printf(ts, "\033[%d;%dr\033[%d;1H\033[%d%c\033[r",
+                   top + 1, bot + 1, top + 1, abs(k), k > 0 ? 'M' : 'L');
+
+    /* update the shadow buffer, cleared rows are invalid */
+    if (k > 0) {
+        memmove(old + top * w, old + (top + k) * w,
+                (bot + 1 - top - k) * w * sizeof(TTYChar));
+        memset(old + (bot + 1 - k) * w, 0xFF, k * w * sizeof(TTYChar));
+    } else {
+        memmove(old + (top - k) * w, old + top * w,
+                (bot + 1 - top + k) * w * sizeof(TTYChar));
+        memset(old + top * w, 0xFF, -k * w * sizeof(TTYChar));
+    }
+    memset(ts->line_updated + top, 1, bot + 1 - top);
+}
+
 static void tty_term_flush(QEditScreen *s)
 {
     TTYState *ts = s->priv_data;
     TTYChar *ptr, *ptr1, *ptr2, *ptr3, *ptr4, cc, blankcc;
     int y, shadow, ch, bgcolor, fgcolor, shifted;
 
-    TTY_FPUTS("\033[H\033[0m", s->STDOUT);
+    tty_out_puts(ts, "\033[H\033[0m");
 
     if (ts->term_code != TERM_CYGWIN) {
-        TTY_FPUTS("\033(B\033)0", s->STDOUT);
+        tty_out_puts(ts, "\033(B\033)0");
     }
 
     bgcolor = -1;
     fgcolor = -1;
     shifted = 0;
 
-    /* CG: Should optimize output by computing it in a temporary buffer
-     * and flushing it in one call to fwrite()
-     */
-
     shadow = ts->screen_size;
+    if (qe_state.tty_scroll && ts->term_code != TERM_VT100)
+        tty_term_scroll(s, ts);
+
     /* We cannot print anything on the bottom right screen cell,
      * pretend it's OK: */
     ts->screen[shadow - 1] = ts->screen[2 * shadow - 1];
@@ -1159,7 +1493,7 @@ static void tty_term_flush(QEditScreen *s)
              * double-width glyphs on the row in front of this
              * difference
              */
-            TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
+            tty_out_printf(ts, "\033[%d;%dH",
                         y + 1, (int)(ptr1 - ptr + 1));
 
             while (ptr1 < ptr4) {
@@ -1167,27 +1501,30 @@ static void tty_term_flush(QEditScreen *s)
                 ptr1[shadow] = cc;
                 ptr1++;
                 ch = TTYCHAR_GETCH(cc);
-                if (ch != 0xffff) {
+                if (ch != TTYCHAR_NONE) {
                     /* output attributes */
                   again:
                     if (bgcolor != (int)TTYCHAR_GETBG(cc)) {
                         int lastbg = bgcolor;
                         bgcolor = TTYCHAR_GETBG(cc);
+                        if (bgcolor > 15) {
+                            tty_put_color(ts, 48, bgcolor);
+                        } else
                         if (ts->term_flags & USE_BLINK_AS_BRIGHT) {
                             if (bgcolor > 7) {
                                 if (lastbg <= 7) {
-                                    TTY_FPUTS("\033[5m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[5m");
                                 }
                             } else {
                                 if (lastbg > 7) {
-                                    TTY_FPUTS("\033[0m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[0m");
                                     fgcolor = -1;
                                 }
                             }
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
+                            tty_out_printf(ts, "\033[%dm",
                                         40 + (bgcolor & 7));
                         } else {
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
+                            tty_out_printf(ts, "\033[%dm",
                                         bgcolor > 7 ? 100 + bgcolor - 8 :
                                         40 + bgcolor);
                         }
@@ -1197,55 +1534,57 @@ static void tty_term_flush(QEditScreen *s)
                     if (fgcolor != (int)TTYCHAR_GETFG(cc)) {
                         int lastfg = fgcolor;
                         fgcolor = TTYCHAR_GETFG(cc);
+                        if (fgcolor > 15) {
+                            tty_put_color(ts, 38, fgcolor);
+                        } else
                         if (ts->term_flags & USE_BOLD_AS_BRIGHT) {
                             if (fgcolor > 7) {
                                 if (lastfg <= 7) {
-                                    TTY_FPUTS("\033[1m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[1m");
                                 }
                             } else {
                                 if (lastfg > 7) {
-                                    TTY_FPUTS("\033[0m", s->STDOUT);
+                                    tty_out_puts(ts, "\033[0m");
                                     fgcolor = -1;
                                     bgcolor = -1;
                                     goto again;
                                 }
                             }
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
+                            tty_out_printf(ts, "\033[%dm",
                                         30 + (fgcolor & 7));
                         } else {
-                            TTY_FPRINTF(s->STDOUT, "\033[%dm",
-                                        fgcolor > 8 ? 90 + fgcolor - 8 :
+                            tty_out_printf(ts, "\033[%dm",
+                                        fgcolor > 7 ? 90 + fgcolor - 8 :
                                         30 + fgcolor);
                         }
                     }
                     if (shifted) {
                         /* Kludge for linedrawing chars */
                         if (ch < 128 || ch >= 128 + 32) {
-                            TTY_FPUTS("\033(B", s->STDOUT);
+                            tty_out_puts(ts, "\033(B");
                             shifted = 0;
                         }
                     }
 
                     /* do not display escape codes or invalid codes */
                     if (ch < 32 || ch == 127) {
-                        TTY_PUTC('.', s->STDOUT);
+                        tty_out_putc(ts, '.');
                     } else
                     if (ch < 127) {
-                        TTY_PUTC(ch, s->STDOUT);
+                        tty_out_putc(ts, ch);
                     } else
                     if (ch < 128 + 32) {
                         /* Kludges for linedrawing chars */
                         if (ts->term_code == TERM_CYGWIN) {
                             static const char unitab_xterm_poorman[32] =
                                 "*#****o~**+++++-----++++|****L. ";
-                            TTY_PUTC(unitab_xterm_poorman[ch - 128],
-                                     s->STDOUT);
+                            tty_out_putc(ts, unitab_xterm_poorman[ch - 128]);
                         } else {
                             if (!shifted) {
-                                TTY_FPUTS("\033(0", s->STDOUT);
+                                tty_out_puts(ts, "\033(0");
                                 shifted = 1;
                             }
-                            TTY_PUTC(ch - 32, s->STDOUT);
+                            tty_out_putc(ts, ch - 32);
                         }
                     } else {
                         u8 buf[10], *q;
@@ -1270,23 +1609,19 @@ static void tty_term_flush(QEditScreen *s)
                         }
 
                         nc = q - buf;
-                        if (nc == 1) {
-                            TTY_PUTC(*buf, s->STDOUT);
-                        } else {
-                            TTY_FWRITE(buf, 1, nc, s->STDOUT);
-                        }
+                        tty_out_write(ts, buf, nc);
                     }
                 }
             }
             if (shifted) {
-                TTY_FPUTS("\033(B", s->STDOUT);
+                tty_out_puts(ts, "\033(B");
                 shifted = 0;
             }
             if (ptr1 < ptr2) {
                 /* More differences to synch in shadow, erase eol */
                 cc = *ptr1;
                 /* the current attribute is already set correctly */
-                TTY_FPUTS("\033[K", s->STDOUT);
+                tty_out_puts(ts, "\033[K");
                 while (ptr1 < ptr2) {
                     ptr1[shadow] = cc;
                     ptr1++;
@@ -1295,19 +1630,19 @@ static void tty_term_flush(QEditScreen *s)
 //            if (ts->term_flags & USE_BLINK_AS_BRIGHT)
             {
                 if (bgcolor > 7) {
-                    TTY_FPUTS("\033[0m", s->STDOUT);
+                    tty_out_puts(ts, "\033[0m");
                     fgcolor = bgcolor = -1;
                 }
             }
         }
     }
 
-    TTY_FPUTS("\033[0m", s->STDOUT);
+    tty_out_puts(ts, "\033[0m");
     if (ts->cursor_y + 1 >= 0 && ts->cursor_x + 1 >= 0) {
-        TTY_FPRINTF(s->STDOUT, "\033[%d;%dH",
+        tty_out_printf(ts, "\033[%d;%dH",
                     ts->cursor_y + 1, ts->cursor_x + 1);
     }
-    fflush(s->STDOUT);
+    tty_out_flush(s, ts);
 }
 
 static QEDisplay tty_dpy = {
@@ -23,7 +23,8 @@
 
 static int unihex_mode_init(EditState *s, ModeSavedData *saved_data)
 {
-    int c, maxc, offset, max_offset;
+    QEOffset offset, max_offset;
+    int c, maxc;
 
     text_mode_init(s, saved_data);
 
@@ -32,7 +33,7 @@ static int unihex_mode_init(EditState *s, ModeSavedData *saved_data)
 
     /* Compute max width of character in hex dump (limit to first 64K) */
     maxc = 0xFF;
-    max_offset = min(65536, s->b->total_size);
+    max_offset = min_offset(65536, s->b->total_size);
     for (offset = 0; offset < max_offset;) {
         c = eb_nextc(s->b, offset, &offset);
         maxc = max(maxc, c);
@@ -58,9 +59,9 @@ static int unihex_to_disp(int c)
     return c;
 }
 
-static int unihex_backward_offset(EditState *s, int offset)
+static QEOffset unihex_backward_offset(EditState *s, QEOffset offset)
 {
-    int pos;
+    QEOffset pos;
 
     /* CG: beware: offset may fall inside a character */
     pos = eb_get_char_offset(s->b, offset);
@@ -68,19 +69,19 @@ static int unihex_backward_offset(EditState *s, int offset)
     return eb_goto_char(s->b, pos);
 }
 
-static int unihex_display(EditState *s, DisplayState *ds, int offset)
+static QEOffset unihex_display(EditState *s, DisplayState *ds, QEOffset offset)
 {
     int j, len, ateof, disp_width;
-    int offset1, offset2;
+    QEOffset offset1, offset2;
     unsigned int b;
     /* CG: array size is incorrect, should be smaller */
     unsigned int buf[LINE_MAX_SIZE];
-    unsigned int pos[LINE_MAX_SIZE];
+    QEOffset pos[LINE_MAX_SIZE];
 
     display_bol(ds);
 
     ds->style = QE_STYLE_COMMENT;
-    display_printf(ds, -1, -1, "%08x ", offset);
+    display_printf(ds, -1, -1, "%08llx ", offset);
     //int charpos = eb_get_char_offset(s->b, offset);
     //display_printf(ds, -1, -1, "%08x ", charpos);
     //display_printf(ds, -1, -1, "%08x %08x ", charpos, offset);
@@ -159,7 +160,7 @@ static int unihex_display(EditState *s, DisplayState *ds, int offset)
 
 static void unihex_move_bol(EditState *s)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
     pos = align(pos, s->disp_width);
@@ -168,7 +169,7 @@ static void unihex_move_bol(EditState *s)
 
 static void unihex_move_eol(EditState *s)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
@@ -189,7 +190,7 @@ static void unihex_move_left_right(EditState *s, int dir)
 
 static void unihex_move_up_down(EditState *s, int dir)
 {
-    int pos;
+    QEOffset pos;
 
     pos = eb_get_char_offset(s->b, s->offset);
 
@@ -201,7 +202,7 @@ static void unihex_move_up_down(EditState *s, int dir)
 static void unihex_mode_line(EditState *s, buf_t *out)
 {
     basic_mode_line(s, out, '-');
-    buf_printf(out, "0x%x--0x%x--%s",
+    buf_printf(out, "0x%llx--0x%llx--%s",
                eb_get_char_offset(s->b, s->offset),
                s->offset, s->b->charset->name);
     buf_printf(out, "--%d%%", compute_percent(s->offset, s->b->total_size));
@@ -210,7 +210,6 @@ static inline int check_timers(int max_delay)
     int timeout, cur_time;
 
     cur_time = get_clock_ms();
-    timeout = cur_time + max_delay;
     pt = &first_timer;
     for (;;) {
         ti = *pt;
@@ -224,12 +223,19 @@ static inline int check_timers(int max_delay)
             qe_free(&ti);
             call_bottom_halves();
         } else {
-            if ((ti->timeout - timeout) < 0)
-                timeout = ti->timeout;
             pt = &ti->next;
         }
     }
-    return timeout - cur_time;
+    /* scan again to account for timers added by the callbacks, such
+     * as background jobs rescheduling themselves with no delay.
+     */
+    cur_time = get_clock_ms();
+    timeout = cur_time + max_delay;
+    for (ti = first_timer; ti != NULL; ti = ti->next) {
+        if ((ti->timeout - timeout) < 0)
+            timeout = ti->timeout;
+    }
+    return max(timeout - cur_time, 0);
 }
 
 static void url_block_reset(void)
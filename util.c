@@ -1408,6 +1408,123 @@ void free_strings(StringArray *cs)
     memset(cs, 0, sizeof(StringArray));
 }
 
+/* Hash tables use open addressing with linear probing, the load is
+ * kept below 1/2 so probe sequences are short and always end on a free
+ * slot.  Removed items leave a deleted slot until the table is
+ * rebuilt.  Several items may share the same key.
+ */
+static char qe_hash_deleted_slot;
+#define HASH_DELETED  ((void *)&qe_hash_deleted_slot)
+
+/* FNV-1a */
+unsigned int qe_hash_string(const char *str)
+{
+    const unsigned char *p = (const unsigned char *)str;
+    unsigned int h = 2166136261U;
+
+    while (*p)
+        h = (h ^ *p++) * 16777619U;
+    return h;
+}
+
+static int qe_hash_resize(QEHashTable *ht, int size)
+{
+    void **items;
+    unsigned int *hashes;
+    int i, j;
+
+    items = qe_mallocz_array(void *, size);
+    hashes = qe_malloc_array(unsigned int, size);
+    if (!items || !hashes) {
+        qe_free(&items);
+        qe_free(&hashes);
+        return -1;
+    }
+    for (i = 0; i < ht->size; i++) {
+        if (ht->items[i] && ht->items[i] != HASH_DELETED) {
+            for (j = ht->hashes[i] & (size - 1); items[j];
+                 j = (j + 1) & (size - 1))
+                continue;
+            items[j] = ht->items[i];
+            hashes[j] = ht->hashes[i];
+        }
+    }
+    qe_free(&ht->items);
+    qe_free(&ht->hashes);
+    ht->items = items;
+    ht->hashes = hashes;
+    ht->size = size;
+    ht->nb_used = ht->nb_items;
+    return 0;
+}
+
+int qe_hash_add(QEHashTable *ht, unsigned int hash, void *item)
+{
+    int i, size;
+
+    if (2 * (ht->nb_used + 1) > ht->size) {
+        for (size = 16; size < 4 * (ht->nb_items + 1); size *= 2)
+            continue;
+        if (qe_hash_resize(ht, size))
+            return -1;
+    }
+    for (i = hash & (ht->size - 1);
+         ht->items[i] && ht->items[i] != HASH_DELETED;
+         i = (i + 1) & (ht->size - 1))
+        continue;
+    if (!ht->items[i])
+        ht->nb_used++;
+    ht->items[i] = item;
+    ht->hashes[i] = hash;
+    ht->nb_items++;
+    return 0;
+}
+
+/* return the next item with hash value 'hash', *pos_ptr must be
+ * initialized to -1.
+ */
+void *qe_hash_next(QEHashTable *ht, unsigned int hash, int *pos_ptr)
+{
+    void *item;
+    int i;
+
+    if (!ht->size)
+        return NULL;
+
+    i = *pos_ptr < 0 ? hash : *pos_ptr + 1;
+    for (;; i++) {
+        i &= ht->size - 1;
+        item = ht->items[i];
+        if (!item)
+            return NULL;
+        if (item != HASH_DELETED && ht->hashes[i] == hash) {
+            *pos_ptr = i;
+            return item;
+        }
+    }
+}
+
+void qe_hash_remove(QEHashTable *ht, unsigned int hash, void *item)
+{
+    void *p;
+    int pos = -1;
+
+    while ((p = qe_hash_next(ht, hash, &pos)) != NULL) {
+        if (p == item) {
+            ht->items[pos] = HASH_DELETED;
+            ht->nb_items--;
+            break;
+        }
+    }
+}
+
+void qe_hash_free(QEHashTable *ht)
+{
+    qe_free(&ht->items);
+    qe_free(&ht->hashes);
+    memset(ht, 0, sizeof(*ht));
+}
+
 /**
  * Add a memory region to a dynamic string. In case of allocation
  * failure, the data is not added. The dynamic string is guaranteed to
@@ -48,6 +48,15 @@ static VarDef var_table[] = {
     S_VAR( "default-tab-width", default_tab_width, VAR_NUMBER, VAR_RW )
     S_VAR( "default-fill-column", default_fill_column, VAR_NUMBER, VAR_RW )
     S_VAR( "backup-inhibited", backup_inhibited, VAR_NUMBER, VAR_RW )
+    S_VAR( "save-time", save_time, VAR_NUMBER, VAR_RO )
+    S_VAR( "undo-limit", undo_limit, VAR_NUMBER, VAR_RW )
+    S_VAR( "undo-tree", undo_tree, VAR_NUMBER, VAR_RW )
+    S_VAR( "undo-journal", undo_journal, VAR_NUMBER, VAR_RW )
+    S_VAR( "display-fps", display_fps, VAR_NUMBER, VAR_RW )
+    S_VAR( "display-requests", display_requests, VAR_NUMBER, VAR_RO )
+    S_VAR( "display-frames", display_frames, VAR_NUMBER, VAR_RO )
+    S_VAR( "display-bytes", display_bytes, VAR_NUMBER, VAR_RO )
+    S_VAR( "tty-scroll", tty_scroll, VAR_NUMBER, VAR_RW )
 
     //B_VAR( "screen-charset", charset, VAR_NUMBER, VAR_RW )
 
@@ -187,6 +196,16 @@ QVarType qe_get_variable(EditState *s, const char *name,
             pstrcpy(buf, size, str);
         break;
     case VAR_NUMBER:
+        if (vp->size == sizeof(QEOffset)) {
+            /* 64-bit fields such as point, mark, bufsize and
+               display-bytes */
+            QEOffset num64 = *(const QEOffset*)ptr;
+            if (pnum)
+                *pnum = (int)clamp_offset(num64, INT_MIN, INT_MAX);
+            else
+                snprintf(buf, size, "%lld", num64);
+            break;
+        }
         num = *(const int*)ptr;
         if (pnum)
             *pnum = num;
@@ -282,6 +301,13 @@ QVarType qe_set_variable(EditState *s, const char *name,
             pstrcpy(ptr, vp->size, value);
             break;
         case VAR_NUMBER:
+            if (vp->size == sizeof(QEOffset)) {
+                if (!value)
+                    *(QEOffset*)ptr = num;
+                else
+                    *(QEOffset*)ptr = strtoll(value, NULL, 0);
+                break;
+            }
             if (!value)
                 *(int*)ptr = num;
             else